@@ -22,6 +22,12 @@ Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccess
   memcpy(data,rhs.data,rhs.length);
 }
 
+Block::Block(Block &&rhs) : data(rhs.data), length(rhs.length), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+{
+  rhs.data=0;
+  rhs.length=0;
+}
+
 Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
 {
   if (Resize(strlen(str))!=ERROR_NOERROR) { 
@@ -40,7 +46,29 @@ Block::~Block()
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this!=&rhs) { 
+    if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+      throw GenericException();
+    }
+    memcpy(data,rhs.data,rhs.length);
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+  }
+  return *this;
+}
+
+Block & Block::operator=(Block &&rhs)
+{
+  if (this!=&rhs) { 
+    if (data) { delete [] data; }
+    data=rhs.data;
+    length=rhs.length;
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+    rhs.data=0;
+    rhs.length=0;
+  }
+  return *this;
 }
 
 
@@ -50,6 +78,10 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
+
+  if (data && newlen==length) { 
+    return ERROR_NOERROR;
+  }
   
   try {
     d = new BYTE_T [newlen];
@@ -58,7 +90,7 @@ ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
     return ERROR_NOMEM;
   }
 
-  if (copy) { 
+  if (copy && data) { 
     memcpy(d,data,MIN(newlen,length));
   }
   
@@ -16,12 +16,16 @@ struct Block {
   Block();
   Block(const SIZE_T size);
   Block(const Block &rhs);
+  Block(Block &&rhs);
   Block(const char *data);
   virtual ~Block();
+  // Copying into a block of the same length reuses its buffer
   Block & operator=(const Block &rhs);
+  Block & operator=(Block &&rhs);
 
   // returns one of ERROR_NOERROR (zero)
   // ERROR_NOMEM or other nonzero error code.
+  // Resizing to the current length does nothing.
   ERROR_T Resize(const SIZE_T newlength, const bool copy=true);
 
   bool operator<(const Block &rhs) const;
@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 #include "btree.h"
 #include <stack>
 KeyValuePair::KeyValuePair()
@@ -15,13 +17,28 @@ KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
 {}
 
 
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs) :
+  key(move(rhs.key)), value(move(rhs.value))
+{}
+
+
 KeyValuePair::~KeyValuePair()
 {}
 
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
+}
+
+
+KeyValuePair & KeyValuePair::operator=(KeyValuePair &&rhs)
+{
+  key=move(rhs.key);
+  value=move(rhs.value);
+  return *this;
 }
 
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
@@ -32,10 +49,26 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
   buffercache=cache;
-  // note: ignoring unique now
+  wal=0;
+  allocator=0;
+  lognumblocks=BTREE_LOG_AUTO;
+  loggroupsize=WAL_DEFAULT_GROUP_SIZE;
+  searchtype=BTREE_SEARCH_SIMD;
+  nodeaccess=GetNodeAccess(0,0);
+  minfill=BTREE_MIN_FILL;
+  compactpercent=BTREE_COMPACT_TOMBSTONES;
+  compactpace=BTREE_COMPACT_PACE;
+  compactsweep=compactswept=false;
+  superblock.info.format=BTREE_FORMAT_COLUMNAR;
+  superblock.info.overflowsize=BTREE_OVERFLOW_AUTO;
+  // A key's values go in one posting list, whose length varies
+  superblock.info.duplicates=!unique;
+  if (!unique) { 
+    superblock.info.format=BTREE_FORMAT_SLOTTED;
+  }
 }
 
-BTreeIndex::BTreeIndex()
+BTreeIndex::BTreeIndex() : wal(0), allocator(0), lognumblocks(BTREE_LOG_AUTO), loggroupsize(WAL_DEFAULT_GROUP_SIZE), searchtype(BTREE_SEARCH_SIMD), nodeaccess(GetNodeAccess(0,0)), minfill(BTREE_MIN_FILL), compactpercent(BTREE_COMPACT_TOMBSTONES), compactpace(BTREE_COMPACT_PACE), compactsweep(false), compactswept(false)
 {
   // shouldn't have to do anything
 }
@@ -49,11 +82,29 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  wal=0;
+  allocator=0;
+  lognumblocks=rhs.lognumblocks;
+  loggroupsize=rhs.loggroupsize;
+  searchtype=rhs.searchtype;
+  nodeaccess=rhs.nodeaccess;
+  minfill=rhs.minfill;
+  compactpercent=rhs.compactpercent;
+  compactpace=rhs.compactpace;
+  compactsweep=compactswept=false;
 }
 
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  // If we were never detached, the log just goes away, and
+  // whatever it did not get home will be redone on the next attach
+  // (a shared one is the catalog's to close)
+  if (wal && !allocator) { 
+    buffercache->SetLog(0);
+    delete wal;
+    wal=0;
+  }
+  LeaveShared();
 }
 
 
@@ -65,6 +116,10 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
+  if (allocator) { 
+    return allocator->AllocateNode(n);
+  }
+
   n=superblock.info.freelist;
 
   if (n==0) { 
@@ -89,6 +144,10 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
+  if (allocator) { 
+    return allocator->DeallocateNode(n);
+  }
+
   BTreeNode node;
 
   node.Unserialize(buffercache,n);
@@ -111,6 +170,148 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
 }
 
+void BTreeIndex::SetGroupCommitSize(const SIZE_T numops)
+{
+  loggroupsize=numops;
+  if (wal) { 
+    wal->SetGroupSize(numops);
+  }
+}
+
+
+ERROR_T BTreeIndex::EndOperation(const ERROR_T rc)
+{
+  ERROR_T logrc;
+
+  if (!wal) { 
+    return rc;
+  }
+  if (rc==ERROR_NOERROR) { 
+    logrc=wal->Commit();
+    if (logrc!=ERROR_NOSPACE) { 
+      return logrc;
+    }
+    // Too big for the log, so Commit undid it
+  } else {
+    // A failed operation can have stopped half way through, so none
+    // of it is kept
+    logrc=wal->Abort();
+    if (logrc!=ERROR_NOERROR) { 
+      return logrc;
+    }
+    logrc=rc;
+  }
+  // The superblocks in memory go back to what their blocks now have
+  ERROR_T sbrc=superblock.Unserialize(buffercache,superblock_index);
+  if (sbrc==ERROR_NOERROR && allocator) { 
+    sbrc=allocator->superblock.Unserialize(buffercache,allocator->superblock_index);
+  }
+  return sbrc!=ERROR_NOERROR ? sbrc : logrc;
+}
+
+
+ERROR_T BTreeIndex::CheckLimits(NodeMetadata &limits) const
+{
+  limits=superblock.info;
+  limits.blocksize=buffercache->GetBlockSize();
+  if (limits.overflowsize==BTREE_OVERFLOW_AUTO) { 
+    limits.overflowsize=limits.GetNumDataBytes()/4;
+  }
+
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED && 
+      limits.blocksize>BTREE_SLOTTED_MAX_BLOCKSIZE) { 
+    return ERROR_SIZE;
+  }
+  // Posting lists are as long as they get, so they need variable
+  // length values, and somewhere to go once they are too long for
+  // a leaf
+  if (superblock.info.duplicates && 
+      (superblock.info.format!=BTREE_FORMAT_SLOTTED || limits.overflowsize==0)) { 
+    return ERROR_SIZE;
+  }
+  // A full node splits in two (by bytes, if slotted), and both 
+  // halves are sure to fit only if the longest pair (or key) takes
+  // at most half a node.  Values too long for that need overflow 
+  // blocks.
+  if (limits.GetNumSlotsAsLeaf()<2 || limits.GetNumSlotsAsInterior()<2) { 
+    return ERROR_SIZE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::WriteEmptyIndex(const NodeMetadata &limits,
+				    const SIZE_T root, 
+				    const SIZE_T freelist,
+				    const SIZE_T logstart, 
+				    const SIZE_T numlogblocks)
+{
+  ERROR_T rc;
+
+  BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+			  superblock.info.keysize,
+			  superblock.info.valuesize,
+			  buffercache->GetBlockSize(),
+			  superblock.info.format);
+  newsuperblock.info.rootnode=root;
+  newsuperblock.info.freelist=freelist;
+  newsuperblock.info.numkeys=0;
+  newsuperblock.info.logstart=logstart;
+  newsuperblock.info.lognumblocks=numlogblocks;
+  newsuperblock.info.overflowsize=limits.overflowsize;
+  newsuperblock.info.tombstones=superblock.info.tombstones;
+  newsuperblock.info.duplicates=superblock.info.duplicates;
+
+  rc=newsuperblock.Serialize(buffercache,superblock_index);
+
+  if (rc) { 
+    return rc;
+  }
+    
+  BTreeNode newrootnode(BTREE_ROOT_NODE,
+			superblock.info.keysize,
+			superblock.info.valuesize,
+			buffercache->GetBlockSize(),
+			superblock.info.format);
+  newrootnode.info.rootnode=root;
+  newrootnode.info.freelist=freelist;
+  newrootnode.info.numkeys=0;
+
+  return newrootnode.Serialize(buffercache,root);
+}
+
+
+ERROR_T BTreeIndex::ReadSuperblock()
+{
+  ERROR_T rc;
+
+  rc = superblock.Unserialize(buffercache,superblock_index);
+
+  if (rc) { 
+    return rc;
+  }
+
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    return ERROR_NOTANINDEX;
+  }
+  // Written with another layout of nodes, which we would misread
+  if (superblock.info.version!=BTREE_LAYOUT_VERSION) { 
+    return ERROR_NOTANINDEX;
+  }
+
+  nodeaccess=GetNodeAccess(superblock.info.keysize,superblock.info.valuesize);
+  assert(nodeaccess->Agrees(superblock.info));
+
+  // Tombstones left from before are only on disk, so Compact will
+  // have to look for them
+  compactleaves.clear();
+  compactsweep = superblock.info.tombstones!=0;
+  compactswept = false;
+
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -119,50 +320,47 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   assert(superblock_index==0);
 
   if (create) {
-    // build a super block, root node, and a free space list
+    // build a super block, root node, a free space list, and a log
     //
     // Superblock at superblock_index
     // root node at superblock_index+1
     // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
-
-    buffercache->NotifyAllocateBlock(superblock_index);
-
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
+    // log in the last lognumblocks blocks
+    SIZE_T numlogblocks = lognumblocks==BTREE_LOG_AUTO ? 
+      buffercache->GetNumBlocks()/WAL_DEFAULT_FRACTION : lognumblocks;
+    if (numlogblocks<WAL_MIN_BLOCKS || 
+	numlogblocks+superblock_index+2>=buffercache->GetNumBlocks()) { 
+      numlogblocks=0;
+    }
+    SIZE_T endblock=buffercache->GetNumBlocks()-numlogblocks;
 
+    NodeMetadata limits;
+    rc=CheckLimits(limits);
     if (rc) { 
       return rc;
     }
-    
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
 
+    buffercache->NotifyAllocateBlock(superblock_index);
     buffercache->NotifyAllocateBlock(superblock_index+1);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+    rc=WriteEmptyIndex(limits,
+		       superblock_index+1,
+		       superblock_index+2,
+		       numlogblocks ? endblock : 0,
+		       numlogblocks);
 
     if (rc) { 
       return rc;
     }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
+    for (SIZE_T i=superblock_index+2; i<endblock;i++) { 
       BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.format);
       newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+      newfreenode.info.freelist= ((i+1)==endblock) ? 0: i+1;
       
       rc = newfreenode.Serialize(buffercache,i);
 
@@ -171,161 +369,672 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
       }
 
     }
+
+    if (numlogblocks) { 
+      for (SIZE_T i=endblock; i<buffercache->GetNumBlocks(); i++) { 
+	buffercache->NotifyAllocateBlock(i);
+      }
+      // The new index has to be at home before the log can start
+      rc = buffercache->WriteBackDirtyBlocks();
+      if (rc) { 
+	return rc;
+      }
+      WriteAheadLog log(buffercache,endblock,numlogblocks,loggroupsize);
+      rc = log.Format();
+      if (rc) { 
+	return rc;
+      }
+    }
   }
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
+  // and replaying anything the log holds
+
+  rc = ReadSuperblock();
+
+  if (rc) { 
+    return rc;
+  }
+
+  if (superblock.info.lognumblocks>0) { 
+    wal = new WriteAheadLog(buffercache,
+			    superblock.info.logstart,
+			    superblock.info.lognumblocks,
+			    loggroupsize);
+    // The log region never moves, so the superblock at home 
+    // is good enough to find it
+    rc = wal->Recover();
+    if (rc) { 
+      return rc;
+    }
+    buffercache->SetLog(wal);
+    rc = superblock.Unserialize(buffercache,initblock);
+  }
 
-  return superblock.Unserialize(buffercache,initblock);
+  return rc;
 }
-    
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+
+ERROR_T BTreeIndex::AttachShared(BTreeIndex &owner, 
+				 const SIZE_T initblock, 
+				 const bool create)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  ERROR_T rc;
+
+  buffercache=owner.buffercache;
+  allocator=&owner;
+  wal=owner.wal;
+  superblock_index=initblock;
+
+  if (create) { 
+    // The superblock and the root come off the shared free list, and
+    // there is no free list or log of its own
+    NodeMetadata limits;
+    SIZE_T root;
+
+    rc=CheckLimits(limits);
+    if (rc) { 
+      return rc;
+    }
+    rc=AllocateNode(superblock_index);
+    if (rc) { 
+      return rc;
+    }
+    rc=AllocateNode(root);
+    if (rc) { 
+      DiscardNode(superblock_index);
+      owner.superblock.Serialize(buffercache,owner.superblock_index);
+      return rc;
+    }
+    rc=WriteEmptyIndex(limits,root,0,0,0);
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  rc=ReadSuperblock();
+  if (rc==ERROR_NOERROR) { 
+    owner.sharers.insert(superblock_index);
+  }
+  return rc;
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+
+void BTreeIndex::LeaveShared()
+{
+  if (allocator) { 
+    std::multiset<SIZE_T>::iterator i=allocator->sharers.find(superblock_index);
+    if (i!=allocator->sharers.end()) { 
+      allocator->sharers.erase(i);
+    }
+    allocator=0;
+    wal=0;
+  }
+}
+
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
 
-  rc= b.Unserialize(buffercache,node);
+  initblock=superblock_index;
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
+  rc = superblock.Serialize(buffercache,superblock_index);
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
+  if (allocator) { 
+    // The log is the catalog's, and it closes it
+    ERROR_T logrc = wal ? wal->Commit() : ERROR_NOERROR;
+    LeaveShared();
+    if (rc==ERROR_NOERROR) { 
+      rc=logrc;
     }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+  } else if (wal) { 
+    ERROR_T logrc = wal->Commit();
+    if (logrc==ERROR_NOERROR) { 
+      logrc = wal->Checkpoint();
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  
-	  // WRITE ME
-	  //setval
-	  rc = b.SetVal(offset,value);
-
-      if(rc!=ERROR_NOERROR){
-        return rc;
-      } else {
-        return b.Serialize(buffercache,node);
-      }
-	  //serialize
-	  //return ERROR_UNIMPL;
-	}
-      }
+    buffercache->SetLog(0);
+    delete wal;
+    wal=0;
+    if (rc==ERROR_NOERROR) { 
+      rc=logrc;
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
+  }
 
-  return ERROR_INSANE;
+  return rc;
 }
+ 
+
+BTreeValueReader::BTreeValueReader() : 
+  buffercache(0), overflow(false), length(0), position(0), 
+  blockbytes(0), blockoffset(0), nextblock(0)
+{}
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeValueReader::Open(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
+  OverflowRef ref;
   ERROR_T rc;
-  unsigned i;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  if (leaf.IsOverflowVal(offset)) { 
+    rc=leaf.GetOverflowRef(offset,ref);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    Open(cache,ref);
+    return ERROR_NOERROR;
   }
+  buffercache=cache;
+  overflow=false;
+  position=0;
+  rc=leaf.GetVal(offset,inlinevalue);
+  length=inlinevalue.length;
+  return rc;
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
+
+void BTreeValueReader::Open(BufferCache *cache, const OverflowRef &ref)
+{
+  buffercache=cache;
+  overflow=true;
+  length=ref.length;
+  position=0;
+  blockbytes=0;
+  blockoffset=0;
+  nextblock=ref.block;
+}
+
+
+ERROR_T BTreeValueReader::Read(BYTE_T *buf, const SIZE_T len, SIZE_T &numread)
+{
+  ERROR_T rc;
+  SIZE_T n;
+
+  numread=0;
+  while (numread<len && position<length) { 
+    if (!overflow) { 
+      n = len-numread<length-position ? len-numread : length-position;
+      memcpy(buf+numread,inlinevalue.data+position,n);
     } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
-      }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
+      if (blockoffset==blockbytes) { 
+	// On to the next block of the chain
+	if (nextblock==0) { 
+	  return ERROR_INSANE;
 	}
-	os << " ";
+	rc=block.Unserialize(buffercache,nextblock);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	if (block.info.nodetype!=BTREE_OVERFLOW_NODE || block.info.numkeys==0) { 
+	  return ERROR_INSANE;
+	}
+	memcpy(&nextblock,block.data,sizeof(SIZE_T));
+	blockbytes=block.info.numkeys;
+	blockoffset=0;
       }
+      n = len-numread<blockbytes-blockoffset ? len-numread : blockbytes-blockoffset;
+      memcpy(buf+numread,block.data+sizeof(SIZE_T)+blockoffset,n);
+      blockoffset+=n;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
+    numread+=n;
+    position+=n;
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Gives the ith value of leaf, from its overflow blocks if it is in them
+static ERROR_T ReadValue(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset, VALUE_T &value)
+{
+  BTreeValueReader reader;
+  SIZE_T numread;
+  ERROR_T rc;
+
+  if (!leaf.IsOverflowVal(offset)) { 
+    return leaf.GetVal(offset,value);
+  }
+  rc=reader.Open(cache,leaf,offset);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  value.Resize(reader.GetLength(),false);
+  rc=reader.Read(value.data,reader.GetLength(),numread);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return numread==value.length ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+// Posting lists keep all the values of a key in a non-unique index
+// (see BTreeIndex).  Each value is its length, as a varint of seven
+// bits a byte, low ones first, and then its bytes.
+
+// Writes n as a varint to buf, and gives how many bytes it took
+static SIZE_T PutVarint(SIZE_T n, BYTE_T *buf)
+{
+  SIZE_T i=0;
+
+  for (; n>=0x80; n>>=7) { 
+    buf[i++]=(BYTE_T)(n|0x80);
+  }
+  buf[i++]=(BYTE_T)n;
+  return i;
+}
+
+
+// Bytes the varint for n takes
+static SIZE_T VarintLength(SIZE_T n)
+{
+  BYTE_T buf[8];
+  return PutVarint(n,buf);
+}
+
+
+// Finds the value at pos of a posting list, which is len bytes from 
+// start, and moves pos past it
+static ERROR_T NextPosting(const VALUE_T &list, SIZE_T &pos, SIZE_T &start, SIZE_T &len)
+{
+  BYTE_T b;
+
+  len=0;
+  for (SIZE_T shift=0; ; shift+=7) { 
+    if (pos>=list.length || shift>28) { 
+      return ERROR_INSANE;
     }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
-	}
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
+    b=list.data[pos++];
+    len|=(SIZE_T)(b&0x7f)<<shift;
+    if (!(b&0x80)) { 
+      break;
+    }
+  }
+  if (len>list.length-pos) { 
+    return ERROR_INSANE;
+  }
+  start=pos;
+  pos+=len;
+  return ERROR_NOERROR;
+}
+
+
+// Finds the value in a posting list that is at least value, which 
+// is from pos to end, or where it would go (pos==end) if there is none
+static ERROR_T FindPosting(const VALUE_T &list, 
+			   const VALUE_T &value, 
+			   SIZE_T &pos, 
+			   SIZE_T &end, 
+			   bool &found)
+{
+  SIZE_T start, len;
+  int c;
+  ERROR_T rc;
+
+  found=false;
+  for (pos=0; pos<list.length; pos=end) { 
+    end=pos;
+    rc=NextPosting(list,end,start,len);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    c=memcmp(list.data+start,value.data,len<value.length ? len : value.length);
+    if (c==0) { 
+      c = len<value.length ? -1 : len>value.length ? 1 : 0;
+    }
+    if (c>=0) { 
+      found = c==0;
+      return ERROR_NOERROR;
+    }
+  }
+  end=pos;
+  return ERROR_NOERROR;
+}
+
+
+// Reads the next value of the posting list reader is on
+static ERROR_T ReadPosting(BTreeValueReader &reader, VALUE_T &value)
+{
+  SIZE_T len=0, numread;
+  BYTE_T b;
+  ERROR_T rc;
+
+  for (SIZE_T shift=0; ; shift+=7) { 
+    rc=reader.Read(&b,1,numread);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (numread==0 || shift>28) { 
+      return ERROR_INSANE;
+    }
+    len|=(SIZE_T)(b&0x7f)<<shift;
+    if (!(b&0x80)) { 
+      break;
+    }
+  }
+  value.Resize(len,false);
+  rc=reader.Read(value.data,len,numread);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return numread==len ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+// Gives the first value of the posting list at offset of leaf, which 
+// takes only the first of its overflow blocks, if it is in them
+static ERROR_T ReadFirstPosting(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset, VALUE_T &value)
+{
+  BTreeValueReader reader;
+  ERROR_T rc;
+
+  rc=reader.Open(cache,leaf,offset);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return ReadPosting(reader,value);
+}
+
+
+BTreeValueCursor::BTreeValueCursor() : valid(false), postings(false)
+{}
+
+
+ERROR_T BTreeValueCursor::Open(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset, const bool p)
+{
+  SIZE_T numread;
+  ERROR_T rc;
+
+  valid=false;
+  postings=p;
+  rc=reader.Open(cache,leaf,offset);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (postings) { 
+    rc=ReadPosting(reader,value);
+  } else {
+    // The one value, all of it
+    value.Resize(reader.GetLength(),false);
+    rc=reader.Read(value.data,value.length,numread);
+  }
+  valid = rc==ERROR_NOERROR;
+  return rc;
+}
+
+
+ERROR_T BTreeValueCursor::GetVal(VALUE_T &v) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  v=value;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeValueCursor::Next()
+{
+  ERROR_T rc;
+
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (!postings || reader.AtEnd()) { 
+    valid=false;
+    return ERROR_NOERROR;
+  }
+  rc=ReadPosting(reader,value);
+  valid = rc==ERROR_NOERROR;
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::GetLeafValue(const BTreeNode &leaf, const SIZE_T offset, VALUE_T &value) const
+{
+  if (superblock.info.duplicates) { 
+    return ReadFirstPosting(buffercache,leaf,offset,value);
+  }
+  if (leaf.IsOverflowVal(offset)) { 
+    return ReadValue(buffercache,leaf,offset,value);
+  }
+  return nodeaccess->GetVal(leaf,offset,value);
+}
+
+
+bool BTreeIndex::IsOverflowValue(const VALUE_T &value) const
+{
+  return superblock.info.overflowsize>0 && value.length>superblock.info.overflowsize;
+}
+
+
+// Adds the overflow blocks of the pair at offset, if it has any, to
+// refs, for a pair that is being left out of its leaf
+static ERROR_T NoteOverflow(const BTreeNode &leaf, const SIZE_T offset, vector<OverflowRef> &refs)
+{
+  if (!leaf.IsOverflowVal(offset)) { 
+    return ERROR_NOERROR;
+  }
+  refs.push_back(OverflowRef());
+  return leaf.GetOverflowRef(offset,refs.back());
+}
+
+
+ERROR_T BTreeIndex::WriteOverflow(const VALUE_T &value, VALUE_T &stored)
+{
+  BTreeNode block(BTREE_OVERFLOW_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format);
+  const SIZE_T room=block.info.GetNumDataBytes()-sizeof(SIZE_T);
+  OverflowRef ref;
+  SIZE_T ptr, next, done;
+  ERROR_T rc;
+
+  ref.length=value.length;
+  rc=AllocateNode(ref.block);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // Each block is written once the one after it is allocated, so
+  // that it can point to it
+  ptr=ref.block;
+  for (done=0; done<value.length; done+=block.info.numkeys) { 
+    block.info.numkeys = value.length-done<room ? value.length-done : room;
+    next=0;
+    if (done+block.info.numkeys<value.length) { 
+      rc=AllocateNode(next);
+      if (rc!=ERROR_NOERROR) { 
+	// End the chain here, so that it can be freed
+	next=0;
+	memcpy(block.data,&next,sizeof(SIZE_T));
+	block.Serialize(buffercache,ptr);
+	FreeOverflow(ref);
+	return rc;
+      }
+    }
+    memcpy(block.data,&next,sizeof(SIZE_T));
+    memcpy(block.data+sizeof(SIZE_T),value.data+done,block.info.numkeys);
+    rc=block.Serialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptr=next;
+  }
+
+  stored.Resize(sizeof(ref),false);
+  memcpy(stored.data,&ref,sizeof(ref));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RewriteOverflow(const OverflowRef &ref, const VALUE_T &value)
+{
+  BTreeNode block;
+  SIZE_T ptr=ref.block;
+  SIZE_T done=0;
+  ERROR_T rc;
+
+  if (value.length!=ref.length) { 
+    return ERROR_SIZE;
+  }
+  while (done<value.length) { 
+    rc=block.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (block.info.nodetype!=BTREE_OVERFLOW_NODE || done+block.info.numkeys>value.length) { 
+      return ERROR_INSANE;
+    }
+    memcpy(block.data+sizeof(SIZE_T),value.data+done,block.info.numkeys);
+    done+=block.info.numkeys;
+    rc=block.Serialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    memcpy(&ptr,block.data,sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FreeOverflow(const OverflowRef &ref)
+{
+  BTreeNode block;
+  SIZE_T ptr=ref.block;
+  SIZE_T next;
+  ERROR_T rc;
+
+  while (ptr!=0) { 
+    rc=block.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (block.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    memcpy(&next,block.data,sizeof(SIZE_T));
+    rc=DeallocateNode(ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptr=next;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
+					   const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value,
+					   BTreeValueReader *reader)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  // The descent reuses b, and compares keys in place, so after the 
+  // first level nothing here touches the heap
+  ptr=node;
+
+  while (1) { 
+    rc= b.Unserialize(buffercache,ptr);
+
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) { 
+	// There are no keys at all on this node, so nowhere to go
+	return ERROR_NONEXISTENT;
+      }
+      // The first key that's at least as large as ours.  We go
+      // down the pointer immediately previous to it, or the last
+      // pointer if there is no such key
+      rc=b.GetPtr(nodeaccess->LowerBound(b,key,searchtype),ptr);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      offset=nodeaccess->LowerBound(b,key,searchtype);
+      if (offset>=b.info.numkeys || nodeaccess->CompareKey(b,key,offset)!=0 || 
+	  b.IsTombstone(offset)) { 
+	return ERROR_NONEXISTENT;
+      }
+      if (op==BTREE_OP_LOOKUP) { 
+	if (reader) { 
+	  return reader->Open(buffercache,b,offset);
+	}
+	return GetLeafValue(b,offset,value);
+      } else { 
+	// BTREE_OP_UPDATE
+	if (b.IsOverflowVal(offset)) { 
+	  // Every value is the same length here, so the new one 
+	  // fits in the blocks of the old one
+	  OverflowRef ref;
+	  rc = b.GetOverflowRef(offset,ref);
+	  if (rc!=ERROR_NOERROR) { return rc; }
+	  return RewriteOverflow(ref,value);
+	}
+	rc = nodeaccess->SetVal(b,offset,value);
+	if (rc!=ERROR_NOERROR) {
+	  return rc;
+	} else {
+	  return b.Serialize(buffercache,ptr);
+	}
+      }
+      break;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+      break;
+    }  
+  }
+
+  return ERROR_INSANE;
+}
+
+
+// postings says whether values are posting lists, whose values are
+// shown one by one
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt, BufferCache *cache, const bool postings)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  SIZE_T pos, start, len;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	for (i=0;i<key.length;i++) { 
+	  os << key.data[i];
+	}
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (b.IsTombstone(offset)) { 
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  continue;
+	}
+	// A dead pair, which only the tree shows
+	os << "~";
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      for (i=0;i<key.length;i++) { 
 	os << key.data[i];
       }
       if (dt==BTREE_SORTED_KEYVAL) { 
@@ -333,10 +1042,30 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
       } else {
 	os << " ";
       }
-      rc=b.GetVal(offset,value);
+      rc=ReadValue(cache,b,offset,value);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
+      if (!postings) { 
+	for (i=0;i<value.length;i++) { 
+	  os << value.data[i];
+	}
+      }
+      for (pos=0; postings && pos<value.length; ) { 
+	rc=NextPosting(value,pos,start,len);
+	if (rc) {  return rc; }
+	for (i=0;i<len;i++) { 
+	  os << value.data[start+i];
+	}
+	if (pos==value.length) { 
+	} else if (dt==BTREE_SORTED_KEYVAL) { 
+	  // One pair to a line, as in a unique index
+	  os << ")\n(";
+	  for (i=0;i<key.length;i++) { 
+	    os << key.data[i];
+	  }
+	  os << ",";
+	} else {
+	  os << "|";
+	}
       }
       if (dt==BTREE_SORTED_KEYVAL) { 
 	os << ")\n";
@@ -344,462 +1073,2472 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 	os << " ";
       }
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+}
+
+ERROR_T BTreeIndex::OpenValue(const KEY_T &key, BTreeValueReader &reader)
+{
+  VALUE_T unused;
+  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, unused, &reader);
+}
+
+ERROR_T BTreeIndex::SeekValues(const KEY_T &key, BTreeValueCursor &values) const
+{
+  BTreeNode leaf;
+  SIZE_T ptr, offset;
+  ERROR_T rc;
+
+  values.valid=false;
+  rc=SeekLeaf(&key,false,ptr,leaf);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (ptr==0) { 
+    return ERROR_NONEXISTENT;
+  }
+  offset=nodeaccess->LowerBound(leaf,key,searchtype);
+  if (offset>=leaf.info.numkeys || nodeaccess->CompareKey(leaf,key,offset)!=0 || 
+      leaf.IsTombstone(offset)) { 
+    return ERROR_NONEXISTENT;
+  }
+  return values.Open(buffercache,leaf,offset,superblock.info.duplicates!=0);
+}
+
+
+BTreeCursor::BTreeCursor() : 
+  buffercache(0), leafptr(0), offset(0), valid(false), haslow(false), hashigh(false), 
+  rootptr(0), postings(false), maxreadahead(BTREE_READAHEAD_MAX), raforward(true), streak(0),
+  window(0), ahead(0)
+{}
+
+
+ERROR_T BTreeCursor::Load(SIZE_T ptr, const bool forward)
+{
+  ERROR_T rc;
+
+  valid=false;
+  while (ptr!=0) { 
+    Readahead(ptr,forward);
+    rc=leaf.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    leafptr=ptr;
+    if (leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+      return ERROR_INSANE;
+    }
+    if (leaf.info.numkeys>0) { 
+      offset = forward ? 0 : leaf.info.numkeys-1;
+      valid=true;
+      CheckRange();
+      return ERROR_NOERROR;
+    }
+    // An empty leaf, so on to the one past it
+    if (forward) { 
+      rc=leaf.GetPtr(0,ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    } else {
+      ptr=leaf.info.prevleaf;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeCursor::Readahead(const SIZE_T next, const bool forward)
+{
+  KEY_T key;
+  SIZE_T ptr;
+
+  if (maxreadahead==0) { 
+    return;
+  }
+  if (next==(forward ? leafptr+1 : leafptr-1)) { 
+    // The leaves are in order on disk here, and the disk streams 
+    // them as they are asked for without help
+    streak=0;
+    return;
+  }
+  if (forward!=raforward || streak==0) { 
+    // A new scan, or one that turned around
+    raforward=forward;
+    streak=0;
+    window=0;
+    rapath.clear();
+  }
+  streak++;
+  ahead--;
+  if (streak<BTREE_READAHEAD_TRIGGER) { 
+    return;
+  }
+  if (rapath.empty()) { 
+    // The window starts from the leaf being left
+    if (leaf.info.numkeys==0 || leaf.GetKey(0,key)!=ERROR_NOERROR || !FindPath(key)) { 
+      return;
+    }
+    ahead=-1;
+  }
+  if (ahead>(int)window/2) { 
+    return;
+  }
+  window = window==0 ? BTREE_READAHEAD_MIN : 2*window;
+  if (window>maxreadahead) { 
+    window=maxreadahead;
+  }
+  while (ahead<(int)window && StepPath(forward,ptr)) { 
+    ahead++;
+    if (buffercache->PrefetchBlock(ptr)!=ERROR_NOERROR) { 
+      // The cache has no room for more just now
+      break;
+    }
+  }
+}
+
+
+bool BTreeCursor::FindPath(const KEY_T &key)
+{
+  BTreeNode node;
+  SIZE_T ptr=rootptr;
+
+  rapath.clear();
+  raoffsets.clear();
+  while (1) { 
+    if (node.Unserialize(buffercache,ptr)!=ERROR_NOERROR) { 
+      break;
+    }
+    if (node.info.nodetype==BTREE_LEAF_NODE) { 
+      return !rapath.empty();
+    }
+    if (node.info.numkeys==0) { 
+      break;
+    }
+    raoffsets.push_back(node.LowerBound(key));
+    rapath.push_back(node);
+    if (node.GetPtr(raoffsets.back(),ptr)!=ERROR_NOERROR) { 
+      break;
+    }
+  }
+  rapath.clear();
+  return false;
+}
+
+
+bool BTreeCursor::StepPath(const bool forward, SIZE_T &leafptr)
+{
+  int level=(int)rapath.size()-1;
+  SIZE_T ptr;
+
+  // Up to the first node that has a pointer the next way to go
+  while (level>=0 && (forward ? raoffsets[level]==rapath[level].info.numkeys : raoffsets[level]==0)) { 
+    level--;
+  }
+  if (level<0) { 
+    return false;
+  }
+  if (forward) { 
+    raoffsets[level]++;
+  } else {
+    raoffsets[level]--;
+  }
+  // and back down the nearest side of the subtree it leads to
+  for (SIZE_T l=level+1; l<rapath.size(); l++) { 
+    if (rapath[l-1].GetPtr(raoffsets[l-1],ptr)!=ERROR_NOERROR ||
+	rapath[l].Unserialize(buffercache,ptr)!=ERROR_NOERROR) { 
+      rapath.clear();
+      return false;
+    }
+    raoffsets[l] = forward ? 0 : rapath[l].info.numkeys;
+  }
+  return rapath.back().GetPtr(raoffsets.back(),leafptr)==ERROR_NOERROR;
+}
+
+
+void BTreeCursor::CheckRange()
+{
+  if (valid && ((haslow && leaf.CompareKey(low,offset)>0) ||
+		(hashigh && leaf.CompareKey(high,offset)<0))) { 
+    valid=false;
+  }
+}
+
+
+ERROR_T BTreeCursor::GetKey(KEY_T &key) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  return leaf.GetKey(offset,key);
+}
+
+
+ERROR_T BTreeCursor::GetVal(VALUE_T &value) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (postings) { 
+    return ReadFirstPosting(buffercache,leaf,offset,value);
+  }
+  return ReadValue(buffercache,leaf,offset,value);
+}
+
+
+ERROR_T BTreeCursor::OpenValue(BTreeValueReader &reader) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  return reader.Open(buffercache,leaf,offset);
+}
+
+
+ERROR_T BTreeCursor::OpenValues(BTreeValueCursor &values) const
+{
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  return values.Open(buffercache,leaf,offset,postings);
+}
+
+
+ERROR_T BTreeCursor::Step(const bool forward)
+{
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (forward ? offset+1<leaf.info.numkeys : offset>0) { 
+    offset = forward ? offset+1 : offset-1;
+    CheckRange();
+    return ERROR_NOERROR;
+  }
+  if (!forward) { 
+    return Load(leaf.info.prevleaf,false);
+  }
+  rc=leaf.GetPtr(0,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return Load(ptr,true);
+}
+
+
+ERROR_T BTreeCursor::SkipTombstones(const bool forward)
+{
+  ERROR_T rc;
+
+  while (valid && leaf.IsTombstone(offset)) { 
+    rc=Step(forward);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCursor::Next()
+{
+  ERROR_T rc;
+
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  rc=Step(true);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return SkipTombstones(true);
+}
+
+
+ERROR_T BTreeCursor::Prev()
+{
+  ERROR_T rc;
+
+  if (!valid) { 
+    return ERROR_NONEXISTENT;
+  }
+  rc=Step(false);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return SkipTombstones(false);
+}
+
+
+ERROR_T BTreeIndex::SeekLeaf(const KEY_T *key, 
+			     const bool last, 
+			     SIZE_T &ptr, 
+			     BTreeNode &leaf) const
+{
+  ERROR_T rc;
+
+  ptr=superblock.info.rootnode;
+  while (1) { 
+    rc=leaf.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    switch (leaf.info.nodetype) { 
+    case BTREE_LEAF_NODE:
+      return ERROR_NOERROR;
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (leaf.info.numkeys==0) { 
+	// An empty index, with no leaves at all
+	ptr=0;
+	return ERROR_NOERROR;
+      }
+      rc=leaf.GetPtr(key ? nodeaccess->LowerBound(leaf,*key,searchtype) :
+		     last ? leaf.info.numkeys : 0, ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+ERROR_T BTreeIndex::SeekInternal(const KEY_T *key, 
+				 const bool backward, 
+				 BTreeCursor &cursor) const
+{
+  BTreeNode &leaf=cursor.leaf;
+  SIZE_T ptr, offset;
+  ERROR_T rc;
+
+  cursor.buffercache=buffercache;
+  cursor.rootptr=superblock.info.rootnode;
+  cursor.postings=superblock.info.duplicates!=0;
+  cursor.valid=false;
+  cursor.streak=0;
+  rc=SeekLeaf(key,backward,ptr,leaf);
+  if (rc!=ERROR_NOERROR || ptr==0) { return rc; }
+  cursor.leafptr=ptr;
+
+  // The pairs before offset come before key, and the rest after it
+  offset = key ? nodeaccess->LowerBound(leaf,*key,searchtype) : backward ? leaf.info.numkeys : 0;
+  if (key && backward && offset<leaf.info.numkeys && nodeaccess->CompareKey(leaf,*key,offset)==0) { 
+    offset++;
+  }
+  if (!backward && offset<leaf.info.numkeys) { 
+    cursor.offset=offset;
+    cursor.valid=true;
+    cursor.CheckRange();
+  } else if (backward && offset>0) { 
+    cursor.offset=offset-1;
+    cursor.valid=true;
+    cursor.CheckRange();
+  } else if (!backward) { 
+    rc=leaf.GetPtr(0,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=cursor.Load(ptr,true);
+  } else {
+    rc=cursor.Load(leaf.info.prevleaf,false);
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return cursor.SkipTombstones(!backward);
+}
+
+
+ERROR_T BTreeIndex::Seek(const KEY_T &key, BTreeCursor &cursor) const
+{
+  cursor.haslow=cursor.hashigh=false;
+  return SeekInternal(&key,false,cursor);
+}
+
+
+ERROR_T BTreeIndex::SeekFirst(BTreeCursor &cursor) const
+{
+  cursor.haslow=cursor.hashigh=false;
+  return SeekInternal(0,false,cursor);
+}
+
+
+ERROR_T BTreeIndex::SeekLast(BTreeCursor &cursor) const
+{
+  cursor.haslow=cursor.hashigh=false;
+  return SeekInternal(0,true,cursor);
+}
+
+
+ERROR_T BTreeIndex::SeekRange(const KEY_T &low, 
+			      const KEY_T &high, 
+			      BTreeCursor &cursor, 
+			      const bool backward) const
+{
+  cursor.haslow=cursor.hashigh=true;
+  cursor.low=low;
+  cursor.high=high;
+  return SeekInternal(backward ? &high : &low,backward,cursor);
+}
+
+
+// Whether a key or value of this length can go in an index with 
+// this superblock, whose keys or values are size long (or at most 
+// that, if slotted)
+static bool SizeFits(const NodeMetadata &info, const SIZE_T length, const SIZE_T size)
+{
+  return info.format==BTREE_FORMAT_SLOTTED ? length<=size : length==size;
+}
+
+
+// Makes the new posting list of a key in a non-unique index from the
+// one it has, for InsertInternal
+//   ADD      adds value to it
+//   REPLACE  makes value the only one
+//   REMOVE   takes value out
+// Adding a value that is there already, or removing the only one, 
+// backs out with ERROR_CONFLICT, and says which in found or last.
+class PostingEdit : public BTreeValueModifier {
+ public:
+  enum Mode {ADD, REPLACE, REMOVE};
+
+ private:
+  const NodeMetadata &info;
+  const VALUE_T &value;
+  const Mode mode;
+
+ public:
+  bool found, last;
+
+  PostingEdit(const NodeMetadata &i, const VALUE_T &v, const Mode m) : 
+    info(i), value(v), mode(m), found(false), last(false) {}
+
+  ERROR_T Modify(const KEY_T &key, const bool exists, const VALUE_T &old, VALUE_T &list) { 
+    // The new list is old up to pos, then the change, then the rest
+    const SIZE_T oldlength = exists && mode!=REPLACE ? old.length : 0;
+    SIZE_T pos=0, end=0, n;
+    ERROR_T rc;
+
+    if (!SizeFits(info,value.length,info.valuesize)) { 
+      return ERROR_SIZE;
+    }
+    if (oldlength>0) { 
+      rc=FindPosting(old,value,pos,end,found);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    if (mode==REMOVE) { 
+      if (!found) { 
+	return ERROR_NONEXISTENT;
+      }
+      if (pos==0 && end==old.length) { 
+	last=true;
+	return ERROR_CONFLICT;
+      }
+      list.Resize(old.length-(end-pos),false);
+      memcpy(list.data,old.data,pos);
+      memcpy(list.data+pos,old.data+end,old.length-end);
+      return ERROR_NOERROR;
+    }
+    if (found) { 
+      return ERROR_CONFLICT;
+    }
+    n=VarintLength(value.length);
+    list.Resize(oldlength+n+value.length,false);
+    memcpy(list.data,old.data,pos);
+    PutVarint(value.length,list.data+pos);
+    memcpy(list.data+pos+n,value.data,value.length);
+    memcpy(list.data+pos+n+value.length,old.data+pos,oldlength-pos);
+    return ERROR_NOERROR;
+  }
+};
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  if (superblock.info.duplicates) { 
+    PostingEdit add(superblock.info,value,PostingEdit::ADD);
+    return EndOperation(InsertInternal(key,value,BTREE_OP_UPSERT,&add));
+  }
+  return EndOperation(InsertInternal(key,value));
+}
+
+
+// The operation InsertInternal does for each mode of Put
+static BTreeOp PutOp(const BTreePutMode mode)
+{
+  return mode==BTREE_PUT_INSERT ? BTREE_OP_INSERT : 
+    mode==BTREE_PUT_UPDATE ? BTREE_OP_UPDATE : BTREE_OP_UPSERT;
+}
+
+
+ERROR_T BTreeIndex::Put(const KEY_T &key, const VALUE_T &value, const BTreePutMode mode)
+{
+  if (superblock.info.duplicates) { 
+    PostingEdit edit(superblock.info,value,mode==BTREE_PUT_UPDATE ? PostingEdit::REPLACE : PostingEdit::ADD);
+    ERROR_T rc=InsertInternal(key,value,mode==BTREE_PUT_UPDATE ? BTREE_OP_UPDATE : BTREE_OP_UPSERT,&edit);
+    if (rc==ERROR_CONFLICT && edit.found && mode==BTREE_PUT_UPSERT) { 
+      // The pair is there already, which is all an upsert asks
+      rc=ERROR_NOERROR;
+    }
+    return EndOperation(rc);
+  }
+  return EndOperation(InsertInternal(key,value,PutOp(mode)));
+}
+
+
+ERROR_T BTreeIndex::Put(const KEY_T &key, BTreeValueModifier &modifier, const BTreePutMode mode)
+{
+  VALUE_T unused;
+  if (superblock.info.duplicates) { 
+    return ERROR_UNIMPL;
+  }
+  return EndOperation(InsertInternal(key,unused,PutOp(mode),&modifier));
+}
+
+// The shortest key that is at least left and less than right, which
+// is a prefix of right if there is one short enough, and left if not
+static void ShortestSeparator(const KEY_T &left, const KEY_T &right, KEY_T &separator)
+{
+  SIZE_T n = left.length<right.length ? left.length : right.length;
+  SIZE_T shared;
+
+  for (shared=0; shared<n && left.data[shared]==right.data[shared]; shared++) {}
+
+  if (shared+1<right.length) { 
+    separator.Resize(shared+1,false);
+    memcpy(separator.data,right.data,shared+1);
+  } else if (&separator!=&left) { 
+    separator=left;
+  }
+}
+
+
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, 
+				   const VALUE_T &value, 
+				   const BTreeOp op, 
+				   BTreeValueModifier *modifier)
+{
+  BTreeNode node;
+  ERROR_T rc;
+  SIZE_T offset=0;
+  SIZE_T ptr;
+  std::stack<SIZE_T> traversednodes;
+  // found is whether the leaf has the key, and exists whether it is
+  // alive there rather than a tombstone
+  bool empty, found=false, exists=false;
+  VALUE_T old, modified;
+  // The value that goes in, which is the one modifier makes if there
+  // is one
+  const VALUE_T *newvalue=&value;
+  // The leaf keeps the value, or if it is too long, the OverflowRef
+  // for the blocks it is put in
+  VALUE_T stored;
+
+  if (!SizeFits(superblock.info,key.length,superblock.info.keysize) || 
+      (!modifier && !SizeFits(superblock.info,value.length,superblock.info.valuesize))) { 
+    return ERROR_SIZE;
+  }
+
+  ptr=superblock.info.rootnode;
+  rc=node.Unserialize(buffercache,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  empty = node.info.numkeys==0;
+  if (!empty) { 
+    // Go down to the leaf, remembering the path so that splits
+    // can be pushed back up it
+    while (node.info.nodetype!=BTREE_LEAF_NODE) {
+      traversednodes.push(ptr);
+      rc = node.GetPtr(nodeaccess->LowerBound(node,key,searchtype),ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = node.Unserialize(buffercache,ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    offset=nodeaccess->LowerBound(node,key,searchtype);
+    found = offset<node.info.numkeys && nodeaccess->CompareKey(node,key,offset)==0;
+    exists = found && !node.IsTombstone(offset);
+  }
+
+  if (op==BTREE_OP_UPDATE && !exists) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (op==BTREE_OP_INSERT && exists) { 
+    return ERROR_CONFLICT;
+  }
+  if (modifier) { 
+    // Nothing has changed yet, so the modifier can still back out
+    if (exists) { 
+      rc=ReadValue(buffercache,node,offset,old);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc=modifier->Modify(key,exists,old,modified);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    // A posting list is as long as its values make it
+    if (!superblock.info.duplicates && 
+	!SizeFits(superblock.info,modified.length,superblock.info.valuesize)) { 
+      return ERROR_SIZE;
+    }
+    newvalue=&modified;
+  }
+
+  const bool overflow=IsOverflowValue(*newvalue);
+  const VALUE_T &inleaf = overflow ? stored : *newvalue;
+
+  if (empty) {
+    // First insert into an empty tree.  The root gets this key and 
+    // two leaves, the left one holding the key and the right one empty
+    BTreeNode child(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format, superblock.info.overflowsize, superblock.info.tombstones, superblock.info.duplicates);
+    SIZE_T rootleft;
+    SIZE_T rootright;
+    
+    rc = AllocateNode(rootleft);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = AllocateNode(rootright);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    
+    child.info.prevleaf = rootleft;
+    rc = child.Serialize(buffercache, rootright);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    child.info.prevleaf = 0;
+    child.SetPtr(0, rootright);
+
+    if (overflow) { 
+      rc = WriteOverflow(*newvalue,stored);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc = child.InsertKeyVal(0,key,inleaf,overflow);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = child.Serialize(buffercache, rootleft);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    node.info.numkeys = 1;
+    node.SetKey(0, key);
+    node.SetPtr(0, rootleft);
+    node.SetPtr(1, rootright);
+    return node.Serialize(buffercache, ptr);
+  }
+
+  // An old value in overflow blocks is freed only once the leaf no
+  // longer points at them, so that an insert that fails on the way
+  // leaves the old value as it was
+  OverflowRef oldref;
+  bool freeold=false;
+  if (found && node.IsOverflowVal(offset)) { 
+    rc=node.GetOverflowRef(offset,oldref);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (overflow && oldref.length==newvalue->length) { 
+      // The new value fits in the blocks of the old one, and the 
+      // leaf does not change at all, unless the pair was dead
+      rc=RewriteOverflow(oldref,*newvalue);
+      if (rc!=ERROR_NOERROR || exists) { return rc; }
+      rc=node.SetTombstone(offset,false);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      return node.Serialize(buffercache,ptr);
+    }
+    freeold=true;
+  }
+
+  if (overflow) { 
+    rc=WriteOverflow(*newvalue,stored);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+
+  SIZE_T newleafptr;
+  KEY_T promote;
+  rc=PutInLeaf(node,ptr,offset,found,exists,key,inleaf,overflow,newleafptr,promote);
+  if (rc!=ERROR_NOERROR) { 
+    // The leaf on disk is as it was, so the new blocks go back
+    if (overflow) { 
+      OverflowRef ref;
+      memcpy(&ref,stored.data,sizeof(ref));
+      FreeOverflow(ref);
+    }
+    return rc;
+  }
+  if (freeold) { 
+    rc=FreeOverflow(oldref);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  if (newleafptr==0) { 
+    return ERROR_NOERROR;
+  }
+  return Upsert(newleafptr, promote, traversednodes);
+}
+
+
+ERROR_T BTreeIndex::PutInLeaf(BTreeNode &node,
+			      const SIZE_T ptr,
+			      const SIZE_T offset,
+			      const bool found,
+			      const bool exists,
+			      const KEY_T &key,
+			      const VALUE_T &inleaf,
+			      const bool overflow,
+			      SIZE_T &newleafptr,
+			      KEY_T &promote)
+{
+  ERROR_T rc;
+
+  newleafptr=0;
+  if (found) { 
+    // A dead pair with the key is brought back to life with the new
+    // value
+    if (overflow) { 
+      OverflowRef ref;
+      memcpy(&ref,inleaf.data,sizeof(ref));
+      rc=node.SetOverflowRef(offset,ref);
+    } else {
+      rc=node.SetVal(offset,inleaf);
+    }
+    if (rc==ERROR_NOERROR && !exists) { 
+      rc=node.SetTombstone(offset,false);
+    }
+    if (rc!=ERROR_NOSPACE) { 
+      if (rc!=ERROR_NOERROR) { return rc; }
+      return node.Serialize(buffercache,ptr);
+    }
+    // A longer value that does not fit, so take the pair out and put
+    // it back in the way an insert would, splitting the leaf
+    rc=node.RemoveSlots(offset,1);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  
+  if (node.HasRoomFor(key,inleaf)) { 
+    rc=node.InsertKeyVal(offset,key,inleaf,overflow);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    return node.Serialize(buffercache,ptr);
+  }
+
+  // The leaf is full, so split it.  The upper half moves to a new
+  // leaf on its right, and the largest key left behind goes up to
+  // the parent to separate the two.
+  BTreeNode newleaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format, superblock.info.overflowsize, superblock.info.tombstones, superblock.info.duplicates);
+  KeyValuePair kvpair;
+  SIZE_T nextleafptr;
+  bool left;
+  SIZE_T split=node.ChooseLeafSplit(offset,key,inleaf,left);
+
+  rc = AllocateNode(newleafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // The keys that move share the prefix they had here
+  rc = node.GetCommonPrefix(promote);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = newleaf.SetCommonPrefix(promote,promote.length);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  rc = node.MoveSlots(split,node.info.numkeys-split,newleaf,0);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // Link the new leaf in between this one and the one after it
+  rc = node.GetPtr(0,nextleafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (nextleafptr!=0) { 
+    BTreeNode nextleaf;
+    rc = nextleaf.Unserialize(buffercache,nextleafptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    nextleaf.info.prevleaf = newleafptr;
+    rc = nextleaf.Serialize(buffercache,nextleafptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  newleaf.SetPtr(0,nextleafptr);
+  newleaf.info.prevleaf = ptr;
+  node.SetPtr(0,newleafptr);
+
+  if (left) { 
+    rc = node.InsertKeyVal(offset,key,inleaf,overflow);
+  } else {
+    rc = newleaf.InsertKeyVal(offset-split,key,inleaf,overflow);
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  rc = node.GetKey(node.info.numkeys-1,promote);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  if (node.info.format==BTREE_FORMAT_SLOTTED) { 
+    // Interior nodes take keys of any length here, so only as much
+    // of a key goes up as it takes to tell the two leaves apart
+    rc = newleaf.GetKey(0,kvpair.key);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ShortestSeparator(promote,kvpair.key,promote);
+  }
+
+  rc = newleaf.Serialize(buffercache,newleafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return node.Serialize(buffercache,ptr);
+}
+
+
+ERROR_T BTreeIndex::Upsert(const SIZE_T &ptr, const KEY_T &key, std::stack<SIZE_T> traversed)
+{
+  ERROR_T rc;
+  BTreeNode parent;
+  SIZE_T parentptr;
+  SIZE_T offset;
+
+  parentptr = traversed.top();
+  traversed.pop();
+  rc = parent.Unserialize(buffercache,parentptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // key separates the subtree we came up from and its new
+  // right neighbor ptr, so it goes just after that subtree
+  offset = nodeaccess->LowerBound(parent,key,searchtype);
+
+  if (parent.HasRoomFor(key)) { 
+    rc = parent.InsertKeyPtr(offset,key,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    return parent.Serialize(buffercache,parentptr);
+  }
+
+  // The parent is full, so split it.  It keeps the keys before the
+  // middle one, the middle one goes up, and the keys after it move
+  // to a new interior node on its right, along with their pointers.
+  BTreeNode newinterior(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format);
+  KEY_T promote, tempkey;
+  SIZE_T tempptr;
+  SIZE_T newnode;
+  SIZE_T split = parent.ChooseInteriorSplit(offset,key);
+
+  rc = AllocateNode(newnode);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  rc = parent.GetCommonPrefix(tempkey);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = newinterior.SetCommonPrefix(tempkey,tempkey.length);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  rc = parent.GetKey(split,promote);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // The new node's first pointer is the one after the key that goes
+  // up, and the slots after that move over whole
+  rc = parent.GetPtr(split+1,tempptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = newinterior.SetPtr(0,tempptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = parent.MoveSlots(split+1,parent.info.numkeys-split-1,newinterior,0);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = parent.RemoveSlots(split,1);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  if (offset<=split) { 
+    rc = parent.InsertKeyPtr(offset,key,ptr);
+  } else {
+    rc = newinterior.InsertKeyPtr(offset-split-1,key,ptr);
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  if (parent.info.nodetype==BTREE_ROOT_NODE) { 
+    // The root split, so the tree grows a level
+    BTreeNode newroot(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format);
+    SIZE_T newrootptr;
+
+    rc = AllocateNode(newrootptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    newroot.info.numkeys = 1;
+    newroot.SetKey(0,promote);
+    newroot.SetPtr(0,parentptr);
+    newroot.SetPtr(1,newnode);
+    parent.info.nodetype = BTREE_INTERIOR_NODE;
+
+    rc = parent.Serialize(buffercache,parentptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = newinterior.Serialize(buffercache,newnode);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = newroot.Serialize(buffercache,newrootptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    superblock.info.rootnode = newrootptr;
+    return superblock.Serialize(buffercache,superblock_index);
+  }
+
+  rc = parent.Serialize(buffercache,parentptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = newinterior.Serialize(buffercache,newnode);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  return Upsert(newnode, promote, traversed);
+}
+  
+// Compares keys the way the leaves order them
+static int CompareKeys(const KEY_T &a, const KEY_T &b)
+{
+  SIZE_T n = a.length<b.length ? a.length : b.length;
+  int c=memcmp(a.data,b.data,n);
+
+  if (c!=0) { 
+    return c;
+  }
+  return a.length<b.length ? -1 : a.length>b.length ? 1 : 0;
+}
+
+static bool PairLess(const KeyValuePair &a, const KeyValuePair &b)
+{
+  return CompareKeys(a.key,b.key)<0;
+}
+
+// The same, but pairs with the same key go by value
+static bool PairValueLess(const KeyValuePair &a, const KeyValuePair &b)
+{
+  int c=CompareKeys(a.key,b.key);
+  return c<0 || (c==0 && CompareKeys(a.value,b.value)<0);
+}
+
+// Whether the pair is the right size for an index with this superblock
+static bool PairFits(const NodeMetadata &info, const KeyValuePair &pair)
+{
+  return SizeFits(info,pair.key.length,info.keysize) && SizeFits(info,pair.value.length,info.valuesize);
+}
+
+// Hands out the pairs of a vector, in the order they are in
+class VectorPairSource : public BTreePairSource {
+ private:
+  const vector<KeyValuePair> &pairs;
+  SIZE_T next;
+
+ public:
+  VectorPairSource(const vector<KeyValuePair> &p) : pairs(p), next(0) {}
+
+  ERROR_T Next(KeyValuePair &pair) { 
+    if (next==pairs.size()) { 
+      return ERROR_NONEXISTENT;
+    }
+    pair=pairs[next++];
+    return ERROR_NOERROR;
+  }
+};
+
+// Hands out a pair for each key of source, whose value is the posting
+// list of the values source has for it, for a non-unique index.  The
+// pairs of source come in key order.
+class PostingPairSource : public BTreePairSource {
+ private:
+  BTreePairSource &source;
+  const NodeMetadata &info;
+  KeyValuePair pending;  // the first pair of the next key
+  bool started, more;
+
+ public:
+  PostingPairSource(BTreePairSource &s, const NodeMetadata &i) : 
+    source(s), info(i), started(false), more(false) {}
+
+  ERROR_T Next(KeyValuePair &pair) { 
+    vector<VALUE_T> values;
+    SIZE_T length=0, pos=0;
+    ERROR_T rc;
+
+    if (!started) { 
+      started=true;
+      rc=source.Next(pending);
+      if (rc!=ERROR_NOERROR && rc!=ERROR_NONEXISTENT) { return rc; }
+      more = rc==ERROR_NOERROR;
+    }
+    if (!more) { 
+      return ERROR_NONEXISTENT;
+    }
+    pair.key=pending.key;
+    do { 
+      if (!SizeFits(info,pending.value.length,info.valuesize)) { 
+	return ERROR_SIZE;
+      }
+      values.push_back(pending.value);
+      length+=VarintLength(pending.value.length)+pending.value.length;
+      rc=source.Next(pending);
+    } while (rc==ERROR_NOERROR && CompareKeys(pending.key,pair.key)==0);
+    if (rc!=ERROR_NOERROR && rc!=ERROR_NONEXISTENT) { return rc; }
+    more = rc==ERROR_NOERROR;
+
+    sort(values.begin(),values.end(),
+	 [](const VALUE_T &a, const VALUE_T &b) { return CompareKeys(a,b)<0; });
+    pair.value.Resize(length,false);
+    for (SIZE_T i=0; i<values.size(); i++) { 
+      if (i>0 && CompareKeys(values[i-1],values[i])==0) { 
+	return ERROR_CONFLICT;
+      }
+      pos+=PutVarint(values[i].length,pair.value.data+pos);
+      memcpy(pair.value.data+pos,values[i].data,values[i].length);
+      pos+=values[i].length;
+    }
+    return ERROR_NOERROR;
+  }
+};
+
+
+ERROR_T BTreeIndex::BulkLoad(vector<KeyValuePair> &pairs, const SIZE_T fillfactor)
+{
+  // In a non-unique index, only the same pair twice is a conflict
+  bool (*less)(const KeyValuePair &, const KeyValuePair &) = 
+    superblock.info.duplicates ? PairValueLess : PairLess;
+
+  // Everything is checked before the index is touched
+  for (SIZE_T i=0; i<pairs.size(); i++) { 
+    if (!PairFits(superblock.info,pairs[i])) { 
+      return ERROR_SIZE;
+    }
+  }
+  if (!is_sorted(pairs.begin(),pairs.end(),less)) { 
+    sort(pairs.begin(),pairs.end(),less);
+  }
+  for (SIZE_T i=1; i<pairs.size(); i++) { 
+    if (!less(pairs[i-1],pairs[i])) { 
+      return ERROR_CONFLICT;
+    }
+  }
+
+  VectorPairSource source(pairs);
+
+  return BulkLoad(source,fillfactor);
+}
+
+
+ERROR_T BTreeIndex::BulkLoad(BTreePairSource &source, const SIZE_T fillfactor)
+{
+  BTreeNode root;
+  PostingPairSource postings(source,superblock.info);
+  // What goes in the leaves, which in a non-unique index is a posting
+  // list for each key
+  BTreePairSource &pairs = superblock.info.duplicates ? (BTreePairSource &)postings : source;
+  ERROR_T rc;
+
+  if (fillfactor<1 || fillfactor>100) { 
+    return ERROR_SIZE;
+  }
+  rc=root.Unserialize(buffercache,superblock.info.rootnode);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (root.info.numkeys!=0) { 
+    return ERROR_CONFLICT;
+  }
+
+  bulknodes.clear();
+  bulkoverflows.clear();
+  if (!wal) { 
+    rc=BulkLoadInternal(pairs,fillfactor);
+    if (rc!=ERROR_NOERROR) { 
+      BulkLoadUndo();
+    }
+    return rc;
+  }
+
+  // The new nodes go straight home, as they do when an index is 
+  // created, rather than through the log.  Nothing points to them
+  // until the root is written, and that is written last.  A crash
+  // before then leaves the index empty, and at worst loses the 
+  // blocks taken off the free list.
+  rc=wal->Checkpoint();
+  if (rc!=ERROR_NOERROR) { return rc; }
+  buffercache->SetLog(0);
+  rc=BulkLoadInternal(pairs,fillfactor);
+  if (rc!=ERROR_NOERROR) { 
+    // The blocks go back home as well, so as not to be lost
+    BulkLoadUndo();
+    buffercache->WriteBackDirtyBlocks();
+  } else {
+    rc=buffercache->WriteBackDirtyBlocks();
+  }
+  buffercache->SetLog(wal);
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::BulkAllocateNode(SIZE_T &n)
+{
+  SIZE_T freelist=allocator ? allocator->superblock.info.freelist : superblock.info.freelist;
+  ERROR_T rc;
+
+  if (freelist!=0 && bulknodes.size()%BTREE_BULKLOAD_RUN==0) { 
+    if (!bulknodes.empty()) { 
+      rc = buffercache->WriteBackDirtyBlocks();
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    for (SIZE_T i=0; i<BTREE_BULKLOAD_RUN; i++) { 
+      if (buffercache->PrefetchBlock(freelist+i)!=ERROR_NOERROR) { 
+	break;
+      }
+    }
+  }
+  rc = AllocateNode(n);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  bulknodes.push_back(n);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::BulkLoadUndo()
+{
+  BTreeIndex *owner = allocator ? allocator : this;
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (SIZE_T i=0; i<bulkoverflows.size() && rc==ERROR_NOERROR; i++) { 
+    rc=FreeOverflow(bulkoverflows[i]);
+  }
+  // Some of these were never written, so they are not read first
+  for (SIZE_T i=0; i<bulknodes.size() && rc==ERROR_NOERROR; i++) { 
+    rc=DiscardNode(bulknodes[i]);
+  }
+  bulknodes.clear();
+  bulkoverflows.clear();
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return owner->superblock.Serialize(buffercache,owner->superblock_index);
+}
+
+
+ERROR_T BTreeIndex::BulkLoadInternal(BTreePairSource &source, 
+				     const SIZE_T fillfactor)
+{
+  BTreeNode leaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format, superblock.info.overflowsize, superblock.info.tombstones, superblock.info.duplicates);
+  const BTreeNode emptyleaf(leaf);
+  vector<SIZE_T> ptrs;
+  vector<KEY_T> seps;
+  SIZE_T leafptr, nextptr, prevptr=0;
+  KeyValuePair pair, previous;
+  SIZE_T numpairs=0;
+  KEY_T last;
+  VALUE_T stored;
+  ERROR_T rc;
+
+  rc = source.Next(pair);
+  if (rc==ERROR_NONEXISTENT) { 
+    return ERROR_NOERROR;
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc = BulkAllocateNode(leafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  do { 
+    const KEY_T &key=pair.key;
+    const bool overflow=IsOverflowValue(pair.value);
+    const VALUE_T &inleaf = overflow ? stored : pair.value;
+
+    // A posting list was checked value by value (PostingPairSource)
+    if (!SizeFits(superblock.info,key.length,superblock.info.keysize) || 
+	(!superblock.info.duplicates && 
+	 !SizeFits(superblock.info,pair.value.length,superblock.info.valuesize))) { 
+      return ERROR_SIZE;
+    }
+    if (numpairs++>0 && CompareKeys(previous.key,key)>=0) { 
+      return ERROR_CONFLICT;
+    }
+    if (overflow) { 
+      rc = WriteOverflow(pair.value,stored);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      bulkoverflows.push_back(OverflowRef());
+      memcpy(&bulkoverflows.back(),stored.data,sizeof(OverflowRef));
+    }
+    if (leaf.info.numkeys>0 && 
+	(!leaf.HasRoomFor(key,inleaf) || leaf.GetFillPercent()>=fillfactor)) { 
+      // This leaf is done, and the next one goes in the next block
+      rc = BulkAllocateNode(nextptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      leaf.SetPtr(0,nextptr);
+      leaf.info.prevleaf = prevptr;
+      rc = leaf.Serialize(buffercache,leafptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = leaf.GetKey(leaf.info.numkeys-1,last);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+	ShortestSeparator(last,key,last);
+      }
+      ptrs.push_back(leafptr);
+      seps.push_back(last);
+      prevptr=leafptr;
+      leafptr=nextptr;
+      leaf=emptyleaf;
+    }
+    rc = leaf.InsertKeyVal(leaf.info.numkeys,key,inleaf,overflow);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    swap(previous,pair);
+  } while ((rc=source.Next(pair))==ERROR_NOERROR);
+  if (rc!=ERROR_NONEXISTENT) { return rc; }
+
+  nextptr=0;
+  if (ptrs.empty()) { 
+    // The root needs two children, so as after the first insert, 
+    // the one leaf gets an empty one on its right
+    rc = BulkAllocateNode(nextptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = leaf.GetKey(leaf.info.numkeys-1,last);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    seps.push_back(last);
+  }
+  leaf.SetPtr(0,nextptr);
+  leaf.info.prevleaf = prevptr;
+  rc = leaf.Serialize(buffercache,leafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  ptrs.push_back(leafptr);
+  if (nextptr!=0) { 
+    leaf=emptyleaf;
+    leaf.info.prevleaf = leafptr;
+    rc = leaf.Serialize(buffercache,nextptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptrs.push_back(nextptr);
+  }
+
+  while (ptrs.size()>1) { 
+    rc = BulkLoadLevel(ptrs,seps,fillfactor);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::BulkLoadLevel(vector<SIZE_T> &ptrs, 
+				  vector<KEY_T> &seps, 
+				  const SIZE_T fillfactor)
+{
+  const BTreeNode emptynode(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format);
+  BTreeNode node(emptynode);
+  vector<BTreeNode> nodes;
+  vector<KEY_T> up;
+  ERROR_T rc;
+
+  node.SetPtr(0,ptrs[0]);
+  for (SIZE_T i=1; i<ptrs.size(); i++) { 
+    const KEY_T &key=seps[i-1];
+    if (node.info.numkeys>0 && 
+	(!node.HasRoomFor(key) || node.GetFillPercent()>=fillfactor)) { 
+      // The separator between this node and the next goes up
+      nodes.push_back(node);
+      up.push_back(key);
+      node=emptynode;
+      node.SetPtr(0,ptrs[i]);
+      continue;
+    }
+    rc = node.InsertKeyPtr(node.info.numkeys,key,ptrs[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+
+  if (node.info.numkeys==0 && !nodes.empty()) { 
+    // The last node got only one child.  It goes in the node before
+    // if that has room, and if not, takes that node's last child.
+    BTreeNode &prev=nodes.back();
+    KEY_T key=up.back();
+    SIZE_T child, moved;
+    up.pop_back();
+    node.GetPtr(0,child);
+    if (prev.HasRoomFor(key)) { 
+      rc = prev.InsertKeyPtr(prev.info.numkeys,key,child);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    } else {
+      KEY_T promote;
+      rc = prev.GetPtr(prev.info.numkeys,moved);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = prev.GetKey(prev.info.numkeys-1,promote);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = prev.RemoveSlots(prev.info.numkeys-1,1);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      node.SetPtr(0,moved);
+      rc = node.InsertKeyPtr(0,key,child);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      up.push_back(promote);
+      nodes.push_back(node);
+    }
+  } else {
+    nodes.push_back(node);
+  }
+
+  ptrs.clear();
+  if (nodes.size()==1) { 
+    nodes[0].info.nodetype=BTREE_ROOT_NODE;
+    if (wal) { 
+      // Everything under the root has to be home before it is
+      rc = buffercache->WriteBackDirtyBlocks();
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    return nodes[0].Serialize(buffercache,superblock.info.rootnode);
+  }
+  for (SIZE_T i=0; i<nodes.size(); i++) { 
+    SIZE_T ptr;
+    rc = BulkAllocateNode(ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = nodes[i].Serialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptrs.push_back(ptr);
+  }
+  seps.swap(up);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::InsertBatch(vector<KeyValuePair> &pairs)
+{
+  BTreeNode root;
+  SIZE_T next=0, numskipped=0;
+  ERROR_T rc;
+
+  for (SIZE_T i=0; i<pairs.size(); i++) { 
+    if (!PairFits(superblock.info,pairs[i])) { 
+      return ERROR_SIZE;
+    }
+  }
+  // Stable, so that of two pairs with the same key, the one that 
+  // came first goes in, as it would one at a time
+  if (!is_sorted(pairs.begin(),pairs.end(),PairLess)) { 
+    stable_sort(pairs.begin(),pairs.end(),PairLess);
+  }
+  if (pairs.empty()) { 
+    return ERROR_NOERROR;
+  }
+  if (superblock.info.duplicates) { 
+    // Each pair has its key's posting list to go in, so they go in 
+    // one at a time
+    for (next=0; next<pairs.size(); next++) { 
+      rc=Insert(pairs[next].key,pairs[next].value);
+      if (rc==ERROR_CONFLICT) { 
+	numskipped++;
+      } else if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
+    return numskipped>0 ? ERROR_CONFLICT : ERROR_NOERROR;
+  }
+
+  rc=root.Unserialize(buffercache,superblock.info.rootnode);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (root.info.numkeys==0) { 
+    // The first pair makes the first leaves
+    rc=EndOperation(InsertInternal(pairs[0].key,pairs[0].value));
+    if (rc!=ERROR_NOERROR) { return rc; }
+    next=1;
+  }
+
+  while (next<pairs.size()) { 
+    rc=EndOperation(InsertBatchLeaf(pairs,next,numskipped));
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return numskipped>0 ? ERROR_CONFLICT : ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SeekLeafPath(const KEY_T &key, 
+				 std::stack<SIZE_T> &path, 
+				 SIZE_T &ptr, 
+				 BTreeNode &leaf, 
+				 bool &bounded, 
+				 KEY_T &bound) const
+{
+  SIZE_T offset;
+  ERROR_T rc;
+
+  bounded=false;
+  ptr=superblock.info.rootnode;
+  while (1) { 
+    rc=leaf.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (leaf.info.nodetype==BTREE_LEAF_NODE) { 
+      return ERROR_NOERROR;
+    }
+    path.push(ptr);
+    offset=nodeaccess->LowerBound(leaf,key,searchtype);
+    if (offset<leaf.info.numkeys) { 
+      // The separator after the pointer followed is the tightest
+      // bound yet, since the ones above it are at least as large
+      bounded=true;
+      rc=leaf.GetKey(offset,bound);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc=leaf.GetPtr(offset,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+}
+
+
+ERROR_T BTreeIndex::InsertBatchLeaf(const vector<KeyValuePair> &pairs, 
+				    SIZE_T &next, 
+				    SIZE_T &numskipped)
+{
+  const BTreeNode emptyleaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format, superblock.info.overflowsize, superblock.info.tombstones, superblock.info.duplicates);
+  BTreeNode leaf, node(emptyleaf);
+  std::stack<SIZE_T> path;
+  SIZE_T leafptr, nextleafptr, numleaves, numadded=0, i=0;
+  bool bounded;
+  KEY_T bound;
+  vector<KeyValuePair> merged;
+  vector<bool> overflows;
+  vector<BTreeNode> nodes;
+  vector<KEY_T> seps;
+  vector<SIZE_T> ptrs;
+  // Overflow values of dead pairs, which are left out, and freed 
+  // once the leaf is written without them
+  vector<OverflowRef> dead;
+  ERROR_T rc;
+
+  rc = SeekLeafPath(pairs[next].key,path,leafptr,leaf,bounded,bound);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  // Merge the pairs in the leaf with the ones that go in it, which 
+  // are the ones up to its bound, in one pass over each
+  while (next<pairs.size() && (!bounded || CompareKeys(pairs[next].key,bound)<=0)) { 
+    const KeyValuePair &pair=pairs[next++];
+    int c=1;
+
+    for (; i<leaf.info.numkeys && (c=nodeaccess->CompareKey(leaf,pair.key,i))>=0; i++) { 
+      if (leaf.IsTombstone(i)) { 
+	// A dead pair, which a new one can take the key of
+	rc = NoteOverflow(leaf,i,dead);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	c=1;
+	continue;
+      }
+      if (c==0) { 
+	break;
+      }
+      merged.push_back(KeyValuePair());
+      leaf.GetKey(i,merged.back().key);
+      leaf.GetVal(i,merged.back().value);
+      overflows.push_back(leaf.IsOverflowVal(i));
+    }
+    if (c==0 || (!merged.empty() && CompareKeys(merged.back().key,pair.key)==0)) { 
+      // Already there, or earlier in the batch
+      numskipped++;
+      continue;
+    }
+    merged.push_back(pair);
+    overflows.push_back(IsOverflowValue(pair.value));
+    if (overflows.back()) { 
+      rc = WriteOverflow(pair.value,merged.back().value);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    numadded++;
+  }
+  if (numadded==0) { 
+    return ERROR_NOERROR;
+  }
+  for (; i<leaf.info.numkeys; i++) { 
+    if (leaf.IsTombstone(i)) { 
+      rc = NoteOverflow(leaf,i,dead);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      continue;
+    }
+    merged.push_back(KeyValuePair());
+    leaf.GetKey(i,merged.back().key);
+    leaf.GetVal(i,merged.back().value);
+    overflows.push_back(leaf.IsOverflowVal(i));
+  }
+
+  // Find how few leaves they fit in, filling each one up.  Usually 
+  // that is just the one, and this is it.
+  numleaves=1;
+  for (i=0; i<merged.size(); i++) { 
+    if (node.info.numkeys>0 && !node.HasRoomFor(merged[i].key,merged[i].value)) { 
+      numleaves++;
+      node=emptyleaf;
+    }
+    rc = node.InsertKeyVal(node.info.numkeys,merged[i].key,merged[i].value,overflows[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+
+  if (numleaves>1) { 
+    // Spread them evenly over that many, rather than leaving the last 
+    // one nearly empty
+    SIZE_T target=0, start=0;
+    node=emptyleaf;
+    for (i=0; i<merged.size(); i++) { 
+      if (node.info.numkeys>0 && 
+	  (node.info.numkeys>=target || !node.HasRoomFor(merged[i].key,merged[i].value))) { 
+	KEY_T last;
+	rc = node.GetKey(node.info.numkeys-1,last);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+	  ShortestSeparator(last,merged[i].key,last);
+	}
+	nodes.push_back(node);
+	seps.push_back(last);
+	node=emptyleaf;
+      }
+      if (node.info.numkeys==0) { 
+	SIZE_T left = numleaves>nodes.size()+1 ? numleaves-nodes.size() : 1;
+	start=i;
+	target=(merged.size()-start+left-1)/left;
+      }
+      rc = node.InsertKeyVal(node.info.numkeys,merged[i].key,merged[i].value,overflows[i]);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+  }
+  nodes.push_back(node);
+
+  // The first goes where the leaf was, and the rest in new blocks,
+  // linked in between it and the one after it
+  ptrs.push_back(leafptr);
+  for (i=1; i<nodes.size(); i++) { 
+    SIZE_T ptr;
+    rc = AllocateNode(ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptrs.push_back(ptr);
+  }
+  rc = leaf.GetPtr(0,nextleafptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  for (i=0; i<nodes.size(); i++) { 
+    nodes[i].info.prevleaf = i>0 ? ptrs[i-1] : leaf.info.prevleaf;
+    nodes[i].SetPtr(0, i+1<nodes.size() ? ptrs[i+1] : nextleafptr);
+    rc = nodes[i].Serialize(buffercache,ptrs[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  if (nodes.size()>1 && nextleafptr!=0) { 
+    rc = node.Unserialize(buffercache,nextleafptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    node.info.prevleaf = ptrs.back();
+    rc = node.Serialize(buffercache,nextleafptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  for (i=0; i<dead.size(); i++) { 
+    rc = FreeOverflow(dead[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+
+  // Each new leaf's separator goes up to its parent, just after the
+  // leaf before it.  That one is found again each time, since a 
+  // split along the way can move it to another parent.
+  for (i=1; i<nodes.size(); i++) { 
+    if (i>1) { 
+      SIZE_T ptr;
+      path=std::stack<SIZE_T>();
+      rc = SeekLeafPath(seps[i-1],path,ptr,leaf,bounded,bound);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc = Upsert(ptrs[i],seps[i-1],path);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupBatch(const vector<KEY_T> &keys, 
+				vector<VALUE_T> &values, 
+				vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order(keys.size());
+  ERROR_T rc;
+
+  values.resize(keys.size());
+  results.assign(keys.size(),ERROR_NONEXISTENT);
+  for (SIZE_T i=0; i<order.size(); i++) { 
+    order[i]=i;
+  }
+  // The keys stay where they are, and order is what gets sorted
+  sort(order.begin(),order.end(),
+       [&keys](const SIZE_T a, const SIZE_T b) { return CompareKeys(keys[a],keys[b])<0; });
+
+  rc=LookupBatchInternal(superblock.info.rootnode,keys,order,0,order.size(),values,results);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  for (SIZE_T i=0; i<results.size(); i++) { 
+    if (results[i]!=ERROR_NOERROR) { 
+      return ERROR_NONEXISTENT;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupBatchInternal(const SIZE_T &node, 
+					const vector<KEY_T> &keys, 
+					const vector<SIZE_T> &order, 
+					const SIZE_T lo, 
+					const SIZE_T hi, 
+					vector<VALUE_T> &values, 
+					vector<ERROR_T> &results)
+{
+  BTreeNode b;
+  SIZE_T offset, ptr, i, end;
+  ERROR_T rc;
+
+  rc=b.Unserialize(buffercache,node);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) { 
+      // An empty index, so none of them are there
+      return ERROR_NOERROR;
+    }
+    for (i=lo; i<hi; i=end) { 
+      // The keys from i that go down the same pointer are the ones 
+      // up to the separator after it, or all the rest past the last
+      offset=nodeaccess->LowerBound(b,keys[order[i]],searchtype);
+      for (end=i+1; end<hi && (offset==b.info.numkeys || 
+			       nodeaccess->CompareKey(b,keys[order[end]],offset)<=0); end++) {}
+      rc=b.GetPtr(offset,ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc=LookupBatchInternal(ptr,keys,order,i,end,values,results);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    for (i=lo; i<hi; i++) { 
+      const KEY_T &key=keys[order[i]];
+      offset=nodeaccess->LowerBound(b,key,searchtype);
+      if (offset>=b.info.numkeys || nodeaccess->CompareKey(b,key,offset)!=0 || 
+	  b.IsTombstone(offset)) { 
+	continue;
+      }
+      rc=GetLeafValue(b,offset,values[order[i]]);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      results[order[i]]=ERROR_NOERROR;
+    }
+    return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  if (superblock.info.duplicates) { 
+    PostingEdit replace(superblock.info,value,PostingEdit::REPLACE);
+    return EndOperation(InsertInternal(key,value,BTREE_OP_UPDATE,&replace));
+  }
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+    // The new value can be longer than the old one, and if the leaf
+    // has no room for it, the leaf splits just as for an insert
+    return EndOperation(InsertInternal(key,value,BTREE_OP_UPDATE));
+  }
+  if (value.length!=superblock.info.valuesize) { 
+    return ERROR_SIZE;
+  }
+  return EndOperation(LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, (KEY_T&)key, (VALUE_T&)value));
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key, const BTreeDeleteMode mode)
+{
+  return EndOperation(DeleteInternal(key,mode));
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key, const VALUE_T &value, const BTreeDeleteMode mode)
+{
+  VALUE_T current;
+  ERROR_T rc;
+
+  if (superblock.info.duplicates) { 
+    PostingEdit remove(superblock.info,value,PostingEdit::REMOVE);
+    rc=InsertInternal(key,value,BTREE_OP_UPDATE,&remove);
+    if (rc==ERROR_CONFLICT && remove.last) { 
+      // Its last value, so the key goes too
+      rc=DeleteInternal(key,mode);
+    }
+    return EndOperation(rc);
+  }
+  if (!SizeFits(superblock.info,value.length,superblock.info.valuesize)) { 
+    return ERROR_SIZE;
+  }
+  rc=Lookup(key,current);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (current.length!=value.length || memcmp(current.data,value.data,value.length)!=0) { 
+    return ERROR_NONEXISTENT;
+  }
+  return EndOperation(DeleteInternal(key,mode));
+}
+
+
+ERROR_T BTreeIndex::DeleteInternal(const KEY_T &key, const BTreeDeleteMode mode)
+{
+  BTreeNode leaf;
+  vector<SIZE_T> path, offsets;
+  SIZE_T ptr, offset;
+  ERROR_T rc;
+
+  if (!SizeFits(superblock.info,key.length,superblock.info.keysize)) { 
+    return ERROR_SIZE;
+  }
+
+  rc=SeekLeafParents(key,path,offsets,ptr,leaf);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+    // An empty index
+    return ERROR_NONEXISTENT;
+  }
+  offset=nodeaccess->LowerBound(leaf,key,searchtype);
+  if (offset>=leaf.info.numkeys || nodeaccess->CompareKey(leaf,key,offset)!=0 || 
+      leaf.IsTombstone(offset)) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  if (mode==BTREE_DELETE_LAZY && superblock.info.tombstones) { 
+    // The pair stays, dead, and its leaf is left for Compact
+    rc=leaf.SetTombstone(offset,true);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    compactleaves.insert(ptr);
+    return leaf.Serialize(buffercache,ptr);
+  }
+
+  if (leaf.IsOverflowVal(offset)) { 
+    OverflowRef ref;
+    rc=leaf.GetOverflowRef(offset,ref);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=FreeOverflow(ref);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  rc=leaf.RemoveSlots(offset,1);
+  if (rc!=ERROR_NOERROR) { return rc; }
+
+  return Rebalance(path,offsets,ptr,leaf);
+}
+
+
+ERROR_T BTreeIndex::SeekLeafParents(const KEY_T &key, 
+				    vector<SIZE_T> &path, 
+				    vector<SIZE_T> &offsets, 
+				    SIZE_T &ptr, 
+				    BTreeNode &leaf) const
+{
+  SIZE_T offset;
+  ERROR_T rc;
+
+  ptr=superblock.info.rootnode;
+  while (1) { 
+    rc=leaf.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (leaf.info.nodetype==BTREE_LEAF_NODE || leaf.info.numkeys==0) { 
+      return ERROR_NOERROR;
+    }
+    offset=nodeaccess->LowerBound(leaf,key,searchtype);
+    path.push_back(ptr);
+    offsets.push_back(offset);
+    rc=leaf.GetPtr(offset,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+}
+
+
+bool BTreeIndex::IsUnderfull(const BTreeNode &node) const
+{
+  return node.info.numkeys==0 || node.GetFillPercent()<minfill;
+}
+
+
+// Appends pairs[lo..hi) to the end of leaf, dead or not as they 
+// were, or returns false as soon as one does not fit
+static bool AppendPairs(BTreeNode &leaf, 
+			const vector<KeyValuePair> &pairs, 
+			const vector<bool> &overflows, 
+			const vector<bool> &dead, 
+			const SIZE_T lo, 
+			const SIZE_T hi)
+{
+  for (SIZE_T i=lo; i<hi; i++) { 
+    if (!leaf.HasRoomFor(pairs[i].key,pairs[i].value) || 
+	leaf.InsertKeyVal(leaf.info.numkeys,pairs[i].key,pairs[i].value,overflows[i])!=ERROR_NOERROR || 
+	(dead[i] && leaf.SetTombstone(leaf.info.numkeys-1,true)!=ERROR_NOERROR)) { 
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// The same for the keys of an interior node, each with the pointer
+// after it
+static bool AppendKeys(BTreeNode &node, 
+		       const vector<KEY_T> &keys, 
+		       const vector<SIZE_T> &ptrs, 
+		       const SIZE_T lo, 
+		       const SIZE_T hi)
+{
+  for (SIZE_T i=lo; i<hi; i++) { 
+    if (!node.HasRoomFor(keys[i]) || 
+	node.InsertKeyPtr(node.info.numkeys,keys[i],ptrs[i+1])!=ERROR_NOERROR) { 
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// How many of the items of the given sizes to put on the left so
+// that each side gets about half of the bytes, with at least one
+// on the left and at least min not
+static SIZE_T HalfwayPoint(const vector<SIZE_T> &sizes, const SIZE_T min)
+{
+  SIZE_T total=0, sofar=0, i;
+
+  for (i=0; i<sizes.size(); i++) { 
+    total+=sizes[i];
+  }
+  for (i=0; i+min<sizes.size() && (i==0 || 2*(sofar+sizes[i])<=total); i++) { 
+    sofar+=sizes[i];
+  }
+  return i;
+}
+
+
+ERROR_T BTreeIndex::MergeOrBorrow(BTreeNode &parent, 
+				  const SIZE_T sep, 
+				  BTreeNode &left, 
+				  const SIZE_T leftptr, 
+				  BTreeNode &right, 
+				  const SIZE_T rightptr, 
+				  bool &merged)
+{
+  BTreeNode newparent(parent);
+  KEY_T newsep;
+  SIZE_T split;
+  vector<SIZE_T> sizes;
+  ERROR_T rc;
+
+  if (left.info.nodetype==BTREE_LEAF_NODE) { 
+    const BTreeNode emptyleaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format, superblock.info.overflowsize, superblock.info.tombstones, superblock.info.duplicates);
+    BTreeNode a(emptyleaf), b(emptyleaf);
+    vector<KeyValuePair> pairs(left.info.numkeys+right.info.numkeys);
+    vector<bool> overflows(pairs.size()), dead(pairs.size());
+    SIZE_T nextleafptr;
+
+    for (SIZE_T i=0; i<pairs.size(); i++) { 
+      const BTreeNode &from = i<left.info.numkeys ? left : right;
+      SIZE_T offset = i<left.info.numkeys ? i : i-left.info.numkeys;
+      rc = from.GetKey(offset,pairs[i].key);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = from.GetVal(offset,pairs[i].value);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      overflows[i]=from.IsOverflowVal(offset);
+      dead[i]=from.IsTombstone(offset);
+      sizes.push_back(pairs[i].key.length+pairs[i].value.length);
+    }
+    rc = right.GetPtr(0,nextleafptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    a.info.prevleaf=left.info.prevleaf;
+    // Dead pairs come along, so Compact has to look at these leaves
+    // again even if it has been through them
+    if (find(dead.begin(),dead.end(),true)!=dead.end()) { 
+      compactleaves.insert(leftptr);
+      compactleaves.insert(rightptr);
+    }
+
+    merged=AppendPairs(a,pairs,overflows,dead,0,pairs.size());
+    if (merged) { 
+      // The right leaf goes away, so the one after it links back to 
+      // the left one now
+      a.SetPtr(0,nextleafptr);
+      if (nextleafptr!=0) { 
+	rc = b.Unserialize(buffercache,nextleafptr);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	b.info.prevleaf=leftptr;
+	rc = b.Serialize(buffercache,nextleafptr);
+	if (rc!=ERROR_NOERROR) { return rc; }
+      }
+      rc = parent.RemoveSlots(sep,1);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      left=a;
+      return ERROR_NOERROR;
+    }
+
+    // Too many for one leaf, so even them out between the two
+    split=HalfwayPoint(sizes,1);
+    a=emptyleaf;
+    a.info.prevleaf=left.info.prevleaf;
+    if (!AppendPairs(a,pairs,overflows,dead,0,split) || 
+	!AppendPairs(b,pairs,overflows,dead,split,pairs.size())) { 
+      return ERROR_NOSPACE;
+    }
+    a.SetPtr(0,rightptr);
+    b.SetPtr(0,nextleafptr);
+    b.info.prevleaf=leftptr;
+    newsep=pairs[split-1].key;
+    if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+      ShortestSeparator(newsep,pairs[split].key,newsep);
+    }
+    rc = newparent.RemoveSlots(sep,1);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (!newparent.HasRoomFor(newsep)) { 
+      return ERROR_NOSPACE;
+    }
+    rc = newparent.InsertKeyPtr(sep,newsep,rightptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    left=a;
+    right=b;
+    parent=newparent;
+    return ERROR_NOERROR;
+  }
+
+  // Interior nodes, with the separator between them coming down to
+  // sit between their keys
+  const BTreeNode emptyinterior(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize(), superblock.info.format);
+  BTreeNode a(emptyinterior), b(emptyinterior);
+  vector<KEY_T> keys(left.info.numkeys+1+right.info.numkeys);
+  vector<SIZE_T> ptrs(keys.size()+1);
+
+  for (SIZE_T i=0; i<keys.size(); i++) { 
+    if (i<left.info.numkeys) { 
+      rc = left.GetKey(i,keys[i]);
+    } else if (i==left.info.numkeys) { 
+      rc = parent.GetKey(sep,keys[i]);
     } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+      rc = right.GetKey(i-left.info.numkeys-1,keys[i]);
     }
+    if (rc!=ERROR_NOERROR) { return rc; }
+    sizes.push_back(keys[i].length);
   }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
+  for (SIZE_T i=0; i<ptrs.size(); i++) { 
+    if (i<=left.info.numkeys) { 
+      rc = left.GetPtr(i,ptrs[i]);
+    } else {
+      rc = right.GetPtr(i-left.info.numkeys-1,ptrs[i]);
+    }
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+
+  a.SetPtr(0,ptrs[0]);
+  merged=AppendKeys(a,keys,ptrs,0,keys.size());
+  if (merged) { 
+    rc = parent.RemoveSlots(sep,1);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    left=a;
+    return ERROR_NOERROR;
+  }
+
+  // The key at the split goes up in place of the old separator, and
+  // each side keeps at least one key
+  split=HalfwayPoint(sizes,2);
+  a=emptyinterior;
+  a.SetPtr(0,ptrs[0]);
+  b.SetPtr(0,ptrs[split+1]);
+  if (!AppendKeys(a,keys,ptrs,0,split) || 
+      !AppendKeys(b,keys,ptrs,split+1,keys.size())) { 
+    return ERROR_NOSPACE;
   }
+  rc = newparent.RemoveSlots(sep,1);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (!newparent.HasRoomFor(keys[split])) { 
+    return ERROR_NOSPACE;
+  }
+  rc = newparent.InsertKeyPtr(sep,keys[split],rightptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  left=a;
+  right=b;
+  parent=newparent;
   return ERROR_NOERROR;
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+
+ERROR_T BTreeIndex::Rebalance(vector<SIZE_T> &path, 
+			      vector<SIZE_T> &offsets, 
+			      SIZE_T ptr, 
+			      BTreeNode &node)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  BTreeNode parent, sibling;
+  SIZE_T parentptr, siblingptr, sep;
+  bool merged;
+  ERROR_T rc;
+
+  while (!path.empty() && IsUnderfull(node)) { 
+    parentptr=path.back();
+    sep=offsets.back();
+    path.pop_back();
+    offsets.pop_back();
+    rc = parent.Unserialize(buffercache,parentptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    if (parent.info.nodetype==BTREE_ROOT_NODE && parent.info.numkeys==1 && 
+	node.info.nodetype==BTREE_LEAF_NODE) { 
+      // A root over leaves keeps two of them, as the first insert 
+      // made it, until both are empty and the index is empty again
+      rc = parent.GetPtr(1-sep,siblingptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = sibling.Unserialize(buffercache,siblingptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      if (node.info.numkeys>0 || sibling.info.numkeys>0) { 
+	break;
+      }
+      rc = DeallocateNode(ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = DeallocateNode(siblingptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      parent.info.numkeys=0;
+      return parent.Serialize(buffercache,parentptr);
+    }
+
+    // Pair up with the sibling on the right, or on the left for the
+    // last child.  sep is the separator between the two.
+    const bool onleft = sep<parent.info.numkeys;
+    if (!onleft) { 
+      sep--;
+    }
+    rc = parent.GetPtr(onleft ? sep+1 : sep,siblingptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = sibling.Unserialize(buffercache,siblingptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    BTreeNode &left = onleft ? node : sibling;
+    BTreeNode &right = onleft ? sibling : node;
+    const SIZE_T leftptr = onleft ? ptr : siblingptr;
+    const SIZE_T rightptr = onleft ? siblingptr : ptr;
+
+    rc = MergeOrBorrow(parent,sep,left,leftptr,right,rightptr,merged);
+    if (rc==ERROR_NOSPACE) { 
+      // Variable length keys that cannot be shared out, or a parent
+      // with no room for the new separator, so it stays underfull
+      break;
+    }
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    if (!merged) { 
+      rc = left.Serialize(buffercache,leftptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = right.Serialize(buffercache,rightptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      return parent.Serialize(buffercache,parentptr);
+    }
+
+    rc = DeallocateNode(rightptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    if (parent.info.nodetype==BTREE_ROOT_NODE && parent.info.numkeys==0) { 
+      // The root is down to the one child, which takes its place, 
+      // and the tree is a level shorter
+      left.info.nodetype=BTREE_ROOT_NODE;
+      rc = left.Serialize(buffercache,leftptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      superblock.info.rootnode=leftptr;
+      rc = superblock.Serialize(buffercache,superblock_index);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      return DeallocateNode(parentptr);
+    }
+
+    rc = left.Serialize(buffercache,leftptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    // The parent lost a key, so it may be underfull now in turn
+    node=parent;
+    ptr=parentptr;
+  }
+
+  return node.Serialize(buffercache,ptr);
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeIndex::DeleteRange(const KEY_T &lo, const KEY_T &hi)
+{
+  return EndOperation(DeleteRangeInternal(lo,hi));
+}
+
+
+ERROR_T BTreeIndex::DeleteRangeInternal(const KEY_T &lo, const KEY_T &hi)
 {
   BTreeNode root;
+  vector<OverflowRef> dead;
+  SIZE_T leftleaf=0, height;
   ERROR_T rc;
-  SIZE_T offset;
-  SIZE_T reverseoffset;
-  KEY_T testkey;
-  SIZE_T ptr;
-  KeyValuePair kvpair = KeyValuePair(key,value);
 
-  //Start with rootnode and check if it is empty (aka first insert)
-  root.Unserialize(buffercache, superblock.info.rootnode);  
+  if (!SizeFits(superblock.info,lo.length,superblock.info.keysize) || 
+      !SizeFits(superblock.info,hi.length,superblock.info.keysize)) { 
+    return ERROR_SIZE;
+  }
 
-  if(root.info.numkeys == 0) {
-    BTreeNode child(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
+  rc=root.Unserialize(buffercache,superblock.info.rootnode);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (root.info.numkeys==0) { 
+    // An empty index
+    return ERROR_NOERROR;
+  }
+
+  // Take the pairs out, and then even out what is left on the way 
+  // down to the two ends of the range, where nodes can be underfull,
+  // or down to one child
+  rc=DeleteRangeNode(superblock.info.rootnode,&lo,&hi,leftleaf,height,dead);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=RebalancePath(lo);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=RebalancePath(hi);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  // The nodes freed along the way only changed the free list
+  rc=superblock.Serialize(buffercache,superblock_index);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (allocator) { 
+    rc=allocator->superblock.Serialize(buffercache,allocator->superblock_index);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  for (SIZE_T i=0; i<dead.size(); i++) { 
+    rc=FreeOverflow(dead[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
 
-    SIZE_T rootleft;
-    SIZE_T rootright;
-    
-    rc = AllocateNode(rootleft);
-    if(rc != ERROR_NOERROR) {return rc;}
-    rc = AllocateNode(rootright);
-    if(rc != ERROR_NOERROR) {return rc;}
-    
-    child.Serialize(buffercache, rootright);
 
-    //im pretty sure the first key goes into the left?
-    child.info.numkeys += 1;
-    child.SetKeyVal(0, kvpair);
-    child.Serialize(buffercache, rootleft);
-    root.info.numkeys += 1;
+ERROR_T BTreeIndex::DeleteRangeNode(const SIZE_T ptr, 
+				    const KEY_T *lo, 
+				    const KEY_T *hi, 
+				    SIZE_T &leftleaf, 
+				    SIZE_T &height, 
+				    vector<OverflowRef> &dead)
+{
+  BTreeNode node;
+  SIZE_T first, last, from, to, child;
+  ERROR_T rc;
+
+  rc=node.Unserialize(buffercache,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
 
-    //the key that is inserted is that the keys less than it go to the left
-    root.SetKey(0, key);
-    root.SetPtr(0, rootleft);
-    root.SetPtr(1, rootright);
-    root.Serialize(buffercache, superblock.info.rootnode);
+  if (node.info.nodetype==BTREE_LEAF_NODE) { 
+    height=0;
+    first = lo ? nodeaccess->LowerBound(node,*lo,searchtype) : 0;
+    for (last=first; last<node.info.numkeys && (!hi || nodeaccess->CompareKey(node,*hi,last)>=0); last++) { 
+      rc=NoteOverflow(node,last,dead);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc=node.RemoveSlots(first,last-first);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (leftleaf==0) { 
+      leftleaf=ptr;
+    } else if (leftleaf!=ptr) { 
+      // This is the leaf hi is in, and the leaves between it and the 
+      // one lo is in are gone
+      BTreeNode left;
+      node.info.prevleaf=leftleaf;
+      rc=left.Unserialize(buffercache,leftleaf);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc=left.SetPtr(0,ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc=left.Serialize(buffercache,leftleaf);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    return node.Serialize(buffercache,ptr);
+  }
 
+  if (node.info.nodetype!=BTREE_ROOT_NODE && node.info.nodetype!=BTREE_INTERIOR_NODE) { 
+    return ERROR_INSANE;
+  }
+  first = lo ? nodeaccess->LowerBound(node,*lo,searchtype) : 0;
+  last = hi ? nodeaccess->LowerBound(node,*hi,searchtype) : node.info.numkeys;
+  if (first>last) { 
+    // lo is after hi
+    height=0;
     return ERROR_NOERROR;
   }
+  if (first==last) { 
+    rc=node.GetPtr(first,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=DeleteRangeNode(child,lo,hi,leftleaf,height,dead);
+    height++;
+    return rc;
+  }
+
+  // The children the range starts and ends partway through are 
+  // trimmed, and the ones from and to between them go whole
+  from=first;
+  to=last+1;
+  if (lo) { 
+    rc=node.GetPtr(first,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=DeleteRangeNode(child,lo,0,leftleaf,height,dead);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    from++;
+  }
+  if (hi) { 
+    rc=node.GetPtr(last,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=DeleteRangeNode(child,0,hi,leftleaf,height,dead);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    to--;
+  }
+  for (SIZE_T i=from; i<to; i++) { 
+    rc=node.GetPtr(i,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=FreeSubtree(child,height,dead);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  height++;
+
+  // Slot i is key i and pointer i+1, so the first pointer is moved 
+  // by hand when it goes
+  if (!lo) { 
+    rc=node.GetPtr(last,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=node.SetPtr(0,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=node.RemoveSlots(0,last);
+  } else { 
+    rc=node.RemoveSlots(first,to-from);
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return node.Serialize(buffercache,ptr);
+}
 
 
-  //initialize a stack that holds nodes
-  std::stack<SIZE_T> traversednodes;
-  //cout << "Traversing the tree\n\n-----------------\n";
-  traversednodes.push(superblock.info.rootnode);
-  //traverse the tree, unserilizing nodes and inserting them, until we reach a leaf node
-  while(root.info.nodetype != BTREE_LEAF_NODE){
-    //cout << root <<"\n";
-    //get the next node to go to, which is the pointer before the first key that is larger
-    //than the key we have
-    for(offset = 0; offset < root.info.numkeys; offset++) {
-      rc = root.GetKey(offset,testkey);
-      if(rc != ERROR_NOERROR) {return rc;}
-      
+ERROR_T BTreeIndex::RebalancePath(const KEY_T &key)
+{
+  BTreeNode node, newroot;
+  SIZE_T ptr, child;
+  ERROR_T rc;
 
-      //did we find the fisrt key larger?
-      if(key<testkey || key==testkey){
-        if (key == testkey) {return ERROR_CONFLICT;}
-        break;
+  ptr=superblock.info.rootnode;
+  rc=node.Unserialize(buffercache,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  while (node.info.nodetype!=BTREE_LEAF_NODE) { 
+    if (node.info.numkeys>0) { 
+      rc=RebalanceChild(node,nodeaccess->LowerBound(node,key,searchtype));
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+    rc=node.GetPtr(node.info.numkeys>0 ? nodeaccess->LowerBound(node,key,searchtype) : 0,child);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (node.info.nodetype==BTREE_ROOT_NODE && node.info.numkeys==0) { 
+      if (child==0) { 
+	// Its leaves are gone, and the index is empty
+	return node.Serialize(buffercache,ptr);
       }
+      // The root is down to the one child, which takes its place, 
+      // and the tree is a level shorter
+      rc=newroot.Unserialize(buffercache,child);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      newroot.info.nodetype=BTREE_ROOT_NODE;
+      rc=DiscardNode(ptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      superblock.info.rootnode=child;
+      ptr=child;
+      node=newroot;
+      continue;
     }
-    
-    rc = root.GetPtr(offset,ptr);
-    if (rc != ERROR_NOERROR) {return rc; }
-    traversednodes.push(ptr);
-    root.Unserialize(buffercache,ptr);
+    rc=node.Serialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    ptr=child;
+    rc=node.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
   }
-  
+  return ERROR_NOERROR;
+}
 
-  //root is currently the laef node
-  //cout << root.info.numkeys << " of " << root.info.GetNumSlotsAsLeaf() << " used." << "\n\n";
-  //cout << root.info.GetNumSlotsAsInterior();
-
-  //test printing the stack to make sure each node is difersnt
-  //while(!traversednodes.empty())
- // {
-  //  cout << traversednodes.top();
-  //  cout << "\n\n";
-  //  traversednodes.pop();
-  //} 
-  //upon reaching the leaf node, attempt to insert the key, this might be hard
-
-  //get the offset of where to put the key
-  //
-  
 
-  //new thing we need to check if the key exists in the leaf
-  SIZE_T leafcounter;
-  for(leafcounter = 0; leafcounter < root.info.numkeys; leafcounter++){
-    rc = root.GetKey(leafcounter, testkey);
-    if(rc != ERROR_NOERROR) {return rc;}
-    if(key == testkey) {return ERROR_CONFLICT;}
+ERROR_T BTreeIndex::FreeSubtree(const SIZE_T ptr, 
+				const SIZE_T height, 
+				vector<OverflowRef> &dead)
+{
+  BTreeNode node;
+  SIZE_T child;
+  ERROR_T rc;
+
+  if (height>0 || superblock.info.HasOverflowValues()) { 
+    rc=node.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    for (SIZE_T i=0; i<=node.info.numkeys; i++) { 
+      if (height>0) { 
+	rc=node.GetPtr(i,child);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	rc=FreeSubtree(child,height-1,dead);
+      } else if (i<node.info.numkeys) { 
+	rc=NoteOverflow(node,i,dead);
+      }
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+  }
+  return DiscardNode(ptr);
+}
+
+
+ERROR_T BTreeIndex::DiscardNode(const SIZE_T n)
+{
+  if (allocator) { 
+    return allocator->DiscardNode(n);
   }
-  
-  if(root.info.numkeys >= root.info.GetNumSlotsAsLeaf()){
-    //the leaf is full so we have to split it
-    //allocate a new node
-    KEY_T promote;
-    SIZE_T newleafptr;
-    BTreeNode newleaf;
-    SIZE_T counter,othercounter;
-    othercounter = 0;
-    rc = AllocateNode(newleafptr);
-    if(rc != ERROR_NOERROR) {return rc;}
-
-    newleaf.Unserialize(buffercache,newleafptr); 
-    //copy half of the keys from
-    //split the keys into left and right keys
-    SIZE_T leftsplit = root.info.numkeys / 2;
-    SIZE_T rightsplit = root.info.numkeys - leftsplit;
-    
-    newleaf.info.numkeys = rightsplit;
 
-    for (counter = leftsplit; counter < root.info.numkeys; counter++){
-      rc = root.GetKeyVal(counter,kvpair);
-      if (rc != ERROR_NOERROR) {return rc;}
-      rc = newleaf.SetKeyVal(othercounter,kvpair);
-      if (rc != ERROR_NOERROR) {return rc;}
+  BTreeNode node(BTREE_UNALLOCATED_BLOCK, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
+  ERROR_T rc;
+
+  node.info.freelist=superblock.info.freelist;
+  rc=node.Serialize(buffercache,n);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  superblock.info.freelist=n;
+  return buffercache->NotifyDeallocateBlock(n);
+}
+
+
+ERROR_T BTreeIndex::FreeIndex()
+{
+  BTreeNode node;
+  vector<OverflowRef> dead;
+  SIZE_T ptr=superblock.info.rootnode;
+  SIZE_T height=0;
+  ERROR_T rc;
+
+  // The leftmost path down gives the height
+  rc=node.Unserialize(buffercache,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  while (node.info.nodetype!=BTREE_LEAF_NODE) { 
+    rc=node.GetPtr(0,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (ptr==0) { 
+      // A root with no keys and no leaves
+      break;
     }
-    
-    root.info.numkeys = leftsplit;
-    //between the two nodes, find out where to put the key val pair
-    
-    root.GetKey(root.info.numkeys-1,testkey);
-
-    if(key < testkey){
-      //insert in root
-      root.info.numkeys += 1;
-      for (offset = 0; offset < root.info.numkeys; offset++){
-        root.GetKey(offset,testkey);
-        if(testkey < key) {
-          break;
-        }
-      }
+    rc=node.Unserialize(buffercache,ptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    height++;
+  }
+  if (height>0) { 
+    rc=FreeSubtree(superblock.info.rootnode,height,dead);
+  } else { 
+    rc=DiscardNode(superblock.info.rootnode);
+  }
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=DiscardNode(superblock_index);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=allocator->superblock.Serialize(buffercache,allocator->superblock_index);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  for (SIZE_T i=0; i<dead.size(); i++) { 
+    rc=FreeOverflow(dead[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
 
-      for (reverseoffset = root.info.numkeys-1; reverseoffset >= offset && reverseoffset > 0; reverseoffset--){
-        //shift keyvalue pairs over til we got the slot where we will place the key
-        rc = root.GetKeyVal(reverseoffset-1,kvpair);
-        if (rc != ERROR_NOERROR) {return rc;}
-        rc = root.SetKeyVal(reverseoffset,kvpair);
-        if (rc != ERROR_NOERROR) {return rc;}
-      }
-      root.SetKey(offset,key);
-      root.SetVal(offset,value);
-      
-    } else {
-      //insert in newleaf
-      newleaf.info.numkeys += 1;
-      for (offset = 0; offset < newleaf.info.numkeys; offset++){
-        newleaf.GetKey(offset,testkey);
-        if(testkey < key) {
-          break;
-        }
-      }
 
-      for (reverseoffset = newleaf.info.numkeys-1; reverseoffset >= offset && reverseoffset > 0; reverseoffset--){
-        //shift keyvalue pairs over til we got the slot where we will place the key
-        rc = newleaf.GetKeyVal(reverseoffset-1,kvpair);
-        if (rc != ERROR_NOERROR) {return rc;}
-        rc = newleaf.SetKeyVal(reverseoffset,kvpair);
-        if (rc != ERROR_NOERROR) {return rc;}
-      }
-      newleaf.SetKey(offset,key);
-      newleaf.SetVal(offset,value);
+ERROR_T BTreeIndex::RebalanceChild(BTreeNode &parent, SIZE_T offset)
+{
+  BTreeNode child, sibling;
+  SIZE_T childptr, siblingptr, sep;
+  bool merged;
+  ERROR_T rc;
+
+  while (parent.info.numkeys>0) { 
+    rc = parent.GetPtr(offset,childptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = child.Unserialize(buffercache,childptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (!IsUnderfull(child)) { 
+      break;
     }
-    
 
-    
-    newleaf.Serialize(buffercache,newleafptr);
-    root.Serialize(buffercache,ptr);
-    //upsert the newleaf ptr, and the key that you are promoting
+    // The sibling on the right, or on the left for the last child, 
+    // as in Rebalance
+    const bool onleft = offset<parent.info.numkeys;
+    sep = onleft ? offset : offset-1;
+    rc = parent.GetPtr(onleft ? offset+1 : offset-1,siblingptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = sibling.Unserialize(buffercache,siblingptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+
+    if (parent.info.nodetype==BTREE_ROOT_NODE && parent.info.numkeys==1 && 
+	child.info.nodetype==BTREE_LEAF_NODE) { 
+      // The root keeps its two leaves until both are empty
+      if (child.info.numkeys>0 || sibling.info.numkeys>0) { 
+	break;
+      }
+      rc = DiscardNode(childptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc = DiscardNode(siblingptr);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      parent.info.numkeys=0;
+      return parent.SetPtr(0,0);
+    }
 
-    root.GetKey(root.info.numkeys-1,promote);
+    BTreeNode &left = onleft ? child : sibling;
+    BTreeNode &right = onleft ? sibling : child;
+    const SIZE_T leftptr = onleft ? childptr : siblingptr;
+    const SIZE_T rightptr = onleft ? siblingptr : childptr;
 
-    //cout << "\n\n" << root << "\n--------\n" << newleaf << "\n\n";
-    return Upsert(newleafptr, promote, traversednodes);
-  } else {
-    //leaf has room for at least
-    for (offset = 0; offset < root.info.numkeys; offset++) {
-      rc = root.GetKey(offset,testkey);
-      if(key < testkey || key == testkey) {
-        if (key == testkey) {return ERROR_CONFLICT;}
-        break;
-      }
-    }
-    //cout << "Offset is: " << offset << "\n\n";
-    //now we push all the stuff from offset 1 over to the right
-    root.info.numkeys += 1;
-    for (reverseoffset = root.info.numkeys-1; reverseoffset >= offset && reverseoffset > 0; reverseoffset--){
-      //shift keyvalue pairs over til we got the slot where we will place the key
-      rc = root.GetKeyVal(reverseoffset-1,kvpair);
-      if (rc != ERROR_NOERROR) {return rc;}
-      rc = root.SetKeyVal(reverseoffset,kvpair);
-      if (rc != ERROR_NOERROR) {return rc;}
-    }
-      root.SetKey(offset,key);
-      root.SetVal(offset,value);
-      root.Serialize(buffercache,ptr);
-      //cout << root << "\n\n";
-      return ERROR_NOERROR;
+    rc = MergeOrBorrow(parent,sep,left,leftptr,right,rightptr,merged);
+    if (rc==ERROR_NOSPACE) { 
+      break;
+    }
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc = left.Serialize(buffercache,leftptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    if (!merged) { 
+      return right.Serialize(buffercache,rightptr);
+    }
+    rc = DiscardNode(rightptr);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    // The merged node is where the left one was, and may still be
+    // underfull
+    offset = sep;
   }
-
-  //if the leaf is full, allocate a new node, get its disk pointer.
-  //split the full leaf keys in have, putting the right hand side in the new one
-  //promote the key that you have split on, and insert the key and pointer into the parent
-  //by popping it off the stack.  
-  return ERROR_UNIMPL;
+  return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Upsert(const SIZE_T &ptr, const KEY_T &key, std::stack<SIZE_T> traversed)
+
+void BTreeIndex::SetCompaction(const SIZE_T tombstonepercent, const SIZE_T leavesperstep)
 {
-   ERROR_T rc;
-   BTreeNode parent;
-   SIZE_T offset, counter, reverseoffset, tempptr, parentptr, numleftkeys, numrightkeys, newnode, newrootptr;
-   KEY_T testkey, tempkey, newkey, largestkeyofparent;
-
-
-   parentptr = traversed.top();
-   traversed.pop(); //remove node from stack
-   parent.Unserialize(buffercache,parentptr);
-   //first find out if the parent is full or not.
-   if (parent.info.numkeys >= parent.info.GetNumSlotsAsInterior()){
-     if(parent.info.nodetype == BTREE_ROOT_NODE) {
-        //need to make a new root node for upsert purposes
-        BTreeNode newroot(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
-        BTreeNode newinterior(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
-        rc = AllocateNode(newnode);        
-        if (rc != ERROR_NOERROR) {return rc; }
-        rc = AllocateNode(newrootptr);
-        if (rc != ERROR_NOERROR) {return rc; }
-
-        newroot.Unserialize(buffercache, newrootptr);
-        newinterior.Unserialize(buffercache, newnode);
-
-        //move half the keys from parent to new interior
-        numleftkeys = parent.info.numkeys / 2;
-        numrightkeys = parent.info.numkeys - numleftkeys;
-        
-        newinterior.info.numkeys = numrightkeys;
-        offset = 0;
-        for(counter = numleftkeys + 1; counter < parent.info.numkeys; counter++){
-          rc = parent.GetKey(counter, tempkey);
-          rc = parent.GetPtr(counter, tempptr);
-          rc = newinterior.SetKey(offset, tempkey);
-          rc = newinterior.SetPtr(offset, tempptr);
-          offset++;
-        }
-        //don't forget that one dangling pointer
-        rc = parent.GetPtr(offset, tempptr);
-        rc = newinterior.SetPtr(0, tempptr);
-        parent.info.numkeys = numleftkeys;
-        newinterior.info.numkeys = numrightkeys;
-
-        //figure out where the key and ptr go (old root or newinterior)
-        rc = parent.GetKey(parent.info.numkeys, tempkey);
-        if(key < testkey) {
-          //put into parent
-          parent.info.numkeys += 1;
-          //find offset of first key that is larger than key
-          for(offset = 0; offset < parent.info.numkeys - 1; offset++){
-            rc = parent.GetKey(offset, tempkey);
-            if(key < tempkey) {break;}
-          }
-          //now offset is where we should put key
-          //shift key ptrs to the right but don't forget dangling pointer
-          rc = parent.GetPtr(parent.info.numkeys, tempptr);
-          rc = parent.SetPtr(parent.info.numkeys + 1, tempptr);
-          for(reverseoffset = parent.info.numkeys; reverseoffset> offset; reverseoffset--) {
-            //do stuff
-            rc = parent.GetPtr(reverseoffset-1, tempptr);
-            rc = parent.GetKey(reverseoffset-1, tempkey);
-            rc = parent.SetPtr(reverseoffset, tempptr);
-            rc = parent.SetKey(reverseoffset, tempkey);
-          }
-          rc = parent.SetKey(offset, key);
-          rc = parent.SetPtr(offset, ptr);
-        } else {
-          //put in new interior
-          newinterior.info.numkeys += 1;
-          for(offset = 0; offset < newinterior.info.numkeys; offset++){
-            rc = newinterior.GetKey(offset,tempkey);
-            if(key< tempkey) {break;}
-          }
-          
-          rc = newinterior.GetPtr(newinterior.info.numkeys, tempptr);
-          rc = newinterior.SetPtr(newinterior.info.numkeys + 1, tempptr);
-          for(reverseoffset = newinterior.info.numkeys; reverseoffset > offset; reverseoffset--){
-            rc = newinterior.GetPtr(reverseoffset-1, tempptr);
-            rc = newinterior.GetKey(reverseoffset-1, tempkey);
-            rc = newinterior.SetKey(reverseoffset, tempkey);
-            rc = newinterior.SetPtr(reverseoffset, tempptr);
-          }
-          rc = newinterior.SetKey(offset,key);
-          rc = newinterior.SetPtr(offset,ptr);
-        }
+  compactpercent=tombstonepercent;
+  compactpace = leavesperstep>0 ? leavesperstep : 1;
+}
 
-        //root node contains one key, which is the largest key of parent
-        rc = parent.GetKey(parent.info.numkeys, tempkey);
-        newroot.info.numkeys = 1;
-        newroot.SetKey(0, tempkey);
-        newroot.SetPtr(0, parentptr);
-        newroot.SetPtr(1, newnode);        
-
-        parent.info.nodetype = BTREE_INTERIOR_NODE;
-        
-        //make sure to change the thing to a interior before serializing
-        parent.Serialize(buffercache, parentptr);
-        newroot.Serialize(buffercache,newrootptr);
-        newinterior.Serialize(buffercache, newnode);
-        //also set new root
-        superblock.info.rootnode = newrootptr;
-        superblock.Serialize(buffercache, 0);
-        return ERROR_NOERROR;
-     } else {
-        BTreeNode newinterior(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
-        rc = AllocateNode(newnode);
-        if(rc!=ERROR_NOERROR) {return rc;}
-        newinterior.Unserialize(buffercache, newnode);
-        //we need to split keys and pointers
-        numleftkeys = parent.info.numkeys / 2;
-        numrightkeys = parent.info.numkeys - numleftkeys;
-
-        //move all the key pointers from right split onwards from parent to 
-        newinterior.info.numkeys = numrightkeys;
-        offset = 0;
-        for(counter = numleftkeys + 1; counter < parent.info.numkeys; counter++){
-          //move the keys and pointers over
-          rc = parent.GetKey(counter, tempkey);
-          rc = parent.GetPtr(counter, tempptr);
-          rc = newinterior.SetKey(offset, tempkey);
-          rc = newinterior.SetPtr(offset, tempptr);
-          offset++;
-        }
-        //theres also one dangling pointer
-        rc = parent.GetPtr(offset, tempptr);
-        rc = newinterior.SetPtr(0, tempptr);
-        parent.info.numkeys = numleftkeys;
-        newinterior.info.numkeys = numrightkeys;
-
-
-        //findout where to put the key ptr pair, old node or new node?
-        rc = parent.GetKey(parent.info.numkeys,testkey);
-        if(key < testkey) {
-          //put into parent
-          parent.info.numkeys += 1;
-          //find the offset of the first key that is larger than key
-          for(offset = 0; offset < parent.info.numkeys - 1; offset++) {
-            rc = parent.GetKey(offset, tempkey);
-            if(key < tempkey) {break;}
-          }
-          //now offset contains where we should put the key
-          //so we shift key ptrs to the right, but don't forget dangling pointer
-          rc = parent.GetPtr(parent.info.numkeys, tempptr);
-          rc = parent.SetPtr(parent.info.numkeys + 1, tempptr); 
-          for(reverseoffset = parent.info.numkeys; reverseoffset > offset; reverseoffset--){
-            rc = parent.GetPtr(reverseoffset-1, tempptr);
-            rc = parent.GetKey(reverseoffset-1, tempkey);
-            rc = parent.SetPtr(reverseoffset, tempptr);
-            rc = parent.SetKey(reverseoffset, tempkey);
-          }
-
-          //insert the key and ptr to offset
-          rc = parent.SetKey(offset, key);
-          rc = parent.SetPtr(offset, ptr);
-        } else {
-          //put into new interior
-          newinterior.info.numkeys += 1;
-          //find the offset of the first key that is larger than key
-          for(offset = 0; offset < parent.info.numkeys - 1; offset++) {
-            rc = newinterior.GetKey(offset, tempkey);
-            if(key < tempkey) {break;}
-          }
-          //now offset contains where we should put the key
-          //shift key ptrs to right, but don't forget dangling pointer
-          rc = newinterior.GetPtr(newinterior.info.numkeys, tempptr);
-          rc = newinterior.SetPtr(newinterior.info.numkeys + 1, tempptr);
-          for(reverseoffset = newinterior.info.numkeys; reverseoffset > offset; reverseoffset--){
-            rc = newinterior.GetPtr(reverseoffset-1, tempptr);
-            rc = newinterior.GetKey(reverseoffset-1, tempkey);
-            rc = newinterior.SetKey(reverseoffset, tempkey);
-            rc = newinterior.SetPtr(reverseoffset, tempptr);
-          }
-          rc = newinterior.SetKey(offset,key);
-          rc = newinterior.SetPtr(offset,ptr); 
-        }
 
-        parent.Serialize(buffercache,parentptr);
-        newinterior.Serialize(buffercache,newnode);
-        
-        rc = parent.GetKey(parent.info.numkeys, largestkeyofparent); 
-        return Upsert(newnode, largestkeyofparent, traversed);
-     }
-   } else {
-     //not full, so we just find out where to stick the pointer and the key
-     //we can get the old pointer by getting the old key location, and set its key to our promotion
-     for(counter = 0; counter < parent.info.GetNumSlotsAsInterior(); counter++) {
-       rc = parent.GetKey(counter,testkey);
-       if (rc != ERROR_NOERROR) {return rc;}
-       if (key < testkey) {break;}  //found the location where the key should go
-     }
-     //counter now has the offset of the old key so now we shift stuff over to the right
-     
-     parent.info.numkeys += 1;
-     for(reverseoffset = parent.info.numkeys; reverseoffset > counter; reverseoffset--){
-       //shift all the ptr and keys up
-       rc = parent.GetKey(reverseoffset-1, tempkey);
-       rc = parent.SetKey(reverseoffset, tempkey);
-       rc = parent.GetPtr(reverseoffset-1, tempptr);
-       rc = parent.SetPtr(reverseoffset, tempptr);
-     }
-     rc = parent.SetPtr(reverseoffset+1, ptr);
-     rc = parent.SetKey(reverseoffset,key);
-     //nooooo, just leave pointer alone
-     //rc = parent.SetPtr(reverseoffset,ptr);
-
-     parent.Serialize(buffercache,parentptr);
-     //now insert the new pointer and serialize the node.
-     
-     return ERROR_NOERROR;
-   } 
-   return ERROR_INSANE;
-}
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::Compact(bool &done)
 {
-  // WRITE ME
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, (KEY_T&)key, (VALUE_T&)value);
+  BTreeNode leaf;
+  SIZE_T ptr, numleaves;
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (numleaves=0; numleaves<compactpace && rc==ERROR_NOERROR; numleaves++) { 
+    if (!compactleaves.empty()) { 
+      // Leaves with new tombstones first
+      ptr=*compactleaves.begin();
+      compactleaves.erase(compactleaves.begin());
+    } else if (compactsweep) { 
+      // and then the rest of the tombstones on disk, from ones made
+      // before the index was last attached, a leaf at a time in key
+      // order, starting after the last leaf swept
+      rc=SeekLeaf(compactswept ? &compactafter : 0,false,ptr,leaf);
+      // On past that one, and past empty ones
+      while (rc==ERROR_NOERROR && ptr!=0 && 
+	     (leaf.info.numkeys==0 || 
+	      (compactswept && nodeaccess->CompareKey(leaf,compactafter,leaf.info.numkeys-1)>=0))) { 
+	rc=leaf.GetPtr(0,ptr);
+	if (rc==ERROR_NOERROR && ptr!=0) { 
+	  rc=leaf.Unserialize(buffercache,ptr);
+	}
+      }
+      if (rc!=ERROR_NOERROR) { break; }
+      if (ptr==0) { 
+	compactsweep=false;
+	break;
+      }
+      rc=leaf.GetKey(leaf.info.numkeys-1,compactafter);
+      if (rc!=ERROR_NOERROR) { break; }
+      compactswept=true;
+    } else {
+      break;
+    }
+    rc=CompactLeaf(ptr);
+  }
+
+  done = compactleaves.empty() && !compactsweep;
+  return EndOperation(rc);
 }
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+
+ERROR_T BTreeIndex::CompactLeaf(const SIZE_T ptr)
 {
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  BTreeNode leaf, found;
+  vector<SIZE_T> path, offsets;
+  vector<OverflowRef> dead;
+  SIZE_T numdead, foundptr;
+  KEY_T key;
+  ERROR_T rc;
+
+  // The block may have been freed or reused since it was noted, and
+  // if it is still a leaf with pairs, its first key finds its path
+  rc=leaf.Unserialize(buffercache,ptr);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (leaf.info.nodetype!=BTREE_LEAF_NODE || leaf.info.numkeys==0) { 
+    return ERROR_NOERROR;
+  }
+  numdead=leaf.GetNumTombstones();
+  if (numdead*100<compactpercent*leaf.info.numkeys && !IsUnderfull(leaf)) { 
+    return ERROR_NOERROR;
+  }
+  rc=leaf.GetKey(0,key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=SeekLeafParents(key,path,offsets,foundptr,found);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (foundptr!=ptr) { 
+    return ERROR_NOERROR;
+  }
+
+  // Rewrite it without its dead pairs, and then merge it or even it
+  // out with a sibling if it is underfull
+  for (SIZE_T i=leaf.info.numkeys; i>0; i--) { 
+    if (leaf.IsTombstone(i-1)) { 
+      rc=NoteOverflow(leaf,i-1,dead);
+      if (rc!=ERROR_NOERROR) { return rc; }
+      rc=leaf.RemoveSlots(i-1,1);
+      if (rc!=ERROR_NOERROR) { return rc; }
+    }
+  }
+  rc=Rebalance(path,offsets,ptr,leaf);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  for (SIZE_T i=0; i<dead.size(); i++) { 
+    rc=FreeOverflow(dead[i]);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  return ERROR_NOERROR;
 }
 
   
@@ -825,7 +3564,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,node,b,display_type,buffercache,superblock.info.duplicates!=0);
   
   if (rc) { return rc; }
 
@@ -874,7 +3613,24 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  if (display_type==BTREE_SORTED_KEYVAL) { 
+    // The leaves are linked in key order, so walk them rather than
+    // the whole tree
+    BTreeCursor cursor;
+    SIZE_T next;
+    rc=SeekFirst(cursor);
+    while (rc==ERROR_NOERROR && cursor.IsValid()) { 
+      rc=PrintNode(o,0,cursor.leaf,display_type,buffercache,superblock.info.duplicates!=0);
+      if (rc==ERROR_NOERROR) { 
+	rc=cursor.leaf.GetPtr(0,next);
+      }
+      if (rc==ERROR_NOERROR) { 
+	rc=cursor.Load(next,true);
+      }
+    }
+  } else {
+    rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  }
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
@@ -926,7 +3682,7 @@ ERROR_T BTreeIndex::SanityCheckHelper(const SIZE_T &node) const{
    //switch statements to check for type of node
    switch(n.info.nodetype){
         case BTREE_INTERIOR_NODE:{
-                for(offset; offset<n.info.numkeys+1;offset++){
+                for(; offset<n.info.numkeys+1;offset++){
                         rc=n.GetKey(offset,k1);
                         if(rc){
                                 return rc;
@@ -958,7 +3714,7 @@ ERROR_T BTreeIndex::SanityCheckHelper(const SIZE_T &node) const{
                 break;
         }
         case BTREE_LEAF_NODE:{
-		for(offset; offset<n.info.numkeys;offset++){
+		for(; offset<n.info.numkeys;offset++){
 			rc=n.GetKey(offset,k1);
 			if(rc){
 				return rc;
@@ -990,11 +3746,150 @@ ERROR_T BTreeIndex::SanityCheckHelper(const SIZE_T &node) const{
 ostream & BTreeIndex::Print(ostream &os) const
 {
   // WRITE ME
-  ERROR_T rc;
-  rc = Display(os, BTREE_DEPTH_DOT);
+  Display(os, BTREE_DEPTH_DOT);
   return os;
 }
 
 
+BTreeCatalog::BTreeCatalog(BufferCache *cache) : 
+  names(BTREE_CATALOG_NAME_MAX,sizeof(SIZE_T),cache)
+{
+  names.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+  names.SetOverflowSize(0);
+}
+
+
+ERROR_T BTreeCatalog::Attach(const bool create)
+{
+  const NodeMetadata settings=names.superblock.info;
+  SIZE_T initblock;
+  ERROR_T rc;
+
+  rc=names.Attach(0,create);
+  if (rc==ERROR_NOERROR && 
+      (names.superblock.info.format!=BTREE_FORMAT_SLOTTED ||
+       names.GetKeySize()!=BTREE_CATALOG_NAME_MAX || 
+       names.GetValueSize()!=sizeof(SIZE_T))) { 
+    // Some other index, which is left as it was
+    names.Detach(initblock);
+    rc=ERROR_NOTANINDEX;
+  }
+  if (rc!=ERROR_NOERROR) { 
+    // Nothing of the disk, not even its log, stays with us
+    if (names.wal) { 
+      names.buffercache->SetLog(0);
+      delete names.wal;
+      names.wal=0;
+    }
+    names.superblock.info=settings;
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeCatalog::Detach()
+{
+  SIZE_T initblock;
+
+  return names.Detach(initblock);
+}
+
+
+ERROR_T BTreeCatalog::Find(const string &name, KEY_T &key, SIZE_T &superblock)
+{
+  VALUE_T value;
+  ERROR_T rc;
+
+  if (name.length()==0 || name.length()>BTREE_CATALOG_NAME_MAX) { 
+    return ERROR_SIZE;
+  }
+  rc=key.Resize(name.length());
+  if (rc!=ERROR_NOERROR) { return rc; }
+  memcpy(key.data,name.data(),name.length());
+  rc=names.Lookup(key,value);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  memcpy(&superblock,value.data,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCatalog::Create(const string &name, BTreeIndex &index)
+{
+  KEY_T key;
+  VALUE_T value(sizeof(SIZE_T));
+  SIZE_T superblock;
+  ERROR_T rc;
+
+  rc=Find(name,key,superblock);
+  if (rc==ERROR_NOERROR) { 
+    return ERROR_CONFLICT;
+  }
+  if (rc!=ERROR_NONEXISTENT) { return rc; }
+
+  // The new index and its name go in the log as one operation
+  rc=index.AttachShared(names,0,true);
+  if (rc==ERROR_NOERROR) { 
+    memcpy(value.data,&index.superblock_index,sizeof(SIZE_T));
+    rc=names.InsertInternal(key,value);
+    if (rc!=ERROR_NOERROR) { 
+      index.FreeIndex();
+    }
+  }
+  if (rc!=ERROR_NOERROR) { 
+    index.LeaveShared();
+  }
+  return names.EndOperation(rc);
+}
+
+
+ERROR_T BTreeCatalog::Open(const string &name, BTreeIndex &index)
+{
+  KEY_T key;
+  SIZE_T superblock;
+  ERROR_T rc;
+
+  rc=Find(name,key,superblock);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return index.AttachShared(names,superblock,false);
+}
+
+
+ERROR_T BTreeCatalog::Drop(const string &name)
+{
+  BTreeIndex index;
+  KEY_T key;
+  SIZE_T superblock;
+  ERROR_T rc;
+
+  rc=Find(name,key,superblock);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  if (names.sharers.count(superblock)) { 
+    return ERROR_CONFLICT;
+  }
+  rc=index.AttachShared(names,superblock,false);
+  if (rc==ERROR_NOERROR) { 
+    rc=index.FreeIndex();
+  }
+  if (rc==ERROR_NOERROR) { 
+    rc=names.DeleteInternal(key,BTREE_DELETE_NOW);
+  }
+  return names.EndOperation(rc);
+}
+
 
+ERROR_T BTreeCatalog::List(vector<string> &indexes) const
+{
+  BTreeCursor cursor;
+  KEY_T key;
+  ERROR_T rc;
 
+  indexes.clear();
+  rc=names.SeekFirst(cursor);
+  while (rc==ERROR_NOERROR && cursor.IsValid()) { 
+    rc=cursor.GetKey(key);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    indexes.push_back(string((const char *)key.data,key.length));
+    rc=cursor.Next();
+  }
+  return rc;
+}
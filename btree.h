@@ -4,13 +4,17 @@
 #include <iostream>
 #include <string>
 #include <stack>
+#include <set>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
 #include "buffercache.h"
+#include "writeaheadlog.h"
 
 #include "btree_ds.h"
+#include "nodeview.h"
 
 using namespace std;
 
@@ -33,33 +37,467 @@ struct KeyValuePair {
   KeyValuePair();
   KeyValuePair(const KEY_T &key, const VALUE_T &value);
   KeyValuePair(const KeyValuePair &rhs);
+  KeyValuePair(KeyValuePair &&rhs);
   virtual ~KeyValuePair();
   KeyValuePair & operator=(const KeyValuePair &rhs);
+  KeyValuePair & operator=(KeyValuePair &&rhs);
 
 };
 
-enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
+// Where BTreeIndex::BulkLoad can take its pairs from, one at a time
+class BTreePairSource {
+ public:
+  virtual ~BTreePairSource() {}
+  // The next pair, or ERROR_NONEXISTENT once there are no more
+  virtual ERROR_T Next(KeyValuePair &pair)=0;
+};
+
+// Makes the new value of a key from the one it has, for 
+// BTreeIndex::Put
+class BTreeValueModifier {
+ public:
+  virtual ~BTreeValueModifier() {}
+  // exists says whether key is in the index, and if it is, old is 
+  // its value.  Returning anything but ERROR_NOERROR leaves the index
+  // as it was, and Put returns it.
+  virtual ERROR_T Modify(const KEY_T &key, 
+			 const bool exists, 
+			 const VALUE_T &old, 
+			 VALUE_T &value)=0;
+};
+
+enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP,BTREE_OP_UPSERT};
+
+// What BTreeIndex::Put does with a key that is or is not there
+//   INSERT  only adds it (ERROR_CONFLICT if it is there), like Insert
+//   UPDATE  only replaces it (ERROR_NONEXISTENT if not), like Update
+//   UPSERT  adds it or replaces it, whichever it takes
+enum BTreePutMode {BTREE_PUT_INSERT, BTREE_PUT_UPDATE, BTREE_PUT_UPSERT};
+
+// How BTreeIndex::Delete takes a pair out
+//   NOW   removes it from its leaf, and rebalances the tree
+//   LAZY  marks it dead in place, as a tombstone, and leaves the rest
+//         to Compact, in an index with tombstones (SetTombstones)
+enum BTreeDeleteMode {BTREE_DELETE_NOW, BTREE_DELETE_LAZY};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// Log size that means "pick one based on the size of the disk"
+const SIZE_T BTREE_LOG_AUTO=(SIZE_T)-1;
+
+
+//
+// Reads a value a piece at a time, so that a big one in overflow
+// blocks is never all in memory at once.  BTreeIndex::OpenValue 
+// sets one up.  It is good until the index next changes.
+//
+class BTreeValueReader {
+ private:
+  BufferCache *buffercache;
+  VALUE_T      inlinevalue;  // the value, if it is in its leaf
+  bool         overflow;
+  SIZE_T       length;
+  SIZE_T       position;
+  BTreeNode    block;        // the overflow block being read
+  SIZE_T       blockbytes;   // bytes of the value it holds
+  SIZE_T       blockoffset;  // how many of them have been read
+  SIZE_T       nextblock;
+
+ public:
+  BTreeValueReader();
+
+  // Reads the value held at offset of leaf
+  ERROR_T Open(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset);
+  // Reads the value in overflow blocks at ref
+  void    Open(BufferCache *cache, const OverflowRef &ref);
+
+  SIZE_T  GetLength() const { return length; }
+  SIZE_T  GetPosition() const { return position; }
+  bool    AtEnd() const { return position==length; }
+
+  // Copies up to len more bytes of the value to buf, and says how 
+  // many in numread, which is less than len only at the end
+  ERROR_T Read(BYTE_T *buf, const SIZE_T len, SIZE_T &numread);
+};
+
+//
+// Goes through the values of one key.  In a non-unique index (see 
+// BTreeIndex), a key keeps all of its values together, as a posting
+// list, and this reads them one at a time, in order, from the leaf
+// or the overflow blocks the list is in.  In a unique index there is
+// just the one.  BTreeIndex::SeekValues and BTreeCursor::OpenValues
+// set one up, and it is good until the index next changes.
+//
+class BTreeValueCursor {
+ private:
+  BTreeValueReader reader;
+  VALUE_T          value;    // the one it is on
+  bool             valid;
+  bool             postings; // whether the value read is a posting list
+
+  ERROR_T Open(BufferCache *cache, const BTreeNode &leaf, const SIZE_T offset, const bool postings);
+
+  friend class BTreeIndex;
+  friend class BTreeCursor;
+
+ public:
+  BTreeValueCursor();
+
+  // Whether it is on a value, rather than past the last one
+  bool    IsValid() const { return valid; }
+  ERROR_T GetVal(VALUE_T &value) const;
+  // Moves to the next value.  Past the last one, it is no longer valid.
+  ERROR_T Next();
+};
+
+// How full BTreeIndex::BulkLoad makes each node by default, in percent
+#define BTREE_BULKLOAD_FILL 90
+// Nodes it allocates, and writes home, at a time
+#define BTREE_BULKLOAD_RUN 64
+
+// Nodes other than the root that fall below this many percent full
+// after a delete borrow from a sibling, or merge with it
+#define BTREE_MIN_FILL 40
+// Leaves that BTreeIndex::Compact rewrites without their tombstones
+// are at least this many percent dead by default
+#define BTREE_COMPACT_TOMBSTONES 25
+// and it looks at this many leaves a step
+#define BTREE_COMPACT_PACE 8
+
+// Readahead for cursors (see BTreeCursor)
+// Leaves entered in a row going the same way before it starts
+#define BTREE_READAHEAD_TRIGGER 2
+// Leaves in its first window, and in its largest by default
+#define BTREE_READAHEAD_MIN 4
+#define BTREE_READAHEAD_MAX 64
+
+//
+// Walks the pairs of an index in key order, either way.  One of the
+// BTreeIndex::Seek calls puts it on a pair by going down the tree
+// once, and from then on Next and Prev go from leaf to leaf over the
+// links between them, never back through the interior nodes.  It 
+// can be kept between two keys, and goes off the end at them.  It is
+// good until the index next changes.
+//
+// Once it has gone from leaf to leaf the same way a few times, and
+// the leaves were not next to each other on disk, it reads ahead.
+// It prefetches the next window of leaves through the buffer cache,
+// and the window doubles each time the scan gets half way through
+// it, up to a limit.  The leaves to come are found from
+// the pointers of their parents, so that a whole window can be asked
+// for at once, and the cache reads them in block order, a run of
+// consecutive blocks at a time.  Leaves that are already in order
+// on disk stream well enough as they are; going up to their parents
+// would only move the disk head back and forth.
+//
+class BTreeCursor {
+ private:
+  BufferCache *buffercache;
+  BTreeNode    leaf;     // the leaf it is in
+  SIZE_T       leafptr;  // and its block
+  SIZE_T       offset;   // of the pair it is on
+  bool         valid;    // whether it is on a pair at all
+  bool         haslow, hashigh;
+  KEY_T        low, high; // the range it is kept in, if it is
+  SIZE_T       rootptr;
+  bool         postings; // whether values are posting lists
+
+  SIZE_T       maxreadahead;
+  bool         raforward;   // the way it has been going
+  SIZE_T       streak;      // leaves entered in a row going that way
+  SIZE_T       window;      // leaves to keep prefetched ahead
+  int          ahead;       // how many are, past the current leaf
+  vector<BTreeNode> rapath; // interior nodes from the root down to 
+                            // the parent of the last leaf prefetched
+  vector<SIZE_T> raoffsets; // the pointer followed in each
+
+  // Goes to the first pair of the first leaf from ptr on that has 
+  // any, following the links forward or backward
+  ERROR_T Load(SIZE_T ptr, const bool forward);
+  // Goes off the end if the pair is outside the range
+  void    CheckRange();
+  // Moves to the next or previous pair, dead or not
+  ERROR_T Step(const bool forward);
+  // Moves on that way past dead pairs (see BTreeIndex::Delete)
+  ERROR_T SkipTombstones(const bool forward);
+  // Called on the way into each leaf of a scan, with its block
+  void    Readahead(const SIZE_T next, const bool forward);
+  // Sets rapath to the path down to the leaf key is in
+  bool    FindPath(const KEY_T &key);
+  // Moves rapath on to the next (or previous) leaf, and gives its
+  // block, or returns false if there is none
+  bool    StepPath(const bool forward, SIZE_T &leafptr);
+
+  friend class BTreeIndex;
+
+ public:
+  BTreeCursor();
+
+  // Whether it is on a pair, rather than off one end or the other
+  bool    IsValid() const { return valid; }
+
+  // Most leaves to read ahead.  Zero turns readahead off.
+  void    SetReadahead(const SIZE_T maxleaves) { maxreadahead=maxleaves; }
+
+  ERROR_T GetKey(KEY_T &key) const;
+  // Reads the value from its overflow blocks, if it is in them.  In a
+  // non-unique index, this is the first of the key's values.
+  ERROR_T GetVal(VALUE_T &value) const;
+  // Sets up reader to read the value a piece at a time.  In a 
+  // non-unique index, that is the whole posting list, as it is kept.
+  ERROR_T OpenValue(BTreeValueReader &reader) const;
+  // Sets up values to go through all of the key's values
+  ERROR_T OpenValues(BTreeValueCursor &values) const;
+
+  // Move to the pair after or before this one.  Past the last (or 
+  // the first) one, the cursor is no longer valid.
+  ERROR_T Next();
+  ERROR_T Prev();
+};
+
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  WriteAheadLog *wal;
+  BTreeIndex   *allocator;    // whose free list and log these are, if 
+                              // not ours (see BTreeCatalog)
+  std::multiset<SIZE_T> sharers; // superblocks of the indexes attached
+                              // to our free list, once for each
+  SIZE_T       lognumblocks;
+  SIZE_T       loggroupsize;
+  BTreeSearchType searchtype;
+  const NodeAccess *nodeaccess; // specialized for our key and value sizes
+  vector<SIZE_T> bulknodes;   // nodes the BulkLoad going on has taken,
+  vector<OverflowRef> bulkoverflows; // and the overflow chains it wrote
+  SIZE_T       minfill;       // percent full a node must stay, but the root
+  // Compaction of leaves with tombstones
+  std::set<SIZE_T> compactleaves; // noted by lazy deletes since attach
+  SIZE_T       compactpercent;    // dead pairs a leaf must have to be rewritten
+  SIZE_T       compactpace;       // leaves looked at per step
+  bool         compactsweep;      // whether leaves on disk are yet to be looked at
+  bool         compactswept;      // and if any have been, the last key
+  KEY_T        compactafter;      // of the last one
+
+  friend class BTreeLookupEngine;
+  friend class BTreeCatalog;
 
  protected:
 
+  // Checks that nodes of the sizes and format asked for can hold 
+  // enough pairs, and gives the sizes of the index to create
+  ERROR_T      CheckLimits(NodeMetadata &limits) const;
+  // Writes the superblock and an empty root of a new index
+  ERROR_T      WriteEmptyIndex(const NodeMetadata &limits,
+			       const SIZE_T root, 
+			       const SIZE_T freelist,
+			       const SIZE_T logstart, 
+			       const SIZE_T numlogblocks);
+  // Reads the superblock, and sets up for what it says
+  ERROR_T      ReadSuperblock();
+  // Attach for an index in a catalog: its nodes come from, and go 
+  // back to, the free list of owner, and it uses owner's cache and 
+  // log.  If create=true, its superblock and root are allocated, 
+  // and initblock is meaningless.
+  ERROR_T      AttachShared(BTreeIndex &owner, 
+			    const SIZE_T initblock, 
+			    const bool create);
+  // Undoes AttachShared, leaving the owner's log to the owner
+  void         LeaveShared();
+  // Gives every block of an index attached by AttachShared back to
+  // the shared free list, superblock and all
+  ERROR_T      FreeIndex();
+
+  // Every public operation that modifies the tree ends here
+  // This commits the operation to the log, if there is one, or, if it
+  // failed (or is too big for the log), aborts it, so that the tree 
+  // is as it was before it
+  ERROR_T      EndOperation(const ERROR_T rc);
+
+  // Also does updates that can make a leaf split (op==BTREE_OP_UPDATE),
+  // and either one (BTREE_OP_UPSERT), with one descent.  With a 
+  // modifier, the value is the one it makes rather than value.
+  ERROR_T      InsertInternal(const KEY_T &key, 
+			      const VALUE_T &value,
+			      const BTreeOp op=BTREE_OP_INSERT,
+			      BTreeValueModifier *modifier=0);
+  // The part of InsertInternal that changes the leaf node at ptr: it
+  // puts key, with inleaf for the leaf to keep as its value, at
+  // offset, or over the pair there if found.  If this fails, the
+  // leaf on disk is left as it was.  If it splits, newleafptr is the
+  // new leaf and promote the key that separates them, for the caller
+  // to push up; otherwise newleafptr is 0.
+  ERROR_T      PutInLeaf(BTreeNode &node,
+			 const SIZE_T ptr,
+			 const SIZE_T offset,
+			 const bool found,
+			 const bool exists,
+			 const KEY_T &key,
+			 const VALUE_T &inleaf,
+			 const bool overflow,
+			 SIZE_T &newleafptr,
+			 KEY_T &promote);
+
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
+  // A lookup with a reader opens it on the value, instead of 
+  // copying the value out
   ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
-				      VALUE_T &val);
+				      VALUE_T &val,
+				      BTreeValueReader *reader=0);
+
+  // The value Lookup gives for the pair at offset of leaf, which in a
+  // non-unique index is the first one in its posting list
+  ERROR_T      GetLeafValue(const BTreeNode &leaf, 
+			    const SIZE_T offset, 
+			    VALUE_T &value) const;
+
+  // Whether value is too long to keep in a leaf
+  bool         IsOverflowValue(const VALUE_T &value) const;
+  // Puts value in a new chain of overflow blocks, and the bytes of
+  // the OverflowRef for them in stored, for the leaf to keep.  If it
+  // runs out of blocks, the ones it took go back.
+  ERROR_T      WriteOverflow(const VALUE_T &value, VALUE_T &stored);
+  // Writes value over the one in the overflow blocks at ref, which 
+  // is the same length
+  ERROR_T      RewriteOverflow(const OverflowRef &ref, const VALUE_T &value);
+  ERROR_T      FreeOverflow(const OverflowRef &ref);
   
 
+  // Goes down to the leaf that key is or would be in, or to the 
+  // first or last leaf if key is null
+  ERROR_T      SeekLeaf(const KEY_T *key, 
+			const bool last, 
+			SIZE_T &ptr, 
+			BTreeNode &leaf) const;
+  // Puts cursor on the first pair from key on, or the last one up 
+  // to key if backward.  Keys outside its range count as missing.
+  ERROR_T      SeekInternal(const KEY_T *key, 
+			    const bool backward, 
+			    BTreeCursor &cursor) const;
+
+  // Builds the leaves for the pairs of source, and then the interior
+  // levels over them, one level at a time
+  ERROR_T      BulkLoadInternal(BTreePairSource &source, 
+				const SIZE_T fillfactor);
+  // AllocateNode for BulkLoad.  Every BTREE_BULKLOAD_RUN nodes, it 
+  // writes the ones before home, in one sweep, and prefetches the
+  // next run of blocks after the head of the free list, which in a
+  // new index are the next ones on it.
+  ERROR_T      BulkAllocateNode(SIZE_T &n);
+  // Gives back every block the BulkLoad going on has taken, once it
+  // has failed, so that the index is as it was before
+  ERROR_T      BulkLoadUndo();
+  // Builds the level over the nodes at ptrs, which seps separate,
+  // and leaves its nodes and separators in them.  A level of one
+  // node is the root, and goes in the root block.
+  ERROR_T      BulkLoadLevel(vector<SIZE_T> &ptrs, 
+			     vector<KEY_T> &seps, 
+			     const SIZE_T fillfactor);
+
+  // Goes down to the leaf key is or would be in, pushing the 
+  // interior nodes on the way onto path, as InsertInternal does.  The
+  // keys that go in the same leaf are the ones up to bound, or all 
+  // the ones after key if there is none (bounded is false).
+  ERROR_T      SeekLeafPath(const KEY_T &key, 
+			    std::stack<SIZE_T> &path, 
+			    SIZE_T &ptr, 
+			    BTreeNode &leaf, 
+			    bool &bounded, 
+			    KEY_T &bound) const;
+  // Inserts the sorted pairs from next on that go in the leaf the
+  // one at next goes in, and moves next past them.  It goes down to
+  // the leaf once, merges them into it in one pass, and if they do
+  // not all fit, spreads them evenly over as few new leaves as they
+  // fit in.  Pairs whose keys are already there are skipped, and
+  // counted in numskipped.
+  ERROR_T      InsertBatchLeaf(const vector<KeyValuePair> &pairs, 
+			       SIZE_T &next, 
+			       SIZE_T &numskipped);
+
+  // Looks up the keys at order[lo..hi), which are sorted, in the 
+  // subtree at node.  Each interior node hands each of its children 
+  // the run of keys that goes down to it, so that every node is read
+  // once, however many of the keys pass through it.
+  ERROR_T      LookupBatchInternal(const SIZE_T &node, 
+				   const vector<KEY_T> &keys, 
+				   const vector<SIZE_T> &order, 
+				   const SIZE_T lo, 
+				   const SIZE_T hi, 
+				   vector<VALUE_T> &values, 
+				   vector<ERROR_T> &results);
+
+  // Goes down to the leaf key is or would be in, as SeekLeafPath 
+  // does, and also notes which pointer was followed in each interior
+  // node.  In an empty index, leaf is the root.
+  ERROR_T      SeekLeafParents(const KEY_T &key, 
+			       vector<SIZE_T> &path, 
+			       vector<SIZE_T> &offsets, 
+			       SIZE_T &ptr, 
+			       BTreeNode &leaf) const;
+  ERROR_T      DeleteInternal(const KEY_T &key, const BTreeDeleteMode mode);
+  // Whether a node other than the root is too empty after a delete
+  bool         IsUnderfull(const BTreeNode &node) const;
+  // Moves the pairs or keys of two neighbouring nodes, which sep in
+  // parent separates, all into left if they fit (merged), or else 
+  // evens them out between the two, with a new separator.  Only the 
+  // next leaf's link is written; the rest is left to the caller.
+  // return ERROR_NOSPACE, with nothing changed, if they cannot be
+  //   evened out or the parent has no room for the new separator
+  ERROR_T      MergeOrBorrow(BTreeNode &parent, 
+			     const SIZE_T sep, 
+			     BTreeNode &left, 
+			     const SIZE_T leftptr, 
+			     BTreeNode &right, 
+			     const SIZE_T rightptr, 
+			     bool &merged);
+  // Writes node, which is at ptr and lost a pair or a key, and while
+  // it is underfull, merges it with or borrows from a sibling, going
+  // up path, freeing the nodes that merge away and the root if it is
+  // left with one child
+  ERROR_T      Rebalance(vector<SIZE_T> &path, 
+			 vector<SIZE_T> &offsets, 
+			 SIZE_T ptr, 
+			 BTreeNode &node);
+  ERROR_T      DeleteRangeInternal(const KEY_T &lo, const KEY_T &hi);
+  // Takes the pairs from lo to hi out of the subtree at ptr, where a 
+  // null lo or hi is the start or end of the subtree.  It leaves 
+  // nodes underfull, or with no keys, for RebalancePath.  leftleaf is the leaf the range
+  // starts in, once there is one, and height comes back as that of 
+  // the subtree.  The overflow blocks of the pairs go in dead.
+  ERROR_T      DeleteRangeNode(const SIZE_T ptr, 
+			       const KEY_T *lo, 
+			       const KEY_T *hi, 
+			       SIZE_T &leftleaf, 
+			       SIZE_T &height, 
+			       vector<OverflowRef> &dead);
+  // Frees the subtree at ptr, of the given height.  Its leaves are 
+  // only read if they can have overflow blocks, which go in dead.
+  ERROR_T      FreeSubtree(const SIZE_T ptr, 
+			   const SIZE_T height, 
+			   vector<OverflowRef> &dead);
+  // DeallocateNode without reading the node, or writing the superblock
+  ERROR_T      DiscardNode(const SIZE_T n);
+  // Evens out the nodes on the way down to key, from the top, so that
+  // each one that is underfull, or down to one child, has its sibling
+  // to merge with or borrow from
+  ERROR_T      RebalancePath(const KEY_T &key);
+  // Merges or evens out the child at offset of parent, which is not
+  // written, with a sibling, for as long as it is underfull.  A root 
+  // whose two leaves are both empty is left with no keys and a null
+  // first pointer.
+  ERROR_T      RebalanceChild(BTreeNode &parent, SIZE_T offset);
+  // Rewrites the leaf at ptr without its dead pairs, and rebalances 
+  // it, if enough of them are dead or it is underfull.  A block that
+  // is no longer a leaf of the index is left alone.
+  ERROR_T      CompactLeaf(const SIZE_T ptr);
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
@@ -74,6 +512,14 @@ public:
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
   // invoked
+  //
+  // In a non-unique index, a key can have any number of values, and
+  // they are kept with it, once, as a posting list: each value's 
+  // length, as a varint, and then its bytes, in the order of 
+  // CompareKeys, with no value twice.  A list longer than the 
+  // overflow size goes in overflow blocks, as a long value would.  
+  // Such an index is slotted, and has to have an overflow size; 
+  // valuesize is the longest one value can be.
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
@@ -86,6 +532,43 @@ public:
   BTreeIndex & operator=(const BTreeIndex &rhs);
   
 
+  // Size of the write-ahead log region reserved by Attach(initblock,true)
+  // Zero means no log, and updates are durable only after Detach
+  void SetLogSize(const SIZE_T numblocks) { lognumblocks=numblocks; }
+  // Number of operations committed together in one log append.  By
+  // default, one: each operation is in the log on disk by the time it
+  // returns.  With more, an operation that returns success is only 
+  // durable once its group is appended (or at Detach), and a crash 
+  // can lose up to numops-1 of them.
+  void SetGroupCommitSize(const SIZE_T numops);
+  // Layout of the nodes of an index created by Attach(initblock,true)
+  // One of BTREE_FORMAT_*.  An existing index keeps the one it has.
+  void SetNodeFormat(const int format) { superblock.info.format=format; }
+  // How keys are searched for within each node
+  void SetSearchType(const BTreeSearchType type) { searchtype=type; }
+  // Values longer than this many bytes are kept out of the leaves, in
+  // overflow blocks, in an index created by Attach(initblock,true)
+  // Zero means never.  The default, BTREE_OVERFLOW_AUTO, is a quarter 
+  // of a node.
+  void SetOverflowSize(const SIZE_T bytes) { superblock.info.overflowsize=bytes; }
+  // Whether an index created by Attach(initblock,true) keeps a 
+  // tombstone flag with each pair, so that Delete can be lazy.  It 
+  // costs a byte of each leaf slot, except in slotted leaves.
+  void SetTombstones(const bool on) { superblock.info.tombstones=on; }
+  // How full, in percent, a node other than the root has to stay.
+  // Below that, after a delete or a compaction, it borrows from or 
+  // merges with a sibling.  BTREE_MIN_FILL by default.
+  void SetMinFill(const SIZE_T percent) { minfill=percent; }
+  // How much of a leaf has to be tombstones for Compact to rewrite 
+  // it, in percent, and how many leaves each step of Compact looks at
+  void SetCompaction(const SIZE_T tombstonepercent, const SIZE_T leavesperstep);
+
+  // Sizes of keys and values (limits, if slotted), once attached
+  SIZE_T GetKeySize() const { return superblock.info.keysize; }
+  SIZE_T GetValueSize() const { return superblock.info.valuesize; }
+  // Whether a key maps to a single value
+  bool   IsUnique() const { return !superblock.info.duplicates; }
+
   // This is called before any inserts, updates, or deletes happen
   // If create=true, then initblock is meaningless
   // If create=false, than the index already exists and we are telling you
@@ -93,39 +576,173 @@ public:
   // This should be your superblock, which contains the information 
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
-  // giving you an incorrect block to start with
+  // giving you an incorrect block to start with, or the index was
+  // written with another layout of nodes (BTREE_LAYOUT_VERSION)
+  // If the index has a log, any operations it holds that did not 
+  // make it home before a crash are redone here.
+  // An index takes the whole disk this way.  For several on one disk,
+  // see BTreeCatalog.
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
+  // This checkpoints and closes the log.
   ERROR_T Detach(SIZE_T &initblock);
    
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  //   (in the slotted format, if either is longer than its size)
   // return ERROR_CONFLICT if the key already exists and it's a unique index
+  //   (or if the key already has this value, in a non-unique one)
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
   
+  // Inserts or updates key, as mode says, with one descent to its 
+  // leaf and one write of it, rather than an Insert that fails and
+  // then an Update.  In a non-unique index, INSERT and UPSERT add 
+  // value to those of key, and UPDATE replaces all of them with it.
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_CONFLICT if mode is BTREE_PUT_INSERT and the key exists
+  //   (and has this value, in a non-unique index)
+  // return ERROR_NONEXISTENT if mode is BTREE_PUT_UPDATE and it doesn't
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T Put(const KEY_T &key, 
+	      const VALUE_T &value, 
+	      const BTreePutMode mode=BTREE_PUT_UPSERT);
+  // The same, with the value modifier makes from the one key has, 
+  // read and written in the same operation.  With a log, they commit
+  // together.
+  // return ERROR_UNIMPL in a non-unique index
+  ERROR_T Put(const KEY_T &key, 
+	      BTreeValueModifier &modifier, 
+	      const BTreePutMode mode=BTREE_PUT_UPSERT);
+
+  // Inserts many pairs at once.  They are sorted by key first, unless
+  // they already are, and then each leaf they go in is gone down to
+  // once, for all of its pairs, rather than once per pair.  With a
+  // log, each leaf's pairs commit as one operation.
+  // return ERROR_SIZE if any key or value is the wrong size for this 
+  //   index, before any pair goes in
+  // return ERROR_CONFLICT if any key was already there, or came 
+  //   earlier in pairs, once the rest have gone in
+  // return ERROR_NOSPACE if you run out of disk space, with the pairs
+  //   of the leaves before in
+  // In a non-unique index, the pairs go in one at a time, as Insert 
+  // would put them, and each is an operation of its own in the log.
+  ERROR_T InsertBatch(vector<KeyValuePair> &pairs);
+
+  // Builds an empty index from pairs all at once, bottom up, rather
+  // than inserting them one at a time.  The pairs are sorted by key
+  // first, unless they already are.  Each node is filled until it is
+  // fillfactor percent full, and the nodes of each level take blocks
+  // from the free list one after another, which in a new index are
+  // consecutive.
+  // return ERROR_CONFLICT if the index is not empty, or two pairs 
+  //   have the same key (the same key and value, if it is non-unique,
+  //   and then each key's values go in its posting list)
+  // return ERROR_SIZE if a key or value is the wrong size for this 
+  //   index, or fillfactor is not from 1 to 100
+  // return ERROR_NOSPACE if you run out of disk space
+  // Whatever the error, the index is left empty, and every block 
+  // the load took is back on the free list.
+  ERROR_T BulkLoad(vector<KeyValuePair> &pairs, 
+		   const SIZE_T fillfactor=BTREE_BULKLOAD_FILL);
+  // The same, for more pairs than fit in memory, which source hands
+  // out in key order (see ExternalSort).  They are checked as they
+  // come, and if one is the wrong size, or not after the one before
+  // it, this stops with ERROR_SIZE or ERROR_CONFLICT, and, as for 
+  // any other error, leaves the index empty.
+  ERROR_T BulkLoad(BTreePairSource &source, 
+		   const SIZE_T fillfactor=BTREE_BULKLOAD_FILL);
+
   ERROR_T Upsert(const SIZE_T &ptr, const KEY_T &key, std::stack<SIZE_T> traversed);
   ERROR_T SanityCheckHelper(const SIZE_T &node) const;
   // given a key, return the offset of where it can be found/is found if leaf
   SIZE_T  FindOffsetFromKey(const KEY_T &key);
     
+  // In a non-unique index, value replaces all of the key's values
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
+  // Nodes left underfull borrow from a sibling or merge with it, 
+  // and the blocks freed go back on the free list.  A lazy delete 
+  // only marks the pair dead, with one write of its leaf, and in an 
+  // index without tombstones is the same as one done now.
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
-  // return ERROR_SIZE if the key or value are the wrong size for this index
-  ERROR_T Delete(const KEY_T &key);
+  // return ERROR_SIZE if the key is the wrong size for this index
+  ERROR_T Delete(const KEY_T &key, const BTreeDeleteMode mode=BTREE_DELETE_NOW);
+  // Deletes just the one pair, which in a non-unique index takes 
+  // value out of the key's posting list, and deletes the key as 
+  // above only once it has no values left
+  // return ERROR_NONEXISTENT  if the key doesn't have this value
+  // return ERROR_SIZE if the key or value is the wrong size for this index
+  ERROR_T Delete(const KEY_T &key, 
+		 const VALUE_T &value, 
+		 const BTreeDeleteMode mode=BTREE_DELETE_NOW);
+
+  // Deletes every pair with a key from lo to hi, inclusive.  The 
+  // subtrees wholly inside the range are freed without reading their
+  // leaves (unless values can be in overflow blocks), and then the 
+  // leaves at the two ends are trimmed and the nodes on the way down
+  // to them rebalanced, once.  So it reads about twice the height of 
+  // the tree, and writes a block for each node it frees, rather than 
+  // going down once per pair.  It is one operation in the log.
+  // return ERROR_SIZE if lo or hi is the wrong size for this index
+  ERROR_T DeleteRange(const KEY_T &lo, const KEY_T &hi);
+
+  // One step of cleaning up after lazy deletes, for when the index 
+  // is not busy.  It looks at the leaves lazy deletes have been in,
+  // up to the pace set by SetCompaction, and rewrites the ones that
+  // have enough tombstones without them, merging them with a sibling
+  // if they are left underfull.  After an attach, it also sweeps the
+  // leaves on disk in key order for tombstones from before.  done 
+  // says whether there is nothing left to look at.  With a log, each
+  // step commits as one operation.
+  ERROR_T Compact(bool &done);
   
+  // In a non-unique index, value is the first of the key's values
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // The same, but sets up reader to read the value a piece at a time
+  // (in a non-unique index, the whole posting list, as it is kept)
+  ERROR_T OpenValue(const KEY_T &key, BTreeValueReader &reader);
+
+  // Sets up values to go through all of the values of key, with one
+  // descent to its leaf
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  ERROR_T SeekValues(const KEY_T &key, BTreeValueCursor &values) const;
+
+  // Looks up many keys at once.  The keys are sorted, and the tree is
+  // walked once for all of them, so that each node is read at most 
+  // once per batch.  values[i] and results[i] are the value and the
+  // result of keys[i], as Lookup would give them.
+  // return ERROR_NONEXISTENT if any key doesn't exist, once all of
+  //   them have been looked up
+  ERROR_T LookupBatch(const vector<KEY_T> &keys, 
+		      vector<VALUE_T> &values, 
+		      vector<ERROR_T> &results);
+
+  // Puts cursor on the first pair whose key is at least key.  If
+  // there is none, cursor is not valid afterward.
+  ERROR_T Seek(const KEY_T &key, BTreeCursor &cursor) const;
+  // Puts cursor on the first or the last pair of the index
+  ERROR_T SeekFirst(BTreeCursor &cursor) const;
+  ERROR_T SeekLast(BTreeCursor &cursor) const;
+  // Keeps cursor to the pairs with keys from low to high, inclusive,
+  // and puts it on the first of them, or the last if backward.  Next
+  // (or Prev) then takes it through the rest, and off the end after
+  // high (or before low).
+  ERROR_T SeekRange(const KEY_T &low, 
+		    const KEY_T &high, 
+		    BTreeCursor &cursor, 
+		    const bool backward=false) const;
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
@@ -150,4 +767,69 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+// Longest name of an index in a catalog
+#define BTREE_CATALOG_NAME_MAX 64
+
+//
+// Several named indexes on one disk
+//
+// A catalog takes the whole disk, as an index would, and it is an
+// index itself: a slotted one, at block 0, from each name to the
+// superblock of the index by that name.  The free list in its 
+// superblock is the free list of the whole disk, and its log is the
+// log of every index in it.  So the indexes allocate nodes from, and
+// free them to, the one list, their operations are committed 
+// together, and they share the catalog's BufferCache, whose blocks 
+// go to whichever of them is busy.
+//
+// An index in a catalog is used as any other, and detached with 
+// Detach (or destroyed) before the catalog is.  Its superblock is 
+// wherever it was allocated, so that block is only good for Open by
+// name.
+//
+class BTreeCatalog {
+ private:
+  BTreeIndex   names;
+
+  // Gives the key of name, and the superblock of its index
+  ERROR_T Find(const string &name, KEY_T &key, SIZE_T &superblock);
+
+ public:
+  BTreeCatalog(BufferCache *cache);
+
+  // As for a BTreeIndex, but for the log shared by all of the indexes
+  void    SetLogSize(const SIZE_T numblocks) { names.SetLogSize(numblocks); }
+  void    SetGroupCommitSize(const SIZE_T numops) { names.SetGroupCommitSize(numops); }
+
+  // If create=true, an empty catalog takes the disk.  Otherwise, the
+  // one on it is opened, and the log of all of its indexes replayed.
+  // return ERROR_NOTANINDEX if the disk has no catalog, after which
+  //   the catalog is detached, as it was before
+  ERROR_T Attach(const bool create=false);
+  // Checkpoints and closes the log
+  ERROR_T Detach();
+
+  // Creates an index called name, with the sizes and settings index
+  // was constructed and set up with, as Attach(initblock,true) 
+  // would, and attaches index to it.  Its log size is ignored.
+  // return ERROR_CONFLICT if there already is one by that name
+  // return ERROR_SIZE if name is empty or longer than 
+  //   BTREE_CATALOG_NAME_MAX, or as Attach would
+  // return ERROR_NOSPACE if the disk is full
+  ERROR_T Create(const string &name, BTreeIndex &index);
+  // Attaches index, which can be constructed with BTreeIndex(), to
+  // the index called name
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T Open(const string &name, BTreeIndex &index);
+  // Frees every block of the index called name.  It is one 
+  // operation in the log.
+  // return ERROR_NONEXISTENT if there is none
+  // return ERROR_CONFLICT if it is attached (by Create or Open) 
+  //   and has not been detached since
+  ERROR_T Drop(const string &name);
+  // The names of the indexes, in order
+  ERROR_T List(vector<string> &indexes) const;
+};
+
 #endif
@@ -0,0 +1,1667 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include "btree.h"
+#include "keysearch.h"
+#include "nodeview.h"
+#include "lookupengine.h"
+
+//
+// Microbenchmarks for the btree and the structures under it
+//
+// Each benchmark creates a fresh index on the given disk, so
+// do not point this at a disk you care about.
+//
+
+static SIZE_T numallocations=0;
+
+void *operator new(size_t n)
+{
+  numallocations++;
+  void *p=malloc(n ? n : 1);
+  if (!p) { throw std::bad_alloc(); }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  numallocations++;
+  void *p=malloc(n ? n : 1);
+  if (!p) { throw std::bad_alloc(); }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+
+void usage()
+{
+  cerr << "usage: btree_bench filestem cachesize keysize valuesize numkeys allocs|search|view|shift|compress|varlen|overflow|scan|bulk|batch|multiget|interleave|put|delete|tombstone|range|postings|catalog\n";
+  cerr << "  allocs   heap allocations per insert and per lookup\n";
+  cerr << "  search   key comparisons per in-node search against node fan-out\n";
+  cerr << "           for each node format and search type (numkeys searches per node)\n";
+  cerr << "  view     ns per lookup step through the generic node accessors and\n";
+  cerr << "           through the NodeView for keysize/valuesize, if there is one\n";
+  cerr << "  shift    inserts per second into a leaf one pair short of full, for\n";
+  cerr << "           each node format, opening up the slot one pair at a time and\n";
+  cerr << "           with a memmove per array (numkeys inserts per node)\n";
+  cerr << "  compress nodes, blocks read per lookup, and ns per lookup for an index\n";
+  cerr << "           of numkeys keys, with and without prefix compression, and with\n";
+  cerr << "           suffix-truncated separators (slotted)\n";
+  cerr << "  varlen   the same, for keys and values of varying length, padded to\n";
+  cerr << "           keysize and valuesize (columnar) and as they are (slotted)\n";
+  cerr << "  overflow nodes, and blocks read per key search and per value read, with\n";
+  cerr << "           values kept in the leaves and in overflow blocks\n";
+  cerr << "  scan     simulated disk time for a cursor to scan every pair from a\n";
+  cerr << "           cold cache, without and with readahead, against reading as\n";
+  cerr << "           many blocks in one request\n";
+  cerr << "  bulk     nodes, disk traffic, and simulated disk time to load numkeys\n";
+  cerr << "           pairs by inserting them, shuffled and in order, and with\n";
+  cerr << "           BulkLoad at two fill factors, and then to scan them cold\n";
+  cerr << "  batch    blocks read per key and simulated disk time to insert numkeys\n";
+  cerr << "           pairs into an index of as many, one at a time and with\n";
+  cerr << "           InsertBatch, in batches of clustered and of scattered keys\n";
+  cerr << "  multiget blocks read per key and simulated disk time to look up numkeys\n";
+  cerr << "           keys of an index of as many, one at a time and with\n";
+  cerr << "           LookupBatch, in batches of several sizes\n";
+  cerr << "  interleave\n";
+  cerr << "           lookups per second and simulated disk time to look up\n";
+  cerr << "           numkeys keys with BTreeLookupEngine, against the number of\n";
+  cerr << "           lookups in flight, from a cold cache and from a warm one\n";
+  cerr << "  put      blocks read and written per operation for numkeys insert-or-\n";
+  cerr << "           replace operations, half of them on keys already there, as an\n";
+  cerr << "           Insert and then an Update if it fails, and as one Put\n";
+  cerr << "  delete   nodes, and blocks read and written per delete, to delete nine\n";
+  cerr << "           in ten of numkeys keys, for each node format, and blocks read\n";
+  cerr << "           per lookup of the rest afterward and in a new index of them\n";
+  cerr << "  tombstone blocks read and written per delete, and simulated disk time,\n";
+  cerr << "           to delete nine in ten of numkeys keys now and lazily, and for\n";
+  cerr << "           the lazy deletes, to compact the index afterward\n";
+  cerr << "  range    disk traffic and simulated disk time, from a cold cache, to\n";
+  cerr << "           delete a tenth, a quarter and a half of numkeys keys in one\n";
+  cerr << "           range, a key at a time and with DeleteRange\n";
+  cerr << "  postings nodes, disk traffic per insert, and blocks read to go through\n";
+  cerr << "           all the values of a key, from a cold cache, for numkeys pairs\n";
+  cerr << "           of 4, 32 and 256 values a key, in a non-unique index and in a\n";
+  cerr << "           unique one whose keys have the value appended\n";
+  cerr << "  catalog  blocks read per lookup and simulated disk time for four\n";
+  cerr << "           indexes of numkeys/4 keys each, looked up evenly and with\n";
+  cerr << "           most lookups on one, each with a quarter of the cache to\n";
+  cerr << "           itself and all in one catalog sharing the whole cache\n";
+}
+
+
+// Keys are the decimal representation of i, zero padded to keysize,
+// with the digits shuffled so that the insertion order is not sorted
+static void MakeKey(const SIZE_T i, const SIZE_T keysize, KEY_T &key)
+{
+  key.Resize(keysize,false);
+  SIZE_T x=(i*2654435761u)%1000000007u;
+  for (SIZE_T j=0;j<keysize;j++) {
+    key.data[keysize-1-j]='0'+(x%10);
+    x/=10;
+  }
+}
+
+static void MakeValue(const SIZE_T i, const SIZE_T valuesize, VALUE_T &value)
+{
+  value.Resize(valuesize,false);
+  for (SIZE_T j=0;j<valuesize;j++) {
+    value.data[j]='a'+((i+j)%26);
+  }
+}
+
+
+static int BenchAllocs(BTreeIndex &btree, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T before, failed;
+
+  failed=0;
+  before=numallocations;
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeKey(i,keysize,key);
+    MakeValue(i,valuesize,value);
+    if (btree.Insert(key,value)!=ERROR_NOERROR) {
+      failed++;
+    }
+  }
+  double perinsert=(double)(numallocations-before)/numkeys;
+
+  before=numallocations;
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeKey(i,keysize,key);
+    if (btree.Lookup(key,value)!=ERROR_NOERROR) {
+      failed++;
+    }
+  }
+  double perlookup=(double)(numallocations-before)/numkeys;
+
+  cout << "allocations per insert = "<<perinsert<<endl;
+  cout << "allocations per lookup = "<<perlookup<<endl;
+  cout << "failed operations      = "<<failed<<endl;
+  return 0;
+}
+
+
+// Fills every slot of a leaf with sorted numeric keys, spread evenly
+// over the key space, or bunched up toward the low end if skewed
+static void FillSortedLeaf(BTreeNode &node, const SIZE_T keysize, const bool skewed)
+{
+  SIZE_T n=node.info.GetNumSlotsAsLeaf();
+  SIZE_T digits=keysize<18 ? keysize : 18;
+  double max=1;
+  KEY_T key;
+  
+  for (SIZE_T j=0;j<digits;j++) { max*=10; }
+  max-=n+1;
+  
+  key.Resize(keysize,false);
+  memset(key.data,'0',keysize);
+  node.info.numkeys=n;
+  for (SIZE_T i=0;i<n;i++) { 
+    double f=(double)i/n;
+    unsigned long long x=(unsigned long long)(max*(skewed ? f*f*f*f : f)) + i;
+    for (SIZE_T j=0;j<digits;j++) {
+      key.data[digits-1-j]='0'+(x%10);
+      x/=10;
+    }
+    node.SetKey(i,key);
+  }
+}
+
+
+// Average ns per LowerBound over the probes
+static double TimeSearches(const BTreeNode &node, const vector<KEY_T> &probes, const BTreeSearchType type)
+{
+  clock_t start=clock();
+  for (SIZE_T i=0;i<probes.size();i++) { 
+    node.LowerBound(probes[i],type);
+  }
+  return 1e9*(clock()-start)/CLOCKS_PER_SEC/probes.size();
+}
+
+
+static int BenchSearch(const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numsearches)
+{
+  const char *names[]={"linear","binary","interp","simd"};
+  BTreeSearchType types[]={BTREE_SEARCH_LINEAR,BTREE_SEARCH_BINARY,BTREE_SEARCH_INTERPOLATION,BTREE_SEARCH_SIMD};
+  const char *formatnames[]={"interleaved","columnar","prefix"};
+  int formats[]={BTREE_FORMAT_INTERLEAVED,BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_COLUMNAR_PREFIX};
+  KeySearchKernel kernels[]={KEYSEARCH_SCALAR,KEYSEARCH_SSE,KEYSEARCH_AVX2};
+  KeySearchKernel best=GetKeySearchKernel();
+
+  cout << "simd kernel = " << GetKeySearchKernelName(best) << endl;
+
+  for (int f=0;f<3;f++) { 
+    cout << formatnames[f] << " nodes" << endl;
+    cout << "blocksize fanout dist   ";
+    for (int t=0;t<4;t++) { 
+      cout << names[t] << "(cmp,ns)  ";
+    }
+    if (f>0) { 
+      cout << "simd ns by kernel";
+    }
+    cout << endl;
+
+    for (SIZE_T blocksize=256; blocksize<=65536; blocksize*=2) { 
+      for (int skewed=0; skewed<2; skewed++) { 
+	BTreeNode node(BTREE_LEAF_NODE,keysize,valuesize,blocksize,formats[f]);
+	vector<KEY_T> probes(numsearches);
+	SIZE_T n=node.info.GetNumSlotsAsLeaf();
+	
+	if (n<2) { 
+	  continue;
+	}
+	FillSortedLeaf(node,keysize,skewed);
+	for (SIZE_T i=0;i<numsearches;i++) { 
+	  node.GetKey((i*2654435761u)%n,probes[i]);
+	}
+	
+	cout << blocksize << "\t  " << n << "\t " << (skewed ? "skewed" : "even  ");
+	for (int t=0;t<4;t++) { 
+	  SIZE_T numcompares=0;
+	  for (SIZE_T i=0;i<numsearches;i++) { 
+	    node.LowerBound(probes[i],types[t],&numcompares);
+	  }
+	  cout << "  " << (double)numcompares/numsearches << ", " << TimeSearches(node,probes,types[t]) << "\t";
+	}
+	if (f>0) { 
+	  for (int k=0;k<3;k++) { 
+	    if (SetKeySearchKernel(kernels[k])) { 
+	      cout << "  " << GetKeySearchKernelName(kernels[k]) << "=" << TimeSearches(node,probes,BTREE_SEARCH_SIMD);
+	    }
+	  }
+	  SetKeySearchKernel(best);
+	}
+	cout << endl;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Average ns per leaf lookup step (LowerBound, CompareKey, GetVal)
+// through the given accessors
+static double TimeLookups(const NodeAccess &access, const BTreeNode &node, const vector<KEY_T> &probes)
+{
+  VALUE_T value;
+  SIZE_T found=0;
+  clock_t start=clock();
+  for (SIZE_T i=0;i<probes.size();i++) { 
+    SIZE_T offset=access.LowerBound(node,probes[i],BTREE_SEARCH_SIMD);
+    if (offset<node.info.numkeys && access.CompareKey(node,probes[i],offset)==0) { 
+      access.GetVal(node,offset,value);
+      found++;
+    }
+  }
+  double ns=1e9*(clock()-start)/CLOCKS_PER_SEC/probes.size();
+  return found==probes.size() ? ns : -1;
+}
+
+
+static int BenchView(const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numsearches)
+{
+  const char *formatnames[]={"interleaved","columnar","prefix"};
+  int formats[]={BTREE_FORMAT_INTERLEAVED,BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_COLUMNAR_PREFIX};
+  NodeAccess generic;
+  const NodeAccess *view=GetNodeAccess(keysize,valuesize);
+
+  if (view->GetKeySize()==0) { 
+    cout << "no NodeView for keysize="<<keysize<<" valuesize="<<valuesize<<", both columns use the generic accessors"<<endl;
+  }
+
+  for (int f=0;f<3;f++) { 
+    cout << formatnames[f] << " nodes" << endl;
+    cout << "blocksize fanout  generic(ns)  view(ns)" << endl;
+    for (SIZE_T blocksize=256; blocksize<=65536; blocksize*=2) { 
+      BTreeNode node(BTREE_LEAF_NODE,keysize,valuesize,blocksize,formats[f]);
+      vector<KEY_T> probes(numsearches);
+      VALUE_T value;
+      SIZE_T n=node.info.GetNumSlotsAsLeaf();
+
+      if (n<2) { 
+	continue;
+      }
+      FillSortedLeaf(node,keysize,false);
+      for (SIZE_T i=0;i<n;i++) { 
+	MakeValue(i,valuesize,value);
+	node.SetVal(i,value);
+      }
+      for (SIZE_T i=0;i<numsearches;i++) { 
+	node.GetKey((i*2654435761u)%n,probes[i]);
+      }
+      cout << blocksize << "\t  " << n << "\t  " << TimeLookups(generic,node,probes) 
+	   << "\t       " << TimeLookups(*view,node,probes) << endl;
+    }
+  }
+  return 0;
+}
+
+
+// Key i of the ones FillShiftLeaf and BenchShift use.  Leaves hold 
+// the even ones, and the odd ones go between them.
+static void MakeShiftKey(const SIZE_T i, const SIZE_T keysize, KEY_T &key)
+{
+  SIZE_T x=i;
+
+  key.Resize(keysize,false);
+  for (SIZE_T j=0;j<keysize;j++) {
+    key.data[keysize-1-j]='0'+(x%10);
+    x/=10;
+  }
+}
+
+// Fills a leaf to one pair short of full, so that inserts shift 
+// slots but do not need a split
+static SIZE_T FillShiftLeaf(BTreeNode &node, const SIZE_T keysize, const VALUE_T &value)
+{
+  KEY_T key;
+
+  MakeShiftKey(0,keysize,key);
+  while (node.HasRoomFor(key,value)) { 
+    if (node.InsertKeyVal(node.info.numkeys,key,value)!=ERROR_NOERROR) { 
+      return 0;
+    }
+    MakeShiftKey(2*node.info.numkeys,keysize,key);
+  }
+  node.RemoveSlots(node.info.numkeys-1,1);
+  return node.info.numkeys;
+}
+
+// Opens up a slot one pair at a time, the way inserts did before 
+// OpenSlots, for comparison
+static ERROR_T InsertOneAtATime(BTreeNode &node, const SIZE_T offset, const KEY_T &key, const VALUE_T &value)
+{
+  KeyValuePair kvpair;
+  ERROR_T rc;
+
+  rc=node.FitCommonPrefix(key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  node.info.numkeys++;
+  for (SIZE_T i=node.info.numkeys-1; i>offset; i--) { 
+    rc=node.GetKeyVal(i-1,kvpair);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    rc=node.SetKeyVal(i,kvpair);
+    if (rc!=ERROR_NOERROR) { return rc; }
+  }
+  rc=node.SetKey(offset,key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return node.SetVal(offset,value);
+}
+
+// Inserts per second into a leaf with n pairs, each at a random 
+// offset and taken out again with RemoveSlots, or -1 on an error
+static double TimeShiftInserts(BTreeNode &node, const SIZE_T n, const vector<KEY_T> &keys, 
+			       const VALUE_T &value, const SIZE_T numinserts, const bool oneatatime)
+{
+  clock_t start=clock();
+
+  for (SIZE_T i=0;i<numinserts;i++) { 
+    SIZE_T offset=(i*2654435761u)%(n+1);
+    ERROR_T rc = oneatatime ? InsertOneAtATime(node,offset,keys[offset],value) :
+      node.InsertKeyVal(offset,keys[offset],value);
+    if (rc!=ERROR_NOERROR || node.RemoveSlots(offset,1)!=ERROR_NOERROR) { 
+      return -1;
+    }
+  }
+  return numinserts/((double)(clock()-start)/CLOCKS_PER_SEC);
+}
+
+
+static int BenchShift(const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numinserts)
+{
+  const char *formatnames[]={"interleaved","columnar","prefix","compressed","slotted"};
+  int formats[]={BTREE_FORMAT_INTERLEAVED,BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_COLUMNAR_PREFIX,
+		 BTREE_FORMAT_COMPRESSED,BTREE_FORMAT_SLOTTED};
+  VALUE_T value;
+
+  MakeValue(0,valuesize,value);
+  for (int f=0;f<5;f++) { 
+    cout << formatnames[f] << " leaves" << endl;
+    cout << "blocksize fanout  one-at-a-time(inserts/s)  memmove(inserts/s)" << endl;
+    for (SIZE_T blocksize=256; blocksize<=65536; blocksize*=2) { 
+      BTreeNode node(BTREE_LEAF_NODE,keysize,valuesize,blocksize,formats[f]);
+      vector<KEY_T> keys;
+      SIZE_T n;
+
+      if (node.info.GetNumSlotsAsLeaf()<2 ||
+	  (formats[f]==BTREE_FORMAT_SLOTTED && blocksize>BTREE_SLOTTED_MAX_BLOCKSIZE)) { 
+	continue;
+      }
+      n=FillShiftLeaf(node,keysize,value);
+      // Key offset goes at offset, between the pairs around it
+      keys.resize(n+1);
+      for (SIZE_T i=0;i<=n;i++) { 
+	MakeShiftKey(i>0 ? 2*i-1 : 0,keysize,keys[i]);
+      }
+      cout << blocksize << "\t  " << n << "\t  ";
+      if (formats[f]==BTREE_FORMAT_SLOTTED) { 
+	// Its slot directory was always moved with memmove
+	cout << "-";
+      } else {
+	cout << TimeShiftInserts(node,n,keys,value,numinserts,true);
+      }
+      cout << "\t\t\t    " << TimeShiftInserts(node,n,keys,value,numinserts,false) << endl;
+    }
+  }
+  return 0;
+}
+
+
+// Builds an index in each format in turn, on the same disk
+static int BenchCompress(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *formatnames[]={"columnar","compressed","slotted"};
+  int formats[]={BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_COMPRESSED,BTREE_FORMAT_SLOTTED};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "format      nodes  blocks/lookup  ns/lookup" << endl;
+  for (int f=0;f<3;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    SIZE_T superblocknum, allocs, reads, failed=0;
+
+    btree.SetNodeFormat(formats[f]);
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+
+    allocs=cache.GetNumAllocs();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeKey(i,keysize,key);
+      MakeValue(i,valuesize,value);
+      if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    allocs=cache.GetNumAllocs()-allocs;
+
+    reads=cache.GetNumReads();
+    clock_t start=clock();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeKey(i,keysize,key);
+      if (btree.Lookup(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    double ns=1e9*(clock()-start)/CLOCKS_PER_SEC/numkeys;
+    reads=cache.GetNumReads()-reads;
+
+    cout << formatnames[f] << "\t    " << allocs << "\t   " << (double)reads/numkeys << "\t  " << ns;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// The key of MakeKey without its leading zeros, and a value from 1
+// to valuesize bytes long.  With pad, both are zero padded on the 
+// right to their full size, which keeps the keys in the same order.
+static void MakeVarPair(const SIZE_T i, const SIZE_T keysize, const SIZE_T valuesize, 
+			const bool pad, KEY_T &key, VALUE_T &value)
+{
+  SIZE_T skip, length;
+
+  MakeKey(i,keysize,key);
+  for (skip=0; skip+1<keysize && key.data[skip]=='0'; skip++) {}
+  memmove(key.data,key.data+skip,keysize-skip);
+  memset(key.data+keysize-skip,0,skip);
+  if (!pad) { 
+    key.Resize(keysize-skip);
+  }
+
+  length=1+i%valuesize;
+  MakeValue(i,valuesize,value);
+  memset(value.data+length,0,valuesize-length);
+  if (!pad) { 
+    value.Resize(length);
+  }
+}
+
+
+static int BenchVarlen(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *formatnames[]={"columnar","slotted"};
+  int formats[]={BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_SLOTTED};
+  KEY_T key;
+  VALUE_T value, found;
+  ERROR_T rc;
+
+  cout << "format      nodes  bytes/pair  blocks/lookup  ns/lookup" << endl;
+  for (int f=0;f<2;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    bool pad=formats[f]!=BTREE_FORMAT_SLOTTED;
+    SIZE_T superblocknum, allocs, reads, failed=0;
+    double bytes=0;
+
+    btree.SetNodeFormat(formats[f]);
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+
+    allocs=cache.GetNumAllocs();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeVarPair(i,keysize,valuesize,pad,key,value);
+      bytes+=key.length+value.length;
+      if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    allocs=cache.GetNumAllocs()-allocs;
+
+    reads=cache.GetNumReads();
+    clock_t start=clock();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeVarPair(i,keysize,valuesize,pad,key,value);
+      if (btree.Lookup(key,found)!=ERROR_NOERROR || found.length!=value.length ||
+	  memcmp(found.data,value.data,value.length)!=0) {
+	failed++;
+      }
+    }
+    double ns=1e9*(clock()-start)/CLOCKS_PER_SEC/numkeys;
+    reads=cache.GetNumReads()-reads;
+
+    cout << formatnames[f] << "\t    " << allocs << "\t   " << bytes/numkeys 
+	 << "\t       " << (double)reads/numkeys << "\t  " << ns;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+static int BenchOverflow(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *names[]={"in leaves","overflow"};
+  SIZE_T sizes[]={0,BTREE_OVERFLOW_AUTO};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "values       nodes  blocks/search  blocks/value  ns/value" << endl;
+  for (int f=0;f<2;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    SIZE_T superblocknum, allocs, searchreads, reads, failed=0;
+
+    btree.SetOverflowSize(sizes[f]);
+    if ((rc=btree.Attach(0,true))==ERROR_SIZE) { 
+      cout << names[f] << "\t    (values too long for a leaf)" << endl;
+      continue;
+    }
+    if (rc!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+
+    allocs=cache.GetNumAllocs();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeKey(i,keysize,key);
+      MakeValue(i,valuesize,value);
+      if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    allocs=cache.GetNumAllocs()-allocs;
+
+    // Finding a key, without reading its value
+    searchreads=cache.GetNumReads();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      BTreeValueReader reader;
+      MakeKey(i,keysize,key);
+      if (btree.OpenValue(key,reader)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    searchreads=cache.GetNumReads()-searchreads;
+
+    reads=cache.GetNumReads();
+    clock_t start=clock();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeKey(i,keysize,key);
+      if (btree.Lookup(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    double ns=1e9*(clock()-start)/CLOCKS_PER_SEC/numkeys;
+    reads=cache.GetNumReads()-reads;
+
+    cout << names[f] << "\t    " << allocs << "\t   " << (double)searchreads/numkeys 
+	 << "\t\t  " << (double)reads/numkeys << "\t\t" << ns;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Scans a whole index from a cold cache, without and with readahead,
+// once when the keys went in in order and once when they did not
+static int BenchScan(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *names[]={"in order","shuffled"};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "inserted  readahead  pairs  disk reads  prefetched  sim ms  sequential ms" << endl;
+  for (int f=0;f<2;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    SIZE_T superblocknum, blocks=0, failed=0;
+
+    // No log, so that the cache can be emptied under the index
+    btree.SetLogSize(0);
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    for (SIZE_T i=0;i<numkeys;i++) {
+      if (f==0) { 
+	MakeShiftKey(i,keysize,key);
+      } else {
+	MakeKey(i,keysize,key);
+      }
+      MakeValue(i,valuesize,value);
+      if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+
+    for (int ra=0;ra<2;ra++) { 
+      BTreeCursor cursor;
+      SIZE_T pairs=0, reads, prefetches;
+      double start, ms, seqms;
+
+      cache.Detach();
+      cache.Attach();
+      cursor.SetReadahead(ra ? BTREE_READAHEAD_MAX : 0);
+      reads=cache.GetNumDiskReads();
+      prefetches=cache.GetNumPrefetches();
+      start=cache.GetCurrentTime();
+      for (rc=btree.SeekFirst(cursor); rc==ERROR_NOERROR && cursor.IsValid(); rc=cursor.Next()) { 
+	pairs++;
+      }
+      if (rc!=ERROR_NOERROR) { 
+	failed++;
+      }
+      ms=cache.GetCurrentTime()-start;
+      reads=cache.GetNumDiskReads()-reads;
+      prefetches=cache.GetNumPrefetches()-prefetches;
+      if (!ra) { 
+	// Without readahead, each disk read is one of the blocks the
+	// scan needs
+	blocks=reads;
+      }
+
+      // What reading as many blocks in one go would take
+      vector<Block> run;
+      start=cache.GetCurrentTime();
+      cache.ReadBlocksUncached(1,blocks<cache.GetNumBlocks()-1 ? blocks : cache.GetNumBlocks()-1,run);
+      seqms=cache.GetCurrentTime()-start;
+
+      cout << names[f] << "  " << (ra ? "on " : "off") << "\t     " << pairs << "  " << reads 
+	   << "\t      " << prefetches << "\t  " << ms << "\t" << seqms;
+      if (failed) { 
+	cout << "  (" << failed << " failed operations)";
+      }
+      cout << endl;
+    }
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Keys are all keysize long here
+static bool KeyLess(const KeyValuePair &a, const KeyValuePair &b)
+{
+  return memcmp(a.key.data,b.key.data,a.key.length)<0;
+}
+
+static int BenchBulk(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *names[]={"insert shuffled","insert in order","bulk load 100% ","bulk load 90%  "};
+  vector<KeyValuePair> pairs(numkeys);
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeKey(i,keysize,pairs[i].key);
+    MakeValue(i,valuesize,pairs[i].value);
+  }
+
+  cout << "load             nodes  disk reads  disk writes  sim ms  scan ms" << endl;
+  for (int f=0;f<4;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    BTreeCursor cursor;
+    SIZE_T superblocknum, failed=0, allocs, reads, writes;
+    double start, ms, scanms;
+
+    btree.SetLogSize(0);
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    if (f==1) { 
+      sort(pairs.begin(),pairs.end(),KeyLess);
+    }
+    // Starting from a cold cache, with the new index all home
+    cache.Detach();
+    cache.Attach();
+    allocs=cache.GetNumAllocs();
+    reads=cache.GetNumDiskReads();
+    writes=cache.GetNumDiskWrites();
+    start=cache.GetCurrentTime();
+    if (f<2) { 
+      for (SIZE_T i=0;i<numkeys;i++) {
+	if (btree.Insert(pairs[i].key,pairs[i].value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+    } else if (btree.BulkLoad(pairs,f==2 ? 100 : 90)!=ERROR_NOERROR) { 
+      failed++;
+    }
+    // Until it is all home
+    cache.Detach();
+    ms=cache.GetCurrentTime()-start;
+    allocs=cache.GetNumAllocs()-allocs;
+    reads=cache.GetNumDiskReads()-reads;
+    writes=cache.GetNumDiskWrites()-writes;
+
+    cache.Attach();
+    start=cache.GetCurrentTime();
+    for (rc=btree.SeekFirst(cursor); rc==ERROR_NOERROR && cursor.IsValid(); rc=cursor.Next()) { }
+    if (rc!=ERROR_NOERROR) { 
+      failed++;
+    }
+    scanms=cache.GetCurrentTime()-start;
+
+    cout << names[f] << "  " << allocs << "\t " << reads << "\t     " << writes 
+	 << "\t  " << ms << "\t" << scanms;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Inserts numkeys pairs into an index that already has numkeys, one
+// at a time and in batches, with the keys of each batch either in a 
+// run (clustered) or spread over the whole index (scattered)
+static int BenchBatch(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *names[]={"clustered","scattered"};
+  const SIZE_T batchsize=1000;
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "keys       insert  blocks/key  disk reads  sim ms" << endl;
+  for (int f=0;f<2;f++) { 
+    for (int batched=0;batched<2;batched++) { 
+      BTreeIndex btree(keysize,valuesize,&cache);
+      SIZE_T superblocknum, reads, diskreads, failed=0;
+      double start, ms;
+
+      btree.SetLogSize(0);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      // The even keys are there already, and the odd ones go in
+      for (SIZE_T i=0;i<numkeys;i++) {
+	MakeShiftKey(2*i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      cache.Detach();
+      cache.Attach();
+      reads=cache.GetNumReads();
+      diskreads=cache.GetNumDiskReads();
+      start=cache.GetCurrentTime();
+      for (SIZE_T b=0;b<numkeys;b+=batchsize) { 
+	vector<KeyValuePair> pairs;
+	for (SIZE_T i=b;i<numkeys && i<b+batchsize;i++) { 
+	  // Clustered batches take a run of keys, and scattered ones 
+	  // take every numkeys/batchsize-th
+	  SIZE_T j = f==0 ? i : (i%batchsize)*(numkeys/batchsize) + i/batchsize;
+	  pairs.push_back(KeyValuePair());
+	  MakeShiftKey(2*j+1,keysize,pairs.back().key);
+	  MakeValue(j,valuesize,pairs.back().value);
+	}
+	if (batched) { 
+	  if (btree.InsertBatch(pairs)!=ERROR_NOERROR) {
+	    failed++;
+	  }
+	} else {
+	  for (SIZE_T i=0;i<pairs.size();i++) { 
+	    if (btree.Insert(pairs[i].key,pairs[i].value)!=ERROR_NOERROR) {
+	      failed++;
+	    }
+	  }
+	}
+      }
+      cache.Detach();
+      ms=cache.GetCurrentTime()-start;
+      reads=cache.GetNumReads()-reads;
+      diskreads=cache.GetNumDiskReads()-diskreads;
+      cache.Attach();
+
+      cout << names[f] << "  " << (batched ? "batch " : "single") << "  " << (double)reads/numkeys 
+	   << "\t     " << diskreads << "\t " << ms;
+      if (failed) { 
+	cout << "  (" << failed << " failed operations)";
+      }
+      cout << endl;
+
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Looks up every key of an index of numkeys, in a shuffled order, 
+// one at a time and then in batches of growing size
+static int BenchMultiget(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  BTreeIndex btree(keysize,valuesize,&cache);
+  vector<KEY_T> keys(numkeys);
+  VALUE_T value;
+  SIZE_T superblocknum, failed=0;
+  ERROR_T rc;
+
+  btree.SetLogSize(0);
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  }
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeKey(i,keysize,keys[i]);
+    MakeValue(i,valuesize,value);
+    if (btree.Insert(keys[i],value)!=ERROR_NOERROR) {
+      failed++;
+    }
+  }
+
+  cout << "batch  blocks/key  disk reads  sim ms" << endl;
+  for (SIZE_T batchsize=1; batchsize<=10000; batchsize*=10) { 
+    SIZE_T reads, diskreads;
+    double start, ms;
+
+    cache.Detach();
+    cache.Attach();
+    reads=cache.GetNumReads();
+    diskreads=cache.GetNumDiskReads();
+    start=cache.GetCurrentTime();
+    for (SIZE_T b=0;b<numkeys;b+=batchsize) { 
+      if (batchsize==1) { 
+	if (btree.Lookup(keys[b],value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      } else {
+	vector<KEY_T> batch(keys.begin()+b,keys.begin()+(b+batchsize<numkeys ? b+batchsize : numkeys));
+	vector<VALUE_T> values;
+	vector<ERROR_T> results;
+	if (btree.LookupBatch(batch,values,results)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+    }
+    ms=cache.GetCurrentTime()-start;
+    reads=cache.GetNumReads()-reads;
+    diskreads=cache.GetNumDiskReads()-diskreads;
+
+    cout << batchsize << "\t" << (double)reads/numkeys << "\t    " << diskreads << "\t" << ms;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  return 0;
+}
+
+
+// Looks up every key of an index of numkeys, in a shuffled order,
+// with groups of more and more lookups interleaved
+static int BenchInterleave(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  BTreeIndex btree(keysize,valuesize,&cache);
+  vector<KEY_T> keys(numkeys);
+  VALUE_T value;
+  SIZE_T superblocknum, failed=0;
+  ERROR_T rc;
+
+  btree.SetLogSize(0);
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  }
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeKey(i,keysize,keys[i]);
+    MakeValue(i,valuesize,value);
+    if (btree.Insert(keys[i],value)!=ERROR_NOERROR) {
+      failed++;
+    }
+  }
+
+  cout << "group  cold lookups/s  disk reads  prefetched  sim ms  warm lookups/s" << endl;
+  for (SIZE_T groupsize=1; groupsize<=64; groupsize*=2) { 
+    BTreeLookupEngine engine(btree,groupsize);
+    vector<VALUE_T> values;
+    vector<ERROR_T> results;
+    SIZE_T diskreads, prefetches;
+    double start, ms, coldrate, warmrate;
+    clock_t begin;
+
+    cache.Detach();
+    cache.Attach();
+    diskreads=cache.GetNumDiskReads();
+    prefetches=cache.GetNumPrefetches();
+    start=cache.GetCurrentTime();
+    begin=clock();
+    if (engine.Lookup(keys,values,results)!=ERROR_NOERROR) { 
+      failed++;
+    }
+    coldrate=numkeys/((double)(clock()-begin)/CLOCKS_PER_SEC);
+    ms=cache.GetCurrentTime()-start;
+    diskreads=cache.GetNumDiskReads()-diskreads;
+    prefetches=cache.GetNumPrefetches()-prefetches;
+
+    // Again, with whatever the cold run left in the cache
+    begin=clock();
+    if (engine.Lookup(keys,values,results)!=ERROR_NOERROR) { 
+      failed++;
+    }
+    warmrate=numkeys/((double)(clock()-begin)/CLOCKS_PER_SEC);
+
+    cout << groupsize << "\t" << coldrate << "\t    " << diskreads << "\t" << prefetches 
+	 << "\t    " << ms << "\t" << warmrate;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  return 0;
+}
+
+
+// Inserts or replaces numkeys pairs, half of them with keys that are
+// already there, the way callers had to before Put, and with Put
+static int BenchPut(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *names[]={"insert+update","put          "};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "operation      blocks read/op  blocks written/op  sim ms" << endl;
+  for (int f=0;f<2;f++) { 
+    BTreeIndex btree(keysize,valuesize,&cache);
+    SIZE_T superblocknum, reads, writes, failed=0;
+    double start, ms;
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    // The even keys are there already
+    for (SIZE_T i=0;i<numkeys;i+=2) {
+      MakeKey(i,keysize,key);
+      MakeValue(i,valuesize,value);
+      if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    reads=cache.GetNumReads();
+    writes=cache.GetNumWrites();
+    start=cache.GetCurrentTime();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      MakeKey(i,keysize,key);
+      MakeValue(i+1,valuesize,value);
+      if (f==0) { 
+	rc=btree.Insert(key,value);
+	if (rc==ERROR_CONFLICT) { 
+	  rc=btree.Update(key,value);
+	}
+      } else {
+	rc=btree.Put(key,value);
+      }
+      if (rc!=ERROR_NOERROR) {
+	failed++;
+      }
+    }
+    ms=cache.GetCurrentTime()-start;
+    reads=cache.GetNumReads()-reads;
+    writes=cache.GetNumWrites()-writes;
+
+    cout << names[f] << "  " << (double)reads/numkeys << "\t\t  " << (double)writes/numkeys 
+	 << "\t\t     " << ms;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Builds an index in each format, deletes most of it, and compares 
+// what is left with an index of just the keys that stayed
+static int BenchDelete(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *formatnames[]={"columnar","compressed","slotted"};
+  int formats[]={BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_COMPRESSED,BTREE_FORMAT_SLOTTED};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "format      nodes  after  fresh  reads/delete  writes/delete  blocks/lookup  fresh" << endl;
+  for (int f=0;f<3;f++) { 
+    SIZE_T nodes[3], lookupreads[2], reads=0, writes=0, failed=0;
+
+    for (int fresh=0;fresh<2;fresh++) { 
+      BTreeIndex btree(keysize,valuesize,&cache);
+      SIZE_T superblocknum, allocs;
+
+      btree.SetNodeFormat(formats[f]);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      allocs=cache.GetNumAllocs()-cache.GetNumDeallocs();
+      for (SIZE_T i=0;i<numkeys;i++) {
+	if (fresh && i%10!=0) { 
+	  continue;
+	}
+	MakeKey(i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      nodes[fresh]=cache.GetNumAllocs()-cache.GetNumDeallocs()-allocs;
+
+      if (!fresh) { 
+	reads=cache.GetNumReads();
+	writes=cache.GetNumWrites();
+	for (SIZE_T i=0;i<numkeys;i++) {
+	  if (i%10==0) { 
+	    continue;
+	  }
+	  MakeKey(i,keysize,key);
+	  if (btree.Delete(key)!=ERROR_NOERROR) {
+	    failed++;
+	  }
+	}
+	reads=cache.GetNumReads()-reads;
+	writes=cache.GetNumWrites()-writes;
+	nodes[2]=cache.GetNumAllocs()-cache.GetNumDeallocs()-allocs;
+      }
+
+      lookupreads[fresh]=cache.GetNumReads();
+      for (SIZE_T i=0;i<numkeys;i+=10) {
+	MakeKey(i,keysize,key);
+	if (btree.Lookup(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      lookupreads[fresh]=cache.GetNumReads()-lookupreads[fresh];
+
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+
+    SIZE_T numdeleted=numkeys-(numkeys+9)/10, numleft=(numkeys+9)/10;
+    cout << formatnames[f] << "\t    " << nodes[0] << "\t   " << nodes[2] << "\t  " << nodes[1] 
+	 << "\t " << (double)reads/numdeleted << "\t\t" << (double)writes/numdeleted 
+	 << "\t\t" << (double)lookupreads[0]/numleft << "\t\t" << (double)lookupreads[1]/numleft;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+  }
+  return 0;
+}
+
+
+// Deletes nine in ten of numkeys keys, now and lazily, and for the
+// lazy deletes, compacts the index afterward
+static int BenchTombstone(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const char *formatnames[]={"columnar","slotted "};
+  int formats[]={BTREE_FORMAT_COLUMNAR,BTREE_FORMAT_SLOTTED};
+  const char *modenames[]={"now ","lazy"};
+  BTreeDeleteMode modes[]={BTREE_DELETE_NOW,BTREE_DELETE_LAZY};
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "format    delete  reads/delete  writes/delete  disk writes  sim ms  compact steps  sim ms  nodes  blocks/lookup" << endl;
+  for (int f=0;f<2;f++) { 
+    for (int m=0;m<2;m++) { 
+      BTreeIndex btree(keysize,valuesize,&cache);
+      SIZE_T superblocknum, allocs, reads, writes, diskwrites, lookupreads, steps=0, failed=0;
+      double start, ms, compactms=0;
+      bool done=false;
+
+      btree.SetNodeFormat(formats[f]);
+      btree.SetTombstones(true);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      allocs=cache.GetNumAllocs()-cache.GetNumDeallocs();
+      for (SIZE_T i=0;i<numkeys;i++) {
+	MakeKey(i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+
+      reads=cache.GetNumReads();
+      writes=cache.GetNumWrites();
+      diskwrites=cache.GetNumDiskWrites();
+      start=cache.GetCurrentTime();
+      for (SIZE_T i=0;i<numkeys;i++) {
+	if (i%10==0) { 
+	  continue;
+	}
+	MakeKey(i,keysize,key);
+	if (btree.Delete(key,modes[m])!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      ms=cache.GetCurrentTime()-start;
+      reads=cache.GetNumReads()-reads;
+      writes=cache.GetNumWrites()-writes;
+      diskwrites=cache.GetNumDiskWrites()-diskwrites;
+
+      if (modes[m]==BTREE_DELETE_LAZY) { 
+	start=cache.GetCurrentTime();
+	while (!done) { 
+	  if (btree.Compact(done)!=ERROR_NOERROR) { 
+	    failed++;
+	    break;
+	  }
+	  steps++;
+	}
+	compactms=cache.GetCurrentTime()-start;
+      }
+
+      lookupreads=cache.GetNumReads();
+      for (SIZE_T i=0;i<numkeys;i+=10) {
+	MakeKey(i,keysize,key);
+	if (btree.Lookup(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      lookupreads=cache.GetNumReads()-lookupreads;
+
+      SIZE_T numdeleted=numkeys-(numkeys+9)/10, numleft=(numkeys+9)/10;
+      cout << formatnames[f] << "  " << modenames[m] << "\t    " << (double)reads/numdeleted 
+	   << "\t\t" << (double)writes/numdeleted << "\t\t" << diskwrites << "\t     " << ms
+	   << "\t" << steps << "\t\t" << compactms 
+	   << "\t" << cache.GetNumAllocs()-cache.GetNumDeallocs()-allocs
+	   << "\t" << (double)lookupreads/numleft;
+      if (failed) { 
+	cout << "  (" << failed << " failed operations)";
+      }
+      cout << endl;
+
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Deletes a range of keys, a tenth, a quarter and a half of numkeys
+// of them, one key at a time and with DeleteRange
+static int BenchRange(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T fractions[]={10,4,2};
+  KEY_T key, lo, hi;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "keys     delete  disk reads  disk writes  sim ms  nodes freed" << endl;
+  for (int r=0;r<3;r++) { 
+    for (int whole=0;whole<2;whole++) { 
+      BTreeIndex btree(keysize,valuesize,&cache);
+      SIZE_T superblocknum, allocs, reads, writes, failed=0;
+      double start, ms;
+
+      btree.SetNodeFormat(BTREE_FORMAT_COLUMNAR);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      // Keys that sort as i does, so that a range of them is a run of i
+      for (SIZE_T i=0;i<numkeys;i++) {
+	MakeShiftKey(i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      // From a cold cache
+      cache.Detach();
+      cache.Attach();
+      allocs=cache.GetNumAllocs()-cache.GetNumDeallocs();
+
+      SIZE_T count=numkeys/fractions[r], first=(numkeys-count)/2;
+      reads=cache.GetNumDiskReads();
+      writes=cache.GetNumDiskWrites();
+      start=cache.GetCurrentTime();
+      if (whole) { 
+	MakeShiftKey(first,keysize,lo);
+	MakeShiftKey(first+count-1,keysize,hi);
+	if (btree.DeleteRange(lo,hi)!=ERROR_NOERROR) { 
+	  failed++;
+	}
+      } else {
+	for (SIZE_T i=first;i<first+count;i++) {
+	  MakeShiftKey(i,keysize,key);
+	  if (btree.Delete(key)!=ERROR_NOERROR) {
+	    failed++;
+	  }
+	}
+      }
+      // Until everything it wrote is home
+      cache.Detach();
+      ms=cache.GetCurrentTime()-start;
+      reads=cache.GetNumDiskReads()-reads;
+      writes=cache.GetNumDiskWrites()-writes;
+      cache.Attach();
+
+      for (SIZE_T i=0;i<numkeys;i+=97) {
+	MakeShiftKey(i,keysize,key);
+	if ((btree.Lookup(key,value)==ERROR_NOERROR) != (i<first || i>=first+count)) {
+	  failed++;
+	}
+      }
+
+      cout << count << "\t " << (whole ? "range" : "each ") << "\t " << reads << "\t     " << writes 
+	   << "\t  " << ms << "\t" << allocs-(cache.GetNumAllocs()-cache.GetNumDeallocs());
+      if (failed) { 
+	cout << "  (" << failed << " failed operations)";
+      }
+      cout << endl;
+
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// numkeys pairs of a secondary index, in which keys have several values
+// each, in a non-unique index and in a unique one of key and value 
+// concatenated
+static int BenchPostings(BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T fanouts[]={4,32,256};
+  const char *names[]={"non-unique","uniquifier"};
+  const SIZE_T numsamples=50;
+  KEY_T key, low, high;
+  VALUE_T value, none;
+  ERROR_T rc;
+
+  cout << "values/key  index       nodes  reads/insert  writes/insert  sim ms  reads/key  values/key read" << endl;
+  for (int f=0;f<3;f++) { 
+    for (int u=0;u<2;u++) { 
+      const SIZE_T numgroups=(numkeys+fanouts[f]-1)/fanouts[f];
+      BTreeIndex btree(u ? keysize+valuesize : keysize,valuesize,&cache,u==1);
+      SIZE_T superblocknum, allocs, reads, writes, enumreads, numread=0, failed=0;
+      double start, ms;
+
+      btree.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+      btree.SetLogSize(0);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      allocs=cache.GetNumAllocs()-cache.GetNumDeallocs();
+      reads=cache.GetNumDiskReads();
+      writes=cache.GetNumDiskWrites();
+      start=cache.GetCurrentTime();
+      // Round robin over the keys, so that the values of each arrive
+      // spread out, as rows of a table would
+      for (SIZE_T j=0;j<numkeys;j++) {
+	SIZE_T i=(j%numgroups)*fanouts[f]+j/numgroups;
+	if (i>=numkeys) { 
+	  continue;
+	}
+	MakeKey(i/fanouts[f],keysize,key);
+	MakeShiftKey(i,valuesize,value);
+	if (u) { 
+	  key.Resize(keysize+valuesize);
+	  memcpy(key.data+keysize,value.data,valuesize);
+	  rc=btree.Insert(key,none);
+	} else {
+	  rc=btree.Insert(key,value);
+	}
+	if (rc!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      cache.Detach();
+      ms=cache.GetCurrentTime()-start;
+      reads=cache.GetNumDiskReads()-reads;
+      writes=cache.GetNumDiskWrites()-writes;
+      cache.Attach();
+      allocs=cache.GetNumAllocs()-cache.GetNumDeallocs()-allocs;
+
+      // All the values of a key, each from a cold cache
+      enumreads=0;
+      for (SIZE_T s=0;s<numsamples;s++) { 
+	MakeKey((s*numgroups)/numsamples,keysize,key);
+	cache.Detach();
+	cache.Attach();
+	enumreads-=cache.GetNumDiskReads();
+	if (u) { 
+	  BTreeCursor cursor;
+	  low=key;
+	  low.Resize(keysize+valuesize);
+	  high=low;
+	  memset(low.data+keysize,0,valuesize);
+	  memset(high.data+keysize,0xff,valuesize);
+	  for (rc=btree.SeekRange(low,high,cursor); rc==ERROR_NOERROR && cursor.IsValid(); rc=cursor.Next()) {
+	    numread++;
+	  }
+	} else {
+	  BTreeValueCursor values;
+	  for (rc=btree.SeekValues(key,values); rc==ERROR_NOERROR && values.IsValid(); rc=values.Next()) {
+	    numread++;
+	  }
+	}
+	if (rc!=ERROR_NOERROR) { 
+	  failed++;
+	}
+	enumreads+=cache.GetNumDiskReads();
+      }
+
+      cout << fanouts[f] << "\t    " << names[u] << "  " << allocs << "\t " << (double)reads/numkeys 
+	   << "\t       " << (double)writes/numkeys << "\t      " << ms << "\t" 
+	   << (double)enumreads/numsamples << "\t  " << (double)numread/numsamples;
+      if (failed) { 
+	cout << "  (" << failed << " failed operations)";
+      }
+      cout << endl;
+
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// The index and the key of each lookup, the same for both layouts
+static void MakeCatalogLookups(const SIZE_T numindexes, const SIZE_T keysper, 
+			       const SIZE_T numlookups, const bool skewed,
+			       vector<pair<SIZE_T,SIZE_T> > &lookups)
+{
+  srand(1);
+  lookups.clear();
+  for (SIZE_T i=0;i<numlookups;i++) { 
+    SIZE_T which=rand()%numindexes;
+    // Seven in ten go to the first index
+    if (skewed) { 
+      which = rand()%10<7 ? 0 : 1+rand()%(numindexes-1);
+    }
+    lookups.push_back(make_pair(which,(SIZE_T)rand()%keysper));
+  }
+}
+
+
+// Indexes with a cache each, one after another on the whole disk,
+// against the same indexes in a catalog on one cache
+static int BenchCatalog(DiskSystem &disk, BufferCache &cache, const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T numindexes=4;
+  const SIZE_T keysper=numkeys/numindexes;
+  const char *workloads[]={"even  ","skewed"};
+  vector<pair<SIZE_T,SIZE_T> > lookups;
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  cout << "lookups  layout       reads/lookup  sim ms" << endl;
+  for (int w=0;w<2;w++) { 
+    MakeCatalogLookups(numindexes,keysper,numkeys,w==1,lookups);
+
+    // A quarter of the cache for each index
+    SIZE_T reads=0, failed=0;
+    double ms=0;
+    for (SIZE_T n=0;n<numindexes;n++) { 
+      BufferCache part(&disk,cache.GetCacheSize()/numindexes);
+      BTreeIndex btree(keysize,valuesize,&part);
+      SIZE_T superblocknum;
+      double start;
+
+      part.Attach();
+      btree.SetLogSize(0);
+      if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+	cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+	return -1;
+      }
+      for (SIZE_T i=0;i<keysper;i++) {
+	MakeKey(i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (btree.Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+      part.Detach();
+      part.Attach();
+      reads-=part.GetNumDiskReads();
+      start=part.GetCurrentTime();
+      for (SIZE_T i=0;i<lookups.size();i++) { 
+	if (lookups[i].first!=n) { 
+	  continue;
+	}
+	MakeKey(lookups[i].second,keysize,key);
+	if (btree.Lookup(key,value)!=ERROR_NOERROR) { 
+	  failed++;
+	}
+      }
+      reads+=part.GetNumDiskReads();
+      ms+=part.GetCurrentTime()-start;
+      if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+    cout << workloads[w] << "   partitioned  " << (double)reads/lookups.size() << "\t\t" << ms;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    // All of them in one catalog, on the whole cache
+    BTreeCatalog catalog(&cache);
+    vector<BTreeIndex> indexes(numindexes,BTreeIndex(keysize,valuesize,&cache));
+    double start;
+
+    failed=0;
+    cache.Detach();
+    cache.Attach();
+    catalog.SetLogSize(0);
+    if ((rc=catalog.Attach(true))!=ERROR_NOERROR) {
+      cerr << "Can't attach to catalog with creation due to error "<<rc<<endl;
+      return -1;
+    }
+    for (SIZE_T n=0;n<numindexes;n++) { 
+      string name="index"+to_string(n);
+      if ((rc=catalog.Create(name,indexes[n]))!=ERROR_NOERROR) {
+	cerr << "Can't create index due to error "<<rc<<endl;
+	return -1;
+      }
+      for (SIZE_T i=0;i<keysper;i++) {
+	MakeKey(i,keysize,key);
+	MakeValue(i,valuesize,value);
+	if (indexes[n].Insert(key,value)!=ERROR_NOERROR) {
+	  failed++;
+	}
+      }
+    }
+    cache.Detach();
+    cache.Attach();
+    reads=cache.GetNumDiskReads();
+    start=cache.GetCurrentTime();
+    for (SIZE_T i=0;i<lookups.size();i++) { 
+      MakeKey(lookups[i].second,keysize,key);
+      if (indexes[lookups[i].first].Lookup(key,value)!=ERROR_NOERROR) { 
+	failed++;
+      }
+    }
+    reads=cache.GetNumDiskReads()-reads;
+    ms=cache.GetCurrentTime()-start;
+    cout << workloads[w] << "   shared       " << (double)reads/lookups.size() << "\t\t" << ms;
+    if (failed) { 
+      cout << "  (" << failed << " failed operations)";
+    }
+    cout << endl;
+
+    for (SIZE_T n=0;n<numindexes;n++) { 
+      SIZE_T superblocknum;
+      if ((rc=indexes[n].Detach(superblocknum))!=ERROR_NOERROR) {
+	cerr <<"Can't detach from index due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+    if ((rc=catalog.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from catalog due to error "<<rc<<endl;
+      return -1;
+    }
+    // so that none of it is left for the next caches to go stale on
+    cache.Detach();
+    cache.Attach();
+  }
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, keysize, valuesize, numkeys;
+  SIZE_T superblocknum;
+  string bench;
+
+  if (argc!=7) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  keysize=atoi(argv[3]);
+  valuesize=atoi(argv[4]);
+  numkeys=atoi(argv[5]);
+  bench=argv[6];
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache);
+
+  ERROR_T rc;
+  int ret;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if (bench=="compress" || bench=="varlen" || bench=="overflow" || bench=="scan" || bench=="bulk" ||
+      bench=="batch" || bench=="multiget" || bench=="interleave" ||
+      bench=="put" || bench=="delete" || bench=="tombstone" || bench=="range" || 
+      bench=="postings" || bench=="catalog") { 
+    // These make their own indexes
+    ret = bench=="compress" ? BenchCompress(cache,keysize,valuesize,numkeys) :
+      bench=="varlen" ? BenchVarlen(cache,keysize,valuesize,numkeys) :
+      bench=="overflow" ? BenchOverflow(cache,keysize,valuesize,numkeys) :
+      bench=="scan" ? BenchScan(cache,keysize,valuesize,numkeys) :
+      bench=="bulk" ? BenchBulk(cache,keysize,valuesize,numkeys) :
+      bench=="batch" ? BenchBatch(cache,keysize,valuesize,numkeys) :
+      bench=="multiget" ? BenchMultiget(cache,keysize,valuesize,numkeys) :
+      bench=="interleave" ? BenchInterleave(cache,keysize,valuesize,numkeys) :
+      bench=="put" ? BenchPut(cache,keysize,valuesize,numkeys) :
+      bench=="delete" ? BenchDelete(cache,keysize,valuesize,numkeys) :
+      bench=="tombstone" ? BenchTombstone(cache,keysize,valuesize,numkeys) :
+      bench=="range" ? BenchRange(cache,keysize,valuesize,numkeys) :
+      bench=="postings" ? BenchPostings(cache,keysize,valuesize,numkeys) :
+      BenchCatalog(disk,cache,keysize,valuesize,numkeys);
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    return ret;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (bench=="allocs") {
+    ret=BenchAllocs(btree,keysize,valuesize,numkeys);
+  } else if (bench=="search") {
+    ret=BenchSearch(keysize,valuesize,numkeys);
+  } else if (bench=="view") {
+    ret=BenchView(keysize,valuesize,numkeys);
+  } else if (bench=="shift") {
+    ret=BenchShift(keysize,valuesize,numkeys);
+  } else {
+    usage();
+    ret=-1;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  return ret;
+}
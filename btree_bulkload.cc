@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+#include "externalsort.h"
+
+void usage()
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fillfactor] < pairs\n";
+  cerr << "       btree_bulkload filestem cachesize fillfactor records scratchstem memory threads\n";
+  cerr << "  pairs       one \"key value\" per line, in any order, sorted in memory\n";
+  cerr << "  fillfactor  how full to make each node, in percent (default "<<BTREE_BULKLOAD_FILL<<")\n";
+  cerr << "  records     a file of records, each keysize bytes of key and then\n";
+  cerr << "              valuesize bytes of value, in any order.  They are sorted\n";
+  cerr << "              with an external merge sort, with runs on the disk\n";
+  cerr << "              scratchstem, using memory bytes and threads threads.\n";
+  cerr << "  The index must be empty, as btree_init leaves it.\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T fillfactor=BTREE_BULKLOAD_FILL;
+  SIZE_T superblocknum;
+
+  if (argc!=3 && argc!=4 && argc!=8) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc>=4) {
+    fillfactor=atoi(argv[3]);
+  }
+
+  vector<KeyValuePair> pairs;
+  string key, value;
+
+  if (argc!=8) {
+    while (cin >> key >> value) {
+      pairs.push_back(KeyValuePair(KEY_T(key.c_str()),VALUE_T(value.c_str())));
+    }
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if (argc!=8) {
+      if ((rc=btree.BulkLoad(pairs,fillfactor))!=ERROR_NOERROR) {
+	cerr <<"Can't bulk load index due to error "<<rc<<endl;
+      } else {
+	cerr <<"Bulk load of "<<pairs.size()<<" pairs succeeded\n";
+      }
+    } else {
+      FILE *records=fopen(argv[4],"rb");
+      DiskSystem scratchdisk(argv[5]);
+      BufferCache scratch(&scratchdisk,1);
+      ExternalSort sorter(&scratch,btree.GetKeySize(),btree.GetValueSize(),atoi(argv[6]),atoi(argv[7]));
+
+      if (!records) {
+	cerr <<"Can't open "<<argv[4]<<endl;
+	rc=ERROR_NOFILE;
+      } else if ((rc=scratch.Attach())!=ERROR_NOERROR) {
+	cerr <<"Can't attach scratch disk due to error "<<rc<<endl;
+      } else if ((rc=sorter.Sort(records))!=ERROR_NOERROR) {
+	cerr <<"Can't sort records due to error "<<rc<<endl;
+      } else if ((rc=btree.BulkLoad(sorter,fillfactor))!=ERROR_NOERROR) {
+	cerr <<"Can't bulk load index due to error "<<rc<<endl;
+      } else {
+	cerr <<"Bulk load of "<<sorter.GetNumRecords()<<" records succeeded\n";
+      }
+      if (records) {
+	fclose(records);
+      }
+      cerr << "Sort statistics:\n";
+      cerr << "numrecords      = "<<sorter.GetNumRecords()<<endl;
+      cerr << "numruns         = "<<sorter.GetNumInitialRuns()<<endl;
+      cerr << "nummergepasses  = "<<sorter.GetNumMergePasses()<<endl;
+      cerr << "numdiskreads    = "<<scratch.GetNumDiskReads()<<endl;
+      cerr << "numdiskwrites   = "<<scratch.GetNumDiskWrites()<<endl;
+      cerr << "sort time       = "<<scratch.GetCurrentTime()<<endl;
+      cerr << endl;
+      scratch.Detach();
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
+
+
+
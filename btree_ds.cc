@@ -5,11 +5,206 @@
 
 #include "btree_ds.h"
 #include "buffercache.h"
+#include "keysearch.h"
 
 #include "btree.h"
 
 using namespace std;
 
+// The front of a BTREE_FORMAT_SLOTTED node
+struct SlottedHeader {
+  SIZE_T ptr;      // the first pointer, or a leaf's one pointer
+  SIZE_T heapused; // bytes from the end of the node to the start of the heap
+};
+
+// Where a key or value of a slotted node is in its heap
+struct HeapRef {
+  unsigned short offset;  // in the data area
+  unsigned short length;  // with HEAPREF_OVERFLOW set if this is
+                          // the OverflowRef of a value
+};
+
+#define HEAPREF_OVERFLOW 0x8000
+// Set in the key of a dead pair
+#define HEAPREF_TOMBSTONE 0x4000
+
+static SIZE_T Length(const HeapRef &ref)
+{
+  return ref.length & ~(HEAPREF_OVERFLOW|HEAPREF_TOMBSTONE);
+}
+
+// Slot i of a BTREE_FORMAT_SLOTTED interior node
+struct InteriorSlot {
+  SIZE_T ptr;   // pointer i+1
+  HeapRef key;  // key i
+};
+
+// Slot i of a BTREE_FORMAT_SLOTTED leaf
+struct LeafSlot {
+  HeapRef key;
+  HeapRef value;
+};
+
+
+static InteriorSlot *Slots(const BTreeNode &b)
+{
+  return (InteriorSlot *)(b.data+sizeof(SlottedHeader));
+}
+
+static LeafSlot *LeafSlots(const BTreeNode &b)
+{
+  return (LeafSlot *)(b.data+sizeof(SlottedHeader));
+}
+
+static SlottedHeader *Header(const BTreeNode &b)
+{
+  return (SlottedHeader *)b.data;
+}
+
+// Bytes a pair of a slotted leaf takes, slot and all
+static int PairBytes(const LeafSlot &slot)
+{
+  return Length(slot.key)+Length(slot.value)+sizeof(LeafSlot);
+}
+
+static SIZE_T SlotSize(const NodeMetadata &info)
+{
+  return info.nodetype==BTREE_LEAF_NODE ? sizeof(LeafSlot) : sizeof(InteriorSlot);
+}
+
+static HeapRef &KeyRef(const BTreeNode &b, const SIZE_T offset)
+{
+  return b.info.nodetype==BTREE_LEAF_NODE ? LeafSlots(b)[offset].key : Slots(b)[offset].key;
+}
+
+// Bytes between the slots and the heap of a slotted node, were it
+// to have numslots slots
+static int HeapFree(const BTreeNode &b, const SIZE_T numslots)
+{
+  return (int)b.info.GetNumDataBytes()-(int)Header(b)->heapused
+    -(int)sizeof(SlottedHeader)-(int)(numslots*SlotSize(b.info));
+}
+
+// Bytes in the heap of a slotted node that no key or value uses
+static int HeapHoles(const BTreeNode &b)
+{
+  SIZE_T used=0;
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    used+=Length(KeyRef(b,i));
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      used+=Length(LeafSlots(b)[i].value);
+    }
+  }
+  return (int)Header(b)->heapused-(int)used;
+}
+
+// Takes length bytes from the heap of a slotted node, leaving room 
+// for numslots slots, or gives back 0 if they are not there
+static char *AllocateHeap(BTreeNode &b, const SIZE_T length, const SIZE_T numslots)
+{
+  if (HeapFree(b,numslots)<(int)length) { 
+    b.CompactHeap();
+    if (HeapFree(b,numslots)<(int)length) { 
+      return 0;
+    }
+  }
+  Header(b)->heapused+=length;
+  return b.data+b.info.GetNumDataBytes()-Header(b)->heapused;
+}
+
+// Puts length bytes at ref, where they were if they fit there, and 
+// in new heap space if not
+static ERROR_T PutInHeap(BTreeNode &b, HeapRef &ref, const BYTE_T *bytes, const SIZE_T length)
+{
+  char *p = length<=Length(ref) ? b.data+ref.offset : AllocateHeap(b,length,b.info.numkeys);
+
+  if (p==0) { 
+    return ERROR_NOSPACE;
+  }
+  memcpy(p,bytes,length);
+  ref.offset=p-b.data;
+  ref.length=length;
+  return ERROR_NOERROR;
+}
+
+
+// The tombstone bytes of a leaf that has them, and is not slotted,
+// or 0.  They are the last bytes of the node, one per slot.
+static char *Tombstones(const BTreeNode &b)
+{
+  if (b.info.nodetype!=BTREE_LEAF_NODE || !b.info.tombstones || b.info.IsSlotted()) { 
+    return 0;
+  }
+  return b.data+b.info.GetNumDataBytes()-b.info.GetNumSlotsAsLeaf();
+}
+
+
+// One of the arrays the slots of a node are kept in.  Slot i's part
+// of it is the width bytes at base+i*width.
+struct SlotColumn {
+  char  *base;
+  SIZE_T width;
+};
+
+// The arrays a node keeps its slots in, where slot i is key i and 
+// value i of a leaf, or key i and pointer i+1 of an interior node.
+// Each slot is one piece of a slotted or interleaved node, and the
+// columnar formats spread it over a piece of each of their arrays.
+// Tombstone bytes are one more array.
+static int SlotColumns(const BTreeNode &b, SlotColumn cols[4])
+{
+  const NodeMetadata &info=b.info;
+  const bool leaf=info.nodetype==BTREE_LEAF_NODE;
+  const SIZE_T other = leaf ? info.GetNumValueBytes() : sizeof(SIZE_T);
+  const SIZE_T slots=info.GetNumSlots();
+  char *p=b.data;
+  int n=0;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    cols[0].base=p+sizeof(SlottedHeader);
+    cols[0].width=SlotSize(info);
+    return 1;
+  }
+  if (Tombstones(b)) { 
+    cols[n].base=Tombstones(b);
+    cols[n++].width=1;
+  }
+  if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+    // Pointer 0 comes first, so key i is right before pointer i+1
+    cols[n].base=p+sizeof(SIZE_T);
+    cols[n++].width=info.keysize+other;
+    return n;
+  }
+  p+=info.GetNumCommonPrefixBytes();
+  if (info.GetNumPrefixBytes()>0) { 
+    cols[n].base=p;
+    cols[n++].width=info.GetNumPrefixBytes();
+    p+=slots*info.GetNumPrefixBytes();
+  }
+  cols[n].base=p;
+  cols[n++].width=info.GetNumKeyBytes();
+  p+=slots*info.GetNumKeyBytes();
+  cols[n].base = leaf ? p : p+sizeof(SIZE_T);
+  cols[n++].width=other;
+  return n;
+}
+
+// Copies a key or value from the heap of one slotted node into new
+// heap space in another
+static ERROR_T CopyToHeap(const BTreeNode &from, const HeapRef &src, BTreeNode &to, HeapRef &dst)
+{
+  char *p=AllocateHeap(to,Length(src),to.info.numkeys);
+
+  if (p==0) { 
+    return ERROR_NOSPACE;
+  }
+  memcpy(p,from.data+src.offset,Length(src));
+  dst.offset=p-to.data;
+  dst.length=src.length;
+  return ERROR_NOERROR;
+}
+
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
@@ -17,14 +212,69 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 }
 
 
+SIZE_T NodeMetadata::GetNumPrefixBytes() const
+{
+  return format==BTREE_FORMAT_COLUMNAR_PREFIX ? sizeof(KEYPREFIX_T) : 0;
+}
+
+
+SIZE_T NodeMetadata::GetNumCommonPrefixBytes() const
+{
+  return format==BTREE_FORMAT_COMPRESSED ? prefixlen : 0;
+}
+
+
+SIZE_T NodeMetadata::GetNumKeyBytes() const
+{
+  return keysize-GetNumCommonPrefixBytes();
+}
+
+
+bool NodeMetadata::HasOverflowValues() const
+{
+  // A posting list can always outgrow a leaf
+  return overflowsize>0 && (valuesize>overflowsize || duplicates);
+}
+
+
+SIZE_T NodeMetadata::GetNumValueBytes() const
+{
+  if (!HasOverflowValues()) { 
+    return valuesize;
+  }
+  if (format==BTREE_FORMAT_SLOTTED && overflowsize>sizeof(OverflowRef)) { 
+    // The longest value that stays in
+    return overflowsize;
+  }
+  return sizeof(OverflowRef);
+}
+
+
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  if (format==BTREE_FORMAT_SLOTTED) { 
+    return (GetNumDataBytes()-sizeof(SlottedHeader))/(sizeof(InteriorSlot)+keysize);
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-GetNumCommonPrefixBytes())/(GetNumPrefixBytes()+GetNumKeyBytes()+sizeof(SIZE_T));  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  if (format==BTREE_FORMAT_SLOTTED) { 
+    return (GetNumDataBytes()-sizeof(SlottedHeader))/(sizeof(LeafSlot)+keysize+GetNumValueBytes());
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-GetNumCommonPrefixBytes())/(GetNumPrefixBytes()+GetNumKeyBytes()+GetNumValueBytes()+(tombstones ? 1 : 0));  // floor intended
+}
+
+SIZE_T NodeMetadata::GetNumSlots() const
+{
+  return nodetype==BTREE_LEAF_NODE ? GetNumSlotsAsLeaf() : GetNumSlotsAsInterior();
+}
+
+
+bool NodeMetadata::IsSlotted() const
+{
+  return format==BTREE_FORMAT_SLOTTED;
 }
 
 
@@ -34,15 +284,48 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : 
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys
+     << ", logstart="<<logstart<<", lognumblocks="<<lognumblocks
+     << ", format="<<(format==BTREE_FORMAT_INTERLEAVED ? "INTERLEAVED" :
+		       format==BTREE_FORMAT_COLUMNAR ? "COLUMNAR" :
+		       format==BTREE_FORMAT_COLUMNAR_PREFIX ? "COLUMNAR_PREFIX" : 
+		       format==BTREE_FORMAT_COMPRESSED ? "COMPRESSED" : 
+		       format==BTREE_FORMAT_SLOTTED ? "SLOTTED" : "UNKNOWN_FORMAT");
+  if (format==BTREE_FORMAT_COMPRESSED) { 
+    os << ", prefixlen="<<prefixlen;
+  }
+  if (overflowsize>0) { 
+    os << ", overflowsize="<<overflowsize;
+  }
+  if (nodetype==BTREE_LEAF_NODE) { 
+    os << ", prevleaf="<<prevleaf;
+  }
+  if (tombstones) { 
+    os << ", tombstones";
+  }
+  if (duplicates) { 
+    os << ", duplicates";
+  }
+  if (nodetype==BTREE_SUPERBLOCK) { 
+    os << ", version="<<hex<<version<<dec;
+  }
+  os << ")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.format=BTREE_FORMAT_INTERLEAVED;
+  info.prefixlen=0;
+  info.overflowsize=0;
+  info.prevleaf=0;
+  info.tombstones=0;
+  info.duplicates=0;
+  info.version=BTREE_LAYOUT_VERSION;
   data=0;
 }
 
@@ -56,7 +339,7 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, int format, SIZE_T overflow_size, bool tombstones, bool duplicates)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
@@ -65,6 +348,15 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.logstart=0;
+  info.lognumblocks=0;
+  info.format=format;
+  info.prefixlen=0;
+  info.overflowsize=overflow_size;
+  info.prevleaf=0;
+  info.tombstones=tombstones;
+  info.duplicates=duplicates;
+  info.version=BTREE_LAYOUT_VERSION;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -81,6 +373,15 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.logstart=rhs.info.logstart;
+  info.lognumblocks=rhs.info.lognumblocks;
+  info.format=rhs.info.format;
+  info.prefixlen=rhs.info.prefixlen;
+  info.overflowsize=rhs.info.overflowsize;
+  info.prevleaf=rhs.info.prevleaf;
+  info.tombstones=rhs.info.tombstones;
+  info.duplicates=rhs.info.duplicates;
+  info.version=rhs.info.version;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -89,9 +390,47 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
 }
 
 
+BTreeNode::BTreeNode(BTreeNode &&rhs) : info(rhs.info), data(rhs.data)
+{
+  rhs.data=0;
+  rhs.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+}
+
+
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this==&rhs) { 
+    return *this;
+  }
+  if (rhs.data) { 
+    if (!data || info.GetNumDataBytes()!=rhs.info.GetNumDataBytes()) { 
+      if (data) { 
+	delete [] data;
+      }
+      data=new char [rhs.info.GetNumDataBytes()];
+    }
+    memcpy(data,rhs.data,rhs.info.GetNumDataBytes());
+  } else if (data) { 
+    delete [] data;
+    data=0;
+  }
+  info=rhs.info;
+  return *this;
+}
+
+
+BTreeNode & BTreeNode::operator=(BTreeNode &&rhs) 
+{
+  if (this!=&rhs) { 
+    if (data) { 
+      delete [] data;
+    }
+    info=rhs.info;
+    data=rhs.data;
+    rhs.data=0;
+    rhs.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  }
+  return *this;
 }
 
 
@@ -112,28 +451,35 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
+  const Block *cached;
 
   ERROR_T rc;
 
-  rc=b->ReadBlock(blocknum,block);
+  rc=b->ReadBlockInPlace(blocknum,cached);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
+  const Block &block=*cached;
+
+  SIZE_T oldbytes = data ? info.GetNumDataBytes() : 0;
+
   memcpy(&info,block.data,sizeof(info));
   
-  if (data) { 
-    delete [] data;
-    data=0;
-  }
-
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
+    if (!data || oldbytes!=info.GetNumDataBytes()) { 
+      if (data) { 
+	delete [] data;
+      }
+      data = new char [info.GetNumDataBytes()];
+    }
     memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+  } else if (data) { 
+    delete [] data;
+    data=0;
   }
   
   return ERROR_NOERROR;
@@ -146,11 +492,27 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+      return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    } else if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return data+Slots(*this)[offset].key.offset;
+    } else if (info.format==BTREE_FORMAT_COLUMNAR) { 
+      return data+offset*info.keysize;
+    } else {
+      return data+info.GetNumCommonPrefixBytes()+info.GetNumSlotsAsInterior()*info.GetNumPrefixBytes()+offset*info.GetNumKeyBytes();
+    }
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+      return data+sizeof(SIZE_T)+offset*(info.keysize+info.GetNumValueBytes());
+    } else if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return data+LeafSlots(*this)[offset].key.offset;
+    } else if (info.format==BTREE_FORMAT_COLUMNAR) { 
+      return data+offset*info.keysize;
+    } else {
+      return data+info.GetNumCommonPrefixBytes()+info.GetNumSlotsAsLeaf()*info.GetNumPrefixBytes()+offset*info.GetNumKeyBytes();
+    }
     break;
   default:
     return 0;
@@ -164,11 +526,26 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+      return data+offset*(sizeof(SIZE_T)+info.keysize);
+    } else if (info.format==BTREE_FORMAT_SLOTTED) { 
+      if (offset==0) { 
+	return (char *)&Header(*this)->ptr;
+      }
+      return (char *)&Slots(*this)[offset-1].ptr;
+    } else {
+      return data+info.GetNumCommonPrefixBytes()+info.GetNumSlotsAsInterior()*(info.GetNumPrefixBytes()+info.GetNumKeyBytes())+offset*sizeof(SIZE_T);
+    }
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
-    return data;
+    if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+      return data;
+    } else if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return (char *)&Header(*this)->ptr;
+    } else {
+      return data+info.GetNumCommonPrefixBytes()+info.GetNumSlotsAsLeaf()*(info.GetNumPrefixBytes()+info.GetNumKeyBytes()+info.GetNumValueBytes());
+    }
     break;
   default:
     return 0;
@@ -182,7 +559,31 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info.format==BTREE_FORMAT_INTERLEAVED) { 
+      return data+sizeof(SIZE_T)+offset*(info.keysize+info.GetNumValueBytes())+info.keysize;
+    } else if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return data+LeafSlots(*this)[offset].value.offset;
+    } else {
+      return data+info.GetNumCommonPrefixBytes()+info.GetNumSlotsAsLeaf()*(info.GetNumPrefixBytes()+info.GetNumKeyBytes())+offset*info.GetNumValueBytes();
+    }
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+char * BTreeNode::ResolvePrefix(const SIZE_T offset) const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    assert(offset<info.numkeys);
+    if (info.format==BTREE_FORMAT_COLUMNAR_PREFIX) { 
+      return data+offset*sizeof(KEYPREFIX_T);
+    } 
+    return 0;
     break;
   default:
     return 0;
@@ -204,8 +605,12 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  SIZE_T common=info.GetNumCommonPrefixBytes();
+  SIZE_T length=GetKeyLength(offset);
+
+  k.Resize(length,false);
+  memcpy(k.data,data,common);
+  memcpy(k.data+common,p,length-common);
   return ERROR_NOERROR;
 }
 
@@ -229,8 +634,10 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T length=GetValLength(offset);
+
+  v.Resize(length,false);
+  memcpy(v.data,p,length);
   return ERROR_NOERROR;
 }
 
@@ -247,20 +654,852 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
+// memcmp of a, alen bytes long, and b, blen bytes long, where a
+// prefix of the other is the smaller
+static int CompareBytes(const BYTE_T *a, const SIZE_T alen, const char *b, const SIZE_T blen)
+{
+  int c=memcmp(a,b,alen<blen ? alen : blen);
+
+  if (c!=0) { 
+    return c;
+  }
+  return alen<blen ? -1 : alen>blen ? 1 : 0;
+}
+
+
+int BTreeNode::CompareKey(const KEY_T &k, const SIZE_T offset) const
+{
+  const char *p=ResolveKey(offset);
+  SIZE_T common=info.GetNumCommonPrefixBytes();
+
+  if (common>0) { 
+    int c=CompareCommonPrefix(k);
+    if (c!=0) { 
+      return c;
+    }
+  }
+  return CompareBytes(k.data+common,k.length-common,p,GetKeyLength(offset)-common);
+}
+
+
+int BTreeNode::CompareKey(const KEY_T &k, const KEYPREFIX_T prefix, const SIZE_T offset) const
+{
+  if (info.IsSlotted()) { 
+    const HeapRef &ref=KeyRef(*this,offset);
+    return CompareBytes(k.data,k.length,data+ref.offset,Length(ref));
+  }
+  if (info.format==BTREE_FORMAT_COMPRESSED && k.length==info.keysize) { 
+    return memcmp(k.data+info.prefixlen,ResolveKey(offset),info.keysize-info.prefixlen);
+  }
+  if (info.format!=BTREE_FORMAT_COLUMNAR_PREFIX || k.length!=info.keysize) { 
+    return CompareKey(k,offset);
+  }
+
+  KEYPREFIX_T x;
+  memcpy(&x,ResolvePrefix(offset),sizeof(x));
+
+  if (prefix!=x) { 
+    return prefix<x ? -1 : 1;
+  }
+  if (info.keysize<=sizeof(KEYPREFIX_T)) { 
+    // The prefix is the whole key
+    return 0;
+  }
+  return memcmp(k.data+sizeof(KEYPREFIX_T),
+		ResolveKey(offset)+sizeof(KEYPREFIX_T),
+		info.keysize-sizeof(KEYPREFIX_T));
+}
+
+
+int BTreeNode::CompareCommonPrefix(const KEY_T &k) const
+{
+  SIZE_T common=info.GetNumCommonPrefixBytes();
+
+  if (k.length<common) { 
+    return CompareBytes(k.data,k.length,data,common);
+  }
+  return memcmp(k.data,data,common);
+}
+
+
+// Number of leading bytes a and b share, up to n
+static SIZE_T SharedBytes(const BYTE_T *a, const char *b, const SIZE_T n)
+{
+  SIZE_T i;
+  for (i=0; i<n && a[i]==(BYTE_T)b[i]; i++) {}
+  return i;
+}
+
+
+SIZE_T BTreeNode::CommonPrefixLengthWith(const KEY_T &k) const
+{
+  if (info.format!=BTREE_FORMAT_COMPRESSED) { 
+    return 0;
+  }
+
+  // Every suffix keeps at least a byte
+  SIZE_T len = info.keysize-1;
+
+  if (k.length<len) { 
+    len=k.length;
+  }
+  if (info.numkeys>0) { 
+    // The keys are sorted, so what the first and last share with 
+    // each other, every key between them shares too
+    len=SharedBytes(k.data,data,len<info.prefixlen ? len : info.prefixlen);
+    if (len==info.prefixlen) { 
+      SIZE_T first=SharedBytes(k.data+len,ResolveKey(0),info.keysize-1-len);
+      len+=SharedBytes(k.data+len,ResolveKey(info.numkeys-1),first);
+    }
+  }
+  return len;
+}
+
+
+// Reads len bytes of a key as a number, which orders the same way
+// the keys do.  Runs of ASCII digits are read as decimal, so that
+// keys holding printed numbers interpolate as well as binary ones.
+static double KeyNumber(const unsigned char *p, const SIZE_T len, const bool decimal)
+{
+  double x=0;
+  for (SIZE_T i=0;i<len;i++) { 
+    x = decimal ? x*10+(p[i]-'0') : x*256+p[i];
+  }
+  return x;
+}
+
+static bool AllDigits(const unsigned char *p, const SIZE_T len)
+{
+  for (SIZE_T i=0;i<len;i++) { 
+    if (p[i]<'0' || p[i]>'9') { 
+      return false;
+    }
+  }
+  return true;
+}
+
+// Interpolation probes before we give up and finish with binary search
+#define BTREE_INTERPOLATION_PROBES 4
+// Below this many candidates, binary search is as good
+#define BTREE_INTERPOLATION_MIN    8
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &key, 
+			     const BTreeSearchType type, 
+			     SIZE_T *numcompares) const
+{
+  if (info.format==BTREE_FORMAT_COMPRESSED && info.numkeys>0) { 
+    // Every key starts with the common prefix, so if the probe does
+    // not, it goes before or after all of them
+    if (numcompares) { (*numcompares)++; }
+    int c=CompareCommonPrefix(key);
+    if (c!=0) { 
+      return c<0 ? 0 : info.numkeys;
+    }
+  }
+
+  switch (type) { 
+  case BTREE_SEARCH_LINEAR:
+    return LowerBoundLinear(key,numcompares);
+    break;
+  case BTREE_SEARCH_INTERPOLATION:
+    return LowerBoundInterpolation(key,numcompares);
+    break;
+  case BTREE_SEARCH_SIMD:
+    return LowerBoundSimd(key,numcompares);
+    break;
+  case BTREE_SEARCH_BINARY:
+  default:
+    return LowerBoundBinary(key,0,info.numkeys,numcompares);
+    break;
+  }
+}
+
+
+SIZE_T BTreeNode::LowerBoundLinear(const KEY_T &key, SIZE_T *numcompares) const
+{
+  SIZE_T offset;
+
+  for (offset=0;offset<info.numkeys;offset++) { 
+    if (numcompares) { (*numcompares)++; }
+    if (CompareKey(key,offset)<=0) { 
+      break;
+    }
+  }
+  return offset;
+}
+
+
+SIZE_T BTreeNode::LowerBoundBinary(const KEY_T &key, 
+				   const SIZE_T lo, 
+				   const SIZE_T hi, 
+				   SIZE_T *numcompares) const
+{
+  SIZE_T base=lo;
+  SIZE_T n=hi-lo;
+  KEYPREFIX_T prefix=KeyPrefix(key.data,key.length);
+
+  if (n==0) { 
+    return lo;
+  }
+
+  // The loop runs the same number of times for every key, and the
+  // compiler turns the update of base into a conditional move, so
+  // the only branches left are in the comparison itself
+  while (n>1) { 
+    SIZE_T half=n/2;
+    if (numcompares) { (*numcompares)++; }
+    base = CompareKey(key,prefix,base+half)>0 ? base+half : base;
+    n-=half;
+  }
+  if (numcompares) { (*numcompares)++; }
+  return base + (CompareKey(key,prefix,base)>0);
+}
+
+
+SIZE_T BTreeNode::LowerBoundInterpolation(const KEY_T &key, SIZE_T *numcompares) const
+{
+  // The answer is always in [lo,hi]
+  SIZE_T lo=0;
+  SIZE_T hi=info.numkeys;
+  // In the compressed format, only the suffixes are left to tell apart
+  const unsigned char *k=(const unsigned char *)key.data+info.GetNumCommonPrefixBytes();
+  const SIZE_T keybytes=info.GetNumKeyBytes();
+
+  if (key.length!=info.keysize || info.IsSlotted()) { 
+    return LowerBoundBinary(key,lo,hi,numcompares);
+  }
+
+  for (int i=0; i<BTREE_INTERPOLATION_PROBES && hi-lo>BTREE_INTERPOLATION_MIN; i++) { 
+    const unsigned char *a=(const unsigned char *)ResolveKey(lo);
+    const unsigned char *b=(const unsigned char *)ResolveKey(hi-1);
+    SIZE_T skip, len;
+    SIZE_T guess;
+    int c;
+
+    // Everything in [lo,hi) shares the prefix that a and b share, 
+    // so only the bytes after it tell the keys apart
+    for (skip=0; skip<keybytes && a[skip]==b[skip]; skip++) {}
+    c=memcmp(k,a,skip);
+
+    if (c<0 || skip==keybytes) { 
+      guess=lo;
+    } else if (c>0) {
+      guess=hi-1;
+    } else {
+      len=keybytes-skip;
+      bool decimal=AllDigits(a+skip,len) && AllDigits(b+skip,len) && AllDigits(k+skip,len);
+      if (len>(decimal ? 15 : 6)) { 
+	// As much as a double holds exactly
+	len=decimal ? 15 : 6;
+      }
+      double x=KeyNumber(k+skip,len,decimal);
+      double xa=KeyNumber(a+skip,len,decimal);
+      double xb=KeyNumber(b+skip,len,decimal);
+
+      if (x<=xa) { 
+	guess=lo;
+      } else if (x>=xb) { 
+	guess=hi-1;
+      } else {
+	guess=lo+(SIZE_T)((x-xa)/(xb-xa)*(hi-1-lo));
+      }
+    }
+
+    if (numcompares) { (*numcompares)++; }
+    if (CompareKey(key,guess)<=0) { 
+      hi=guess;
+    } else {
+      lo=guess+1;
+    }
+  }
+  return LowerBoundBinary(key,lo,hi,numcompares);
+}
+
+
+SIZE_T BTreeNode::LowerBoundSimd(const KEY_T &key, SIZE_T *numcompares) const
+{
+  SIZE_T lo=0;
+  SIZE_T hi=info.numkeys;
+  KEYPREFIX_T prefix=KeyPrefix(key.data,key.length);
+  bool prefixes = info.format==BTREE_FORMAT_COLUMNAR_PREFIX;
+  bool keys = (info.format==BTREE_FORMAT_COLUMNAR || info.format==BTREE_FORMAT_COMPRESSED) && 
+    info.GetNumKeyBytes()<=KEYSEARCH_MAX_KEYSIZE;
+
+  if (key.length!=info.keysize || (!prefixes && !keys)) { 
+    return LowerBoundBinary(key,lo,hi,numcompares);
+  }
+
+  while (hi-lo>BTREE_SIMD_WINDOW) { 
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (numcompares) { (*numcompares)++; }
+    if (CompareKey(key,prefix,mid)<=0) { 
+      hi=mid;
+    } else {
+      lo=mid+1;
+    }
+  }
+  if (lo==hi) { 
+    return lo;
+  }
+  if (numcompares) { (*numcompares)+=hi-lo; }
+
+  if (keys) { 
+    return lo+CountLessKeys((const BYTE_T *)ResolveKey(lo),info.GetNumKeyBytes(),hi-lo,
+			    key.data+info.GetNumCommonPrefixBytes(),
+			    (const BYTE_T *)data+info.GetNumDataBytes());
+  }
+
+  SIZE_T offset=lo+CountLessPrefixes((const BYTE_T *)ResolvePrefix(lo),hi-lo,prefix);
+  // Keys whose prefixes tie with ours could still be smaller
+  while (offset<hi && CompareKey(key,prefix,offset)>0) { 
+    if (numcompares) { (*numcompares)++; }
+    offset++;
+  }
+  return offset;
+}
+
+
 ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 {
-  char *p=ResolveKey(offset);
+  char *p;
+  ERROR_T rc;
+
+  if (info.IsSlotted()) { 
+    assert(offset<info.numkeys);
+    if (k.length>info.keysize) { 
+      return ERROR_SIZE;
+    }
+    // A key no longer than the one it replaces goes where that one was
+    return PutInHeap(*this,KeyRef(*this,offset),k.data,k.length);
+  }
+
+  if (CompareCommonPrefix(k)!=0) { 
+    // Keep what the key shares with the common prefix
+    rc=SetCommonPrefix(k,SharedBytes(k.data,data,k.length<info.prefixlen ? k.length : info.prefixlen));
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  p=ResolveKey(offset);
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  memcpy(p,k.data+info.GetNumCommonPrefixBytes(),info.GetNumKeyBytes());
+
+  if (info.format==BTREE_FORMAT_COLUMNAR_PREFIX) { 
+    KEYPREFIX_T x=KeyPrefix(k.data,info.keysize);
+    memcpy(ResolvePrefix(offset),&x,sizeof(x));
+  }
 
   return ERROR_NOERROR;
 }
 
 
+SIZE_T BTreeNode::GetKeyLength(const SIZE_T offset) const
+{
+  if (info.IsSlotted()) { 
+    assert(offset<info.numkeys);
+    return Length(KeyRef(*this,offset));
+  }
+  return info.keysize;
+}
+
+
+SIZE_T BTreeNode::GetValLength(const SIZE_T offset) const
+{
+  if (info.IsSlotted()) { 
+    assert(offset<info.numkeys);
+    return Length(LeafSlots(*this)[offset].value);
+  }
+  return info.GetNumValueBytes();
+}
+
+
+bool BTreeNode::IsOverflowVal(const SIZE_T offset) const
+{
+  if (info.IsSlotted()) { 
+    assert(offset<info.numkeys);
+    return (LeafSlots(*this)[offset].value.length & HEAPREF_OVERFLOW)!=0;
+  }
+  return info.HasOverflowValues();
+}
+
+
+bool BTreeNode::IsTombstone(const SIZE_T offset) const
+{
+  assert(offset<info.numkeys);
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.tombstones) { 
+    return false;
+  }
+  if (info.IsSlotted()) { 
+    return (LeafSlots(*this)[offset].key.length & HEAPREF_TOMBSTONE)!=0;
+  }
+  return Tombstones(*this)[offset]!=0;
+}
+
+
+ERROR_T BTreeNode::SetTombstone(const SIZE_T offset, const bool dead)
+{
+  assert(offset<info.numkeys);
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.tombstones) { 
+    return ERROR_INSANE;
+  }
+  if (info.IsSlotted()) { 
+    HeapRef &key=LeafSlots(*this)[offset].key;
+    key.length = dead ? (key.length | HEAPREF_TOMBSTONE) : (key.length & ~HEAPREF_TOMBSTONE);
+  } else {
+    Tombstones(*this)[offset] = dead ? 1 : 0;
+  }
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetNumTombstones() const
+{
+  SIZE_T n=0;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.tombstones) { 
+    return 0;
+  }
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    n+=IsTombstone(i);
+  }
+  return n;
+}
+
+
+ERROR_T BTreeNode::GetOverflowRef(const SIZE_T offset, OverflowRef &ref) const
+{
+  char *p=ResolveVal(offset);
+
+  if (p==0 || !IsOverflowVal(offset)) { 
+    return ERROR_INSANE;
+  }
+  memcpy(&ref,p,sizeof(ref));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetOverflowRef(const SIZE_T offset, const OverflowRef &ref)
+{
+  ERROR_T rc;
+
+  if (info.IsSlotted()) { 
+    HeapRef &value=LeafSlots(*this)[offset].value;
+    assert(offset<info.numkeys);
+    rc=PutInHeap(*this,value,(const BYTE_T *)&ref,sizeof(ref));
+    if (rc==ERROR_NOERROR) { 
+      value.length|=HEAPREF_OVERFLOW;
+    }
+    return rc;
+  }
+  if (!info.HasOverflowValues()) { 
+    return ERROR_SIZE;
+  }
+  memcpy(ResolveVal(offset),&ref,sizeof(ref));
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::HasRoomFor(const KEY_T &key) const
+{
+  if (info.IsSlotted()) { 
+    // The holes in the heap count, since they can be squeezed out
+    return HeapFree(*this,info.numkeys+1)+HeapHoles(*this)>=(int)key.length;
+  }
+  if (info.format!=BTREE_FORMAT_COMPRESSED) { 
+    return info.numkeys<info.GetNumSlots();
+  }
+  NodeMetadata after=info;
+  after.prefixlen=CommonPrefixLengthWith(key);
+  return info.numkeys<after.GetNumSlots();
+}
+
+
+bool BTreeNode::HasRoomFor(const KEY_T &key, const VALUE_T &value) const
+{
+  if (info.IsSlotted()) { 
+    return HeapFree(*this,info.numkeys+1)+HeapHoles(*this)>=(int)(key.length+value.length);
+  }
+  return HasRoomFor(key);
+}
+
+
+SIZE_T BTreeNode::GetFillPercent() const
+{
+  if (info.IsSlotted()) { 
+    SIZE_T used=sizeof(SlottedHeader)+info.numkeys*SlotSize(info)+Header(*this)->heapused-HeapHoles(*this);
+    return used*100/info.GetNumDataBytes();
+  }
+  return info.numkeys*100/info.GetNumSlots();
+}
+
+
+ERROR_T BTreeNode::GetCommonPrefix(KEY_T &prefix) const
+{
+  SIZE_T common=info.GetNumCommonPrefixBytes();
+
+  prefix.Resize(common,false);
+  memcpy(prefix.data,data,common);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetCommonPrefix(const KEY_T &key, const SIZE_T len)
+{
+  if (info.format!=BTREE_FORMAT_COMPRESSED) { 
+    return ERROR_NOERROR;
+  }
+  if (len>=info.keysize || len>key.length) { 
+    return ERROR_SIZE;
+  }
+  if (len==info.prefixlen && memcmp(key.data,data,len)==0) { 
+    return ERROR_NOERROR;
+  }
+
+  NodeMetadata after=info;
+  after.prefixlen=len;
+  if (info.numkeys>after.GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+
+  // Every offset moves, so build the new layout from a copy
+  BTreeNode old(*this);
+
+  info.prefixlen=len;
+  memcpy(data,key.data,len);
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    // Byte j of key i is in the old prefix or the old suffix
+    char *to=ResolveKey(i);
+    const char *from=old.ResolveKey(i);
+    for (SIZE_T j=len;j<info.keysize;j++) { 
+      *to++ = j<old.info.prefixlen ? old.data[j] : from[j-old.info.prefixlen];
+    }
+  }
+  if (info.nodetype==BTREE_LEAF_NODE && info.numkeys>0) { 
+    memcpy(ResolveVal(0),old.ResolveVal(0),info.numkeys*info.GetNumValueBytes());
+    if (Tombstones(*this)) { 
+      memcpy(Tombstones(*this),Tombstones(old),info.numkeys);
+    }
+  }
+  // The leaf's one pointer, or an interior node's numkeys+1
+  memcpy(ResolvePtr(0),old.ResolvePtr(0),
+	 (info.nodetype==BTREE_LEAF_NODE ? 1 : info.numkeys+1)*sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::FitCommonPrefix(const KEY_T &key)
+{
+  if (info.format!=BTREE_FORMAT_COMPRESSED) { 
+    return ERROR_NOERROR;
+  }
+  return SetCommonPrefix(key,CommonPrefixLengthWith(key));
+}
+
+
+ERROR_T BTreeNode::OpenSlots(const SIZE_T offset, const SIZE_T count)
+{
+  SlotColumn cols[4];
+  int n=SlotColumns(*this,cols);
+
+  assert(offset<=info.numkeys);
+  if (info.IsSlotted() ? HeapFree(*this,info.numkeys+count)<0 : info.numkeys+count>info.GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+  for (int c=0;c<n;c++) { 
+    memmove(cols[c].base+(offset+count)*cols[c].width,
+	    cols[c].base+offset*cols[c].width,
+	    (info.numkeys-offset)*cols[c].width);
+  }
+  if (info.IsSlotted()) { 
+    // Empty keys and values, which take nothing from the heap
+    memset(cols[0].base+offset*cols[0].width,0,count*cols[0].width);
+  } else if (Tombstones(*this)) { 
+    // and new pairs are alive
+    memset(Tombstones(*this)+offset,0,count);
+  }
+  info.numkeys+=count;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::RemoveSlots(const SIZE_T offset, const SIZE_T count)
+{
+  SlotColumn cols[4];
+  int n=SlotColumns(*this,cols);
+
+  assert(offset+count<=info.numkeys);
+  // In a slotted node, what they used in the heap becomes holes
+  for (int c=0;c<n;c++) { 
+    memmove(cols[c].base+offset*cols[c].width,
+	    cols[c].base+(offset+count)*cols[c].width,
+	    (info.numkeys-offset-count)*cols[c].width);
+  }
+  info.numkeys-=count;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::MoveSlots(const SIZE_T offset, const SIZE_T count, BTreeNode &to, const SIZE_T tooffset)
+{
+  SlotColumn cols[4], tocols[4];
+  int n=SlotColumns(*this,cols);
+  ERROR_T rc;
+
+  assert(offset+count<=info.numkeys);
+  if (to.info.format!=info.format || 
+      (to.info.nodetype==BTREE_LEAF_NODE)!=(info.nodetype==BTREE_LEAF_NODE) ||
+      to.info.GetNumCommonPrefixBytes()!=info.GetNumCommonPrefixBytes() ||
+      memcmp(to.data,data,info.GetNumCommonPrefixBytes())!=0) { 
+    return ERROR_INSANE;
+  }
+  rc=to.OpenSlots(tooffset,count);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  SlotColumns(to,tocols);
+
+  if (info.IsSlotted()) { 
+    // The slots can be copied, but what they point to in the heap
+    // has to be given new space there one by one
+    for (SIZE_T i=0;i<count;i++) { 
+      if (info.nodetype==BTREE_LEAF_NODE) { 
+	const LeafSlot &src=LeafSlots(*this)[offset+i];
+	LeafSlot &dst=LeafSlots(to)[tooffset+i];
+	rc=CopyToHeap(*this,src.key,to,dst.key);
+	if (rc!=ERROR_NOERROR) { return rc; }
+	rc=CopyToHeap(*this,src.value,to,dst.value);
+	if (rc!=ERROR_NOERROR) { return rc; }
+      } else {
+	const InteriorSlot &src=Slots(*this)[offset+i];
+	InteriorSlot &dst=Slots(to)[tooffset+i];
+	dst.ptr=src.ptr;
+	rc=CopyToHeap(*this,src.key,to,dst.key);
+	if (rc!=ERROR_NOERROR) { return rc; }
+      }
+    }
+  } else {
+    for (int c=0;c<n;c++) { 
+      memcpy(tocols[c].base+tooffset*tocols[c].width,
+	     cols[c].base+offset*cols[c].width,
+	     count*cols[c].width);
+    }
+  }
+  return RemoveSlots(offset,count);
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &key, const SIZE_T ptr)
+{
+  ERROR_T rc;
+
+  if (info.IsSlotted()) { 
+    InteriorSlot *slots=Slots(*this);
+    char *p;
+    if (key.length>info.keysize) { 
+      return ERROR_SIZE;
+    }
+    p=AllocateHeap(*this,key.length,info.numkeys+1);
+    if (p==0) { 
+      return ERROR_NOSPACE;
+    }
+    memcpy(p,key.data,key.length);
+    rc=OpenSlots(offset,1);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    slots[offset].ptr=ptr;
+    slots[offset].key.offset=p-data;
+    slots[offset].key.length=key.length;
+    return ERROR_NOERROR;
+  }
+
+  rc=FitCommonPrefix(key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=OpenSlots(offset,1);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=SetKey(offset,key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return SetPtr(offset+1,ptr);
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, 
+				const KEY_T &key, 
+				const VALUE_T &value, 
+				const bool overflow)
+{
+  ERROR_T rc;
+
+  if (info.IsSlotted()) { 
+    LeafSlot *slots=LeafSlots(*this);
+    char *k, *v;
+    if (key.length>info.keysize || value.length>info.GetNumValueBytes()) { 
+      return ERROR_SIZE;
+    }
+    // Ask for both at once, so that a compaction can't move the key
+    k=AllocateHeap(*this,key.length+value.length,info.numkeys+1);
+    if (k==0) { 
+      return ERROR_NOSPACE;
+    }
+    v=k+key.length;
+    memcpy(k,key.data,key.length);
+    memcpy(v,value.data,value.length);
+    rc=OpenSlots(offset,1);
+    if (rc!=ERROR_NOERROR) { return rc; }
+    slots[offset].key.offset=k-data;
+    slots[offset].key.length=key.length;
+    slots[offset].value.offset=v-data;
+    slots[offset].value.length=value.length | (overflow ? HEAPREF_OVERFLOW : 0);
+    return ERROR_NOERROR;
+  }
+
+  rc=FitCommonPrefix(key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=OpenSlots(offset,1);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  rc=SetKey(offset,key);
+  if (rc!=ERROR_NOERROR) { return rc; }
+  return SetVal(offset,value);
+}
+
+
+SIZE_T BTreeNode::ChooseLeafSplit(const SIZE_T offset, 
+				  const KEY_T &key, 
+				  const VALUE_T &value,
+				  bool &left) const
+{
+  SIZE_T n=info.numkeys;
+  SIZE_T split=(n+1)/2;
+
+  left=offset<split;
+
+  if (CompareCommonPrefix(key)!=0) { 
+    // A key from outside a compressed leaf's common prefix can only
+    // go at one end of it, and would shorten the prefix of the half
+    // it joined, maybe past what that half can hold.  So it gets a
+    // leaf of its own.
+    left=offset==0;
+    return offset;
+  }
+  if (!info.IsSlotted()) { 
+    return split;
+  }
+
+  // Pairs vary in length, so split where the bytes, not the pairs,
+  // are closest to even, among the splits where both halves fit.
+  // Cut i is between the ith and i+1th of the n+1 pairs there will be.
+  const int room=info.GetNumDataBytes()-sizeof(SlottedHeader);
+  const int need=key.length+value.length+sizeof(LeafSlot);
+  LeafSlot *slots=LeafSlots(*this);
+  int total=need, l=0;
+  int bestdiff=-1;
+
+  for (SIZE_T i=0;i<n;i++) { 
+    total+=PairBytes(slots[i]);
+  }
+  for (SIZE_T cut=1;cut<=n;cut++) { 
+    // The pair just left of the cut is the new one, or an old one
+    l += cut==offset+1 ? need : PairBytes(slots[cut<=offset ? cut-1 : cut-2]);
+    int r=total-l;
+    int diff = l<r ? r-l : l-r;
+    if (l>room || r>room) { 
+      continue;
+    }
+    if (bestdiff<0 || diff<bestdiff) { 
+      bestdiff=diff;
+      left=offset<cut;
+      split=left ? cut-1 : cut;
+    }
+  }
+  return split;
+}
+
+
+SIZE_T BTreeNode::ChooseInteriorSplit(const SIZE_T offset, const KEY_T &key) const
+{
+  SIZE_T n=info.numkeys;
+
+  if (CompareCommonPrefix(key)!=0) { 
+    // A key from outside a compressed node's common prefix can only
+    // go at one end of it, and would shorten the prefix of the half
+    // it joined, maybe past what that half can hold.  So it gets a 
+    // node of its own, by keeping the split at that end.
+    return offset==0 ? 0 : n-1;
+  }
+  if (!info.IsSlotted()) { 
+    return n/2;
+  }
+
+  // Any key near the middle can go up, so take the shortest one.
+  // Keys vary in length, so make sure both halves will fit.
+  const int room=info.GetNumDataBytes()-sizeof(SlottedHeader);
+  const int need=key.length+sizeof(InteriorSlot);
+  const SIZE_T window=n/8;
+  InteriorSlot *slots=Slots(*this);
+  int total=0, left=0;
+  SIZE_T best=n/2;
+  bool found=false, bestinwindow=false;
+  SIZE_T bestlength=0, bestdistance=0;
+
+  for (SIZE_T i=0;i<n;i++) { 
+    total+=slots[i].key.length+sizeof(InteriorSlot);
+  }
+  for (SIZE_T i=0;i<n;i++) { 
+    int mine=slots[i].key.length+sizeof(InteriorSlot);
+    int l=left + (offset<=i ? need : 0);
+    int r=total-left-mine + (offset>i ? need : 0);
+    SIZE_T numleft=i+(offset<=i);
+    SIZE_T numright=n-1-i+(offset>i);
+    SIZE_T distance = i<n/2 ? n/2-i : i-n/2;
+    bool inwindow = distance<=window;
+
+    left+=mine;
+    if (l>room || r>room || numleft==0 || numright==0) { 
+      continue;
+    }
+    // Shortest in the window, or failing that, closest to the middle
+    if (!found ||
+	(inwindow && !bestinwindow) ||
+	(inwindow && bestinwindow && (slots[i].key.length<bestlength || 
+				      (slots[i].key.length==bestlength && distance<bestdistance))) ||
+	(!inwindow && !bestinwindow && distance<bestdistance)) { 
+      found=true;
+      best=i;
+      bestinwindow=inwindow;
+      bestlength=slots[i].key.length;
+      bestdistance=distance;
+    }
+  }
+  return best;
+}
+
+
+void BTreeNode::CompactHeap()
+{
+  if (!info.IsSlotted()) { 
+    return;
+  }
+
+  // Keys can move onto each other, so copy them out first
+  BTreeNode old(*this);
+  SIZE_T end=info.GetNumDataBytes();
+  SIZE_T &used=Header(*this)->heapused;
+
+  used=0;
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    HeapRef *refs[2]={&KeyRef(*this,i), 
+		      info.nodetype==BTREE_LEAF_NODE ? &LeafSlots(*this)[i].value : 0};
+    for (int j=0;j<2 && refs[j];j++) { 
+      used+=Length(*refs[j]);
+      memcpy(data+end-used,old.data+refs[j]->offset,Length(*refs[j]));
+      refs[j]->offset=end-used;
+    }
+  }
+}
+
+
 ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 {
   char *p=ResolvePtr(offset);
@@ -278,13 +1517,23 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
-  char *p=ResolveVal(offset);
+  char *p;
+
+  if (info.IsSlotted()) { 
+    assert(offset<info.numkeys);
+    if (v.length>info.GetNumValueBytes()) { 
+      return ERROR_SIZE;
+    }
+    return PutInHeap(*this,LeafSlots(*this)[offset].value,v.data,v.length);
+  }
+
+  p=ResolveVal(offset);
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
   
-  memcpy(p,v.data,info.valuesize);
+  memcpy(p,v.data,info.GetNumValueBytes());
   
   return ERROR_NOERROR;
 }
@@ -369,7 +1618,7 @@ ostream & BTreeNode::Print(ostream &os) const
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
     os <<", ";
     if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
-      SIZE_T ptr;
+      SIZE_T ptr=0;
       KEY_T key;
       os << "pointers_and_values=(";
       if (info.numkeys>0) { // ==0 implies an empty root node
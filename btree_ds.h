@@ -13,6 +13,25 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_NODE 5
+
+// Layouts of the data area of a node (see below)
+#define BTREE_FORMAT_INTERLEAVED 0
+#define BTREE_FORMAT_COLUMNAR 1
+#define BTREE_FORMAT_COLUMNAR_PREFIX 2
+#define BTREE_FORMAT_COMPRESSED 3
+#define BTREE_FORMAT_SLOTTED 4
+
+// The on-disk layout of nodes: NodeMetadata and the formats above.
+// "BT" and a number, which goes up whenever either changes, so that
+// a disk written with another layout is not taken for an index.
+#define BTREE_LAYOUT_VERSION 0x42540001
+
+// Slotted nodes keep offsets in unsigned shorts
+#define BTREE_SLOTTED_MAX_BLOCKSIZE 65536
+
+// Overflow size that means "a quarter of a node"
+const unsigned BTREE_OVERFLOW_AUTO=(unsigned)-1;
 
 
 typedef Block Buffer;
@@ -20,10 +39,45 @@ typedef Buffer KeyOrValue;
 typedef KeyOrValue KEY_T;
 typedef KeyOrValue VALUE_T;
 
+// The first 8 bytes of a key (zero padded) as a big-endian number,
+// so that comparing two prefixes orders keys the same way memcmp does
+typedef unsigned long long KEYPREFIX_T;
+
+inline KEYPREFIX_T KeyPrefix(const BYTE_T *key, const SIZE_T len)
+{
+  KEYPREFIX_T x=0;
+  for (SIZE_T i=0;i<sizeof(KEYPREFIX_T);i++) { 
+    x=(x<<8) | (i<len ? key[i] : 0);
+  }
+  return x;
+}
+
 
 class BufferCache;
 struct KeyValuePair;
 
+// What a leaf keeps in place of a value that is in overflow blocks
+struct OverflowRef {
+  SIZE_T block;  // the first of them
+  SIZE_T length; // of the whole value
+};
+
+// How BTreeNode::LowerBound searches the keys of a node
+//   LINEAR         scan from the first key
+//   BINARY         branchless binary search
+//   INTERPOLATION  guess positions from the leading bytes of the keys,
+//                  then finish with binary search.  Best when keys
+//                  are numbers (or look like them) and evenly spread.
+//   SIMD           binary search down to a few cache lines, then 
+//                  vector compares over the prefix array, or over the 
+//                  keys themselves if they are small (see keysearch.h).
+//                  Nodes in the interleaved format get binary search.
+enum BTreeSearchType {BTREE_SEARCH_LINEAR, BTREE_SEARCH_BINARY, BTREE_SEARCH_INTERPOLATION, BTREE_SEARCH_SIMD};
+
+// Entries left to the vector kernels once binary search has 
+// narrowed things down (8 cache lines of prefixes)
+#define BTREE_SIMD_WINDOW 64
+
 struct NodeMetadata {
   int nodetype;
   SIZE_T keysize; 
@@ -32,10 +86,38 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
+  SIZE_T logstart; //meaningful only for superblock
+  SIZE_T lognumblocks; //meaningful only for superblock, zero => no log
+  int format; // layout of the data area, BTREE_FORMAT_*
+              // for the superblock, the format of new nodes
+  SIZE_T prefixlen; // meaningful only for BTREE_FORMAT_COMPRESSED
+  SIZE_T overflowsize; // values longer than this are kept in overflow
+                       // blocks, and zero means none are
+                       // meaningful only for superblock or a leaf
+  SIZE_T prevleaf; // the leaf before this one in key order, zero for
+                   // the first.  The leaf after it is its pointer.
+                   // meaningful only for a leaf
+  int tombstones; // whether a leaf keeps a tombstone flag for each
+                  // pair, so that it can be deleted in place
+                  // meaningful only for superblock or a leaf
+  int duplicates; // whether a key can have more than one value, all
+                  // kept with it as a posting list (see BTreeIndex)
+                  // meaningful only for superblock or a leaf
+  int version; // BTREE_LAYOUT_VERSION of the code that wrote the node
+               // checked only for the superblock, so it goes last,
+               // past the fields any earlier layout had
 
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetNumPrefixBytes() const; // per slot, for the prefix array
+  SIZE_T GetNumCommonPrefixBytes() const; // once per node, shared by all keys
+  SIZE_T GetNumKeyBytes() const; // per slot, what is left of each key
+  SIZE_T GetNumValueBytes() const; // most a value takes in a leaf
+  bool   HasOverflowValues() const; // whether any value can be too long for a leaf
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  SIZE_T GetNumSlots() const; // as interior or leaf, as nodetype says
+                              // for slotted nodes, the fewest there can be
+  bool   IsSlotted() const; // keys and values of any length, in a slot directory and heap
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -46,6 +128,8 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 
 
 
+//
+// BTREE_FORMAT_INTERLEAVED
 //
 // Interior node:
 //
@@ -55,7 +139,101 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf in key order, zero for the 
+//  last, and NodeMetadata::prevleaf links back the other way, so 
+//  leaves can be walked in order without the interior nodes.
+//  Leaves in every format have this pointer.
+//
+// BTREE_FORMAT_COLUMNAR
+//
+// Interior node:
+//
+// KEY KEY KEY ... PTR PTR PTR PTR ...
+//
+// Leaf:
+//
+// KEY KEY KEY ... VALUE VALUE VALUE ... PTR*
+//
+// Each array has room for as many slots as the node can hold, so
+// a search only walks over key bytes.
+//
+// BTREE_FORMAT_COLUMNAR_PREFIX
+//
+// As BTREE_FORMAT_COLUMNAR, with an array of KEYPREFIX_Ts in front
+//
+// PREFIX PREFIX PREFIX ... KEY KEY KEY ... 
+//
+// A search compares prefixes, 8 to a cache line, and only looks 
+// at a key itself when the prefixes tie.
+//
+// BTREE_FORMAT_COMPRESSED
+//
+// As BTREE_FORMAT_COLUMNAR, but the first prefixlen bytes, which
+// every key in the node shares, are stored once in front 
+//
+// COMMONPREFIX SUFFIX SUFFIX SUFFIX ... PTR|VALUE PTR|VALUE ...
+//
+// The shorter the suffixes, the more slots fit, so the number of
+// slots changes with prefixlen.  A search compares the probe with
+// the common prefix once, and then only with suffixes.  Inserting
+// a key from outside the prefix shortens it, and the whole node is
+// laid out again (see SetCommonPrefix).  At least one byte of each
+// key stays in its slot.
+//
+// BTREE_FORMAT_SLOTTED
+//
+// Interior node:
+//
+// PTR HEAPUSED SLOT SLOT SLOT ... free space ... KEY KEY KEY
+//
+// where slot i is the ith pointer after the first, and the offset
+// and length of the ith key, which can be any length up to keysize.
+// Keys are put in the heap at the end of the node, which grows 
+// toward the slots.  Keys that are replaced or moved out leave 
+// holes in the heap, which are squeezed out when it runs into the
+// slots.  Separators are only as long as they need to be to tell
+// their subtrees apart, so they are often much shorter than keys.
+//
+// Leaf:
+//
+// PTR* HEAPUSED SLOT SLOT SLOT ... free space ... KEY VALUE KEY VALUE
+//
+// where slot i is the offset and length of the ith key and of the
+// ith value.  Keys can be any length up to keysize and values any
+// length up to valuesize, and each takes only the bytes it has, so
+// keysize and valuesize are limits rather than sizes.  A node holds
+// as many pairs as fit, and splits by bytes rather than by pairs.
+// GetNumSlots is the fewest it can hold, which is when every pair
+// is as long as it can be.
+//
+// Overflow values
+//
+// A value longer than overflowsize is not kept in its leaf.  It goes
+// in a chain of BTREE_OVERFLOW_NODE blocks, and the leaf keeps an
+// OverflowRef to them where the value would be:
+//
+// NEXT BYTES BYTES BYTES ...
+//
+// where NEXT is the next block of the chain (zero in the last) and
+// numkeys is how many bytes this block holds.  In a slotted leaf, 
+// only the values that are too long go out, and their slots say so.
+// In the other formats every value is valuesize long, so either all
+// of them go out or none do, and a leaf is laid out for OverflowRefs
+// rather than values when they all do.  Either way, big values no 
+// longer crowd the keys out of the leaves.
+//
+// Tombstones
+//
+// In an index with tombstones, a pair can be deleted by marking it
+// dead where it is, with no other change to its leaf.  The pair
+// stays until the leaf is compacted, and searches pass over it.  A
+// slotted leaf marks the key of its slot.  The other formats keep a
+// byte per slot at the end of the leaf, after everything else:
+//
+// ... PTR* DEAD DEAD DEAD ...
+//
+// which takes one byte from each slot's share of the node.
+//
 
 
 struct BTreeNode {
@@ -74,9 +252,15 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, 
+	    int format=BTREE_FORMAT_INTERLEAVED, SIZE_T overflow_size=0, 
+	    bool tombstones=false, bool duplicates=false);
   BTreeNode(const BTreeNode &rhs);
+  BTreeNode(BTreeNode &&rhs);
+  // Copying or unserializing into a node with the same block size
+  // reuses its data buffer
   BTreeNode & operator=(const BTreeNode &rhs);
+  BTreeNode & operator=(BTreeNode &&rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
@@ -85,12 +269,76 @@ struct BTreeNode {
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolvePrefix(const SIZE_T offset) const; // Gives a pointer to the ith key prefix (prefix format)
+  // In the compressed format, ResolveKey gives the ith suffix, and
+  // GetKey and SetKey deal in whole keys
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
+  // Compares key against the ith key in place, without copying it out
+  // <0, 0, >0 as key is less than, equal to, or greater than the ith key
+  int CompareKey(const KEY_T &key, const SIZE_T offset) const;
+  // The same, given KeyPrefix(key), using the prefix array if there is one.
+  // In the compressed format, key must match the common prefix already,
+  // and only the suffixes are compared.
+  int CompareKey(const KEY_T &key, const KEYPREFIX_T prefix, const SIZE_T offset) const;
+
+  // Compares key against the common prefix of a compressed node, 
+  // and returns 0 in the other formats, which have none
+  int CompareCommonPrefix(const KEY_T &key) const;
+  // Length the common prefix would have with key in the node too
+  SIZE_T CommonPrefixLengthWith(const KEY_T &key) const;
+  // Whether key can be inserted without splitting the node
+  bool HasRoomFor(const KEY_T &key) const;
+  // The same for a leaf, where the value takes room too
+  bool HasRoomFor(const KEY_T &key, const VALUE_T &value) const;
+  // How full the node is, as a percentage of its slots, or in a 
+  // slotted node, of its bytes
+  SIZE_T GetFillPercent() const;
+  // Length of the ith key, which is keysize unless the node is slotted
+  SIZE_T GetKeyLength(const SIZE_T offset) const;
+  // Length of the ith value as the leaf holds it, which is valuesize 
+  // unless the node is slotted, or the value is in overflow blocks
+  SIZE_T GetValLength(const SIZE_T offset) const;
+  // Whether the ith value is in overflow blocks.  If it is, GetVal 
+  // gives the bytes of its OverflowRef.
+  bool IsOverflowVal(const SIZE_T offset) const;
+  ERROR_T GetOverflowRef(const SIZE_T offset, OverflowRef &ref) const;
+  // Makes the ith value the one in overflow blocks at ref
+  ERROR_T SetOverflowRef(const SIZE_T offset, const OverflowRef &ref);
+  // Whether the ith pair of a leaf is dead (see Tombstones above)
+  bool IsTombstone(const SIZE_T offset) const;
+  // Marks it dead or alive, changing nothing else.  ERROR_INSANE in 
+  // a node that has no tombstones.
+  ERROR_T SetTombstone(const SIZE_T offset, const bool dead);
+  SIZE_T GetNumTombstones() const;
+  ERROR_T GetCommonPrefix(KEY_T &prefix) const;
+  // Lays the node out again with the first len bytes of key as its 
+  // common prefix.  Every key in the node must start with them.
+  // ERROR_NOSPACE if the keys would no longer fit.
+  ERROR_T SetCommonPrefix(const KEY_T &key, const SIZE_T len);
+  // Makes the common prefix as long as it can be with key in the node
+  ERROR_T FitCommonPrefix(const KEY_T &key);
+
+  // Offset of the first key that is at least key, or numkeys if there
+  // is none.  In a leaf, this is where key is or would be inserted.
+  // In an interior node, the pointer at this offset leads to key.
+  // If numcompares is given, the key comparisons made are added to it.
+  SIZE_T LowerBound(const KEY_T &key, 
+		    const BTreeSearchType type=BTREE_SEARCH_BINARY,
+		    SIZE_T *numcompares=0) const;
+  // The searches below leave the common prefix of a compressed node
+  // to LowerBound, which has already checked it
+  SIZE_T LowerBoundLinear(const KEY_T &key, SIZE_T *numcompares=0) const;
+  // Searches only offsets [lo,hi), which must contain the answer
+  SIZE_T LowerBoundBinary(const KEY_T &key, const SIZE_T lo, const SIZE_T hi, 
+			  SIZE_T *numcompares=0) const;
+  SIZE_T LowerBoundInterpolation(const KEY_T &key, SIZE_T *numcompares=0) const;
+  SIZE_T LowerBoundSimd(const KEY_T &key, SIZE_T *numcompares=0) const;
+
   ERROR_T SanityCheckHelper(const SIZE_T &node) const;  
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
@@ -98,6 +346,48 @@ struct BTreeNode {
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Slot i is key i and value i of a leaf, or key i and pointer i+1
+  // of an interior node.  These work on a range of slots at once, 
+  // with one memmove or memcpy for each array the format keeps its
+  // slots in, rather than a key and a value or pointer at a time.
+  //
+  // Opens up count slots at offset, for the caller to fill in.  In
+  // a slotted node they start out with empty keys and values.
+  // ERROR_NOSPACE if the node has no room for them.
+  ERROR_T OpenSlots(const SIZE_T offset, const SIZE_T count);
+  // Closes up count slots at offset
+  ERROR_T RemoveSlots(const SIZE_T offset, const SIZE_T count);
+  // Moves count slots at offset to slot tooffset of node to, which 
+  // must be the same kind of node in the same format, with the same
+  // common prefix if it is compressed.  A split moves the slots past
+  // the split to a new node this way.
+  ERROR_T MoveSlots(const SIZE_T offset, const SIZE_T count, BTreeNode &to, const SIZE_T tooffset);
+
+  // Opens up key slot offset and pointer slot offset+1 in an interior
+  // node that has room for key (see HasRoomFor), and puts key and ptr
+  // there.  ptr is the new right neighbor of the subtree at pointer offset.
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &key, const SIZE_T ptr);
+  // Opens up slot offset in a leaf that has room for key and value
+  // (see HasRoomFor), and puts them there.  If overflow is set, value
+  // holds the OverflowRef of the real one.
+  ERROR_T InsertKeyVal(const SIZE_T offset, 
+		       const KEY_T &key, 
+		       const VALUE_T &value, 
+		       const bool overflow=false);
+  // How many pairs a full leaf should keep when it splits to make
+  // room for key and value at offset.  The rest move to a new leaf,
+  // and left says which of the two the new pair goes in.
+  SIZE_T ChooseLeafSplit(const SIZE_T offset, 
+			 const KEY_T &key, 
+			 const VALUE_T &value,
+			 bool &left) const;
+  // Which key a full interior node should push up when it splits to 
+  // make room for key at offset.  The keys before it stay, and the 
+  // ones after it move to a new node.
+  SIZE_T ChooseInteriorSplit(const SIZE_T offset, const KEY_T &key) const;
+  // Squeezes the holes out of the heap of a slotted node
+  void CompactHeap();
+
   ostream &Print(ostream &rhs) const;
 };
 
@@ -4,7 +4,10 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [format]\n";
+  cerr << "  format  node layout: interleaved, columnar (default), prefix, compressed,\n";
+  cerr << "          or slotted, where keysize and valuesize are limits and shorter\n";
+  cerr << "          keys and values take only the bytes they have\n";
 }
 
 
@@ -14,7 +17,7 @@ int main(int argc, char **argv)
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
 
-  if (argc!=5) { 
+  if (argc!=5 && argc!=6) { 
     usage();
     return -1;
   }
@@ -27,6 +30,24 @@ int main(int argc, char **argv)
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
   BTreeIndex btree(keysize,valuesize,&cache);
+
+  if (argc==6) { 
+    string format(argv[5]);
+    if (format=="interleaved") { 
+      btree.SetNodeFormat(BTREE_FORMAT_INTERLEAVED);
+    } else if (format=="columnar") { 
+      btree.SetNodeFormat(BTREE_FORMAT_COLUMNAR);
+    } else if (format=="prefix") { 
+      btree.SetNodeFormat(BTREE_FORMAT_COLUMNAR_PREFIX);
+    } else if (format=="compressed") { 
+      btree.SetNodeFormat(BTREE_FORMAT_COMPRESSED);
+    } else if (format=="slotted") { 
+      btree.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+    } else {
+      usage();
+      return -1;
+    }
+  }
   
   ERROR_T rc;
 
@@ -0,0 +1,1198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "btree.h"
+#include "lookupengine.h"
+
+//
+// Correctness tests for the btree
+//
+// Each test runs random operations against an index and a model of
+// it (a std::map), and checks the index against the model as it
+// goes.  Each one makes its own indexes on the given disk, so do not
+// point this at a disk you care about.  test_btree.pl makes a disk
+// and runs them all.
+//
+
+void usage()
+{
+  cerr << "usage: btree_test filestem cachesize all|model|batch|overflow|tombstone|range|postings|bulk|catalog|recover|abort\n";
+  cerr << "  model     inserts, updates, puts and deletes, for each node format,\n";
+  cerr << "            with and without the log, until the index is empty again\n";
+  cerr << "  batch     InsertBatch, LookupBatch and BTreeLookupEngine\n";
+  cerr << "  overflow  values kept in overflow blocks, growing and shrinking\n";
+  cerr << "  tombstone lazy deletes, Compact, and the sweep after a reattach\n";
+  cerr << "  range     DeleteRange over every node format\n";
+  cerr << "  postings  several values a key in a non-unique index\n";
+  cerr << "  bulk      BulkLoad, and the loads that fail part way, which\n";
+  cerr << "            have to leave the index empty and every block free\n";
+  cerr << "  catalog   several named indexes on one disk\n";
+  cerr << "  recover   crashes (a child process that exits without detaching)\n";
+  cerr << "            and the replay of the log afterward\n";
+  cerr << "  abort     operations that fail or are too big for the log\n";
+}
+
+
+#define CHECK(c) do { if (!(c)) { Fail(__LINE__,#c); } } while (0)
+
+static void Fail(const int line, const char *what)
+{
+  cerr << "FAILED at btree_test.cc:"<<line<<": "<<what<<endl;
+  exit(1);
+}
+
+typedef map<string,string> Model;
+
+static KEY_T MakeBlock(const string &s)
+{
+  KEY_T b;
+  b.Resize(s.size(),false);
+  memcpy(b.data,s.data(),s.size());
+  return b;
+}
+
+static string MakeString(const Block &b)
+{
+  return string((char *)b.data,b.length);
+}
+
+// Keys are i in decimal, zero padded to keysize, so they sort as i does
+static string MakeKey(const SIZE_T i, const SIZE_T keysize)
+{
+  char buf[64];
+  snprintf(buf,sizeof(buf),"%0*lu",(int)keysize,(unsigned long)i);
+  return string(buf);
+}
+
+static string MakeValue(const SIZE_T i, const SIZE_T valuesize)
+{
+  string s(valuesize,'a');
+  for (SIZE_T j=0;j<valuesize;j++) {
+    s[j]='a'+((i+j)%26);
+  }
+  return s;
+}
+
+// Slotted nodes keep values as they are, so those get random lengths
+static string RandomValue(const int format, const SIZE_T valuesize)
+{
+  return MakeValue(rand(), format==BTREE_FORMAT_SLOTTED ? 1+rand()%valuesize : valuesize);
+}
+
+// The number of blocks in use, for checking that deletes free them
+static SIZE_T BlocksInUse(BufferCache &cache)
+{
+  SIZE_T n=0;
+  for (SIZE_T i=0;i<cache.GetNumBlocks();i++) {
+    BTreeNode b;
+    CHECK(b.Unserialize(&cache,i)==ERROR_NOERROR);
+    if (b.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      n++;
+    }
+  }
+  return n;
+}
+
+// The length of the free list of the index whose superblock is in 
+// block 0, which works whatever is in the blocks of its log
+static SIZE_T BlocksFree(BufferCache &cache)
+{
+  BTreeNode b;
+  SIZE_T n=0;
+  CHECK(b.Unserialize(&cache,0)==ERROR_NOERROR);
+  for (SIZE_T next=b.info.freelist; next!=0; next=b.info.freelist, n++) {
+    CHECK(b.Unserialize(&cache,next)==ERROR_NOERROR);
+    CHECK(b.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+  }
+  return n;
+}
+
+// Scans forward and backward, and looks up every key
+static void Verify(BTreeIndex &btree, const Model &model)
+{
+  BTreeCursor c;
+  ERROR_T rc;
+  Model::const_iterator i=model.begin();
+
+  for (rc=btree.SeekFirst(c); rc==ERROR_NOERROR && c.IsValid(); rc=c.Next()) {
+    KEY_T key;
+    VALUE_T value;
+    CHECK(c.GetKey(key)==ERROR_NOERROR);
+    CHECK(c.GetVal(value)==ERROR_NOERROR);
+    CHECK(i!=model.end());
+    CHECK(MakeString(key)==i->first);
+    CHECK(MakeString(value)==i->second);
+    ++i;
+  }
+  CHECK(rc==ERROR_NOERROR);
+  CHECK(i==model.end());
+
+  Model::const_reverse_iterator r=model.rbegin();
+  for (rc=btree.SeekLast(c); rc==ERROR_NOERROR && c.IsValid(); rc=c.Prev()) {
+    KEY_T key;
+    CHECK(c.GetKey(key)==ERROR_NOERROR);
+    CHECK(r!=model.rend());
+    CHECK(MakeString(key)==r->first);
+    ++r;
+  }
+  CHECK(rc==ERROR_NOERROR);
+  CHECK(r==model.rend());
+
+  for (i=model.begin(); i!=model.end(); ++i) {
+    VALUE_T value;
+    CHECK(btree.Lookup(MakeBlock(i->first),value)==ERROR_NOERROR);
+    CHECK(MakeString(value)==i->second);
+  }
+}
+
+static void Delete(BTreeIndex &btree, Model &model, const string &key,
+		   const BTreeDeleteMode mode=BTREE_DELETE_NOW)
+{
+  ERROR_T rc=btree.Delete(MakeBlock(key),mode);
+  CHECK(rc==(model.count(key) ? ERROR_NOERROR : ERROR_NONEXISTENT));
+  model.erase(key);
+}
+
+static void CompactAll(BTreeIndex &btree)
+{
+  bool done=false;
+  while (!done) {
+    CHECK(btree.Compact(done)==ERROR_NOERROR);
+  }
+}
+
+// One round of random inserts, updates, puts and deletes
+static void Churn(BTreeIndex &btree, Model &model, const int format,
+		  const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T numkeys,
+		  const SIZE_T numops, const BTreeDeleteMode mode)
+{
+  for (SIZE_T i=0;i<numops;i++) {
+    string key=MakeKey(rand()%numkeys,keysize);
+    string value=RandomValue(format,valuesize);
+    bool exists=model.count(key);
+    ERROR_T rc;
+    switch (rand()%6) {
+    case 0:
+    case 1:
+      rc=btree.Insert(MakeBlock(key),MakeBlock(value));
+      CHECK(rc==(exists ? ERROR_CONFLICT : ERROR_NOERROR));
+      if (!exists) { model[key]=value; }
+      break;
+    case 2:
+      rc=btree.Update(MakeBlock(key),MakeBlock(value));
+      CHECK(rc==(exists ? ERROR_NOERROR : ERROR_NONEXISTENT));
+      if (exists) { model[key]=value; }
+      break;
+    case 3:
+      rc=btree.Put(MakeBlock(key),MakeBlock(value),BTREE_PUT_UPSERT);
+      CHECK(rc==ERROR_NOERROR);
+      model[key]=value;
+      break;
+    default:
+      Delete(btree,model,key,mode);
+      break;
+    }
+  }
+}
+
+
+static int TestModel(BufferCache &cache)
+{
+  for (int format=0;format<=BTREE_FORMAT_SLOTTED;format++) {
+    for (int log=0;log<2;log++) {
+      BTreeIndex btree(8,8,&cache);
+      Model model;
+      SIZE_T used=0;
+      SIZE_T superblock;
+
+      srand(format*2+log);
+      btree.SetNodeFormat(format);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+      if (!log) { used=BlocksInUse(cache); }
+
+      for (int round=0;round<3;round++) {
+	Churn(btree,model,format,8,8,3000,9000,BTREE_DELETE_NOW);
+	Verify(btree,model);
+	// Then empty it, which has to merge every node away again
+	vector<string> keys;
+	for (Model::iterator i=model.begin(); i!=model.end(); ++i) {
+	  keys.push_back(i->first);
+	}
+	if (round%2) { reverse(keys.begin(),keys.end()); }
+	for (SIZE_T i=0;i<keys.size();i++) {
+	  Delete(btree,model,keys[i]);
+	  if (i%500==0) { Verify(btree,model); }
+	}
+	Verify(btree,model);
+	if (!log) { CHECK(BlocksInUse(cache)==used); }
+      }
+      // and a few left behind survive a reattach
+      Churn(btree,model,format,8,8,3000,3000,BTREE_DELETE_NOW);
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      BTreeIndex again(0,0,&cache);
+      CHECK(again.Attach(superblock)==ERROR_NOERROR);
+      Verify(again,model);
+      CHECK(again.Detach(superblock)==ERROR_NOERROR);
+      cout << "model format "<<format<<" log "<<log<<" ok"<<endl;
+    }
+  }
+
+  // An index written with another layout of nodes is not attached
+  BTreeIndex btree(8,8,&cache);
+  BTreeNode super;
+  SIZE_T superblock;
+  CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+  CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+  CHECK(super.Unserialize(&cache,superblock)==ERROR_NOERROR);
+  CHECK(super.info.version==BTREE_LAYOUT_VERSION);
+  super.info.version--;
+  CHECK(super.Serialize(&cache,superblock)==ERROR_NOERROR);
+  BTreeIndex old(0,0,&cache);
+  CHECK(old.Attach(superblock)==ERROR_NOTANINDEX);
+  cout << "model layout version ok"<<endl;
+  return 0;
+}
+
+
+static int TestBatch(BufferCache &cache)
+{
+  const int formats[]={BTREE_FORMAT_COLUMNAR, BTREE_FORMAT_SLOTTED, BTREE_FORMAT_COMPRESSED};
+
+  for (SIZE_T f=0;f<sizeof(formats)/sizeof(formats[0]);f++) {
+    BTreeIndex btree(8,8,&cache);
+    Model model;
+    SIZE_T superblock;
+
+    srand(f);
+    btree.SetNodeFormat(formats[f]);
+    CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+    for (int round=0;round<30;round++) {
+      // Batches of clustered and of scattered keys, some there already
+      vector<KeyValuePair> batch;
+      Model added;
+      bool conflict=false;
+      SIZE_T base=rand()%100000;
+      SIZE_T n=rand()%400;
+      for (SIZE_T i=0;i<n;i++) {
+	string key=MakeKey(round%2 ? base+i : rand()%100000,8);
+	string value=MakeValue(rand(),8);
+	batch.push_back(KeyValuePair(MakeBlock(key),MakeBlock(value)));
+	if (model.count(key) || added.count(key)) {
+	  conflict=true;
+	} else {
+	  added[key]=value;
+	}
+      }
+      CHECK(btree.InsertBatch(batch)==(conflict ? ERROR_CONFLICT : ERROR_NOERROR));
+      model.insert(added.begin(),added.end());
+
+      vector<KEY_T> keys;
+      vector<VALUE_T> values, engined;
+      vector<ERROR_T> rcs, enginercs;
+      bool missing=false;
+      for (SIZE_T i=0;i<200;i++) {
+	string key=MakeKey(rand()%100000,8);
+	missing |= !model.count(key);
+	keys.push_back(MakeBlock(key));
+      }
+      CHECK(btree.LookupBatch(keys,values,rcs)==(missing ? ERROR_NONEXISTENT : ERROR_NOERROR));
+      BTreeLookupEngine engine(btree,1+round%16);
+      CHECK(engine.Lookup(keys,engined,enginercs)==(missing ? ERROR_NONEXISTENT : ERROR_NOERROR));
+      for (SIZE_T i=0;i<keys.size();i++) {
+	string key=MakeString(keys[i]);
+	CHECK(rcs[i]==(model.count(key) ? ERROR_NOERROR : ERROR_NONEXISTENT));
+	CHECK(enginercs[i]==rcs[i]);
+	if (model.count(key)) {
+	  CHECK(MakeString(values[i])==model[key]);
+	  CHECK(MakeString(engined[i])==model[key]);
+	}
+      }
+    }
+    Verify(btree,model);
+    CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+    cout << "batch format "<<formats[f]<<" ok"<<endl;
+  }
+  return 0;
+}
+
+
+// Appends an x to the value, so each Put makes it longer
+struct Grow : public BTreeValueModifier {
+  ERROR_T Modify(const KEY_T &key, const bool exists, const VALUE_T &old, VALUE_T &value) {
+    value=MakeBlock((exists ? MakeString(old) : string())+string(37,'x'));
+    return ERROR_NOERROR;
+  }
+};
+
+// Fills the disk with long values, then overwrites one with a longer
+// one, which fails and has to leave the old one and the free list as
+// they were.  Without a log there is nothing to undo the overwrite.
+static void OverwriteFull(BufferCache &cache)
+{
+  BTreeIndex btree(8,8000,&cache);
+  Model model;
+  SIZE_T used, free;
+  SIZE_T superblock;
+  ERROR_T rc=ERROR_NOERROR;
+
+  btree.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+  btree.SetOverflowSize(100);
+  btree.SetLogSize(0);
+  CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+  used=BlocksInUse(cache);
+  for (SIZE_T i=0;rc==ERROR_NOERROR;i++) {
+    string key=MakeKey(i,8), value=MakeValue(i,2000);
+    rc=btree.Insert(MakeBlock(key),MakeBlock(value));
+    if (rc==ERROR_NOERROR) { model[key]=value; }
+  }
+  CHECK(rc==ERROR_NOSPACE);
+  free=BlocksFree(cache);
+  CHECK(btree.Update(MakeBlock(MakeKey(0,8)),MakeBlock(MakeValue(1,8000)))==ERROR_NOSPACE);
+  CHECK(btree.Put(MakeBlock(MakeKey(1,8)),MakeBlock(MakeValue(2,8000)))==ERROR_NOSPACE);
+  CHECK(BlocksFree(cache)==free);
+  Verify(btree,model);
+  while (!model.empty()) {
+    Delete(btree,model,model.begin()->first);
+  }
+  CHECK(BlocksInUse(cache)==used);
+  CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+  cout << "overflow overwrite on a full disk ok"<<endl;
+}
+
+static int TestOverflow(BufferCache &cache)
+{
+  const int formats[]={BTREE_FORMAT_COLUMNAR, BTREE_FORMAT_SLOTTED};
+
+  for (SIZE_T f=0;f<sizeof(formats)/sizeof(formats[0]);f++) {
+    for (int log=0;log<2;log++) {
+      BTreeIndex btree(20,300,&cache);
+      Model model;
+      SIZE_T used=0;
+      SIZE_T superblock;
+
+      srand(f*2+log);
+      btree.SetNodeFormat(formats[f]);
+      btree.SetOverflowSize(100);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+      if (!log) { used=BlocksInUse(cache); }
+      for (int round=0;round<3;round++) {
+	Churn(btree,model,formats[f],20,300,1500,4500,BTREE_DELETE_NOW);
+	Verify(btree,model);
+      }
+      while (!model.empty()) {
+	Delete(btree,model,model.begin()->first);
+      }
+      Verify(btree,model);
+      // Every overflow block went back
+      if (!log) { CHECK(BlocksInUse(cache)==used); }
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      cout << "overflow format "<<formats[f]<<" log "<<log<<" ok"<<endl;
+    }
+  }
+
+  // Values that grow into overflow blocks, a piece at a time
+  BTreeIndex btree(8,400,&cache);
+  Model model;
+  Grow grow;
+  SIZE_T superblock;
+  btree.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+  btree.SetOverflowSize(100);
+  CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+  for (int round=0;round<10;round++) {
+    for (SIZE_T i=0;i<300;i++) {
+      string key=MakeKey(i*7%300,8);
+      CHECK(btree.Put(MakeBlock(key),grow)==ERROR_NOERROR);
+      model[key]+=string(37,'x');
+    }
+  }
+  Verify(btree,model);
+  CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+  cout << "overflow growing values ok"<<endl;
+
+  OverwriteFull(cache);
+  return 0;
+}
+
+
+static int TestTombstone(BufferCache &cache)
+{
+  for (int format=0;format<=BTREE_FORMAT_SLOTTED;format++) {
+    for (int log=0;log<2;log++) {
+      Model model;
+      SIZE_T used=0;
+      SIZE_T superblock;
+
+      srand(format*2+log);
+      {
+	BTreeIndex btree(8,8,&cache);
+	btree.SetNodeFormat(format);
+	btree.SetTombstones(true);
+	if (!log) { btree.SetLogSize(0); }
+	CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+	if (!log) { used=BlocksInUse(cache); }
+	CHECK(btree.Delete(MakeBlock(MakeKey(1,8)),BTREE_DELETE_LAZY)==ERROR_NONEXISTENT);
+	for (int round=0;round<4;round++) {
+	  Churn(btree,model,format,8,8,3000,9000,round%2 ? BTREE_DELETE_LAZY : BTREE_DELETE_NOW);
+	  Verify(btree,model);
+	  for (SIZE_T i=0;i<6000;i++) {
+	    Delete(btree,model,MakeKey(rand()%3000,8),BTREE_DELETE_LAZY);
+	  }
+	  Verify(btree,model);
+	  if (round%2) {
+	    CompactAll(btree);
+	    Verify(btree,model);
+	  }
+	}
+	CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      }
+      // The tombstones left are only on disk now, for the sweep to find
+      BTreeIndex btree(0,0,&cache);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(btree.Attach(superblock)==ERROR_NOERROR);
+      Verify(btree,model);
+      CompactAll(btree);
+      Verify(btree,model);
+      while (!model.empty()) {
+	Delete(btree,model,model.begin()->first,BTREE_DELETE_LAZY);
+      }
+      CompactAll(btree);
+      Verify(btree,model);
+      if (!log) { CHECK(BlocksInUse(cache)==used); }
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      cout << "tombstone format "<<format<<" log "<<log<<" ok"<<endl;
+    }
+  }
+  return 0;
+}
+
+
+static int TestRange(BufferCache &cache)
+{
+  for (int format=0;format<=BTREE_FORMAT_SLOTTED;format++) {
+    for (int log=0;log<2;log++) {
+      BTreeIndex btree(8,8,&cache);
+      Model model;
+      SIZE_T used=0;
+      SIZE_T superblock;
+      const SIZE_T numkeys=6000;
+      const bool tombstones = format==BTREE_FORMAT_COLUMNAR;
+
+      srand(format*2+log);
+      btree.SetNodeFormat(format);
+      btree.SetTombstones(tombstones);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+      if (!log) { used=BlocksInUse(cache); }
+      CHECK(btree.DeleteRange(MakeBlock(MakeKey(1,8)),MakeBlock(MakeKey(5,8)))==ERROR_NOERROR);
+      for (int round=0;round<3;round++) {
+	Churn(btree,model,format,8,8,numkeys,2*numkeys,BTREE_DELETE_NOW);
+	Verify(btree,model);
+	for (int i=0;i<12;i++) {
+	  // Mostly short ranges, some long, and one the wrong way round
+	  SIZE_T lo=rand()%(numkeys+20);
+	  SIZE_T hi=lo+(i%4==0 ? rand()%numkeys : rand()%(numkeys/20));
+	  if (i==5) { swap(lo,hi); lo++; }
+	  string low=MakeKey(lo,8), high=MakeKey(hi,8);
+	  CHECK(btree.DeleteRange(MakeBlock(low),MakeBlock(high))==ERROR_NOERROR);
+	  if (low<=high) {
+	    model.erase(model.lower_bound(low),model.upper_bound(high));
+	  }
+	  Verify(btree,model);
+	  Churn(btree,model,format,8,8,numkeys,30,BTREE_DELETE_NOW);
+	}
+	if (tombstones) {
+	  CompactAll(btree);
+	  Verify(btree,model);
+	}
+      }
+      CHECK(btree.DeleteRange(MakeBlock(MakeKey(0,8)),MakeBlock(MakeKey(numkeys,8)))==ERROR_NOERROR);
+      model.clear();
+      Verify(btree,model);
+      if (!log) { CHECK(BlocksInUse(cache)==used); }
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      cout << "range format "<<format<<" log "<<log<<" ok"<<endl;
+    }
+  }
+  return 0;
+}
+
+
+typedef map<string,set<string> > Postings;
+
+static void VerifyPostings(BTreeIndex &btree, const Postings &model)
+{
+  BTreeCursor c;
+  ERROR_T rc;
+  Postings::const_iterator i=model.begin();
+  ostringstream want, got;
+
+  for (rc=btree.SeekFirst(c); rc==ERROR_NOERROR && c.IsValid(); rc=c.Next()) {
+    KEY_T key;
+    VALUE_T value;
+    BTreeValueCursor values;
+    CHECK(c.GetKey(key)==ERROR_NOERROR);
+    CHECK(c.GetVal(value)==ERROR_NOERROR);
+    CHECK(i!=model.end());
+    CHECK(MakeString(key)==i->first);
+    CHECK(MakeString(value)==*i->second.begin());
+    CHECK(c.OpenValues(values)==ERROR_NOERROR);
+    set<string>::const_iterator j=i->second.begin();
+    for (; values.IsValid(); values.Next()) {
+      CHECK(values.GetVal(value)==ERROR_NOERROR);
+      CHECK(j!=i->second.end());
+      CHECK(MakeString(value)==*j);
+      want << "("<<i->first<<","<<*j<<")\n";
+      ++j;
+    }
+    CHECK(j==i->second.end());
+    ++i;
+  }
+  CHECK(rc==ERROR_NOERROR);
+  CHECK(i==model.end());
+  CHECK(btree.Display(got,BTREE_SORTED_KEYVAL)==ERROR_NOERROR);
+  CHECK(got.str()==want.str());
+}
+
+static void AddPosting(Postings &model, const string &key, const string &value)
+{
+  model[key].insert(value);
+}
+
+static void RemovePosting(Postings &model, const string &key, const string &value)
+{
+  if (model.count(key)) {
+    model[key].erase(value);
+    if (model[key].empty()) { model.erase(key); }
+  }
+}
+
+static bool HasPosting(const Postings &model, const string &key, const string &value)
+{
+  Postings::const_iterator i=model.find(key);
+  return i!=model.end() && i->second.count(value);
+}
+
+static int TestPostings(BufferCache &cache)
+{
+  const SIZE_T numkeys=300;
+  const SIZE_T valuesize=12;
+
+  {
+    BTreeIndex btree(8,8,&cache,false);
+    btree.SetOverflowSize(0);
+    CHECK(btree.Attach(0,true)==ERROR_SIZE);
+  }
+  for (int log=0;log<2;log++) {
+    for (int tombstones=0;tombstones<2;tombstones++) {
+      BTreeIndex btree(10,valuesize,&cache,false);
+      const BTreeDeleteMode mode = tombstones ? BTREE_DELETE_LAZY : BTREE_DELETE_NOW;
+      Postings model;
+      SIZE_T used=0;
+      SIZE_T superblock;
+
+      srand(log*2+tombstones);
+      btree.SetTombstones(tombstones);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(!btree.IsUnique());
+      CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+      if (!log) { used=BlocksInUse(cache); }
+      CHECK(btree.Insert(MakeBlock(MakeKey(1,10)),MakeBlock(string(valuesize+1,'x')))==ERROR_SIZE);
+      for (int round=0;round<3;round++) {
+	for (SIZE_T i=0;i<6*numkeys;i++) {
+	  // A few hot keys get most of the values
+	  string key=MakeKey(rand()%4==0 ? rand()%3 : rand()%numkeys,10);
+	  string value=MakeValue(rand()%50,1+rand()%valuesize);
+	  bool exists=HasPosting(model,key,value);
+	  ERROR_T rc;
+	  switch (rand()%8) {
+	  case 0:
+	  case 1:
+	  case 2:
+	    rc=btree.Insert(MakeBlock(key),MakeBlock(value));
+	    CHECK(rc==(exists ? ERROR_CONFLICT : ERROR_NOERROR));
+	    AddPosting(model,key,value);
+	    break;
+	  case 3:
+	    CHECK(btree.Put(MakeBlock(key),MakeBlock(value),BTREE_PUT_UPSERT)==ERROR_NOERROR);
+	    AddPosting(model,key,value);
+	    break;
+	  case 4:
+	  case 5:
+	    if (!exists && model.count(key) && rand()%2) {
+	      value=*model[key].begin();
+	      exists=true;
+	    }
+	    rc=btree.Delete(MakeBlock(key),MakeBlock(value),mode);
+	    CHECK(rc==(exists ? ERROR_NOERROR : ERROR_NONEXISTENT));
+	    RemovePosting(model,key,value);
+	    break;
+	  case 6:
+	    rc=btree.Delete(MakeBlock(key),mode);
+	    CHECK(rc==(model.count(key) ? ERROR_NOERROR : ERROR_NONEXISTENT));
+	    model.erase(key);
+	    break;
+	  default:
+	    rc=btree.Update(MakeBlock(key),MakeBlock(value));
+	    CHECK(rc==(model.count(key) ? ERROR_NOERROR : ERROR_NONEXISTENT));
+	    if (model.count(key)) {
+	      model[key].clear();
+	      AddPosting(model,key,value);
+	    }
+	    break;
+	  }
+	}
+	VerifyPostings(btree,model);
+	SIZE_T lo=rand()%numkeys, hi=lo+rand()%(numkeys/4);
+	CHECK(btree.DeleteRange(MakeBlock(MakeKey(lo,10)),MakeBlock(MakeKey(hi,10)))==ERROR_NOERROR);
+	model.erase(model.lower_bound(MakeKey(lo,10)),model.upper_bound(MakeKey(hi,10)));
+	VerifyPostings(btree,model);
+	if (tombstones) {
+	  CompactAll(btree);
+	  VerifyPostings(btree,model);
+	}
+      }
+
+      // A list long enough to go to overflow blocks and back
+      string hot=MakeKey(numkeys+7,10);
+      for (SIZE_T i=0;i<600;i++) {
+	string value=MakeKey((i*7919)%600,6)+string(i%6,'a'+i%26);
+	CHECK(btree.Insert(MakeBlock(hot),MakeBlock(value))==ERROR_NOERROR);
+	AddPosting(model,hot,value);
+      }
+      VerifyPostings(btree,model);
+      set<string> values=model[hot];
+      SIZE_T n=0;
+      for (set<string>::iterator i=values.begin(); i!=values.end(); ++i, ++n) {
+	if (n%3) {
+	  CHECK(btree.Delete(MakeBlock(hot),MakeBlock(*i),mode)==ERROR_NOERROR);
+	  RemovePosting(model,hot,*i);
+	}
+      }
+      VerifyPostings(btree,model);
+
+      // Take out every value one at a time
+      Postings all=model;
+      for (Postings::iterator i=all.begin(); i!=all.end(); ++i) {
+	for (set<string>::iterator j=i->second.begin(); j!=i->second.end(); ++j) {
+	  CHECK(btree.Delete(MakeBlock(i->first),MakeBlock(*j),mode)==ERROR_NOERROR);
+	}
+      }
+      model.clear();
+      VerifyPostings(btree,model);
+      if (tombstones) { CompactAll(btree); }
+      if (!log) { CHECK(BlocksInUse(cache)==used); }
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      cout << "postings log "<<log<<" tombstones "<<tombstones<<" ok"<<endl;
+    }
+  }
+  return 0;
+}
+
+
+// Hands out pairs in the order given, to BulkLoad
+class ListSource : public BTreePairSource {
+ protected:
+  const vector<KeyValuePair> &pairs;
+  SIZE_T next;
+ public:
+  ListSource(const vector<KeyValuePair> &p) : pairs(p), next(0) {}
+  ERROR_T Next(KeyValuePair &pair) {
+    if (next==pairs.size()) {
+      return ERROR_NONEXISTENT;
+    }
+    pair=pairs[next++];
+    return ERROR_NOERROR;
+  }
+};
+
+static void MakePairs(vector<KeyValuePair> &pairs, Model &model, const SIZE_T numpairs,
+		      const SIZE_T keysize, const SIZE_T valuesize)
+{
+  pairs.clear();
+  model.clear();
+  for (SIZE_T i=0;i<numpairs;i++) {
+    string key=MakeKey(i,keysize), value=MakeValue(i,valuesize);
+    pairs.push_back(KeyValuePair(MakeBlock(key),MakeBlock(value)));
+    model[key]=value;
+  }
+}
+
+// A load from source that fails with rc, and leaves the index as it
+// was, with every block it took back on the free list
+static void FailedLoad(BTreeIndex &btree, BufferCache &cache, BTreePairSource &source, const ERROR_T rc)
+{
+  SIZE_T free=BlocksFree(cache);
+  Model empty;
+
+  CHECK(btree.BulkLoad(source)==rc);
+  Verify(btree,empty);
+  CHECK(BlocksFree(cache)==free);
+}
+
+static void FailedLoad(BTreeIndex &btree, BufferCache &cache, vector<KeyValuePair> &pairs, const ERROR_T rc)
+{
+  SIZE_T free=BlocksFree(cache);
+  Model empty;
+
+  CHECK(btree.BulkLoad(pairs)==rc);
+  Verify(btree,empty);
+  CHECK(BlocksFree(cache)==free);
+}
+
+static int TestBulk(BufferCache &cache)
+{
+  for (int log=0;log<2;log++) {
+    for (int format=0;format<=BTREE_FORMAT_SLOTTED;format++) {
+      BTreeIndex btree(8,300,&cache);
+      vector<KeyValuePair> pairs;
+      Model model;
+      SIZE_T superblock;
+
+      btree.SetNodeFormat(format);
+      btree.SetOverflowSize(100);
+      if (!log) { btree.SetLogSize(0); }
+      CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+      MakePairs(pairs,model,3000,8,300);
+
+      // The last pair out of order, or too long
+      pairs.push_back(pairs[1000]);
+      ListSource outoforder(pairs);
+      FailedLoad(btree,cache,outoforder,ERROR_CONFLICT);
+      pairs.back()=KeyValuePair(MakeBlock(MakeKey(5000,8)),MakeBlock(string(301,'x')));
+      ListSource toolong(pairs);
+      FailedLoad(btree,cache,toolong,ERROR_SIZE);
+      pairs.pop_back();
+
+      // More than there are blocks for, a block a value
+      vector<KeyValuePair> more;
+      Model toomany;
+      MakePairs(more,toomany,25000,8,300);
+      ListSource nospace(more);
+      FailedLoad(btree,cache,nospace,ERROR_NOSPACE);
+
+      // The same from a vector, which is checked and sorted first
+      FailedLoad(btree,cache,more,ERROR_NOSPACE);
+      reverse(pairs.begin(),pairs.end());
+      pairs.push_back(pairs[1000]);
+      FailedLoad(btree,cache,pairs,ERROR_CONFLICT);
+      pairs.back()=KeyValuePair(MakeBlock(MakeKey(5000,8)),MakeBlock(string(301,'x')));
+      FailedLoad(btree,cache,pairs,ERROR_SIZE);
+      MakePairs(pairs,model,3000,8,300);
+
+      // and after all that, the load that works
+      if (log) {
+	CHECK(btree.BulkLoad(pairs)==ERROR_NOERROR);
+      } else {
+	ListSource source(pairs);
+	CHECK(btree.BulkLoad(source)==ERROR_NOERROR);
+      }
+      Verify(btree,model);
+      CHECK(btree.BulkLoad(pairs)==ERROR_CONFLICT);
+      CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+      BTreeIndex again(0,0,&cache);
+      CHECK(again.Attach(superblock)==ERROR_NOERROR);
+      Verify(again,model);
+      CHECK(again.Detach(superblock)==ERROR_NOERROR);
+      cout << "bulk format "<<format<<" log "<<log<<" ok"<<endl;
+    }
+  }
+  return 0;
+}
+
+
+static void Fill(BTreeIndex &btree, Model &model, const int seed, const SIZE_T numops,
+		 const SIZE_T keysize, const SIZE_T valuesize, const int format)
+{
+  srand(seed);
+  Churn(btree,model,format,keysize,valuesize,numops/2,numops,BTREE_DELETE_NOW);
+}
+
+static int TestCatalog(BufferCache &cache)
+{
+  for (int log=0;log<2;log++) {
+    Model a, b, c, d;
+    SIZE_T used=0;
+    SIZE_T superblock;
+    {
+      BTreeCatalog catalog(&cache);
+      if (!log) { catalog.SetLogSize(0); }
+      CHECK(catalog.Attach(true)==ERROR_NOERROR);
+      if (!log) { used=BlocksInUse(cache); }
+      BTreeIndex alpha(8,8,&cache), beta(20,300,&cache), gamma(8,8,&cache), other(8,8,&cache);
+      beta.SetNodeFormat(BTREE_FORMAT_SLOTTED);
+      beta.SetOverflowSize(100);
+      gamma.SetNodeFormat(BTREE_FORMAT_COMPRESSED);
+      CHECK(catalog.Create("alpha",alpha)==ERROR_NOERROR);
+      CHECK(catalog.Create("beta",beta)==ERROR_NOERROR);
+      CHECK(catalog.Create("gamma",gamma)==ERROR_NOERROR);
+      CHECK(catalog.Create("alpha",other)==ERROR_CONFLICT);
+      CHECK(catalog.Create("",other)==ERROR_SIZE);
+      CHECK(catalog.Create(string(BTREE_CATALOG_NAME_MAX+1,'n'),other)==ERROR_SIZE);
+      CHECK(catalog.Open("delta",other)==ERROR_NONEXISTENT);
+      // Their nodes come from the one free list, interleaved
+      for (int round=0;round<4;round++) {
+	Fill(alpha,a,round*3+1,4000,8,8,BTREE_FORMAT_COLUMNAR);
+	Fill(beta,b,round*3+2,1500,20,300,BTREE_FORMAT_SLOTTED);
+	Fill(gamma,c,round*3+3,4000,8,8,BTREE_FORMAT_COMPRESSED);
+      }
+      Verify(alpha,a);
+      Verify(beta,b);
+      Verify(gamma,c);
+      CHECK(alpha.Detach(superblock)==ERROR_NOERROR);
+      CHECK(beta.Detach(superblock)==ERROR_NOERROR);
+      CHECK(gamma.Detach(superblock)==ERROR_NOERROR);
+      CHECK(catalog.Detach()==ERROR_NOERROR);
+    }
+    {
+      BTreeCatalog catalog(&cache);
+      vector<string> names;
+      CHECK(catalog.Attach()==ERROR_NOERROR);
+      CHECK(catalog.List(names)==ERROR_NOERROR);
+      CHECK(names.size()==3 && names[0]=="alpha" && names[1]=="beta" && names[2]=="gamma");
+      BTreeIndex alpha, beta, gamma;
+      CHECK(catalog.Open("alpha",alpha)==ERROR_NOERROR);
+      CHECK(catalog.Open("beta",beta)==ERROR_NOERROR);
+      CHECK(catalog.Open("gamma",gamma)==ERROR_NOERROR);
+      Verify(alpha,a);
+      Verify(beta,b);
+      Verify(gamma,c);
+      // An index that is open cannot be dropped from under it
+      BTreeIndex beta2;
+      CHECK(catalog.Drop("beta")==ERROR_CONFLICT);
+      CHECK(catalog.Open("beta",beta2)==ERROR_NOERROR);
+      CHECK(beta.Detach(superblock)==ERROR_NOERROR);
+      CHECK(catalog.Drop("beta")==ERROR_CONFLICT);
+      Verify(beta2,b);
+      CHECK(beta2.Detach(superblock)==ERROR_NOERROR);
+      CHECK(catalog.Drop("beta")==ERROR_NOERROR);
+      CHECK(catalog.Drop("beta")==ERROR_NONEXISTENT);
+      Fill(alpha,a,77,6000,8,8,BTREE_FORMAT_COLUMNAR);
+      Verify(alpha,a);
+      Verify(gamma,c);
+      CHECK(alpha.Detach(superblock)==ERROR_NOERROR);
+      CHECK(gamma.Detach(superblock)==ERROR_NOERROR);
+      CHECK(catalog.Drop("alpha")==ERROR_NOERROR);
+      CHECK(catalog.Drop("gamma")==ERROR_NOERROR);
+      CHECK(catalog.List(names)==ERROR_NOERROR);
+      CHECK(names.empty());
+      // A new one comes out of the blocks they gave back
+      BTreeIndex delta(8,8,&cache);
+      CHECK(catalog.Create("delta",delta)==ERROR_NOERROR);
+      Fill(delta,d,5,8000,8,8,BTREE_FORMAT_COLUMNAR);
+      Verify(delta,d);
+      CHECK(delta.Detach(superblock)==ERROR_NOERROR);
+      CHECK(catalog.Drop("delta")==ERROR_NOERROR);
+      CHECK(catalog.Detach()==ERROR_NOERROR);
+      // Only the names index may have grown
+      if (!log) { CHECK(BlocksInUse(cache)<=used+2); }
+    }
+    cout << "catalog log "<<log<<" ok"<<endl;
+  }
+
+  // A plain index is not a catalog, and is left alone
+  BTreeIndex plain(8,8,&cache);
+  BTreeCatalog catalog(&cache);
+  Model model;
+  SIZE_T superblock;
+  CHECK(plain.Attach(0,true)==ERROR_NOERROR);
+  Fill(plain,model,3,2000,8,8,BTREE_FORMAT_COLUMNAR);
+  CHECK(plain.Detach(superblock)==ERROR_NOERROR);
+  CHECK(catalog.Attach()==ERROR_NOTANINDEX);
+  BTreeIndex again(0,0,&cache);
+  CHECK(again.Attach(superblock)==ERROR_NOERROR);
+  Verify(again,model);
+  CHECK(again.Detach(superblock)==ERROR_NOERROR);
+  // and the catalog can still make one of its own there
+  BTreeIndex index(8,8,&cache);
+  CHECK(catalog.Attach(true)==ERROR_NOERROR);
+  CHECK(catalog.Create("index",index)==ERROR_NOERROR);
+  CHECK(index.Detach(superblock)==ERROR_NOERROR);
+  CHECK(catalog.Detach()==ERROR_NOERROR);
+  cout << "catalog on a plain index ok"<<endl;
+  return 0;
+}
+
+
+// Runs f in a child process, which "crashes" by exiting without
+// detaching anything, so that all it leaves is what was written
+static void Crash(void (*f)(const char *, const SIZE_T), const char *filestem, const SIZE_T cachesize)
+{
+  pid_t pid;
+  int status;
+
+  cout.flush();
+  pid=fork();
+  CHECK(pid>=0);
+  if (pid==0) {
+    f(filestem,cachesize);
+    _exit(0);
+  }
+  CHECK(waitpid(pid,&status,0)==pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status)==0);
+}
+
+static void CrashIndex(const char *filestem, const SIZE_T cachesize)
+{
+  DiskSystem disk((char *)filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(8,8,&cache);
+  Model model;
+
+  CHECK(cache.Attach()==ERROR_NOERROR);
+  CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+  Fill(btree,model,1,20000,8,8,BTREE_FORMAT_COLUMNAR);
+}
+
+static void CrashCatalog(const char *filestem, const SIZE_T cachesize)
+{
+  DiskSystem disk((char *)filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeCatalog catalog(&cache);
+  BTreeIndex a(8,8,&cache), b(8,8,&cache), z(8,8,&cache);
+  Model ma, mb, mz;
+  SIZE_T superblock;
+
+  CHECK(cache.Attach()==ERROR_NOERROR);
+  CHECK(catalog.Attach(true)==ERROR_NOERROR);
+  CHECK(catalog.Create("a",a)==ERROR_NOERROR);
+  CHECK(catalog.Create("z",z)==ERROR_NOERROR);
+  CHECK(catalog.Create("b",b)==ERROR_NOERROR);
+  Fill(a,ma,1,5000,8,8,BTREE_FORMAT_COLUMNAR);
+  Fill(z,mz,9,3000,8,8,BTREE_FORMAT_COLUMNAR);
+  Fill(b,mb,2,5000,8,8,BTREE_FORMAT_COLUMNAR);
+  CHECK(z.Detach(superblock)==ERROR_NOERROR);
+  CHECK(catalog.Drop("z")==ERROR_NOERROR);
+  Fill(a,ma,3,3000,8,8,BTREE_FORMAT_COLUMNAR);
+}
+
+static void CrashEmpty(const char *filestem, const SIZE_T cachesize)
+{
+  DiskSystem disk((char *)filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(8,8,&cache);
+
+  CHECK(cache.Attach()==ERROR_NOERROR);
+  CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+}
+
+// What Fill does to a model, without an index
+static void FillModel(Model &model, const int seed, const SIZE_T numops)
+{
+  srand(seed);
+  for (SIZE_T i=0;i<numops;i++) {
+    string key=MakeKey(rand()%(numops/2),8);
+    string value=RandomValue(BTREE_FORMAT_COLUMNAR,8);
+    switch (rand()%6) {
+    case 0:
+    case 1:
+      model.insert(make_pair(key,value));
+      break;
+    case 2:
+      if (model.count(key)) { model[key]=value; }
+      break;
+    case 3:
+      model[key]=value;
+      break;
+    default:
+      model.erase(key);
+      break;
+    }
+  }
+}
+
+static int TestRecover(const char *filestem, const SIZE_T cachesize)
+{
+  SIZE_T superblock;
+  {
+    // Every acknowledged operation is in the log
+    Model model;
+    Crash(CrashIndex,filestem,cachesize);
+    FillModel(model,1,20000);
+    DiskSystem disk((char *)filestem);
+    BufferCache cache(&disk,cachesize);
+    BTreeIndex btree(0,0,&cache);
+    CHECK(cache.Attach()==ERROR_NOERROR);
+    CHECK(btree.Attach(0)==ERROR_NOERROR);
+    Verify(btree,model);
+    CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+    CHECK(cache.Detach()==ERROR_NOERROR);
+    cout << "recover index ok"<<endl;
+  }
+  {
+    // And of all the indexes of a catalog, including a drop
+    Model a, b, z;
+    Crash(CrashCatalog,filestem,cachesize);
+    FillModel(a,1,5000);
+    FillModel(b,2,5000);
+    FillModel(a,3,3000);
+    DiskSystem disk((char *)filestem);
+    BufferCache cache(&disk,cachesize);
+    BTreeCatalog catalog(&cache);
+    vector<string> names;
+    CHECK(cache.Attach()==ERROR_NOERROR);
+    CHECK(catalog.Attach()==ERROR_NOERROR);
+    CHECK(catalog.List(names)==ERROR_NOERROR);
+    CHECK(names.size()==2);
+    BTreeIndex ia, ib, iz(8,8,&cache);
+    CHECK(catalog.Open("a",ia)==ERROR_NOERROR);
+    CHECK(catalog.Open("b",ib)==ERROR_NOERROR);
+    Verify(ia,a);
+    Verify(ib,b);
+    // The dropped index's blocks are free, and not also in use
+    CHECK(catalog.Create("z",iz)==ERROR_NOERROR);
+    Fill(iz,z,11,20000,8,8,BTREE_FORMAT_COLUMNAR);
+    Verify(iz,z);
+    Verify(ia,a);
+    Verify(ib,b);
+    CHECK(ia.Detach(superblock)==ERROR_NOERROR);
+    CHECK(ib.Detach(superblock)==ERROR_NOERROR);
+    CHECK(iz.Detach(superblock)==ERROR_NOERROR);
+    CHECK(catalog.Detach()==ERROR_NOERROR);
+    CHECK(cache.Detach()==ERROR_NOERROR);
+    cout << "recover catalog ok"<<endl;
+  }
+  {
+    // A new index's log does not replay the groups of an old one
+    Model model;
+    Crash(CrashIndex,filestem,cachesize);
+    Crash(CrashEmpty,filestem,cachesize);
+    DiskSystem disk((char *)filestem);
+    BufferCache cache(&disk,cachesize);
+    BTreeIndex btree(0,0,&cache);
+    CHECK(cache.Attach()==ERROR_NOERROR);
+    CHECK(btree.Attach(0)==ERROR_NOERROR);
+    Verify(btree,model);
+    CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+    CHECK(cache.Detach()==ERROR_NOERROR);
+    cout << "recover over an old log ok"<<endl;
+  }
+  return 0;
+}
+
+
+static int TestAbort(BufferCache &cache)
+{
+  SIZE_T superblock;
+  {
+    // Inserts that fill the disk fail, and change nothing
+    BTreeIndex btree(8,300,&cache);
+    Model model;
+    SIZE_T failures=0;
+    srand(3);
+    CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+    while (failures<50) {
+      string key=MakeKey(rand()%10000000,8);
+      string value=MakeValue(rand(),300);
+      ERROR_T rc=btree.Insert(MakeBlock(key),MakeBlock(value));
+      if (rc==ERROR_NOERROR) {
+	model[key]=value;
+      } else {
+	CHECK(rc==ERROR_NOSPACE || (rc==ERROR_CONFLICT && model.count(key)));
+	failures += rc==ERROR_NOSPACE;
+      }
+    }
+    Verify(btree,model);
+    // and deletes still work on a full disk
+    for (SIZE_T i=0;i<2000;i++) {
+      Delete(btree,model,model.begin()->first);
+    }
+    Verify(btree,model);
+    CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+    BTreeIndex again(0,0,&cache);
+    CHECK(again.Attach(superblock)==ERROR_NOERROR);
+    Verify(again,model);
+    CHECK(again.Detach(superblock)==ERROR_NOERROR);
+    cout << "abort on a full disk ok"<<endl;
+  }
+  {
+    // An operation too big for the log changes nothing either
+    BTreeIndex btree(8,8,&cache);
+    Model model;
+    btree.SetLogSize(8);
+    CHECK(btree.Attach(0,true)==ERROR_NOERROR);
+    for (SIZE_T i=0;i<20000;i++) {
+      model[MakeKey(i,8)]=MakeValue(i,8);
+      CHECK(btree.Insert(MakeBlock(MakeKey(i,8)),MakeBlock(MakeValue(i,8)))==ERROR_NOERROR);
+    }
+    CHECK(btree.DeleteRange(MakeBlock(MakeKey(0,8)),MakeBlock(MakeKey(20000,8)))==ERROR_NOSPACE);
+    Verify(btree,model);
+    CHECK(btree.DeleteRange(MakeBlock(MakeKey(100,8)),MakeBlock(MakeKey(110,8)))==ERROR_NOERROR);
+    model.erase(model.lower_bound(MakeKey(100,8)),model.upper_bound(MakeKey(110,8)));
+    Verify(btree,model);
+    CHECK(btree.Detach(superblock)==ERROR_NOERROR);
+    cout << "abort of an operation too big for the log ok"<<endl;
+  }
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  string test;
+  ERROR_T rc;
+  int ret=0;
+
+  if (argc!=4) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  test=argv[3];
+
+  if (test!="all" && test!="model" && test!="batch" && test!="overflow" &&
+      test!="tombstone" && test!="range" && test!="postings" && test!="bulk" && test!="catalog" &&
+      test!="recover" && test!="abort") {
+    usage();
+    return -1;
+  }
+
+  // This one opens the disk itself, again and again
+  if (test=="recover" || test=="all") {
+    ret=TestRecover(filestem,cachesize);
+    if (test=="recover" || ret) {
+      return ret;
+    }
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if (!ret && (test=="model" || test=="all")) { ret=TestModel(cache); }
+  if (!ret && (test=="batch" || test=="all")) { ret=TestBatch(cache); }
+  if (!ret && (test=="overflow" || test=="all")) { ret=TestOverflow(cache); }
+  if (!ret && (test=="tombstone" || test=="all")) { ret=TestTombstone(cache); }
+  if (!ret && (test=="range" || test=="all")) { ret=TestRange(cache); }
+  if (!ret && (test=="postings" || test=="all")) { ret=TestPostings(cache); }
+  if (!ret && (test=="bulk" || test=="all")) { ret=TestBulk(cache); }
+  if (!ret && (test=="catalog" || test=="all")) { ret=TestCatalog(cache); }
+  if (!ret && (test=="abort" || test=="all")) { ret=TestAbort(cache); }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (!ret) {
+    cout << "all tests passed"<<endl;
+  }
+  return ret;
+}
@@ -1,4 +1,5 @@
 #include "buffercache.h"
+#include "writeaheadlog.h"
 
 ERROR_T BufferCache::CheckDeleteOldest()
 {
@@ -17,6 +18,10 @@ ERROR_T BufferCache::CheckDeleteOldest()
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
+       if (wal && (*i).second.dirty && wal->IsUncommitted((*i).first)) {
+	 // no-steal: this block can't go home until its operation commits
+	 continue;
+       }
        if ((*i).second.lastaccessed<oldest) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
@@ -28,6 +33,14 @@ ERROR_T BufferCache::CheckDeleteOldest()
   if (oldestptr!=blockmap.end()) { 
     if ((*oldestptr).second.dirty) {
       double reqtime;
+      WaitForDisk();
+      if (wal && wal->IsUnforced((*oldestptr).first)) { 
+	// write-ahead: its log records must reach the disk first
+	int rc=wal->Force();
+	if (rc!=ERROR_NOERROR) { 
+	  return rc;
+	}
+      }
       int rc=disk->Write((*oldestptr).first,
 			 (*oldestptr).second,
 			 reqtime);
@@ -37,16 +50,71 @@ ERROR_T BufferCache::CheckDeleteOldest()
 	return rc;
       }
     }
+    arrivals.erase((*oldestptr).first);
     blockmap.erase(oldestptr);
   }
   return ERROR_NOERROR;
 }
 
+
+void BufferCache::WaitForDisk()
+{
+  if (diskfree>curtime) { 
+    curtime=diskfree;
+  }
+}
+
+
+ERROR_T BufferCache::IssuePrefetches()
+{
+  set<SIZE_T>::iterator i=prefetchqueue.begin();
+  double start = diskfree>curtime ? diskfree : curtime;
+  ERROR_T rc=ERROR_NOERROR;
+
+  while (i!=prefetchqueue.end() && rc==ERROR_NOERROR) { 
+    // Blocks read meanwhile don't need to be fetched again
+    if (blockmap.find(*i)!=blockmap.end()) { 
+      ++i;
+      continue;
+    }
+    SIZE_T first=*i;
+    SIZE_T num=1;
+    for (++i; i!=prefetchqueue.end() && *i==first+num && blockmap.find(*i)==blockmap.end(); ++i) { 
+      num++;
+    }
+
+    vector<Block> blocks;
+    double reqtime;
+    rc=disk->Read(first,num,blocks,reqtime);
+    diskreads++;
+    if (rc!=ERROR_NOERROR) { 
+      break;
+    }
+    start+=reqtime;
+    for (SIZE_T j=0;j<num;j++) { 
+      // If making room fails, the rest of the prefetches are dropped
+      rc=CheckDeleteOldest();
+      if (rc!=ERROR_NOERROR) { 
+	break;
+      }
+      blocks[j].lastaccessed=curtime;
+      blocks[j].dirty=false;
+      blockmap.emplace(first+j,move(blocks[j]));
+      arrivals[first+j]=start;
+      prefetches++;
+    }
+  }
+  diskfree=start;
+  prefetchqueue.clear();
+  return rc;
+}
+
 BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
+   disk(d), wal(0), cachesize(cs), curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
+   diskreads(0), diskwrites(0), diskfree(0), 
+   prefetches(0), prefetchhits(0)
 {}
 
 
@@ -61,6 +129,8 @@ BufferCache::~BufferCache()
 ERROR_T BufferCache::Attach()
 {
   blockmap.clear();
+  prefetchqueue.clear();
+  arrivals.clear();
   return ERROR_NOERROR;
 }
 
@@ -68,6 +138,17 @@ ERROR_T BufferCache::Detach()
 {
   // write out all of our data and then throw it away
 
+  prefetchqueue.clear();
+  arrivals.clear();
+  WaitForDisk();
+
+  if (wal) { 
+    int rc=wal->Force();
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
@@ -129,15 +210,47 @@ bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+{
+  const Block *b;
+
+  ERROR_T rc = ReadBlockInPlace(inblocknum,b);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  outblock=*b;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::ReadBlockInPlace(const SIZE_T inblocknum, const Block *&outblock) 
 {
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  map<SIZE_T, double>::iterator arrival;
+
+  // A read that the cache can answer leaves the queue to grow, so 
+  // that the blocks asked for meanwhile go to the disk together
+  if (!prefetchqueue.empty() && blockmap.find(inblocknum)==blockmap.end()) { 
+    ERROR_T rc=IssuePrefetches();
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
 
   b = blockmap.find(inblocknum);
 
   if (b!=blockmap.end()) {
+    arrival=arrivals.find(inblocknum);
+    if (arrival!=arrivals.end()) { 
+      // Prefetched, so wait for it if it is still on its way
+      if ((*arrival).second>curtime) { 
+	curtime=(*arrival).second;
+      }
+      arrivals.erase(arrival);
+      prefetchhits++;
+    }
     // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
     (*b).second.lastaccessed=curtime;
+    outblock=&((*b).second);
     reads++;
     return ERROR_NOERROR;
   } else {
@@ -150,31 +263,51 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
       }
     }
     double reqtime;
+    Block newblock;
+    WaitForDisk();
     int rc = disk->Read(inblocknum,
-			outblock,
+			newblock,
 			reqtime);
     curtime+=reqtime;
     diskreads++;
     if (rc!=ERROR_NOERROR) { 
       return rc;
     } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
+      newblock.lastaccessed=curtime;
+      newblock.dirty=false;
+      b=blockmap.emplace(inblocknum,move(newblock)).first;
+      outblock=&((*b).second);
       reads++;
       return ERROR_NOERROR;
     }
   }
 } 
  
+const Block *BufferCache::PeekBlock(const SIZE_T blocknum) const
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b;
+
+  b = blockmap.find(blocknum);
+  return b==blockmap.end() ? 0 : &((*b).second);
+}
+
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(inblocknum);
 
+  if (wal) { 
+    ERROR_T rc=wal->LogBlock(inblocknum,inblock,b!=blockmap.end() ? &((*b).second) : 0);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
   if (b!=blockmap.end()) {
     // It's in  cache, so just replace the block
+    // (if it was prefetched, there is no need to wait for it now)
+    arrivals.erase(inblocknum);
     (*b).second=inblock;
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
@@ -188,10 +321,9 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
-    Block myblock=inblock;
+    Block &myblock=(*(blockmap.emplace(inblocknum,inblock).first)).second;
     myblock.lastaccessed=curtime;
     myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
     writes++;
     return ERROR_NOERROR;
   }
@@ -199,8 +331,18 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
   
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  if (blocknum>=GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  if (blockmap.find(blocknum)!=blockmap.end() || 
+      prefetchqueue.find(blocknum)!=prefetchqueue.end()) { 
+    return ERROR_NOERROR;
+  }
+  if (4*(prefetchqueue.size()+arrivals.size()+1)>cachesize) { 
+    return ERROR_NOFETCH;
+  }
+  prefetchqueue.insert(blocknum);
+  return ERROR_NOERROR;
 }
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
@@ -215,6 +357,17 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
     if ((*b).second.dirty) { 
       double reqtime;
       int rc;
+      if (wal && wal->IsUncommitted(blocknum)) { 
+	// stays cached until its operation commits
+	return ERROR_NOERROR;
+      }
+      if (wal && wal->IsUnforced(blocknum)) { 
+	rc=wal->Force();
+	if (rc!=ERROR_NOERROR) { 
+	  return rc;
+	}
+      }
+      WaitForDisk();
       rc=disk->Write((*b).first,
 		     (*b).second,
 		     reqtime);
@@ -224,11 +377,90 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 	return rc;
       }
     }
+    arrivals.erase(blocknum);
     blockmap.erase(b);
     return ERROR_NOERROR;
   }
 }
   
+ERROR_T BufferCache::WriteBackDirtyBlocks()
+{
+  if (wal) { 
+    ERROR_T rc=wal->Force();
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  WaitForDisk();
+  // blockmap is in block order, so this is one sweep across the disk
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+	 i!=blockmap.end();
+	 ++i) {
+    if ((*i).second.dirty) { 
+      if (wal && wal->IsUncommitted((*i).first)) { 
+	continue;
+      }
+      double reqtime;
+      int rc=disk->Write((*i).first,
+			 (*i).second,
+			 reqtime);
+      curtime+=reqtime;
+      diskwrites++;
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+      (*i).second.dirty=false;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UndoBlock(const SIZE_T blocknum, const Block *image)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+  if (b==blockmap.end()) { 
+    // no-steal kept it cached, so this should not happen
+    return ERROR_NOSUCHBLOCK;
+  }
+  if (image) { 
+    double lastaccessed=(*b).second.lastaccessed;
+    (*b).second=*image;
+    (*b).second.lastaccessed=lastaccessed;
+    (*b).second.dirty=true;
+  } else {
+    arrivals.erase(blocknum);
+    blockmap.erase(b);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::ReadBlocksUncached(const SIZE_T inblocknum,
+					const SIZE_T numblocks,
+					vector<Block> &outblocks)
+{
+  double reqtime;
+  WaitForDisk();
+  ERROR_T rc=disk->Read(inblocknum,numblocks,outblocks,reqtime);
+  curtime+=reqtime;
+  diskreads++;
+  return rc;
+}
+
+ERROR_T BufferCache::WriteBlocksUncached(const SIZE_T inblocknum,
+					 const SIZE_T numblocks,
+					 const vector<Block> &inblocks)
+{
+  double reqtime;
+  WaitForDisk();
+  ERROR_T rc=disk->Write(inblocknum,numblocks,inblocks,reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  return rc;
+}
+  
 ostream & BufferCache::Print(ostream &os) const
 {
   os << "BufferCache(cachesize="<<cachesize
@@ -240,6 +472,8 @@ ostream & BufferCache::Print(ostream &os) const
      << ", writes="<<writes
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
+     << ", prefetches="<<prefetches
+     << ", prefetchhits="<<prefetchhits
      << ", blocks = {";
 
   
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +11,8 @@
 
 using namespace std;
 
+class WriteAheadLog;
+
 struct cache_compare_lessthan {
   bool operator()(const SIZE_T s1, const SIZE_T s2) const {
     return s1<s2;
@@ -18,19 +21,40 @@ struct cache_compare_lessthan {
 
 
 //
-// LRU block cache with single step prefetch
+// LRU block cache with asynchronous prefetch
 //
 // Write Back
 // Write Allocate
+//
+// If a write-ahead log is attached, every block write is logged,
+// blocks with uncommitted changes are never written back, and
+// the log is forced before a block with committed changes is
+// written back.
 class BufferCache {
  private:
   DiskSystem *disk;
+  WriteAheadLog *wal;
   SIZE_T cachesize;
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  // Prefetching.  Requested blocks wait in prefetchqueue until the
+  // next read of a block that is not in the cache, and then go to 
+  // the disk together, in block order,
+  // with each run of consecutive blocks as one request.  They take
+  // the disk until diskfree, but time only passes for the reader
+  // when it reads one that has not arrived yet, or needs the disk.
+  set<SIZE_T> prefetchqueue;
+  map<SIZE_T, double> arrivals; // prefetched blocks not read yet, 
+                                // and when each is in the cache
+  double diskfree;
+  SIZE_T prefetches, prefetchhits;
  protected:
   ERROR_T CheckDeleteOldest();
+  // Sends the queued prefetches to the disk
+  ERROR_T IssuePrefetches();
+  // Waits out the prefetches the disk is still busy with
+  void    WaitForDisk();
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -65,6 +89,17 @@ class BufferCache {
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
   ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+
+  // Same as ReadBlock, but gives back the cached copy itself instead
+  // of copying it out.  The pointer is only good until the next call
+  // into the cache.
+  ERROR_T ReadBlockInPlace(const SIZE_T inblocknum, const Block *&outblock);
+  
+  // The cached copy of a block, or zero if it is not in the cache.
+  // This is not a read: it takes no time and does not touch the LRU
+  // order.  The pointer is only good until the next call into the
+  // cache.
+  const Block *PeekBlock(const SIZE_T blocknum) const;
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
@@ -75,11 +110,35 @@ class BufferCache {
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
+  // At most a quarter of the cache can be prefetched blocks that
+  // have not been read yet.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  // Write every dirty block to disk, keeping it in the cache
+  // Blocks with uncommitted changes are skipped
+  ERROR_T WriteBackDirtyBlocks();
+
+  // Read or write a run of blocks directly, bypassing the cache
+  // This is how the write-ahead log reaches its region of the disk
+  ERROR_T ReadBlocksUncached(const SIZE_T inblocknum,
+			     const SIZE_T numblocks,
+			     vector<Block> &outblocks);
+  ERROR_T WriteBlocksUncached(const SIZE_T inblocknum,
+			      const SIZE_T numblocks,
+			      const vector<Block> &inblocks);
+
+  // Puts back the image a block had before the operation in progress,
+  // without logging it, for WriteAheadLog::Abort.  With no image, the
+  // one at home is good, and the cached copy is dropped.
+  ERROR_T UndoBlock(const SIZE_T blocknum, const Block *image);
+
+  // Log to use for all subsequent writes (zero for none)
+  void SetLog(WriteAheadLog *log) { wal=log; }
+  WriteAheadLog *GetLog() const { return wal; }
   
  
   SIZE_T GetNumAllocs() const { return allocs; }
@@ -88,6 +147,10 @@ class BufferCache {
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  // Blocks read from disk by prefetches, and how many of them were
+  // read from the cache afterward
+  SIZE_T GetNumPrefetches() const { return prefetches;}
+  SIZE_T GetNumPrefetchHits() const { return prefetchhits;}
 
   ostream & Print(ostream &os) const;
   
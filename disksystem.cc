@@ -413,10 +413,10 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
 }
 
 
-ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
-			 const SIZE_T   numblock,
-			 vector<Block> &blocks,
-			 double        &reqtime)
+ERROR_T DiskSystem::ReadBlocks(const SIZE_T   inoffblock,
+			       const SIZE_T   numblock,
+			       Block         *blocks,
+			       double        &reqtime)
 {
   reqtime=0;
 
@@ -428,7 +428,10 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
   reqtime=ModelAccess(inoffblock,numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
-    Block b(blocksize);
+    Block &b=blocks[i];
+    if (b.Resize(blocksize,false)!=ERROR_NOERROR) { 
+      return ERROR_NOMEM;
+    }
     if (!IsBlockAllocated(inoffblock+i)) { 
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
@@ -438,16 +441,44 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
       cerr << "DiskSystem::Read: myread has failed"<<endl;
       return ERROR_IMPLBUG;
     }
-    blocks.push_back(b);
   }
 
   return ERROR_NOERROR;
 }
 
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 vector<Block> &blocks,
+			 double        &reqtime)
+{
+  SIZE_T first=blocks.size();
+
+  blocks.resize(first+numblock);
+
+  ERROR_T rc=ReadBlocks(inoffblock,numblock,&(blocks[first]),reqtime);
+
+  if (rc!=ERROR_NOERROR) { 
+    blocks.resize(first);
+  }
+  return rc;
+}
+
 ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 			  const SIZE_T   numblock,
 			  const vector<Block> &blocks,
 			  double        &reqtime)
+{
+  if (blocks.size()<numblock) { 
+    reqtime=0;
+    return ERROR_SIZE;
+  }
+  return WriteBlocks(inoffblock,numblock,numblock ? &(blocks[0]) : 0,reqtime);
+}
+
+ERROR_T DiskSystem::WriteBlocks(const SIZE_T   inoffblock,
+				const SIZE_T   numblock,
+				const Block   *blocks,
+				double        &reqtime)
 {
   reqtime=0;
 
@@ -470,38 +501,25 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
     }
   }
 
+  // A completed write must survive the process going away
+  // (the write-ahead log depends on this)
+  if (fflush(datafilefd)!=0) { 
+    cerr << "DiskSystem::Write: fflush has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+
   return ERROR_NOERROR;
 }
 
 
 ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
 {
-  vector<Block> bl;
-
-  ERROR_T rc = Read(inoffblock,1,bl,reqtime);
-
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
-
-  blocks = bl[0];
-
-  return ERROR_NOERROR;
+  return ReadBlocks(inoffblock,1,&blocks,reqtime);
 }
 
 ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &reqtime)
 {
-  vector<Block> bl;
-
-  bl.push_back(blocks);
-
-  ERROR_T rc = Write(inoffblock,1,bl,reqtime);
-
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
-
-  return ERROR_NOERROR;
+  return WriteBlocks(inoffblock,1,&blocks,reqtime);
 }
 
 
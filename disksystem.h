@@ -51,6 +51,17 @@ class DiskSystem {
   ERROR_T WriteConfig();
   ERROR_T ReadBitMap();
   ERROR_T WriteBitMap();
+
+  // blocks must point to numblock blocks
+  // Reading resizes each one to the block size
+  ERROR_T ReadBlocks(const SIZE_T inoffblock,
+		     const SIZE_T numblock,
+		     Block *blocks,
+		     double &reqtime);
+  ERROR_T WriteBlocks(const SIZE_T inoffblock,
+		      const SIZE_T numblock,
+		      const Block *blocks,
+		      double &reqtime);
   
    
  public:
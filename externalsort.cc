@@ -0,0 +1,400 @@
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#include "externalsort.h"
+
+using namespace std;
+
+
+// Reads a run back a few blocks at a time
+class ExternalSort::RunReader {
+ private:
+  BufferCache   *scratch;
+  SIZE_T         recordsize;
+  SIZE_T         nextblock;   // of the run, to read next
+  SIZE_T         blocksleft;  // of the run, still on disk
+  SIZE_T         recordsleft; // not yet moved past
+  SIZE_T         numbufblocks;
+  vector<BYTE_T> bytes;
+  SIZE_T         start, end;  // of the bytes read but not used yet
+
+ public:
+  RunReader(BufferCache *s, const Run &run, const SIZE_T recsize, const SIZE_T bufblocks) :
+    scratch(s), recordsize(recsize), nextblock(run.block),
+    blocksleft((run.numrecords*recsize+s->GetBlockSize()-1)/s->GetBlockSize()),
+    recordsleft(run.numrecords), numbufblocks(bufblocks),
+    bytes(recsize+bufblocks*s->GetBlockSize()), start(0), end(0)
+  {}
+
+  bool AtEnd() const { return recordsleft==0; }
+  const BYTE_T *Current() const { return &bytes[start]; }
+
+  // Makes sure all of the current record has been read, if there is one
+  ERROR_T Fill() {
+    while (recordsleft>0 && end-start<recordsize) {
+      vector<Block> blocks;
+      SIZE_T n = blocksleft<numbufblocks ? blocksleft : numbufblocks;
+      ERROR_T rc;
+
+      if (n==0) {
+	return ERROR_INSANE;
+      }
+      memmove(&bytes[0],&bytes[start],end-start);
+      end-=start;
+      start=0;
+      rc=scratch->ReadBlocksUncached(nextblock,n,blocks);
+      if (rc!=ERROR_NOERROR) {
+	return rc;
+      }
+      for (SIZE_T i=0; i<n; i++) {
+	memcpy(&bytes[end],blocks[i].data,blocks[i].length);
+	end+=blocks[i].length;
+      }
+      nextblock+=n;
+      blocksleft-=n;
+    }
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Advance() {
+    start+=recordsize;
+    recordsleft--;
+    return Fill();
+  }
+};
+
+
+// Writes a run a few blocks at a time
+class RunWriter {
+ private:
+  BufferCache  *scratch;
+  SIZE_T        nextblock;
+  vector<Block> blocks;
+  SIZE_T        used;  // bytes of blocks
+
+ protected:
+  ERROR_T Write(const SIZE_T numblocks) {
+    ERROR_T rc;
+
+    if (nextblock+numblocks>scratch->GetNumBlocks()) {
+      return ERROR_NOSPACE;
+    }
+    rc=scratch->WriteBlocksUncached(nextblock,numblocks,blocks);
+    nextblock+=numblocks;
+    used=0;
+    return rc;
+  }
+
+ public:
+  RunWriter(BufferCache *s, const SIZE_T block, const SIZE_T bufblocks) :
+    scratch(s), nextblock(block), blocks(bufblocks,Block(s->GetBlockSize())), used(0)
+  {}
+
+  ERROR_T Put(const BYTE_T *bytes, SIZE_T len) {
+    const SIZE_T blocksize=scratch->GetBlockSize();
+
+    while (len>0) {
+      SIZE_T n = blocksize-used%blocksize;
+      if (n>len) {
+	n=len;
+      }
+      memcpy(blocks[used/blocksize].data+used%blocksize,bytes,n);
+      used+=n;
+      bytes+=n;
+      len-=n;
+      if (used==blocks.size()*blocksize) {
+	ERROR_T rc=Write(blocks.size());
+	if (rc!=ERROR_NOERROR) {
+	  return rc;
+	}
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  // Writes what is left, and gives the block after the run
+  ERROR_T Finish(SIZE_T &after) {
+    const SIZE_T blocksize=scratch->GetBlockSize();
+    ERROR_T rc=ERROR_NOERROR;
+
+    if (used>0) {
+      memset(blocks[used/blocksize].data+used%blocksize,0,(blocksize-used%blocksize)%blocksize);
+      rc=Write((used+blocksize-1)/blocksize);
+    }
+    after=nextblock;
+    return rc;
+  }
+};
+
+
+// Orders records in memory by their keys
+struct RecordLess {
+  const BYTE_T *records;
+  SIZE_T        recordsize;
+  SIZE_T        keysize;
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    return memcmp(records+a*recordsize,records+b*recordsize,keysize)<0;
+  }
+};
+
+// Orders readers so that the one with the smallest key is on top of
+// a heap
+struct ReaderGreater {
+  const vector<ExternalSort::RunReader *> *readers;
+  SIZE_T keysize;
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    return memcmp((*readers)[a]->Current(),(*readers)[b]->Current(),keysize)>0;
+  }
+};
+
+// One thread's share of a load of records: it sorts the numbers of
+// records from first to last
+static void SortShare(const RecordLess less, SIZE_T *order, const SIZE_T first, const SIZE_T last)
+{
+  for (SIZE_T i=first; i<last; i++) {
+    order[i]=i;
+  }
+  sort(order+first,order+last,less);
+}
+
+
+ExternalSort::ExternalSort(BufferCache *s,
+			   const SIZE_T ks,
+			   const SIZE_T vs,
+			   const SIZE_T mem,
+			   const SIZE_T threads) :
+  scratch(s), keysize(ks), valuesize(vs), memory(mem),
+  numthreads(threads>0 ? threads : 1), nextblock(0), record(ks+vs),
+  numrecords(0), numinitialruns(0), nummergepasses(0)
+{}
+
+
+ExternalSort::~ExternalSort()
+{
+  CloseReaders();
+}
+
+
+ERROR_T ExternalSort::MakeRuns(FILE *in)
+{
+  const SIZE_T recordsize=GetRecordSize();
+  const SIZE_T blocksize=scratch->GetBlockSize();
+  // The writer gets an eighth of the budget, and each record that is
+  // read takes its bytes and its place in the sorted order
+  const SIZE_T bufblocks = memory/blocksize/8>0 ? memory/blocksize/8 : 1;
+  const SIZE_T perload=(memory-bufblocks*blocksize)/(recordsize+sizeof(SIZE_T));
+  vector<BYTE_T> records(perload*recordsize);
+  vector<SIZE_T> order(perload);
+  RecordLess less;
+  ERROR_T rc;
+
+  if (perload==0) {
+    return ERROR_SIZE;
+  }
+  less.records=&records[0];
+  less.recordsize=recordsize;
+  less.keysize=keysize;
+
+  while (1) {
+    SIZE_T got=fread(&records[0],1,perload*recordsize,in);
+    SIZE_T n=got/recordsize;
+    SIZE_T shares = n<numthreads ? n : numthreads;
+    vector<thread> threads;
+
+    if (ferror(in)) {
+      return ERROR_GENERAL;
+    }
+    if (got%recordsize!=0) {
+      return ERROR_SIZE;
+    }
+    if (n==0) {
+      break;
+    }
+    numrecords+=n;
+
+    // Share t is records n*t/shares up to n*(t+1)/shares, and this
+    // thread sorts the first one
+    for (SIZE_T t=1; t<shares; t++) {
+      threads.push_back(thread(SortShare,less,&order[0],n*t/shares,n*(t+1)/shares));
+    }
+    SortShare(less,&order[0],0,n/shares);
+    for (SIZE_T t=0; t<threads.size(); t++) {
+      threads[t].join();
+    }
+
+    for (SIZE_T t=0; t<shares; t++) {
+      RunWriter writer(scratch,nextblock,bufblocks);
+      Run run;
+      run.block=nextblock;
+      run.numrecords=n*(t+1)/shares-n*t/shares;
+      for (SIZE_T i=n*t/shares; i<n*(t+1)/shares; i++) {
+	rc=writer.Put(&records[order[i]*recordsize],recordsize);
+	if (rc!=ERROR_NOERROR) {
+	  return rc;
+	}
+      }
+      rc=writer.Finish(nextblock);
+      if (rc!=ERROR_NOERROR) {
+	return rc;
+      }
+      runs.push_back(run);
+    }
+
+    if (got<perload*recordsize) {
+      break;
+    }
+  }
+  numinitialruns=runs.size();
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T ExternalSort::OpenReaders(const SIZE_T first, const SIZE_T count)
+{
+  // The readers and a writer share the budget
+  const SIZE_T numblocks=memory/scratch->GetBlockSize()/(count+1);
+  ReaderGreater greater;
+  ERROR_T rc;
+
+  CloseReaders();
+  for (SIZE_T i=0; i<count; i++) {
+    readers.push_back(new RunReader(scratch,runs[first+i],GetRecordSize(),numblocks>0 ? numblocks : 1));
+    rc=readers.back()->Fill();
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    if (!readers.back()->AtEnd()) {
+      heap.push_back(i);
+    }
+  }
+  greater.readers=&readers;
+  greater.keysize=keysize;
+  make_heap(heap.begin(),heap.end(),greater);
+  return ERROR_NOERROR;
+}
+
+
+void ExternalSort::CloseReaders()
+{
+  for (SIZE_T i=0; i<readers.size(); i++) {
+    delete readers[i];
+  }
+  readers.clear();
+  heap.clear();
+}
+
+
+ERROR_T ExternalSort::NextRecord(BYTE_T *record)
+{
+  ReaderGreater greater;
+  RunReader *reader;
+  ERROR_T rc;
+
+  if (heap.empty()) {
+    return ERROR_NONEXISTENT;
+  }
+  greater.readers=&readers;
+  greater.keysize=keysize;
+  pop_heap(heap.begin(),heap.end(),greater);
+  reader=readers[heap.back()];
+  memcpy(record,reader->Current(),GetRecordSize());
+  rc=reader->Advance();
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (reader->AtEnd()) {
+    heap.pop_back();
+  } else {
+    push_heap(heap.begin(),heap.end(),greater);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T ExternalSort::MergeRuns(const SIZE_T first, const SIZE_T count, Run &merged)
+{
+  const SIZE_T numblocks=memory/scratch->GetBlockSize()/(count+1);
+  RunWriter writer(scratch,nextblock,numblocks>0 ? numblocks : 1);
+  vector<BYTE_T> record(GetRecordSize());
+  ERROR_T rc;
+
+  merged.block=nextblock;
+  merged.numrecords=0;
+  rc=OpenReaders(first,count);
+  while (rc==ERROR_NOERROR && (rc=NextRecord(&record[0]))==ERROR_NOERROR) {
+    merged.numrecords++;
+    rc=writer.Put(&record[0],record.size());
+  }
+  CloseReaders();
+  if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+  return writer.Finish(nextblock);
+}
+
+
+ERROR_T ExternalSort::Sort(FILE *in)
+{
+  const SIZE_T blocksize=scratch->GetBlockSize();
+  // Runs merged at once, each with a block of the budget at least,
+  // along with the one they are merged into
+  SIZE_T fanin=memory/blocksize-1;
+  SIZE_T runblocks;
+  ERROR_T rc;
+
+  if (memory<EXTSORT_MIN_BLOCKS*blocksize+GetRecordSize()) {
+    return ERROR_SIZE;
+  }
+  CloseReaders();
+  runs.clear();
+  nextblock=0;
+  numrecords=numinitialruns=nummergepasses=0;
+
+  rc=MakeRuns(in);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  // Passes take turns writing after the first runs and over them
+  runblocks=nextblock;
+  while (runs.size()>fanin) {
+    vector<Run> merged;
+    nextblock = nummergepasses%2==0 ? runblocks : 0;
+    // As few merges as the fan-in allows, of runs spread evenly
+    // among them.  A run left on its own is still copied, since the
+    // pass after this one writes over where it is.
+    SIZE_T nummerges=(runs.size()+fanin-1)/fanin;
+    for (SIZE_T m=0; m<nummerges; m++) {
+      SIZE_T first=runs.size()*m/nummerges;
+      Run run;
+      rc=MergeRuns(first,runs.size()*(m+1)/nummerges-first,run);
+      if (rc!=ERROR_NOERROR) {
+	return rc;
+      }
+      merged.push_back(run);
+    }
+    runs.swap(merged);
+    nummergepasses++;
+  }
+
+  return OpenReaders(0,runs.size());
+}
+
+
+ERROR_T ExternalSort::Next(KeyValuePair &pair)
+{
+  ERROR_T rc;
+
+  rc=NextRecord(&record[0]);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  pair.key.Resize(keysize,false);
+  memcpy(pair.key.data,&record[0],keysize);
+  pair.value.Resize(valuesize,false);
+  memcpy(pair.value.data,&record[keysize],valuesize);
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,108 @@
+#ifndef _externalsort
+#define _externalsort
+
+#include <stdio.h>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+#include "buffercache.h"
+#include "btree.h"
+
+using namespace std;
+
+// Fewest bytes of memory a sort can be given: room for a record and
+// a few blocks of the scratch disk
+#define EXTSORT_MIN_BLOCKS 3
+
+//
+// External merge sort of fixed-size key/value records
+//
+// Sort reads records from a file that can be far bigger than memory.
+// Each one is keysize bytes of key followed by valuesize bytes of
+// value.  It reads as many as fit in its memory budget, and splits
+// them among its threads, which each sort their share.  Each share is
+// then written to the scratch disk as a sorted run, in sequential
+// multi-block writes.
+//
+// If there are more runs than the budget can merge at once, it merges
+// them into longer runs, as many at a time as it can, until there
+// are few enough.  The last merge is left to Next, which hands out
+// the records in key order, so they can go straight to
+// BTreeIndex::BulkLoad.
+//
+// The scratch disk is written from its first block on, one run after
+// another.  Merge passes take turns writing after the first runs and
+// over them, so it has to hold the records once, or twice if there
+// are any merge passes.  Its time is kept by its own buffer cache.
+//
+class ExternalSort : public BTreePairSource {
+ public:
+  // A sorted run on the scratch disk
+  struct Run {
+    SIZE_T block;      // its first block
+    SIZE_T numrecords;
+  };
+
+  class RunReader;
+
+ private:
+  BufferCache *scratch;
+  SIZE_T       keysize;
+  SIZE_T       valuesize;
+  SIZE_T       memory;
+  SIZE_T       numthreads;
+
+  vector<Run>  runs;
+  SIZE_T       nextblock;  // of the scratch disk, for the next run
+  vector<RunReader *> readers;  // of the last merge
+  vector<SIZE_T> heap;     // of readers, with the smallest key on top
+  vector<BYTE_T> record;   // the one Next hands out
+
+  SIZE_T       numrecords, numinitialruns, nummergepasses;
+
+ protected:
+  SIZE_T  GetRecordSize() const { return keysize+valuesize; }
+  // Fills memory with records from in, over and over, and writes
+  // sorted runs of them
+  ERROR_T MakeRuns(FILE *in);
+  // Merges count runs, from first on, into one new run
+  ERROR_T MergeRuns(const SIZE_T first, const SIZE_T count, Run &merged);
+  // Opens readers on count runs, from first on, sharing the budget
+  ERROR_T OpenReaders(const SIZE_T first, const SIZE_T count);
+  void    CloseReaders();
+  // Takes the smallest record off the heap of readers, and moves its
+  // reader on
+  ERROR_T NextRecord(BYTE_T *record);
+
+ public:
+  // Sorts records of keysize and valuesize bytes using at most memory
+  // bytes and numthreads threads, with scratch for the runs
+  ExternalSort(BufferCache *scratch,
+	       const SIZE_T keysize,
+	       const SIZE_T valuesize,
+	       const SIZE_T memory,
+	       const SIZE_T numthreads=1);
+  ExternalSort() { throw GenericException(); }
+  ExternalSort(const ExternalSort &rhs) { throw GenericException(); }
+  ExternalSort & operator=(const ExternalSort &rhs) { throw GenericException(); return *this; }
+  virtual ~ExternalSort();
+
+  // Reads all the records of in, and sorts them, up to the last merge
+  // return ERROR_SIZE if in does not hold a whole number of records,
+  //   or memory is too small to sort in
+  // return ERROR_NOSPACE if the scratch disk fills up
+  ERROR_T Sort(FILE *in);
+
+  // The records in key order, as pairs, once Sort is done
+  ERROR_T Next(KeyValuePair &pair);
+
+  SIZE_T GetNumRecords() const { return numrecords; }
+  // Sorted runs made from the input, before any merging
+  SIZE_T GetNumInitialRuns() const { return numinitialruns; }
+  // Passes over the records that merged runs into longer runs,
+  // not counting the last merge
+  SIZE_T GetNumMergePasses() const { return nummergepasses; }
+};
+
+#endif
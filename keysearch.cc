@@ -0,0 +1,300 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "keysearch.h"
+
+// The vector kernels are compiled for their instruction sets with
+// target attributes, so the rest of the library does not need them,
+// and are only called once the CPU has said it supports them.
+
+#define PREFIX_SIGN 0x8000000000000000ULL
+
+static SIZE_T CountLessPrefixesScalar(const BYTE_T *prefixes, const SIZE_T n, const KEYPREFIX_T prefix)
+{
+  SIZE_T count=0;
+
+  for (SIZE_T i=0;i<n;i++) {
+    KEYPREFIX_T x;
+    memcpy(&x,prefixes+i*sizeof(KEYPREFIX_T),sizeof(x));
+    count+=(x<prefix);
+  }
+  return count;
+}
+
+
+// SSE4.2 and AVX2 only compare signed 64 bit integers, so both sides
+// get their sign bit flipped, which turns unsigned order into signed
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountLessPrefixesSSE(const BYTE_T *prefixes, const SIZE_T n, const KEYPREFIX_T prefix)
+{
+  const __m128i sign=_mm_set1_epi64x(PREFIX_SIGN);
+  const __m128i p=_mm_xor_si128(_mm_set1_epi64x(prefix),sign);
+  __m128i count=_mm_setzero_si128();
+  SIZE_T i;
+
+  for (i=0;i+2<=n;i+=2) {
+    __m128i x=_mm_loadu_si128((const __m128i *)(prefixes+i*sizeof(KEYPREFIX_T)));
+    // all ones (-1) in each lane where x<prefix
+    count=_mm_sub_epi64(count,_mm_cmpgt_epi64(p,_mm_xor_si128(x,sign)));
+  }
+  return _mm_cvtsi128_si64(count) + _mm_extract_epi64(count,1) +
+    CountLessPrefixesScalar(prefixes+i*sizeof(KEYPREFIX_T),n-i,prefix);
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T CountLessPrefixesAVX2(const BYTE_T *prefixes, const SIZE_T n, const KEYPREFIX_T prefix)
+{
+  const __m256i sign=_mm256_set1_epi64x(PREFIX_SIGN);
+  const __m256i p=_mm256_xor_si256(_mm256_set1_epi64x(prefix),sign);
+  __m256i count=_mm256_setzero_si256();
+  SIZE_T i;
+
+  for (i=0;i+4<=n;i+=4) {
+    __m256i x=_mm256_loadu_si256((const __m256i *)(prefixes+i*sizeof(KEYPREFIX_T)));
+    count=_mm256_sub_epi64(count,_mm256_cmpgt_epi64(p,_mm256_xor_si256(x,sign)));
+  }
+  __m128i c=_mm_add_epi64(_mm256_castsi256_si128(count),_mm256_extracti128_si256(count,1));
+  return _mm_cvtsi128_si64(c) + _mm_extract_epi64(c,1) +
+    CountLessPrefixesScalar(prefixes+i*sizeof(KEYPREFIX_T),n-i,prefix);
+}
+
+
+static SIZE_T CountLessKeysScalar(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n, const BYTE_T *probe)
+{
+  SIZE_T count=0;
+
+  for (SIZE_T i=0;i<n;i++) {
+    count+=(memcmp(keys+i*keysize,probe,keysize)<0);
+  }
+  return count;
+}
+
+
+// Given a mask of the bytes where a key and the probe are equal,
+// one bit per byte, is the key less than the probe?
+static inline SIZE_T KeyIsLess(const BYTE_T *key, const BYTE_T *probe, const unsigned eq, const SIZE_T keysize)
+{
+  unsigned ne = ~eq & (keysize<32 ? (1u<<keysize)-1 : ~0u);
+  if (!ne) {
+    return 0;
+  }
+  unsigned d=__builtin_ctz(ne);
+  return key[d]<probe[d];
+}
+
+
+// Keys of 4 or 8 bytes are compared several to a vector: each lane
+// is byte swapped into a big-endian integer and compared like a prefix
+
+static const BYTE_T swap32[32] = {3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+				  3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12};
+static const BYTE_T swap64[32] = {7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+				  7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8};
+
+static inline unsigned long long LoadBigEndian(const BYTE_T *p, const SIZE_T len)
+{
+  unsigned long long x=0;
+  for (SIZE_T i=0;i<len;i++) {
+    x=(x<<8)|p[i];
+  }
+  return x;
+}
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountLessPackedSSE(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n, const BYTE_T *probe)
+{
+  const SIZE_T perload=16/keysize;
+  const __m128i swap=_mm_loadu_si128((const __m128i *)(keysize==4 ? swap32 : swap64));
+  unsigned long long x=LoadBigEndian(probe,keysize);
+  __m128i count=_mm_setzero_si128();
+  SIZE_T i;
+
+  if (keysize==4) {
+    const __m128i sign=_mm_set1_epi32(0x80000000);
+    const __m128i p=_mm_xor_si128(_mm_set1_epi32((int)x),sign);
+    for (i=0;i+perload<=n;i+=perload) {
+      __m128i k=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(keys+i*keysize)),swap);
+      count=_mm_sub_epi32(count,_mm_cmpgt_epi32(p,_mm_xor_si128(k,sign)));
+    }
+    count=_mm_add_epi32(count,_mm_srli_si128(count,8));
+    count=_mm_add_epi32(count,_mm_srli_si128(count,4));
+    return _mm_cvtsi128_si32(count)+CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+  } else {
+    const __m128i sign=_mm_set1_epi64x(PREFIX_SIGN);
+    const __m128i p=_mm_xor_si128(_mm_set1_epi64x(x),sign);
+    for (i=0;i+perload<=n;i+=perload) {
+      __m128i k=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(keys+i*keysize)),swap);
+      count=_mm_sub_epi64(count,_mm_cmpgt_epi64(p,_mm_xor_si128(k,sign)));
+    }
+    return _mm_cvtsi128_si64(count)+_mm_extract_epi64(count,1)+
+      CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+  }
+}
+
+__attribute__((target("avx2")))
+static SIZE_T CountLessPackedAVX2(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n, const BYTE_T *probe)
+{
+  const SIZE_T perload=32/keysize;
+  const __m256i swap=_mm256_loadu_si256((const __m256i *)(keysize==4 ? swap32 : swap64));
+  unsigned long long x=LoadBigEndian(probe,keysize);
+  __m256i count=_mm256_setzero_si256();
+  SIZE_T i;
+
+  if (keysize==4) {
+    const __m256i sign=_mm256_set1_epi32(0x80000000);
+    const __m256i p=_mm256_xor_si256(_mm256_set1_epi32((int)x),sign);
+    for (i=0;i+perload<=n;i+=perload) {
+      __m256i k=_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(keys+i*keysize)),swap);
+      count=_mm256_sub_epi32(count,_mm256_cmpgt_epi32(p,_mm256_xor_si256(k,sign)));
+    }
+    __m128i c=_mm_add_epi32(_mm256_castsi256_si128(count),_mm256_extracti128_si256(count,1));
+    c=_mm_add_epi32(c,_mm_srli_si128(c,8));
+    c=_mm_add_epi32(c,_mm_srli_si128(c,4));
+    return _mm_cvtsi128_si32(c)+CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+  } else {
+    const __m256i sign=_mm256_set1_epi64x(PREFIX_SIGN);
+    const __m256i p=_mm256_xor_si256(_mm256_set1_epi64x(x),sign);
+    for (i=0;i+perload<=n;i+=perload) {
+      __m256i k=_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(keys+i*keysize)),swap);
+      count=_mm256_sub_epi64(count,_mm256_cmpgt_epi64(p,_mm256_xor_si256(k,sign)));
+    }
+    __m128i c=_mm_add_epi64(_mm256_castsi256_si128(count),_mm256_extracti128_si256(count,1));
+    return _mm_cvtsi128_si64(c)+_mm_extract_epi64(c,1)+
+      CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+  }
+}
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountLessKeysSSE(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n,
+			       const BYTE_T *probe, const BYTE_T *end)
+{
+  BYTE_T pad[32];
+  SIZE_T count=0;
+  SIZE_T i;
+
+  memset(pad,0,sizeof(pad));
+  memcpy(pad,probe,keysize);
+  const __m128i p0=_mm_loadu_si128((const __m128i *)pad);
+  const __m128i p1=_mm_loadu_si128((const __m128i *)(pad+16));
+
+  for (i=0;i<n && keys+i*keysize+32<=end;i++) {
+    const BYTE_T *k=keys+i*keysize;
+    unsigned eq=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)k),p0));
+    if (keysize>16) {
+      eq|=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(k+16)),p1))<<16;
+    }
+    count+=KeyIsLess(k,probe,eq,keysize);
+  }
+  return count+CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T CountLessKeysAVX2(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n,
+				const BYTE_T *probe, const BYTE_T *end)
+{
+  BYTE_T pad[32];
+  SIZE_T count=0;
+  SIZE_T i;
+
+  memset(pad,0,sizeof(pad));
+  memcpy(pad,probe,keysize);
+  const __m256i p=_mm256_loadu_si256((const __m256i *)pad);
+
+  for (i=0;i<n && keys+i*keysize+32<=end;i++) {
+    const BYTE_T *k=keys+i*keysize;
+    unsigned eq=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)k),p));
+    count+=KeyIsLess(k,probe,eq,keysize);
+  }
+  return count+CountLessKeysScalar(keys+i*keysize,keysize,n-i,probe);
+}
+
+
+static bool kernelchosen=false;
+static KeySearchKernel kernel=KEYSEARCH_SCALAR;
+
+static bool Supported(const KeySearchKernel k)
+{
+  // These check CPUID (and that the OS saves the AVX registers)
+  switch (k) {
+  case KEYSEARCH_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case KEYSEARCH_SSE:
+    return __builtin_cpu_supports("sse4.2");
+  case KEYSEARCH_SCALAR:
+  default:
+    return true;
+  }
+}
+
+KeySearchKernel GetKeySearchKernel()
+{
+  if (!kernelchosen) {
+    __builtin_cpu_init();
+    kernel = Supported(KEYSEARCH_AVX2) ? KEYSEARCH_AVX2 :
+      Supported(KEYSEARCH_SSE) ? KEYSEARCH_SSE : KEYSEARCH_SCALAR;
+    kernelchosen=true;
+  }
+  return kernel;
+}
+
+bool SetKeySearchKernel(const KeySearchKernel k)
+{
+  __builtin_cpu_init();
+  if (!Supported(k)) {
+    return false;
+  }
+  kernel=k;
+  kernelchosen=true;
+  return true;
+}
+
+const char *GetKeySearchKernelName(const KeySearchKernel k)
+{
+  return k==KEYSEARCH_AVX2 ? "avx2" : k==KEYSEARCH_SSE ? "sse4.2" : "scalar";
+}
+
+
+SIZE_T CountLessPrefixes(const BYTE_T *prefixes, const SIZE_T n, const KEYPREFIX_T prefix)
+{
+  switch (GetKeySearchKernel()) {
+  case KEYSEARCH_AVX2:
+    return CountLessPrefixesAVX2(prefixes,n,prefix);
+  case KEYSEARCH_SSE:
+    return CountLessPrefixesSSE(prefixes,n,prefix);
+  case KEYSEARCH_SCALAR:
+  default:
+    return CountLessPrefixesScalar(prefixes,n,prefix);
+  }
+}
+
+
+SIZE_T CountLessKeys(const BYTE_T *keys, const SIZE_T keysize, const SIZE_T n,
+		     const BYTE_T *probe, const BYTE_T *end)
+{
+  if (keysize>KEYSEARCH_MAX_KEYSIZE) {
+    return CountLessKeysScalar(keys,keysize,n,probe);
+  }
+  if (keysize==4 || keysize==8) {
+    switch (GetKeySearchKernel()) {
+    case KEYSEARCH_AVX2:
+      return CountLessPackedAVX2(keys,keysize,n,probe);
+    case KEYSEARCH_SSE:
+      return CountLessPackedSSE(keys,keysize,n,probe);
+    default:
+      break;
+    }
+  }
+  switch (GetKeySearchKernel()) {
+  case KEYSEARCH_AVX2:
+    return CountLessKeysAVX2(keys,keysize,n,probe,end);
+  case KEYSEARCH_SSE:
+    return CountLessKeysSSE(keys,keysize,n,probe,end);
+  case KEYSEARCH_SCALAR:
+  default:
+    return CountLessKeysScalar(keys,keysize,n,probe);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef _keysearch
+#define _keysearch
+
+#include "global.h"
+#include "btree_ds.h"
+
+//
+// Vectorized kernels for searching the keys of a node
+//
+// Each kernel counts how many entries of a sorted array are less
+// than a probe, which is the lower bound of the probe in the array.
+// They look at every entry, with no early exit, so they are meant
+// for the last few cache lines of a search, once binary search
+// has narrowed it down.
+//
+// There is an AVX2, an SSE4.2, and a scalar version of each.  The
+// best one the CPU supports is picked the first time one is used.
+//
+enum KeySearchKernel {KEYSEARCH_SCALAR, KEYSEARCH_SSE, KEYSEARCH_AVX2};
+
+// Largest key CountLessKeys handles with vector compares
+#define KEYSEARCH_MAX_KEYSIZE 32
+
+KeySearchKernel GetKeySearchKernel();
+// Force a kernel, for example to benchmark them against each other
+// Returns false, and changes nothing, if this CPU can't run it
+bool            SetKeySearchKernel(const KeySearchKernel kernel);
+const char     *GetKeySearchKernelName(const KeySearchKernel kernel);
+
+// Number of the n prefixes that are less than prefix
+SIZE_T CountLessPrefixes(const BYTE_T *prefixes,
+			 const SIZE_T n,
+			 const KEYPREFIX_T prefix);
+
+// Number of the n keys, stored back to back, that are less than
+// probe, which is keysize bytes long.  A key is read with a full
+// vector load when that stays below end, and with memcmp otherwise.
+SIZE_T CountLessKeys(const BYTE_T *keys,
+		     const SIZE_T keysize,
+		     const SIZE_T n,
+		     const BYTE_T *probe,
+		     const BYTE_T *end);
+
+#endif
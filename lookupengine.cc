@@ -0,0 +1,157 @@
+#include <coroutine>
+#include <exception>
+
+#include "lookupengine.h"
+
+using namespace std;
+
+
+// The coroutine of one lookup.  It starts suspended, and the
+// scheduler resumes it until it is done.
+class BTreeLookupEngine::Task {
+ public:
+  struct promise_type {
+    Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+    suspend_always initial_suspend() noexcept { return suspend_always(); }
+    suspend_always final_suspend() noexcept { return suspend_always(); }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+
+ private:
+  coroutine_handle<promise_type> handle;
+
+ public:
+  Task() : handle(0) {}
+  explicit Task(coroutine_handle<promise_type> h) : handle(h) {}
+  Task(const Task &rhs) = delete;
+  Task(Task &&rhs) : handle(rhs.handle) { rhs.handle=0; }
+  ~Task() { if (handle) { handle.destroy(); } }
+  Task & operator=(const Task &rhs) = delete;
+  Task & operator=(Task &&rhs) {
+    if (this!=&rhs) {
+      if (handle) { handle.destroy(); }
+      handle=rhs.handle;
+      rhs.handle=0;
+    }
+    return *this;
+  }
+
+  bool IsDone() const { return !handle || handle.done(); }
+  void Resume() { handle.resume(); }
+};
+
+
+BTreeLookupEngine::BTreeLookupEngine(const BTreeIndex &i, const SIZE_T n) :
+  index(i), groupsize(n>0 ? n : 1), numsuspends(0), numfetches(0)
+{}
+
+
+void BTreeLookupEngine::Prefetch(const SIZE_T ptr)
+{
+  const Block *cached=index.buffercache->PeekBlock(ptr);
+
+  if (cached) {
+    // Unserialize copies the whole node, so all of it is wanted
+    for (SIZE_T i=0; i<cached->length; i+=64) {
+      __builtin_prefetch(cached->data+i);
+    }
+  } else if (index.buffercache->PrefetchBlock(ptr)==ERROR_NOERROR) {
+    numfetches++;
+  }
+  // If the cache has no room for more prefetches, the read just
+  // waits for the disk when it comes
+}
+
+
+BTreeLookupEngine::Task BTreeLookupEngine::LookupOne(const KEY_T &key, VALUE_T &value, ERROR_T &result)
+{
+  BTreeNode b;
+  SIZE_T ptr=index.superblock.info.rootnode;
+  SIZE_T offset;
+
+  while (1) {
+    Prefetch(ptr);
+    numsuspends++;
+    co_await suspend_always();
+
+    result=b.Unserialize(index.buffercache,ptr);
+    if (result!=ERROR_NOERROR) {
+      co_return;
+    }
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	result=ERROR_NONEXISTENT;
+	co_return;
+      }
+      result=b.GetPtr(index.nodeaccess->LowerBound(b,key,index.searchtype),ptr);
+      if (result!=ERROR_NOERROR) {
+	co_return;
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      offset=index.nodeaccess->LowerBound(b,key,index.searchtype);
+      if (offset>=b.info.numkeys || index.nodeaccess->CompareKey(b,key,offset)!=0 ||
+	  b.IsTombstone(offset)) {
+	result=ERROR_NONEXISTENT;
+      } else {
+	result=index.GetLeafValue(b,offset,value);
+      }
+      co_return;
+    default:
+      result=ERROR_INSANE;
+      co_return;
+    }
+  }
+}
+
+
+ERROR_T BTreeLookupEngine::Lookup(const vector<KEY_T> &keys,
+				  vector<VALUE_T> &values,
+				  vector<ERROR_T> &results)
+{
+  vector<Task> group(groupsize<keys.size() ? groupsize : keys.size());
+  SIZE_T next=0, running=0;
+  ERROR_T rc=ERROR_NOERROR;
+
+  values.resize(keys.size());
+  results.assign(keys.size(),ERROR_NONEXISTENT);
+  numsuspends=0;
+  numfetches=0;
+
+  // Round robin over the group, and each lookup that finishes makes
+  // room for the next key
+  for (SIZE_T i=0; i<group.size(); i++) {
+    group[i]=LookupOne(keys[next],values[next],results[next]);
+    next++;
+    running++;
+  }
+  while (running>0) {
+    for (SIZE_T i=0; i<group.size(); i++) {
+      if (group[i].IsDone()) {
+	continue;
+      }
+      group[i].Resume();
+      if (group[i].IsDone()) {
+	if (next<keys.size()) {
+	  group[i]=LookupOne(keys[next],values[next],results[next]);
+	  next++;
+	} else {
+	  running--;
+	}
+      }
+    }
+  }
+
+  for (SIZE_T i=0; i<results.size(); i++) {
+    if (results[i]!=ERROR_NOERROR && results[i]!=ERROR_NONEXISTENT) {
+      return results[i];
+    }
+    if (results[i]==ERROR_NONEXISTENT) {
+      rc=ERROR_NONEXISTENT;
+    }
+  }
+  return rc;
+}
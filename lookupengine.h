@@ -0,0 +1,77 @@
+#ifndef _lookupengine
+#define _lookupengine
+
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+#include "buffercache.h"
+#include "btree.h"
+
+using namespace std;
+
+// Lookups a BTreeLookupEngine keeps in flight by default
+#define LOOKUP_DEFAULT_GROUP_SIZE 16
+
+//
+// Interleaved point lookups
+//
+// Lookup runs each key's descent as a coroutine, and keeps a group
+// of them going at once.  Before each step down, a lookup asks for
+// the node it is about to read and suspends, and the scheduler goes
+// round the group resuming the others.  By the time it gets back,
+// the node has had a turn's worth of the other lookups' work to
+// arrive in:
+//
+//   - a node in the buffer cache gets __builtin_prefetch over its
+//     bytes, so they are on their way into the CPU cache
+//   - a node that is not gets BufferCache::PrefetchBlock, and the
+//     whole group's blocks go to the disk together, in block order,
+//     on the next read (see BufferCache)
+//
+// A group size of one is a plain lookup at a time.  Larger groups
+// overlap more misses, until the prefetches of a group no longer
+// fit in the quarter of the cache they can use.
+//
+// The engine only reads, and like a cursor it is good until the
+// index next changes.
+//
+class BTreeLookupEngine {
+ public:
+  class Task;
+
+ private:
+  const BTreeIndex &index;
+  SIZE_T            groupsize;
+  SIZE_T            numsuspends;  // of the last Lookup
+  SIZE_T            numfetches;   // blocks it asked the disk for
+
+  // Asks for the block at ptr to be on its way
+  void Prefetch(const SIZE_T ptr);
+  // The descent for one key, which suspends before each node it reads
+  Task LookupOne(const KEY_T &key, VALUE_T &value, ERROR_T &result);
+
+ public:
+  BTreeLookupEngine(const BTreeIndex &index,
+		    const SIZE_T groupsize=LOOKUP_DEFAULT_GROUP_SIZE);
+
+  void   SetGroupSize(const SIZE_T n) { groupsize = n>0 ? n : 1; }
+  SIZE_T GetGroupSize() const { return groupsize; }
+
+  // Looks up every key, groupsize at a time.  values[i] and
+  // results[i] are the value and the result of keys[i], as
+  // BTreeIndex::Lookup would give them.
+  // return ERROR_NONEXISTENT if any key doesn't exist, once all of
+  //   them have been looked up
+  ERROR_T Lookup(const vector<KEY_T> &keys,
+		 vector<VALUE_T> &values,
+		 vector<ERROR_T> &results);
+
+  // Times the lookups of the last Lookup were suspended, and how
+  // many blocks they sent to the disk as prefetches
+  SIZE_T GetNumSuspends() const { return numsuspends; }
+  SIZE_T GetNumDiskPrefetches() const { return numfetches; }
+};
+
+
+#endif
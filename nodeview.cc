@@ -0,0 +1,21 @@
+#include "nodeview.h"
+
+// The sizes worth specializing for.  Any others use the generic
+// accessors, so adding one here is all it takes to support it.
+static NodeAccess           generic;
+static NodeView<4,4>        view4_4;
+static NodeView<8,8>        view8_8;
+static NodeView<16,16>      view16_16;
+static NodeView<10,4>       view10_4;
+
+const NodeAccess *GetNodeAccess(const SIZE_T keysize, const SIZE_T valuesize)
+{
+  const NodeAccess *views[]={&view4_4, &view8_8, &view16_16, &view10_4};
+
+  for (SIZE_T i=0;i<sizeof(views)/sizeof(views[0]);i++) { 
+    if (views[i]->GetKeySize()==keysize && views[i]->GetValueSize()==valuesize) { 
+      return views[i];
+    }
+  }
+  return &generic;
+}
@@ -0,0 +1,298 @@
+#ifndef _nodeview
+#define _nodeview
+
+#include <assert.h>
+#include <string.h>
+
+#include "global.h"
+#include "btree_ds.h"
+#include "keysearch.h"
+
+//
+// Accessors for the keys and values of a node
+//
+// NodeAccess is the generic version, which just uses BTreeNode's
+// own accessors.  Those work out every offset from the sizes in
+// NodeMetadata and copy with variable-length memcpys.
+//
+// NodeView<KEYSIZE,VALUESIZE> does the same things for one key and
+// value size known at compile time.  Offsets are multiplies by
+// constants, a key compare is a few big-endian integer compares,
+// and copies are fixed-size moves the compiler can inline.
+//
+// BTreeIndex gets the right one for its sizes from GetNodeAccess
+// when it attaches.  Only a few common sizes have a NodeView, and
+// every other size uses NodeAccess.
+//
+class NodeAccess {
+ public:
+  virtual ~NodeAccess() {}
+
+  virtual SIZE_T  LowerBound(const BTreeNode &b, const KEY_T &key, const BTreeSearchType type) const
+  { return b.LowerBound(key,type); }
+  virtual int     CompareKey(const BTreeNode &b, const KEY_T &key, const SIZE_T offset) const
+  { return b.CompareKey(key,offset); }
+  virtual ERROR_T GetKey(const BTreeNode &b, const SIZE_T offset, KEY_T &key) const
+  { return b.GetKey(offset,key); }
+  virtual ERROR_T SetKey(BTreeNode &b, const SIZE_T offset, const KEY_T &key) const
+  { return b.SetKey(offset,key); }
+  virtual ERROR_T GetVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const
+  { return b.GetVal(offset,value); }
+  virtual ERROR_T SetVal(BTreeNode &b, const SIZE_T offset, const VALUE_T &value) const
+  { return b.SetVal(offset,value); }
+
+  // Key and value sizes this is specialized for, zero if generic
+  virtual SIZE_T  GetKeySize() const { return 0; }
+  virtual SIZE_T  GetValueSize() const { return 0; }
+
+  // Whether this finds keys and values where BTreeNode does in
+  // the nodes of an index described by info
+  virtual bool    Agrees(const NodeMetadata &info) const { return true; }
+};
+
+
+template <SIZE_T KEYSIZE, SIZE_T VALUESIZE>
+class NodeView : public NodeAccess {
+ protected:
+  static unsigned long long Load64(const BYTE_T *p)
+  { unsigned long long x; memcpy(&x,p,8); return __builtin_bswap64(x); }
+  static unsigned Load32(const BYTE_T *p)
+  { unsigned x; memcpy(&x,p,4); return __builtin_bswap32(x); }
+  static unsigned Load16(const BYTE_T *p)
+  { unsigned short x; memcpy(&x,p,2); return __builtin_bswap16(x); }
+
+  // memcmp(a,b,KEYSIZE), a word at a time.  The loop and the
+  // tests on KEYSIZE all fold away.
+  static int Compare(const BYTE_T *a, const BYTE_T *b) {
+    SIZE_T i=0;
+    for (; i+8<=KEYSIZE; i+=8) {
+      unsigned long long x=Load64(a+i), y=Load64(b+i);
+      if (x!=y) { return x<y ? -1 : 1; }
+    }
+    if (KEYSIZE-i>=4) {
+      unsigned x=Load32(a+i), y=Load32(b+i);
+      if (x!=y) { return x<y ? -1 : 1; }
+      i+=4;
+    }
+    if (KEYSIZE-i>=2) {
+      unsigned x=Load16(a+i), y=Load16(b+i);
+      if (x!=y) { return x<y ? -1 : 1; }
+      i+=2;
+    }
+    if (KEYSIZE-i>=1) {
+      return (int)a[i]-(int)b[i];
+    }
+    return 0;
+  }
+
+  // Compressed and slotted nodes store keys (and slotted leaves 
+  // values) whose length is only known at run time, and leaves with
+  // overflow values hold OverflowRefs, so those go to the generic 
+  // accessors
+  static bool Fits(const BTreeNode &b)
+  { return b.info.keysize==KEYSIZE && b.info.valuesize==VALUESIZE && 
+      b.info.format!=BTREE_FORMAT_COMPRESSED && !b.info.IsSlotted() &&
+      !b.info.HasOverflowValues(); }
+
+  static bool IsLeaf(const BTreeNode &b)
+  { return b.info.nodetype==BTREE_LEAF_NODE; }
+
+  // NodeMetadata::GetNumSlots with constant divisors.  The layout
+  // itself belongs to NodeMetadata and BTreeNode, so this is checked
+  // against theirs here, and Key and Val are by Agrees.
+  static SIZE_T NumSlots(const BTreeNode &b) {
+    SIZE_T n=b.info.GetNumDataBytes()-sizeof(SIZE_T);
+    SIZE_T slots;
+    if (b.info.format==BTREE_FORMAT_COLUMNAR_PREFIX) {
+      if (IsLeaf(b) && b.info.tombstones) {
+	slots=n/(sizeof(KEYPREFIX_T)+KEYSIZE+VALUESIZE+1);
+      } else {
+	slots=IsLeaf(b) ? n/(sizeof(KEYPREFIX_T)+KEYSIZE+VALUESIZE) : n/(sizeof(KEYPREFIX_T)+KEYSIZE+sizeof(SIZE_T));
+      }
+    } else {
+      if (IsLeaf(b) && b.info.tombstones) {
+	slots=n/(KEYSIZE+VALUESIZE+1);
+      } else {
+	slots=IsLeaf(b) ? n/(KEYSIZE+VALUESIZE) : n/(KEYSIZE+sizeof(SIZE_T));
+      }
+    }
+    assert(slots==b.info.GetNumSlots());
+    return slots;
+  }
+
+  static BYTE_T *Key(const BTreeNode &b, const SIZE_T offset) {
+    BYTE_T *d=(BYTE_T *)b.data;
+    BYTE_T *p;
+    switch (b.info.format) {
+    case BTREE_FORMAT_COLUMNAR:
+      p=d+offset*KEYSIZE;
+      break;
+    case BTREE_FORMAT_COLUMNAR_PREFIX:
+      p=d+NumSlots(b)*sizeof(KEYPREFIX_T)+offset*KEYSIZE;
+      break;
+    default:
+      p=d+sizeof(SIZE_T)+offset*(KEYSIZE+(IsLeaf(b) ? VALUESIZE : sizeof(SIZE_T)));
+      break;
+    }
+    return p;
+  }
+
+  static SIZE_T KeyStride(const BTreeNode &b) {
+    if (b.info.format!=BTREE_FORMAT_INTERLEAVED) {
+      return KEYSIZE;
+    }
+    return KEYSIZE+(IsLeaf(b) ? VALUESIZE : sizeof(SIZE_T));
+  }
+
+  static BYTE_T *Val(const BTreeNode &b, const SIZE_T offset) {
+    BYTE_T *d=(BYTE_T *)b.data;
+    BYTE_T *p;
+    switch (b.info.format) {
+    case BTREE_FORMAT_COLUMNAR:
+      p=d+NumSlots(b)*KEYSIZE+offset*VALUESIZE;
+      break;
+    case BTREE_FORMAT_COLUMNAR_PREFIX:
+      p=d+NumSlots(b)*(sizeof(KEYPREFIX_T)+KEYSIZE)+offset*VALUESIZE;
+      break;
+    default:
+      p=d+sizeof(SIZE_T)+offset*(KEYSIZE+VALUESIZE)+KEYSIZE;
+      break;
+    }
+    return p;
+  }
+
+  // Is the ith key less than the probe?  The prefix array, if there
+  // is one, settles it unless the prefixes tie.
+  static bool Less(const BYTE_T *keys, const SIZE_T stride, const BYTE_T *prefixes,
+		   const KEYPREFIX_T prefix, const BYTE_T *probe, const SIZE_T i) {
+    if (prefixes) {
+      KEYPREFIX_T x;
+      memcpy(&x,prefixes+i*sizeof(KEYPREFIX_T),sizeof(x));
+      if (x!=prefix || KEYSIZE<=sizeof(KEYPREFIX_T)) {
+	return x<prefix;
+      }
+    }
+    return Compare(keys+i*stride,probe)<0;
+  }
+
+ public:
+  SIZE_T GetKeySize() const { return KEYSIZE; }
+  SIZE_T GetValueSize() const { return VALUESIZE; }
+
+  // Checks the first and last slot of a full leaf and interior node
+  bool Agrees(const NodeMetadata &info) const {
+    const int types[]={BTREE_LEAF_NODE, BTREE_INTERIOR_NODE};
+    for (SIZE_T i=0;i<sizeof(types)/sizeof(types[0]);i++) {
+      BTreeNode b(types[i],info.keysize,info.valuesize,info.blocksize,info.format,
+		  info.overflowsize,info.tombstones,info.duplicates);
+      if (!Fits(b)) {
+	return true;
+      }
+      b.info.numkeys=NumSlots(b);
+      const SIZE_T last=b.info.numkeys-1;
+      if (Key(b,0)!=(BYTE_T *)b.ResolveKey(0) || Key(b,last)!=(BYTE_T *)b.ResolveKey(last)) {
+	return false;
+      }
+      if (IsLeaf(b) && (Val(b,0)!=(BYTE_T *)b.ResolveVal(0) || Val(b,last)!=(BYTE_T *)b.ResolveVal(last))) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  SIZE_T LowerBound(const BTreeNode &b, const KEY_T &key, const BTreeSearchType type) const {
+    if (!Fits(b) || key.length!=KEYSIZE ||
+	(type!=BTREE_SEARCH_BINARY && type!=BTREE_SEARCH_SIMD)) {
+      return NodeAccess::LowerBound(b,key,type);
+    }
+
+    const BYTE_T *keys=Key(b,0);
+    const SIZE_T stride=KeyStride(b);
+    const BYTE_T *prefixes = b.info.format==BTREE_FORMAT_COLUMNAR_PREFIX ? (const BYTE_T *)b.data : 0;
+    const KEYPREFIX_T prefix=KeyPrefix(key.data,KEYSIZE);
+    const bool simd = type==BTREE_SEARCH_SIMD && b.info.format!=BTREE_FORMAT_INTERLEAVED;
+    const SIZE_T window = simd ? BTREE_SIMD_WINDOW : 1;
+    SIZE_T base=0;
+    SIZE_T n=b.info.numkeys;
+
+    if (n==0) {
+      return 0;
+    }
+    // Branchless binary search, leaving the answer in [base,base+n]
+    while (n>window) {
+      SIZE_T half=n/2;
+      base = Less(keys,stride,prefixes,prefix,key.data,base+half) ? base+half : base;
+      n-=half;
+    }
+    if (!simd) {
+      return base + Less(keys,stride,prefixes,prefix,key.data,base);
+    }
+    if (!prefixes) {
+      return base+CountLessKeys(keys+base*KEYSIZE,KEYSIZE,n,key.data,
+				(const BYTE_T *)b.data+b.info.GetNumDataBytes());
+    }
+    SIZE_T offset=base+CountLessPrefixes(prefixes+base*sizeof(KEYPREFIX_T),n,prefix);
+    // Keys whose prefixes tie with ours could still be smaller
+    while (KEYSIZE>sizeof(KEYPREFIX_T) && offset<base+n &&
+	   Less(keys,stride,prefixes,prefix,key.data,offset)) {
+      offset++;
+    }
+    return offset;
+  }
+
+  int CompareKey(const BTreeNode &b, const KEY_T &key, const SIZE_T offset) const {
+    if (!Fits(b) || key.length!=KEYSIZE) {
+      return NodeAccess::CompareKey(b,key,offset);
+    }
+    assert(offset<b.info.numkeys);
+    return Compare(key.data,Key(b,offset));
+  }
+
+  ERROR_T GetKey(const BTreeNode &b, const SIZE_T offset, KEY_T &key) const {
+    if (!Fits(b)) {
+      return NodeAccess::GetKey(b,offset,key);
+    }
+    assert(offset<b.info.numkeys);
+    key.Resize(KEYSIZE,false);
+    memcpy(key.data,Key(b,offset),KEYSIZE);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T SetKey(BTreeNode &b, const SIZE_T offset, const KEY_T &key) const {
+    if (!Fits(b) || key.length<KEYSIZE) {
+      return NodeAccess::SetKey(b,offset,key);
+    }
+    assert(offset<b.info.numkeys);
+    memcpy(Key(b,offset),key.data,KEYSIZE);
+    if (b.info.format==BTREE_FORMAT_COLUMNAR_PREFIX) {
+      KEYPREFIX_T x=KeyPrefix(key.data,KEYSIZE);
+      memcpy(b.data+offset*sizeof(KEYPREFIX_T),&x,sizeof(x));
+    }
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T GetVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const {
+    if (!Fits(b) || !IsLeaf(b)) {
+      return NodeAccess::GetVal(b,offset,value);
+    }
+    assert(offset<b.info.numkeys);
+    value.Resize(VALUESIZE,false);
+    memcpy(value.data,Val(b,offset),VALUESIZE);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T SetVal(BTreeNode &b, const SIZE_T offset, const VALUE_T &value) const {
+    if (!Fits(b) || !IsLeaf(b) || value.length<VALUESIZE) {
+      return NodeAccess::SetVal(b,offset,value);
+    }
+    assert(offset<b.info.numkeys);
+    memcpy(Val(b,offset),value.data,VALUESIZE);
+    return ERROR_NOERROR;
+  }
+};
+
+
+// The NodeView for these sizes, or a NodeAccess if there is none
+const NodeAccess *GetNodeAccess(const SIZE_T keysize, const SIZE_T valuesize);
+
+#endif
@@ -31,7 +31,7 @@ int main(int argc, char *argv[])
 
   FILE *file; 
   char line[1024];
-  int max = 8192;
+  int max = sizeof(line);
   ERROR_T rc;
   
   // We'll connect to the btree only once and then
@@ -40,7 +40,7 @@ int main(int argc, char *argv[])
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
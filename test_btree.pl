@@ -0,0 +1,29 @@
+#!/usr/bin/perl -w
+
+# Runs btree_test on a fresh disk.  The disk is big enough for the
+# tests that fill it, and small enough for them to do so quickly.
+$diskstem="__btreetest";
+$numblocks=20000;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=16;
+$tracks=1250;
+$avgseek=10;
+$trackseek=1;
+$rotlat=0.28;
+$cachesize=300;
+
+$#ARGV<=0 or die "usage: test_btree.pl [all|model|batch|overflow|tombstone|range|postings|bulk|catalog|recover|abort]\n";
+
+$test = $#ARGV==0 ? $ARGV[0] : "all";
+
+$ENV{PATH}.=":.";
+
+system "deletedisk $diskstem >/dev/null 2>&1";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+
+$rc=system "btree_test $diskstem $cachesize $test";
+
+system "deletedisk $diskstem >/dev/null 2>&1";
+
+exit($rc ? 1 : 0);
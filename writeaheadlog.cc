@@ -0,0 +1,419 @@
+#include <string.h>
+
+#include "writeaheadlog.h"
+#include "buffercache.h"
+
+#define WAL_ANCHOR_MAGIC 0x4c415742  // "BWAL"
+#define WAL_GROUP_MAGIC  0x50524742  // "BGRP"
+
+// Layout of the anchor block, in SIZE_Ts
+#define WAL_ANCHOR_MAGIC_FIELD 0
+#define WAL_ANCHOR_EPOCH_FIELD 1
+
+// Layout of a group header block, in SIZE_Ts
+// A force that does not fit in one header is written as several
+// groups, and only the last one has the last flag set.  Recovery
+// applies a force only once it has seen its last group.
+#define WAL_GROUP_MAGIC_FIELD    0
+#define WAL_GROUP_EPOCH_FIELD    1
+#define WAL_GROUP_SEQ_FIELD      2
+#define WAL_GROUP_NUMPAGES_FIELD 3
+#define WAL_GROUP_LAST_FIELD     4
+#define WAL_GROUP_CHECKSUM_FIELD 5
+#define WAL_GROUP_BLOCKNUMS      6
+
+
+static SIZE_T GetField(const Block &b, const SIZE_T i)
+{
+  SIZE_T x;
+  memcpy(&x,b.data+i*sizeof(SIZE_T),sizeof(SIZE_T));
+  return x;
+}
+
+static void SetField(Block &b, const SIZE_T i, const SIZE_T x)
+{
+  memcpy(b.data+i*sizeof(SIZE_T),&x,sizeof(SIZE_T));
+}
+
+// FNV-1a over the header fields (minus the checksum) and the images
+static SIZE_T GroupChecksum(const Block &header, const vector<Block> &images)
+{
+  SIZE_T h=2166136261u;
+  SIZE_T numpages=GetField(header,WAL_GROUP_NUMPAGES_FIELD);
+
+  for (SIZE_T i=0;i<WAL_GROUP_BLOCKNUMS+numpages;i++) {
+    if (i==WAL_GROUP_CHECKSUM_FIELD) { continue; }
+    SIZE_T x=GetField(header,i);
+    for (SIZE_T j=0;j<sizeof(SIZE_T);j++) {
+      h^=(x>>(8*j))&0xff;
+      h*=16777619u;
+    }
+  }
+  for (SIZE_T i=0;i<images.size();i++) {
+    for (SIZE_T j=0;j<images[i].length;j++) {
+      h^=images[i].data[j];
+      h*=16777619u;
+    }
+  }
+  return h;
+}
+
+
+WriteAheadLog::WriteAheadLog(BufferCache *c,
+			     const SIZE_T start,
+			     const SIZE_T num,
+			     const SIZE_T gs) :
+  cache(c), logstart(start), lognumblocks(num), groupsize(gs>0 ? gs : 1),
+  epoch(0), nextseq(0), head(1), numcommitted(0),
+  numcommits(0), numaborts(0), numforces(0), numlogblocks(0), numcheckpoints(0), numredone(0)
+{}
+
+WriteAheadLog::~WriteAheadLog()
+{
+  cache=0;
+}
+
+
+SIZE_T WriteAheadLog::GetNumBlocknumsPerHeader() const
+{
+  return cache->GetBlockSize()/sizeof(SIZE_T) - WAL_GROUP_BLOCKNUMS;
+}
+
+SIZE_T WriteAheadLog::GetNumGroupBlocks(const SIZE_T numpages) const
+{
+  SIZE_T perheader=GetNumBlocknumsPerHeader();
+  return numpages + (numpages+perheader-1)/perheader;
+}
+
+
+ERROR_T WriteAheadLog::WriteAnchor()
+{
+  vector<Block> blocks;
+  Block anchor(cache->GetBlockSize());
+
+  memset(anchor.data,0,anchor.length);
+  SetField(anchor,WAL_ANCHOR_MAGIC_FIELD,WAL_ANCHOR_MAGIC);
+  SetField(anchor,WAL_ANCHOR_EPOCH_FIELD,epoch);
+  blocks.push_back(anchor);
+
+  return cache->WriteBlocksUncached(logstart,1,blocks);
+}
+
+ERROR_T WriteAheadLog::ReadAnchor()
+{
+  vector<Block> blocks;
+  ERROR_T rc;
+
+  rc=cache->ReadBlocksUncached(logstart,1,blocks);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (GetField(blocks[0],WAL_ANCHOR_MAGIC_FIELD)!=WAL_ANCHOR_MAGIC) {
+    return ERROR_NOTANINDEX;
+  }
+  epoch=GetField(blocks[0],WAL_ANCHOR_EPOCH_FIELD);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Format()
+{
+  vector<Block> blocks;
+  Block empty(cache->GetBlockSize());
+  ERROR_T rc;
+
+  current.clear();
+  undo.clear();
+  committed.clear();
+  numcommitted=0;
+  // Groups of a log that was here before are still on disk, so the
+  // new one starts past its epoch, and its first group is blanked 
+  // so that nothing older can be taken for the start of the log
+  if (ReadAnchor()==ERROR_NOERROR) { 
+    epoch++;
+  } else {
+    epoch=0;
+  }
+  nextseq=0;
+  head=1;
+  memset(empty.data,0,empty.length);
+  blocks.push_back(empty);
+  rc=cache->WriteBlocksUncached(logstart+1,1,blocks);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  return WriteAnchor();
+}
+
+
+ERROR_T WriteAheadLog::Recover()
+{
+  ERROR_T rc;
+  map<SIZE_T, Block> batch;
+
+  current.clear();
+  undo.clear();
+  committed.clear();
+  numcommitted=0;
+
+  rc=ReadAnchor();
+  if (rc==ERROR_NOTANINDEX) {
+    // Never formatted, so there is nothing to redo
+    return Format();
+  }
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  nextseq=0;
+  head=1;
+
+  SIZE_T pos=1;
+  while (pos<lognumblocks) {
+    vector<Block> hdr;
+    rc=cache->ReadBlocksUncached(logstart+pos,1,hdr);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    Block &header=hdr[0];
+    SIZE_T numpages=GetField(header,WAL_GROUP_NUMPAGES_FIELD);
+    if (GetField(header,WAL_GROUP_MAGIC_FIELD)!=WAL_GROUP_MAGIC ||
+	GetField(header,WAL_GROUP_EPOCH_FIELD)!=epoch ||
+	GetField(header,WAL_GROUP_SEQ_FIELD)!=nextseq ||
+	numpages==0 ||
+	numpages>GetNumBlocknumsPerHeader() ||
+	pos+1+numpages>lognumblocks) {
+      // end of the log (or a torn header)
+      break;
+    }
+    vector<Block> images;
+    rc=cache->ReadBlocksUncached(logstart+pos+1,numpages,images);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    if (GroupChecksum(header,images)!=GetField(header,WAL_GROUP_CHECKSUM_FIELD)) {
+      // torn group
+      break;
+    }
+    for (SIZE_T i=0;i<numpages;i++) {
+      batch[GetField(header,WAL_GROUP_BLOCKNUMS+i)]=images[i];
+    }
+    pos+=1+numpages;
+    nextseq++;
+    if (GetField(header,WAL_GROUP_LAST_FIELD)) {
+      // The whole force made it, so redo it
+      for (map<SIZE_T, Block>::iterator i=batch.begin(); i!=batch.end(); ++i) {
+	rc=cache->WriteBlock((*i).first,(*i).second);
+	if (rc!=ERROR_NOERROR) {
+	  return rc;
+	}
+	numredone++;
+      }
+      batch.clear();
+      head=pos;
+    }
+  }
+
+  return Checkpoint();
+}
+
+
+ERROR_T WriteAheadLog::LogBlock(const SIZE_T blocknum, const Block &block, const Block *prior)
+{
+  map<SIZE_T, Block>::iterator c=current.find(blocknum);
+
+  if (c==current.end()) {
+    // First write to this block by this operation.  If the cached
+    // image is dirty, the copy at home is stale, so remember it in
+    // case a checkpoint has to happen before we commit.
+    if (prior && prior->dirty) {
+      undo[blocknum]=*prior;
+    }
+    current[blocknum]=block;
+  } else {
+    (*c).second=block;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Commit()
+{
+  ERROR_T rc;
+
+  numcommits++;
+
+  if (current.empty()) {
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T numpages=committed.size();
+  for (map<SIZE_T, Block>::const_iterator i=current.begin(); i!=current.end(); ++i) {
+    if (committed.find((*i).first)==committed.end()) {
+      numpages++;
+    }
+  }
+
+  if (1+GetNumGroupBlocks(current.size())>lognumblocks) {
+    // It does not fit in the whole log, so it cannot be made atomic
+    rc=Abort();
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    return ERROR_NOSPACE;
+  }
+
+  if (head+GetNumGroupBlocks(numpages)>lognumblocks) {
+    // This operation does not fit in what is left of the log
+    rc=Checkpoint();
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+
+  for (map<SIZE_T, Block>::iterator i=current.begin(); i!=current.end(); ++i) {
+    committed[(*i).first]=(*i).second;
+  }
+  current.clear();
+  undo.clear();
+  numcommitted++;
+
+  if (numcommitted>=groupsize) {
+    return Force();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Abort()
+{
+  ERROR_T rc;
+
+  numaborts++;
+  for (map<SIZE_T, Block>::const_iterator i=current.begin(); i!=current.end(); ++i) {
+    // A block that was clean before the operation (or has been
+    // checkpointed since) is good at home
+    map<SIZE_T, Block>::const_iterator u=undo.find((*i).first);
+    rc=cache->UndoBlock((*i).first,u==undo.end() ? 0 : &((*u).second));
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+  current.clear();
+  undo.clear();
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Force()
+{
+  ERROR_T rc;
+
+  if (committed.empty()) {
+    numcommitted=0;
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T perheader=GetNumBlocknumsPerHeader();
+  vector<Block> blocks;
+  map<SIZE_T, Block>::const_iterator i=committed.begin();
+
+  while (i!=committed.end()) {
+    Block header(cache->GetBlockSize());
+    vector<Block> images;
+
+    memset(header.data,0,header.length);
+    SIZE_T n=0;
+    for (; i!=committed.end() && n<perheader; ++i, ++n) {
+      SetField(header,WAL_GROUP_BLOCKNUMS+n,(*i).first);
+      images.push_back((*i).second);
+    }
+    SetField(header,WAL_GROUP_MAGIC_FIELD,WAL_GROUP_MAGIC);
+    SetField(header,WAL_GROUP_EPOCH_FIELD,epoch);
+    SetField(header,WAL_GROUP_SEQ_FIELD,nextseq++);
+    SetField(header,WAL_GROUP_NUMPAGES_FIELD,n);
+    SetField(header,WAL_GROUP_LAST_FIELD,i==committed.end());
+    SetField(header,WAL_GROUP_CHECKSUM_FIELD,GroupChecksum(header,images));
+
+    blocks.push_back(header);
+    blocks.insert(blocks.end(),images.begin(),images.end());
+  }
+
+  // One sequential append for the whole group
+  rc=cache->WriteBlocksUncached(logstart+head,blocks.size(),blocks);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  head+=blocks.size();
+  numlogblocks+=blocks.size();
+  numforces++;
+  committed.clear();
+  numcommitted=0;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Checkpoint()
+{
+  ERROR_T rc;
+
+  rc=Force();
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  // Blocks of the operation in progress are skipped by the cache...
+  rc=cache->WriteBackDirtyBlocks();
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  // ...and get their last committed image at home instead
+  for (map<SIZE_T, Block>::const_iterator i=undo.begin(); i!=undo.end(); ++i) {
+    vector<Block> blocks;
+    blocks.push_back((*i).second);
+    rc=cache->WriteBlocksUncached((*i).first,1,blocks);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+  undo.clear();
+
+  epoch++;
+  nextseq=0;
+  head=1;
+  numcheckpoints++;
+
+  return WriteAnchor();
+}
+
+
+bool WriteAheadLog::IsUncommitted(const SIZE_T blocknum) const
+{
+  return current.find(blocknum)!=current.end();
+}
+
+bool WriteAheadLog::IsUnforced(const SIZE_T blocknum) const
+{
+  return committed.find(blocknum)!=committed.end();
+}
+
+
+ostream & WriteAheadLog::Print(ostream &os) const
+{
+  os << "WriteAheadLog(logstart="<<logstart
+     << ", lognumblocks="<<lognumblocks
+     << ", groupsize="<<groupsize
+     << ", epoch="<<epoch
+     << ", head="<<head
+     << ", current="<<current.size()
+     << ", committed="<<committed.size()
+     << ", numcommits="<<numcommits
+     << ", numaborts="<<numaborts
+     << ", numforces="<<numforces
+     << ", numlogblocks="<<numlogblocks
+     << ", numcheckpoints="<<numcheckpoints
+     << ", numredone="<<numredone<<")";
+  return os;
+}
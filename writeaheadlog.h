@@ -0,0 +1,133 @@
+#ifndef _writeaheadlog
+#define _writeaheadlog
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+class BufferCache;
+
+// Number of committed operations batched into one log append.  One,
+// so that an operation is on disk by the time Commit returns.
+#define WAL_DEFAULT_GROUP_SIZE 1
+// By default, 1/WAL_DEFAULT_FRACTION of the disk is reserved for the log
+#define WAL_DEFAULT_FRACTION 16
+// Smallest log region that is worth having (anchor + a few groups)
+#define WAL_MIN_BLOCKS 4
+
+//
+// Redo-only write-ahead log with group commit
+//
+// The log lives in a reserved, contiguous region of the disk:
+//
+// ANCHOR GROUP GROUP GROUP ...
+//
+// The anchor records the current epoch.  Each group is a header
+// block (epoch, sequence number, checksum, list of block numbers)
+// followed by the after-image of each of those blocks.  A group
+// is appended with a single sequential multi-block write.
+//
+// Images logged by the operation in progress are held back until
+// Commit().  Committed images are held back until the group is full,
+// and then appended all at once, so with a group size above one, a
+// crash loses the committed operations of the group not yet full.  The buffer cache must not write
+// back a block with uncommitted changes (no-steal), and must force
+// the log before it writes back a block with committed changes
+// (write-ahead).
+//
+// An operation that fails is aborted instead: the cached blocks it
+// wrote get back their images from before it (or are dropped, if 
+// those are the ones at home).
+//
+// A checkpoint writes every dirty block home and starts a new epoch,
+// which logically truncates the log.  Blocks touched by an operation
+// still in progress are written home with the image they had before
+// it started.  Recovery replays each complete group of the current
+// epoch in order, then checkpoints.
+//
+class WriteAheadLog {
+ private:
+  BufferCache *cache;
+  SIZE_T logstart;
+  SIZE_T lognumblocks;
+  SIZE_T groupsize;
+
+  SIZE_T epoch;
+  SIZE_T nextseq;
+  SIZE_T head;            // next free block, relative to logstart
+
+  map<SIZE_T, Block> current;    // images of the operation in progress
+  map<SIZE_T, Block> undo;       // dirty images those blocks had before it
+  map<SIZE_T, Block> committed;  // committed but not yet forced
+  SIZE_T numcommitted;           // operations in committed
+
+  SIZE_T numcommits, numaborts, numforces, numlogblocks, numcheckpoints, numredone;
+
+ protected:
+  SIZE_T   GetNumBlocknumsPerHeader() const;
+  SIZE_T   GetNumGroupBlocks(const SIZE_T numpages) const;
+  ERROR_T  WriteAnchor();
+  ERROR_T  ReadAnchor();
+
+ public:
+  WriteAheadLog(BufferCache *cache,
+		const SIZE_T logstart,
+		const SIZE_T lognumblocks,
+		const SIZE_T groupsize=WAL_DEFAULT_GROUP_SIZE);
+  WriteAheadLog() { throw GenericException(); }
+  WriteAheadLog(const WriteAheadLog &rhs) { throw GenericException(); }
+  WriteAheadLog & operator=(const WriteAheadLog &rhs) { throw GenericException(); return *this; }
+  ~WriteAheadLog();
+
+  // Create an empty log in the region
+  ERROR_T Format();
+
+  // Replay all complete groups of the current epoch into the
+  // buffer cache, then checkpoint
+  ERROR_T Recover();
+
+  // Called by the buffer cache for every block write
+  // prior is the cached image being replaced, if any
+  ERROR_T LogBlock(const SIZE_T blocknum, const Block &block, const Block *prior);
+
+  // End of an operation.  Its images become part of the next group,
+  // which is appended once groupsize operations have committed.
+  // return ERROR_NOSPACE if the operation is too big for the whole 
+  //   log, in which case it is aborted
+  ERROR_T Commit();
+
+  // End of an operation that failed.  Its images are thrown away, and
+  // the blocks it wrote get back, in the cache, what they had before.
+  ERROR_T Abort();
+
+  // Append all committed images to the log now
+  ERROR_T Force();
+
+  // Write every dirty block home and truncate the log
+  ERROR_T Checkpoint();
+
+  // Used by the buffer cache before writing a block back
+  bool IsUncommitted(const SIZE_T blocknum) const;
+  bool IsUnforced(const SIZE_T blocknum) const;
+
+  void   SetGroupSize(const SIZE_T n) { groupsize = n>0 ? n : 1; }
+  SIZE_T GetGroupSize() const { return groupsize; }
+
+  SIZE_T GetNumCommits() const { return numcommits; }
+  SIZE_T GetNumAborts() const { return numaborts; }
+  SIZE_T GetNumForces() const { return numforces; }
+  SIZE_T GetNumLogBlocks() const { return numlogblocks; }
+  SIZE_T GetNumCheckpoints() const { return numcheckpoints; }
+  SIZE_T GetNumRedone() const { return numredone; }
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const WriteAheadLog &w) { return w.Print(os); }
+
+#endif